@@ -0,0 +1,54 @@
+/*
+ * \file
+ * \brief bundle - Detector, sum and inverse kernels in one firmware image
+ * on Elcore-30M
+ *
+ * Kernels are built as one unit, so they share the entry point and the
+ * interrupt handler of crt0-detector.s.
+ *
+ * \copyright
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ */
+
+#include <stdint.h>
+
+#include "bundle.h"
+
+#define start detector_start
+#include "detector.c"
+#undef start
+
+#define start sum_start
+#include "sum.c"
+#undef start
+
+#define start inverse_start
+#include "inverse.c"
+#undef start
+
+typedef int (*kernel_fn)(uint32_t core_id, uint32_t a0, uint32_t a1,
+			 uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5,
+			 uint32_t a6, uint32_t a7, uint32_t a8, uint32_t a9,
+			 uint32_t a10, uint32_t a11);
+
+static const kernel_fn kernels[DSP_KERNEL_COUNT] = {
+	[DSP_KERNEL_DETECTOR] = (kernel_fn)detector_start,
+	[DSP_KERNEL_SUM] = (kernel_fn)sum_start,
+	[DSP_KERNEL_INVERSE] = (kernel_fn)inverse_start,
+};
+
+/*
+ * @core_id - in register R0
+ * @kernel - in register R2
+ * @a0..@a11 - arguments of the kernel
+ */
+int start(uint32_t core_id, uint32_t *kernel, uint32_t a0, uint32_t a1,
+	  uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5, uint32_t a6,
+	  uint32_t a7, uint32_t a8, uint32_t a9, uint32_t a10, uint32_t a11)
+{
+	if (*kernel >= DSP_KERNEL_COUNT)
+		return -1;
+
+	return kernels[*kernel](core_id, a0, a1, a2, a3, a4, a5, a6, a7, a8,
+				a9, a10, a11);
+}
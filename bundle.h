@@ -0,0 +1,21 @@
+/*
+ * \file
+ * \brief Kernels of bundle firmware, shared by firmware and host
+ *
+ * Bundle firmware takes a pointer to the kernel number as the first argument
+ * after core id, the rest of arguments are passed to the kernel unchanged.
+ *
+ * \copyright
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ */
+#ifndef _BUNDLE_H_
+#define _BUNDLE_H_
+
+enum dsp_kernel {
+	DSP_KERNEL_DETECTOR,
+	DSP_KERNEL_SUM,
+	DSP_KERNEL_INVERSE,
+	DSP_KERNEL_COUNT
+};
+
+#endif
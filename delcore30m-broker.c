@@ -0,0 +1,595 @@
+/*
+ * \file
+ * \brief broker - Daemon which shares DSP cores between processes
+ * on Elcore-30M
+ *
+ * Broker requests all DSP cores and SDMA channels once and keeps bundle
+ * firmware loaded to the cores. Jobs of clients are queued by priority and
+ * run on the first free core, so clients do not poll the driver for busy
+ * resources. See dspbroker.h for the protocol.
+ *
+ * \copyright
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ */
+
+#include <error.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/delcore30m.h>
+
+#include "bundle.h"
+#include "dspbroker.h"
+#include "dspfirmware.h"
+#include "dsppool.h"
+
+#define MAKE_STR_(s) #s
+#define MAKE_STR(s) MAKE_STR_(s)
+
+#define MAX_CLIENTS 32
+#define MAX_PENDING 256
+
+struct request {
+	struct dsp_broker_request req;
+	int client;
+	int fds[DSP_BROKER_MAX_INPUTS + DSP_BROKER_MAX_OUTPUTS];
+	uint64_t queued;
+	uint64_t started;
+	struct request *next;
+};
+
+struct core {
+	int id;
+	struct delcore30m_resource res;
+	/// Channels of job chains, sdma.num of them
+	struct delcore30m_resource sdma;
+	uint32_t channels[DSP_BROKER_MAX_CHAINS];
+	struct delcore30m_buffer *kernels[DSP_KERNEL_COUNT];
+	struct delcore30m_job job;
+	struct request *running;
+};
+
+static int fd;
+static struct dsp_pool pool;
+static struct core cores[MAX_CORES];
+static int ncores;
+static int clients[MAX_CLIENTS];
+static struct request *pending;
+static int npending;
+static int verbose;
+static volatile sig_atomic_t stop;
+
+static void help(const char *name)
+{
+	printf("Usage: %s [options]\n", name);
+	printf("Share DSP cores between processes.\n\n");
+	printf("Options:\n");
+	printf("    -s path  socket path (default: %s)\n", DEFAULT_BROKER_SOCKET);
+	printf("    -f path  bundle firmware (default: %s)\n",
+	       MAKE_STR(FIRMWARE_PATH) "bundle.fw.bin");
+	printf("    -d       run in background when socket is ready\n");
+	printf("    -v       print every job\n");
+	printf("    -h       print this help\n");
+}
+
+static uint64_t time_us(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return t.tv_sec * 1000000ull + t.tv_nsec / 1000;
+}
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+static void request_free(struct request *r)
+{
+	for (uint32_t i = 0; i < r->req.inum + r->req.onum; ++i)
+		close(r->fds[i]);
+	free(r);
+}
+
+static void reply(struct request *r, int rc, int core)
+{
+	uint64_t now = time_us();
+	struct dsp_broker_reply rep = {
+		.tag = r->req.tag,
+		.rc = rc,
+		.core = core,
+		.wait_us = (r->started ? r->started : now) - r->queued,
+		.run_us = r->started ? now - r->started : 0
+	};
+
+	if (verbose)
+		printf("Job %u of client %d: kernel %u, core %d, rc %d, wait %u us, run %u us\n",
+		       r->req.tag, r->client, r->req.kernel, core, rc, rep.wait_us, rep.run_us);
+
+	/* Client may have disconnected, the result is dropped then */
+	if (r->client >= 0 && send(clients[r->client], &rep, sizeof(rep), MSG_NOSIGNAL) < 0)
+		fprintf(stderr, "Failed to reply to client %d: %s\n", r->client, strerror(errno));
+}
+
+/* Keep queue sorted by priority, requests of equal priority in FIFO order */
+static void enqueue(struct request *r)
+{
+	struct request **it = &pending;
+
+	while (*it && (*it)->req.priority >= r->req.priority)
+		it = &(*it)->next;
+	r->next = *it;
+	*it = r;
+	npending++;
+}
+
+static struct request *dequeue(int core_id)
+{
+	for (struct request **it = &pending; *it; it = &(*it)->next) {
+		struct request *r = *it;
+
+		if (r->req.core == DSP_BROKER_ANY_CORE || r->req.core == core_id) {
+			*it = r->next;
+			npending--;
+			return r;
+		}
+	}
+
+	return NULL;
+}
+
+/* Write channels of the chains to the job input. Return 0 or negative errno. */
+static int channels_write(const struct core *core, const struct request *r)
+{
+	const struct dsp_broker_request *req = &r->req;
+	size_t size = req->channels_offset + sizeof(uint32_t) * req->nchains;
+	uint8_t *buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			    r->fds[req->channels], 0);
+
+	if (buf == MAP_FAILED)
+		return -errno;
+
+	memcpy(buf + req->channels_offset, core->channels, sizeof(uint32_t) * req->nchains);
+	munmap(buf, size);
+
+	return 0;
+}
+
+/* Set up chains of the request on channels of the core. Return 0 or negative errno. */
+static int chains_setup(const struct core *core, const struct request *r)
+{
+	for (uint32_t i = 0; i < r->req.nchains; ++i) {
+		const struct dsp_broker_chain *c = &r->req.chains[i];
+		struct delcore30m_dmachain dmachain = {
+			.job = core->job.fd,
+			.core = core->id,
+			.external = r->fds[c->external],
+			.internal = { r->fds[c->internal[0]], r->fds[c->internal[1]] },
+			.chain = r->fds[c->chain],
+			.codebuf = r->fds[c->codebuf],
+			.channel = { c->type, core->channels[i] }
+		};
+
+		if (ioctl(fd, ELCIOC_DMACHAIN_SETUP, &dmachain))
+			return -errno;
+	}
+
+	return r->req.nchains ? channels_write(core, r) : 0;
+}
+
+static void job_start(struct core *core, struct request *r)
+{
+	uint32_t inum = r->req.inum;
+	int rc;
+
+	core->job = (struct delcore30m_job) {
+		.inum = inum + 1,
+		.onum = r->req.onum,
+		.cores_fd = core->res.fd,
+		.sdmas_fd = r->req.nchains ? core->sdma.fd : -1,
+		.flags = 0
+	};
+	core->job.input[0] = core->kernels[r->req.kernel]->fd;
+	memcpy(&core->job.input[1], r->fds, sizeof(int) * inum);
+	memcpy(core->job.output, &r->fds[inum], sizeof(int) * r->req.onum);
+
+	r->started = time_us();
+	if (ioctl(fd, ELCIOC_JOB_CREATE, &core->job)) {
+		reply(r, -errno, core->id);
+		request_free(r);
+		return;
+	}
+
+	rc = chains_setup(core, r);
+	if (rc || ioctl(fd, ELCIOC_JOB_ENQUEUE, &core->job)) {
+		reply(r, rc ? rc : -errno, core->id);
+		close(core->job.fd);
+		request_free(r);
+		return;
+	}
+
+	core->running = r;
+}
+
+static void job_finish(struct core *core, bool cancel)
+{
+	struct request *r = core->running;
+	int rc;
+
+	if (cancel && ioctl(fd, ELCIOC_JOB_CANCEL, &core->job))
+		fprintf(stderr, "Failed to cancel job on core %d\n", core->id);
+
+	if (ioctl(fd, ELCIOC_JOB_STATUS, &core->job))
+		rc = -errno;
+	else
+		rc = cancel ? DELCORE30M_JOB_CANCELLED : core->job.rc;
+
+	reply(r, rc, core->id);
+	close(core->job.fd);
+	request_free(r);
+	core->running = NULL;
+}
+
+static void dispatch(void)
+{
+	for (int i = 0; i < ncores; ++i) {
+		struct request *r;
+
+		/* A job which failed to start leaves the core free for the next one */
+		while (!cores[i].running && (r = dequeue(cores[i].id)))
+			job_start(&cores[i], r);
+	}
+}
+
+static int request_check(const struct request *r, int nfds)
+{
+	const struct dsp_broker_request *req = &r->req;
+
+	if (req->inum > DSP_BROKER_MAX_INPUTS || req->onum > DSP_BROKER_MAX_OUTPUTS ||
+	    req->inum + req->onum != nfds || req->kernel >= DSP_KERNEL_COUNT)
+		return -EINVAL;
+
+	if (req->core != DSP_BROKER_ANY_CORE) {
+		int i;
+
+		for (i = 0; i < ncores && cores[i].id != req->core; ++i)
+			continue;
+		if (i == ncores)
+			return -ENODEV;
+		if (req->nchains > cores[i].sdma.num)
+			return -EINVAL;
+	} else if (req->nchains) {
+		return -EINVAL;
+	}
+
+	for (uint32_t i = 0; i < req->nchains; ++i) {
+		const struct dsp_broker_chain *c = &req->chains[i];
+
+		if ((c->type != SDMA_CHANNEL_INPUT && c->type != SDMA_CHANNEL_OUTPUT) ||
+		    c->external >= nfds || c->internal[0] >= nfds || c->internal[1] >= nfds ||
+		    c->chain >= nfds || c->codebuf >= nfds)
+			return -EINVAL;
+	}
+	if (req->nchains && req->channels >= req->inum)
+		return -EINVAL;
+
+	if (npending >= MAX_PENDING)
+		return -EAGAIN;
+
+	return 0;
+}
+
+/* Return false if client has disconnected */
+static bool client_receive(int client)
+{
+	union {
+		char buf[CMSG_SPACE(sizeof(int) *
+				    (DSP_BROKER_MAX_INPUTS + DSP_BROKER_MAX_OUTPUTS))];
+		struct cmsghdr align;
+	} control;
+	struct request *r = calloc(1, sizeof(*r));
+	struct iovec iov;
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf)
+	};
+	int nfds = 0, rc;
+	ssize_t ret;
+
+	if (!r)
+		error(EXIT_FAILURE, errno, "Failed to allocate request");
+
+	iov.iov_base = &r->req;
+	iov.iov_len = sizeof(r->req);
+	ret = recvmsg(clients[client], &msg, MSG_CMSG_CLOEXEC);
+	if (ret <= 0) {
+		free(r);
+		return false;
+	}
+
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(r->fds, CMSG_DATA(cmsg), sizeof(int) * nfds);
+		}
+
+	r->client = client;
+	r->queued = time_us();
+
+	rc = ret != sizeof(r->req) || msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC) ?
+	     -EINVAL : request_check(r, nfds);
+	if (rc) {
+		reply(r, rc, DSP_BROKER_ANY_CORE);
+		for (int i = 0; i < nfds; ++i)
+			close(r->fds[i]);
+		free(r);
+		return true;
+	}
+
+	enqueue(r);
+
+	return true;
+}
+
+static void client_drop(int client)
+{
+	struct request **it = &pending;
+
+	while (*it) {
+		struct request *r = *it;
+
+		if (r->client == client) {
+			*it = r->next;
+			npending--;
+			request_free(r);
+		} else {
+			it = &r->next;
+		}
+	}
+
+	/* Running jobs are finished, but nobody waits for their results */
+	for (int i = 0; i < ncores; ++i)
+		if (cores[i].running && cores[i].running->client == client)
+			cores[i].running->client = -1;
+
+	close(clients[client]);
+	clients[client] = -1;
+}
+
+static void client_accept(int listen_fd)
+{
+	int sock = accept(listen_fd, NULL, NULL);
+
+	if (sock < 0)
+		return;
+
+	for (int i = 0; i < MAX_CLIENTS; ++i)
+		if (clients[i] < 0) {
+			clients[i] = sock;
+			return;
+		}
+
+	fprintf(stderr, "Too many clients\n");
+	close(sock);
+}
+
+/* Return poll timeout in ms for the nearest job time limit, -1 if none */
+static int nearest_timeout(void)
+{
+	uint64_t now = time_us();
+	int timeout = -1;
+
+	for (int i = 0; i < ncores; ++i) {
+		struct request *r = cores[i].running;
+
+		if (!r || !r->req.timeout_ms)
+			continue;
+
+		uint64_t deadline = r->started + r->req.timeout_ms * 1000ull;
+		int left = deadline > now ? (deadline - now + 999) / 1000 : 0;
+
+		if (timeout < 0 || left < timeout)
+			timeout = left;
+	}
+
+	return timeout;
+}
+
+static void cores_init(const char *fw_path)
+{
+	struct delcore30m_hardware hw;
+	struct dsp_firmware fw;
+	int nchannels;
+
+	if (ioctl(fd, ELCIOC_SYS_INFO, &hw))
+		error(EXIT_FAILURE, errno, "Failed to get hardware information");
+
+	/* SDMA channels are split between cores evenly */
+	nchannels = hw.nsdmas / (hw.ncores < MAX_CORES ? hw.ncores : MAX_CORES);
+	if (nchannels > DSP_BROKER_MAX_CHAINS)
+		nchannels = DSP_BROKER_MAX_CHAINS;
+
+	if (dsp_firmware_open(&fw, fw_path))
+		error(EXIT_FAILURE, errno, "Failed to open firmware");
+
+	/* Core resources are requested one by one to run jobs on each core separately */
+	for (ncores = 0; ncores < hw.ncores && ncores < MAX_CORES; ++ncores) {
+		struct core *core = &cores[ncores];
+		uint32_t checksum = 0;
+
+		core->res.type = DELCORE30M_CORE;
+		core->res.num = 1;
+		if (ioctl(fd, ELCIOC_RESOURCE_REQUEST, &core->res))
+			error(EXIT_FAILURE, errno, "Failed to request DELCORE30M_CORE");
+		core->id = __builtin_ffs(core->res.mask) - 1;
+
+		if (dsp_firmware_load(&fw, core->res.fd, core->id, &checksum))
+			error(EXIT_FAILURE, errno, "Failed to load firmware");
+
+		core->sdma.type = DELCORE30M_SDMA;
+		core->sdma.num = nchannels;
+		if (nchannels && ioctl(fd, ELCIOC_RESOURCE_REQUEST, &core->sdma))
+			error(EXIT_FAILURE, errno, "Failed to request DELCORE30M_SDMA");
+		for (int i = 0, mask = core->sdma.mask; i < nchannels; ++i) {
+			core->channels[i] = __builtin_ffs(mask) - 1;
+			mask &= ~(1 << core->channels[i]);
+		}
+
+		for (uint32_t k = 0; k < DSP_KERNEL_COUNT; ++k) {
+			core->kernels[k] = dsp_pool_alloc(&pool, DELCORE30M_MEMORY_XYRAM, core->id,
+							  sizeof(k), &k);
+			if (!core->kernels[k])
+				error(EXIT_FAILURE, errno, "Failed to allocate kernel buffer");
+		}
+	}
+
+	dsp_firmware_close(&fw);
+}
+
+static int socket_listen(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int sock;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		error(EXIT_FAILURE, 0, "Socket path is too long");
+	strcpy(addr.sun_path, path);
+
+	sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		error(EXIT_FAILURE, errno, "Failed to create socket");
+
+	unlink(path);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) || listen(sock, MAX_CLIENTS))
+		error(EXIT_FAILURE, errno, "Failed to listen on %s", path);
+
+	return sock;
+}
+
+int main(int argc, char **argv)
+{
+	const char *socket_path = DEFAULT_BROKER_SOCKET;
+	const char *fw_path = MAKE_STR(FIRMWARE_PATH) "bundle.fw.bin";
+	struct pollfd fds[1 + MAX_CLIENTS + MAX_CORES];
+	struct sigaction sa = { .sa_handler = on_signal };
+	bool background = false;
+	int opt, listen_fd;
+
+	while ((opt = getopt(argc, argv, "s:f:dvh")) != -1) {
+		switch (opt) {
+		case 's':
+			socket_path = optarg;
+			break;
+		case 'f':
+			fw_path = optarg;
+			break;
+		case 'd':
+			background = true;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'h':
+			help(argv[0]);
+			return EXIT_SUCCESS;
+		default:
+			error(EXIT_FAILURE, 0, "Try %s -h for help.", argv[0]);
+		}
+	}
+
+	fd = open("/dev/elcore0", O_RDWR);
+	if (fd < 0)
+		error(EXIT_FAILURE, errno, "Failed to open device file");
+	dsp_pool_init(&pool, fd);
+
+	cores_init(fw_path);
+	listen_fd = socket_listen(socket_path);
+
+	for (int i = 0; i < MAX_CLIENTS; ++i)
+		clients[i] = -1;
+
+	/* Signals interrupt poll() to stop the daemon */
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (background && daemon(0, 1))
+		error(EXIT_FAILURE, errno, "Failed to run in background");
+
+	while (!stop) {
+		int n = 0, ret;
+
+		fds[n++] = (struct pollfd) { .fd = listen_fd, .events = POLLIN };
+		for (int i = 0; i < MAX_CLIENTS; ++i)
+			fds[n++] = (struct pollfd) { .fd = clients[i], .events = POLLIN };
+		for (int i = 0; i < ncores; ++i)
+			fds[n++] = (struct pollfd) {
+				.fd = cores[i].running ? cores[i].job.fd : -1,
+				.events = POLLIN | POLLPRI | POLLOUT | POLLHUP
+			};
+
+		ret = poll(fds, n, nearest_timeout());
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			error(EXIT_FAILURE, errno, "Failed to poll");
+		}
+
+		uint64_t now = time_us();
+		for (int i = 0; i < ncores; ++i) {
+			struct request *r = cores[i].running;
+
+			if (!r)
+				continue;
+			if (fds[1 + MAX_CLIENTS + i].revents)
+				job_finish(&cores[i], false);
+			else if (r->req.timeout_ms &&
+				 now >= r->started + r->req.timeout_ms * 1000ull)
+				job_finish(&cores[i], true);
+		}
+
+		for (int i = 0; i < MAX_CLIENTS; ++i)
+			if (fds[1 + i].revents && !client_receive(i))
+				client_drop(i);
+
+		if (fds[0].revents)
+			client_accept(listen_fd);
+
+		dispatch();
+	}
+
+	for (int i = 0; i < ncores; ++i) {
+		if (cores[i].running)
+			job_finish(&cores[i], true);
+		if (cores[i].sdma.num)
+			close(cores[i].sdma.fd);
+		close(cores[i].res.fd);
+	}
+	for (int i = 0; i < MAX_CLIENTS; ++i)
+		if (clients[i] >= 0)
+			client_drop(i);
+
+	close(listen_fd);
+	unlink(socket_path);
+	dsp_pool_destroy(&pool);
+	close(fd);
+
+	return EXIT_SUCCESS;
+}
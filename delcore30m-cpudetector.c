@@ -30,6 +30,7 @@
 
 #include "drmdisplay.h"
 #include "dspinverse.h"
+#include "startup.h"
 #define STB_TRUETYPE_IMPLEMENTATION
 #include "stbfont.h"
 
@@ -58,10 +59,14 @@ struct arguments {
 	int height;
 	int connector_id;
 	bool verbose;
+	bool luma;
 }arguments;
 
 bool stop;
 
+/// Capture buffers are exported by VINC (MMAP) or allocated on DSP and imported (DMABUF)
+enum v4l2_memory memory = V4L2_MEMORY_MMAP;
+
 void set_format(int fd, uint32_t pixelformat, uint32_t width, uint32_t height)
 {
 	struct v4l2_format format = {
@@ -84,7 +89,7 @@ void request_buffers(int fd, uint32_t *count)
 	struct v4l2_requestbuffers req = {
 		.count = *count,
 		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
-		.memory = V4L2_MEMORY_MMAP
+		.memory = memory
 	};
 	if (ioctl(fd, VIDIOC_REQBUFS, &req) == -1)
 		error(EXIT_FAILURE, errno, "ioctl error VIDIOC_REQBUFS");
@@ -106,6 +111,23 @@ void export_buffers(int const fd, uint32_t const num, int bufs[])
 	}
 }
 
+/* Allocate capture buffers from DSP memory and map them for CPU */
+void alloc_buffers(struct dsp_pool *pool, uint32_t const num, size_t size, int bufs[],
+		   char *data[])
+{
+	for (uint32_t i = 0; i < num; ++i) {
+		struct delcore30m_buffer *buffer = dsp_pool_alloc(pool, DELCORE30M_MEMORY_SYSTEM,
+								  0, size, NULL);
+
+		if (!buffer)
+			error(EXIT_FAILURE, errno, "Failed to allocate capture buffer #%u", i);
+		data[i] = dsp_pool_map(buffer);
+		if (!data[i])
+			error(EXIT_FAILURE, errno, "Can not mmap capture buffer #%u", i);
+		bufs[i] = buffer->fd;
+	}
+}
+
 void stream_on(int fd)
 {
 	int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -114,11 +136,16 @@ void stream_on(int fd)
 		error(EXIT_FAILURE, errno, "ioctl error VIDIOC_STREAMON");
 }
 
-void qbuf(int fd, uint32_t index, struct v4l2_buffer *buf)
+void qbuf(int fd, uint32_t index, int dmabuf, struct v4l2_buffer *buf)
 {
 	buf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	buf->memory = V4L2_MEMORY_MMAP;
+	buf->memory = memory;
 	buf->index = index;
+	if (memory == V4L2_MEMORY_DMABUF) {
+		buf->m.fd = dmabuf;
+		/* Zero length makes VINC use the whole dmabuf */
+		buf->length = 0;
+	}
 	if (ioctl(fd, VIDIOC_QBUF, buf) == -1)
 		error(EXIT_FAILURE, errno, "ioctl error VIDIOC_QBUF");
 }
@@ -126,7 +153,7 @@ void qbuf(int fd, uint32_t index, struct v4l2_buffer *buf)
 void dqbuf(int fd, uint32_t index, struct v4l2_buffer *buf)
 {
 	buf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	buf->memory = V4L2_MEMORY_MMAP;
+	buf->memory = memory;
 	buf->index = index;
 	if (ioctl(fd, VIDIOC_DQBUF, buf) == -1)
 		error(EXIT_FAILURE, errno, "ioctl error VIDIOC_DQBUF");
@@ -141,6 +168,9 @@ static void print_usage(void)
 	puts("   -w <width>\twidth of frame (default: autodetect from framebuffer)");
 	puts("   -h <height>\theight of frame (default: autodetect from framebuffer)");
 	puts("   -c <id>\tconnector ID (for DRM mode only) (default: first available connector)");
+	puts("   -m <memory>\tcapture buffers: mmap - exported by VINC, dmabuf - allocated on DSP");
+	puts("\t\tand imported by VINC (default: mmap)");
+	puts("   -y\t\tcompare luma of pixels with background of 1 byte per pixel");
 	puts("   -v\t\tprint additional information");
 
 	printf("\nBy default, performance metrics are rendered on the frame with %s.\n",
@@ -237,61 +267,139 @@ static void get_fps()
 	frames = 0;
 }
 
-uint32_t back[1920*1080];
-uint16_t red[1920*1080];
-uint16_t green[1920*1080];
-uint16_t blue[1920*1080];
+/// Frames skipped before background learning while the sensor settles
+#define SKIP_FRAMES 30
+/// Frames averaged into background, sums of 32 frames fit uint16_t
+#define BACKGROUND_SHIFT 5
+#define BACKGROUND_FRAMES (1 << BACKGROUND_SHIFT)
+/// Pixel is changed if a component differs from background by the threshold
+#define RGB_THRESHOLD 60
+#define LUMA_THRESHOLD 30
+
+enum background_mode {
+	/// Background is BGRx per pixel, each component is compared
+	BACKGROUND_RGB,
+	/// Background is one byte of luma per pixel
+	BACKGROUND_LUMA,
+};
 
-void detector(uint32_t *src, uint32_t *dst, size_t pixels)
+/*
+ * Background of frames of any size. Sums of learned frames are interleaved
+ * per pixel, so a frame is accumulated in one pass, and are freed when the
+ * background is ready.
+ */
+struct background {
+	enum background_mode mode;
+	size_t pixels;
+	uint32_t frames;
+	uint16_t *sum;
+	uint8_t *model;
+} background;
+
+static void background_init(struct background *bg, size_t pixels, enum background_mode mode)
 {
-	static uint8_t avering_counter = 0;
-	static uint8_t flag_avered = 0;
-	static uint8_t skip_first_30_frames = 0;
-	const uint8_t threshold_2 = 60;
-
-	uint8_t *ptr_src = (uint8_t *)src;
-	uint8_t *ptr_back = (uint8_t *)back;
-	if (!flag_avered) {
-		if (skip_first_30_frames++ < 30)
-			return;
-		if (avering_counter++ < 32) {
-			for (size_t i = 0; i < pixels; ++i) {
-				blue[i] += *ptr_src++;
-				green[i] += *ptr_src++;
-				red[i] += *ptr_src++;
-				ptr_src++;
-			}
-		}
-		else {
-			for (size_t i = 0; i < pixels; ++i) {
-				*ptr_back++ = blue[i] >> 5;
-				*ptr_back++ = green[i] >> 5;
-				*ptr_back++ = red[i] >> 5;
-				ptr_back++;
+	int components = mode == BACKGROUND_LUMA ? 1 : 3;
+
+	bg->mode = mode;
+	bg->pixels = pixels;
+	bg->frames = 0;
+	bg->sum = calloc(pixels * components, sizeof(uint16_t));
+	bg->model = malloc(pixels * (mode == BACKGROUND_LUMA ? 1 : sizeof(uint32_t)));
+	if (!bg->sum || !bg->model)
+		error(EXIT_FAILURE, errno, "Failed to allocate background of %zu pixels", pixels);
+}
+
+static void background_free(struct background *bg)
+{
+	free(bg->sum);
+	free(bg->model);
+}
+
+static inline uint8_t luma(uint32_t pixel)
+{
+	return (29 * (pixel & 0xff) + 150 * ((pixel >> 8) & 0xff) +
+		77 * ((pixel >> 16) & 0xff)) >> 8;
+}
+
+static inline int component_diff(uint32_t a, uint32_t b, int shift)
+{
+	return abs((int)((a >> shift) & 0xff) - (int)((b >> shift) & 0xff));
+}
+
+/* Accumulate frame @src into background. Return true if background is ready. */
+static bool background_learn(struct background *bg, const uint32_t *src)
+{
+	uint16_t *sum = bg->sum;
+
+	if (!sum)
+		return true;
+	if (bg->frames++ < SKIP_FRAMES)
+		return false;
+
+	if (bg->frames <= SKIP_FRAMES + BACKGROUND_FRAMES) {
+		if (bg->mode == BACKGROUND_LUMA) {
+			for (size_t i = 0; i < bg->pixels; ++i)
+				sum[i] += luma(src[i]);
+		} else {
+			for (size_t i = 0; i < bg->pixels; ++i, sum += 3) {
+				sum[0] += src[i] & 0xff;
+				sum[1] += (src[i] >> 8) & 0xff;
+				sum[2] += (src[i] >> 16) & 0xff;
 			}
-			avering_counter = 0;
-			flag_avered = 1;
 		}
-		return;
+		return false;
 	}
 
-	uint8_t *ptr = (uint8_t *) dst;
-	memcpy(dst, src, pixels * 4);
-	for (size_t i = 0; i < pixels; ++i) {
-		uint8_t r;
-		uint8_t blue_diff = abs(*ptr_src++ - *ptr_back++);
-		uint8_t green_diff = abs(*ptr_src++ - *ptr_back++);
-		r = *ptr_src++;
-		uint8_t red_diff = abs(r - *ptr_back++);
-		ptr_src++; ptr_back++;
-
-		uint16_t mask;
-		if ((red_diff < threshold_2) && (green_diff < threshold_2) && (blue_diff < threshold_2))
-			mask = 0;
-		else
-			mask = 255;
+	if (bg->mode == BACKGROUND_LUMA) {
+		for (size_t i = 0; i < bg->pixels; ++i)
+			bg->model[i] = sum[i] >> BACKGROUND_SHIFT;
+	} else {
+		uint32_t *model = (uint32_t *)bg->model;
+
+		for (size_t i = 0; i < bg->pixels; ++i, sum += 3)
+			model[i] = (sum[0] >> BACKGROUND_SHIFT) |
+				   (sum[1] >> BACKGROUND_SHIFT) << 8 |
+				   (sum[2] >> BACKGROUND_SHIFT) << 16;
+	}
+	free(bg->sum);
+	bg->sum = NULL;
 
-		ptr[4 * i + 2] = (mask + r) / 2;
+	return false;
+}
+
+/* Mix red to changed pixels of @src */
+static inline uint32_t mark_pixel(uint32_t pixel, bool changed)
+{
+	uint32_t r = (pixel >> 16) & 0xff;
+
+	r = ((changed ? 255 : 0) + r) / 2;
+
+	return (pixel & ~0xff0000) | r << 16;
+}
+
+void detector(struct background *bg, const uint32_t *src, uint32_t *dst)
+{
+	if (!background_learn(bg, src))
+		return;
+
+	if (bg->mode == BACKGROUND_LUMA) {
+		for (size_t i = 0; i < bg->pixels; ++i) {
+			uint32_t pixel = src[i];
+			bool changed = abs(luma(pixel) - bg->model[i]) >= LUMA_THRESHOLD;
+
+			dst[i] = mark_pixel(pixel, changed);
+		}
+	} else {
+		const uint32_t *model = (const uint32_t *)bg->model;
+
+		for (size_t i = 0; i < bg->pixels; ++i) {
+			uint32_t pixel = src[i];
+			bool changed = component_diff(pixel, model[i], 0) >= RGB_THRESHOLD ||
+				       component_diff(pixel, model[i], 8) >= RGB_THRESHOLD ||
+				       component_diff(pixel, model[i], 16) >= RGB_THRESHOLD;
+
+			dst[i] = mark_pixel(pixel, changed);
+		}
 	}
 }
 
@@ -306,8 +414,14 @@ int main(int argc, char *argv[])
 	struct dsp_struct dsp_data;
 	struct frame_args frame_data;
 	struct fontData font_data = {0};
-	//!< Exported file descriptors of input buffers
+	//!< File descriptors of capture buffers
 	int inbufs[MAX_BUFFERS_COUNT];
+	//!< DSP buffers imported by VINC in DMABUF mode
+	struct dsp_pool capture_pool;
+	int capture_fd = -1;
+	double begin;
+
+	startup_init();
 
 	arguments = (struct arguments ){
 		.iface = MAX_IFACE,
@@ -316,13 +430,14 @@ int main(int argc, char *argv[])
 		.height = 0,
 		.connector_id = -1,
 		.verbose = false,
+		.luma = false,
 	};
 	struct sigaction new_sigaction = {
 		.sa_handler = signal_handler,
 		.sa_flags = SA_RESTART,
 	};
 
-	while ((opt = getopt(argc, argv, "i:o:w:h:c:v")) != -1) {
+	while ((opt = getopt(argc, argv, "i:o:w:h:c:m:yv")) != -1) {
 		switch (opt) {
 		case 'i':
 			arguments.iface = atoi(optarg);
@@ -339,6 +454,17 @@ int main(int argc, char *argv[])
 		case 'c':
 			arguments.connector_id = atoi(optarg);
 			break;
+		case 'm':
+			if (!strcmp(optarg, "dmabuf")) {
+				memory = V4L2_MEMORY_DMABUF;
+			} else if (strcmp(optarg, "mmap")) {
+				print_usage();
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'y':
+			arguments.luma = true;
+			break;
 		case 'v':
 			arguments.verbose = true;
 			break;
@@ -356,16 +482,23 @@ int main(int argc, char *argv[])
 	sigaction(SIGINT, &new_sigaction, NULL);
 	printf("Opening device with sensor interface %d\n", arguments.iface);
 
+	begin = startup_begin();
 	fd = find_device_on_interface_number(arguments.iface);
 	if (fd < 0)
 		error(EXIT_FAILURE, errno, "Can not open device with interface %d",
 		      arguments.iface);
+	startup_end("V4L2 discovery", begin);
 
+	begin = startup_begin();
 	if (drmdisplay_init(&data_drm, arguments.connector_id, arguments.verbose))
 		error(EXIT_FAILURE, errno, "DRM initialize failed");
 
 	if (drmdisplay_fill_mode(&data_drm, &arguments.width, &arguments.height))
 		printf("No suitable display modes found\n");
+	startup_end("DRM init", begin);
+
+	/* Font is loaded by a thread and waited by the first overlay */
+	init_font(&font_data, arguments.height / 12);
 
 	frame_data = (struct frame_args) {
 		.frame_width = arguments.width,
@@ -377,13 +510,24 @@ int main(int argc, char *argv[])
 
 	buffer_size = frame_data.frame_width * frame_data.frame_height * frame_data.pixel_format;
 
-	dsp_init(&dsp_data, frame_data);
+	/* DSP is used only to allocate result frames here */
+	begin = startup_begin();
+	dsp_init(&dsp_data, frame_data, 2, 1);
+	startup_end("DSP init", begin);
 
 	set_format(fd, V4L2_PIX_FMT_BGR32, arguments.width, arguments.height);
 	request_buffers(fd, &buffer_count);
-	export_buffers(fd, buffer_count, &inbufs[0]);
+	if (memory == V4L2_MEMORY_DMABUF) {
+		capture_fd = open("/dev/elcore0", O_RDWR);
+		if (capture_fd < 0)
+			error(EXIT_FAILURE, errno, "Failed to open /dev/elcore0");
+		dsp_pool_init(&capture_pool, capture_fd);
+		alloc_buffers(&capture_pool, buffer_count, buffer_size, &inbufs[0], &buffer[0]);
+	} else {
+		export_buffers(fd, buffer_count, &inbufs[0]);
+	}
 
-	for (uint32_t i = 0; i < buffer_count; i++) {
+	for (uint32_t i = 0; i < buffer_count && memory == V4L2_MEMORY_MMAP; i++) {
 		buf.memory = V4L2_MEMORY_MMAP;
 		buf.index = i;
 		if (ioctl(fd, VIDIOC_QUERYBUF, &buf) == -1)
@@ -399,22 +543,25 @@ int main(int argc, char *argv[])
 			error(EXIT_FAILURE, errno, "Can not mmap vinc buffer #%d", i);
 	}
 	for (uint32_t i = 0; i < buffer_count; i++)
-		qbuf(fd, i, &buf);
+		qbuf(fd, i, inbufs[i], &buf);
 
 	dsp_job_create(&dsp_data, inbufs, buffer_count);
 
-	init_font(&font_data, arguments.height / 12);
-
-	drmdisplay_set_mode(&data_drm, arguments.width, arguments.height, frame_data.pixel_format,
+	begin = startup_begin();
+	drmdisplay_set_mode(&data_drm, arguments.width, arguments.height, dsp_data.result_pitch,
 			    dsp_data.result_frame[0]->fd);
+	int result_fds[MAX_RESULT_FRAMES];
+	for (int i = 1; i < dsp_data.result_count; i++)
+		result_fds[i - 1] = dsp_data.result_frame[i]->fd;
 	drmdisplay_start_flipflop(&data_drm, arguments.width, arguments.height,
-				  frame_data.pixel_format, dsp_data.result_frame[1]->fd);
+				  dsp_data.result_pitch, result_fds, dsp_data.result_count - 1);
 	stream_on(fd);
+	startup_end("DRM mode", begin);
 
 	uint32_t buffer_id = 0;
-	memset(red, 0, 1920*1080*sizeof(uint16_t));
-	memset(green, 0, 1920*1080*sizeof(uint16_t));
-	memset(blue, 0, 1920*1080*sizeof(uint16_t));
+	int result_id = 0;
+	background_init(&background, frame_data.frame_width * frame_data.frame_height,
+			arguments.luma ? BACKGROUND_LUMA : BACKGROUND_RGB);
 	while (!stop) {
 		if (frames % 30 == 0) {
 			get_fps();
@@ -422,33 +569,42 @@ int main(int argc, char *argv[])
 		}
 		dqbuf(fd, buffer_id, &buf);
 
-		detector((uint32_t *) buffer[buffer_id],
-			 (uint32_t *) dsp_data.result_frame_data[buffer_id],
-			 buffer_size >> 2);
+		detector(&background, (uint32_t *) buffer[buffer_id],
+			 (uint32_t *) dsp_data.result_frame_data[result_id]);
 
 		char str[255];
 		sprintf(str, "CPU: %.1f%%, %.1f FPS", cpu_usage, fps);
-		draw_string(&font_data, dsp_data.result_frame_data[buffer_id],
+		draw_string(&font_data, dsp_data.result_frame_data[result_id],
 			    frame_data.frame_width * frame_data.pixel_format,
 			    str, 0);
 		/* send message to flip page handler */
 		pthread_cond_signal(&cv);
+		startup_done();
 
 		frames++;
 
-		qbuf(fd, buffer_id, &buf);
+		qbuf(fd, buffer_id, inbufs[buffer_id], &buf);
 
 		buffer_id++;
 		if (buffer_id >= buffer_count)
 			buffer_id = 0;
+		result_id++;
+		if (result_id >= dsp_data.result_count)
+			result_id = 0;
 	}
 
 	drmdisplay_restore_mode(&data_drm);
 
 	dsp_free(&dsp_data);
+	background_free(&background);
 
 	close(fd);
 
+	if (memory == V4L2_MEMORY_DMABUF) {
+		dsp_pool_destroy(&capture_pool);
+		close(capture_fd);
+	}
+
 	pthread_cancel(thread);
 
 	return EXIT_SUCCESS;
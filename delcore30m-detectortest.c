@@ -0,0 +1,544 @@
+/*
+ * \file
+ * \brief detectortest - Tile stages of detector firmware compared with
+ * the same stages computed by CPU on whole frames
+ *
+ * \copyright
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ */
+
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "dspdetector.h"
+
+#define DEFAULT_STAGES "motion:40,open:1,overlay"
+#define DEFAULT_FRAME_WIDTH 650
+#define DEFAULT_FRAME_HEIGHT 470
+#define DEFAULT_TILE_WIDTH 64
+#define DEFAULT_TILE_HEIGHT 16
+
+/// Objects are placed at least this far apart, but may lie in corners of L shapes
+#define OBJECT_GAP 4
+#define DEFAULT_OBJECT_TRIES 25
+#define MAX_BLOBS 256
+
+/* Frames of the test, frame with objects is processed again with -u */
+enum { FRAME_BACKGROUND, FRAME_OBJECTS, FRAME_COUNT };
+
+struct frame_ref {
+	int width, height;
+	/// RGBA pixels, mask is the top bit of alpha as in firmware
+	uint8_t *pixels;
+	struct tile_blob blobs[MAX_BLOBS];
+	int nblobs;
+};
+
+static void print_usage(void)
+{
+	puts("Compare detector stages on DSP with reference computed by CPU.\n");
+	puts("Usage: delcore30m-detectortest [options]");
+	puts("   -c <cores>\tnumber of DSP cores (default: 1)");
+	printf("   -s <list>\tstages, see delcore30m-dspdetector (default: %s)\n", DEFAULT_STAGES);
+	printf("   -f <W>x<H>\tframe size (default: %dx%d)\n", DEFAULT_FRAME_WIDTH,
+	       DEFAULT_FRAME_HEIGHT);
+	printf("   -t <W>x<H>\ttile size (default: %dx%d)\n", DEFAULT_TILE_WIDTH,
+	       DEFAULT_TILE_HEIGHT);
+	printf("   -n <count>\ttries to place an object (default: %d)\n", DEFAULT_OBJECT_TRIES);
+	puts("   -m\t\tcompare packed mask output instead of pixels");
+	puts("   -k\t\tcompare packed mask written besides pixels, needs one core");
+	puts("   -S\t\tcompare tile statistics");
+	puts("   -u\t\tskip unchanged tiles and process the frame with objects twice");
+	puts("   -b <shift>\tupdate background with weight 1/2^shift before stages");
+	puts("   -2\t\tpipeline tiles over two XYRAM slots without output slots");
+	puts("   -h\t\tprint this help");
+}
+
+static int luma(const uint8_t *pixel)
+{
+	return (29 * pixel[0] + 150 * pixel[1] + 77 * pixel[2]) >> 8;
+}
+
+static int box_free(const uint8_t *taken, int width, int height, int x0, int y0, int w, int h)
+{
+	for (int y = y0 - OBJECT_GAP; y < y0 + h + OBJECT_GAP; ++y)
+		for (int x = x0 - OBJECT_GAP; x < x0 + w + OBJECT_GAP; ++x)
+			if (x >= 0 && y >= 0 && x < width && y < height && taken[y * width + x])
+				return 0;
+
+	return 1;
+}
+
+/*
+ * Fill background with dark noise and random alpha, then add bright
+ * rectangles, L shapes and single pixels to the frame with objects
+ */
+static void make_frames(uint8_t *frames[], int width, int height, int tries)
+{
+	size_t size = (size_t)width * height * 4;
+	uint8_t *taken = calloc(width, height);
+
+	if (!taken)
+		exit(EXIT_FAILURE);
+
+	srand(1);
+	for (size_t i = 0; i < size; ++i)
+		frames[FRAME_BACKGROUND][i] = i % 4 == 3 ? rand() : 40 + rand() % 32;
+	memcpy(frames[FRAME_OBJECTS], frames[FRAME_BACKGROUND], size);
+
+	for (int i = 0; i < tries; ++i) {
+		int speck = rand() % 4 == 0;
+		int w = speck ? 1 : 1 + rand() % 90;
+		int h = speck ? 1 : 1 + rand() % 60;
+		int x0 = rand() % (width - w), y0 = rand() % (height - h);
+		int lshape = rand() % 2;
+
+		if (!box_free(taken, width, height, x0, y0, w, h))
+			continue;
+		for (int y = y0; y < y0 + h; ++y)
+			for (int x = x0; x < x0 + w; ++x) {
+				if (lshape && x > x0 + w / 3 && y > y0 + h / 3)
+					continue;
+				taken[y * width + x] = 1;
+				memset(frames[FRAME_OBJECTS] + (y * width + x) * 4, 200 + rand() % 56, 3);
+			}
+	}
+	free(taken);
+}
+
+/* Move components of @background towards @src by 1/2^@shift of difference, at least by 1 */
+static void update_background(uint8_t *background, const uint8_t *src, size_t pixels, int shift)
+{
+	for (size_t i = 0; i < pixels * 4; ++i) {
+		int diff = src[i] - background[i];
+		int step = abs(diff) >> shift;
+
+		if (i % 4 == 3 || !diff)
+			continue;
+		step = step ? step : 1;
+		background[i] += diff > 0 ? step : -step;
+	}
+}
+
+static void morph(struct frame_ref *ref, int radius, int erode)
+{
+	int width = ref->width, height = ref->height;
+	uint8_t *mask = malloc(width * height);
+
+	if (!mask)
+		exit(EXIT_FAILURE);
+	for (int i = 0; i < width * height; ++i)
+		mask[i] = ref->pixels[i * 4 + 3] >> 7;
+
+	for (int y = 0; y < height; ++y)
+		for (int x = 0; x < width; ++x) {
+			int all = 1, any = 0;
+
+			for (int j = y - radius; j <= y + radius; ++j)
+				for (int i = x - radius; i <= x + radius; ++i) {
+					if (i < 0 || j < 0 || i >= width || j >= height)
+						continue;
+					all &= mask[j * width + i];
+					any |= mask[j * width + i];
+				}
+			ref->pixels[(y * width + x) * 4 + 3] = (erode ? all : any) ? 0xff : 0;
+		}
+	free(mask);
+}
+
+/* Boxes of 8-connected pixels with mask set by flood fill over the whole frame */
+static void blobs(struct frame_ref *ref, uint32_t min_pixels)
+{
+	int width = ref->width, height = ref->height;
+	uint8_t *seen = calloc(width, height);
+	int *stack = malloc(sizeof(int) * width * height);
+
+	if (!seen || !stack)
+		exit(EXIT_FAILURE);
+
+	ref->nblobs = 0;
+	for (int i = 0; i < width * height; ++i) {
+		struct tile_blob box = { UINT16_MAX, UINT16_MAX, 0, 0, 0 };
+		int n = 0;
+
+		if (seen[i] || !(ref->pixels[i * 4 + 3] & 0x80))
+			continue;
+
+		seen[i] = 1;
+		stack[n++] = i;
+		while (n) {
+			int x = stack[--n] % width, y = stack[n] / width;
+
+			box.left = x < box.left ? x : box.left;
+			box.right = x > box.right ? x : box.right;
+			box.top = y < box.top ? y : box.top;
+			box.bottom = y > box.bottom ? y : box.bottom;
+			box.pixels++;
+
+			for (int j = y - 1; j <= y + 1; ++j)
+				for (int k = x - 1; k <= x + 1; ++k) {
+					int next = j * width + k;
+
+					if (k < 0 || j < 0 || k >= width || j >= height || seen[next] ||
+					    !(ref->pixels[next * 4 + 3] & 0x80))
+						continue;
+					seen[next] = 1;
+					stack[n++] = next;
+				}
+		}
+		if (box.pixels >= min_pixels && ref->nblobs < MAX_BLOBS)
+			ref->blobs[ref->nblobs++] = box;
+	}
+	free(seen);
+	free(stack);
+}
+
+/* Run @frame_data stages on @src with @background by CPU to @ref */
+static void reference(const struct frame_args *frame_data, const uint8_t *src,
+		      const uint8_t *background, struct frame_ref *ref)
+{
+	size_t pixels = (size_t)ref->width * ref->height;
+
+	memcpy(ref->pixels, src, pixels * 4);
+	for (int s = 0; s < frame_data->nstages; ++s) {
+		const struct tile_stage *stage = &frame_data->stages[s];
+
+		switch (stage->op) {
+		case TILE_STAGE_ERODE:
+		case TILE_STAGE_DILATE:
+			morph(ref, stage->param, stage->op == TILE_STAGE_ERODE);
+			continue;
+		case TILE_STAGE_OPEN:
+		case TILE_STAGE_CLOSE:
+			morph(ref, stage->param, stage->op == TILE_STAGE_OPEN);
+			morph(ref, stage->param, stage->op == TILE_STAGE_CLOSE);
+			continue;
+		case TILE_STAGE_BLOBS:
+			blobs(ref, stage->param);
+			continue;
+		}
+
+		for (size_t i = 0; i < pixels; ++i) {
+			uint8_t *p = ref->pixels + i * 4;
+			const uint8_t *b = background + i * 4;
+			int moving = 0;
+
+			switch (stage->op) {
+			case TILE_STAGE_MOTION:
+				for (int c = 0; c < 3; ++c)
+					moving |= abs(p[c] - b[c]) > (int)stage->param;
+				p[3] = moving ? 0xff : 0;
+				break;
+			case TILE_STAGE_GRAYSCALE:
+				p[0] = p[1] = p[2] = luma(p);
+				break;
+			case TILE_STAGE_THRESHOLD:
+				p[3] = luma(p) > (int)stage->param ? 0xff : 0;
+				break;
+			case TILE_STAGE_OVERLAY:
+				if (p[3])
+					p[2] = p[2] > 0x7f ? 0xff : p[2] + 0x80;
+				break;
+			}
+		}
+	}
+}
+
+static int compare_pixels(const struct dsp_struct *dsp, const struct frame_ref *ref,
+			  const uint8_t *result)
+{
+	int errors = 0;
+
+	for (int y = 0; y < ref->height; ++y)
+		for (int x = 0; x < ref->width; ++x) {
+			const uint8_t *r = result + y * dsp->result_pitch + x * 4;
+			const uint8_t *e = ref->pixels + (y * ref->width + x) * 4;
+
+			if (memcmp(r, e, 4) && errors++ < 10)
+				fprintf(stderr, "Pixel %d,%d is 0x%08X, expected 0x%08X\n", x, y,
+					*(uint32_t *)r, *(uint32_t *)e);
+		}
+
+	return errors;
+}
+
+/* Mask bits of pixels are compared, padding bits of lines must be clear */
+static int compare_mask(const struct dsp_struct *dsp, const struct frame_ref *ref,
+			const uint8_t *result, int empty)
+{
+	int errors = 0;
+
+	for (int y = 0; y < ref->height; ++y)
+		for (uint32_t x = 0; x < dsp->mask_pitch * 8; ++x) {
+			int bit = result[y * dsp->mask_pitch + x / 8] >> (x % 8) & 1;
+			int expected = x < (uint32_t)ref->width && !empty &&
+				       ref->pixels[(y * ref->width + x) * 4 + 3] >> 7;
+
+			if (bit != expected && errors++ < 10)
+				fprintf(stderr, "Mask bit %u,%d is %d, expected %d\n", x, y, bit,
+					expected);
+		}
+
+	return errors;
+}
+
+static int compare_blobs(const void *a, const void *b)
+{
+	return memcmp(a, b, sizeof(struct tile_blob));
+}
+
+static int check_blobs(struct dsp_struct *dsp, struct frame_ref *ref)
+{
+	struct tile_blob blobs[MAX_BLOBS];
+	uint32_t count = frame_blobs(dsp, blobs, MAX_BLOBS);
+
+	if (count > MAX_BLOBS)
+		count = MAX_BLOBS;
+	qsort(blobs, count, sizeof(blobs[0]), compare_blobs);
+	qsort(ref->blobs, ref->nblobs, sizeof(ref->blobs[0]), compare_blobs);
+
+	if (count == (uint32_t)ref->nblobs &&
+	    !memcmp(blobs, ref->blobs, sizeof(blobs[0]) * count))
+		return 0;
+
+	fprintf(stderr, "Found %u blobs, expected %d, overflow 0x%x\n", count, ref->nblobs,
+		dsp->blob_overflow);
+	for (uint32_t i = 0; i < count; ++i)
+		fprintf(stderr, "Blob %d,%d-%d,%d of %u pixels\n", blobs[i].left, blobs[i].top,
+			blobs[i].right, blobs[i].bottom, blobs[i].pixels);
+
+	return 1;
+}
+
+/* Statistics are taken from input tiles before stages, against the first frame */
+static int check_stats(struct dsp_struct *dsp, const struct frame_args *frame_data,
+		       const uint8_t *src, const uint8_t *background, uint32_t frame)
+{
+	struct tile_stats stats[dsp->grid_tiles];
+	uint32_t cols = DIV_ROUND_UP(frame_data->frame_width, frame_data->tile_width);
+	uint32_t threshold = 0x3f;
+	int errors = 0;
+
+	for (int s = 0; s < frame_data->nstages; ++s)
+		if (frame_data->stages[s].op == TILE_STAGE_MOTION)
+			threshold = frame_data->stages[s].param;
+
+	if (frame_tile_stats(dsp, stats) != dsp->grid_tiles) {
+		fputs("Statistics are missing\n", stderr);
+		return 1;
+	}
+
+	for (uint32_t t = 0; t < dsp->grid_tiles; ++t) {
+		uint32_t x0 = t % cols * frame_data->tile_width;
+		uint32_t y0 = t / cols * frame_data->tile_height;
+		uint32_t w = min(frame_data->tile_width, frame_data->frame_width - x0);
+		uint32_t h = min(frame_data->tile_height, frame_data->frame_height - y0);
+		uint32_t changed = 0, sum = 0;
+
+		for (uint32_t y = y0; y < y0 + h; ++y)
+			for (uint32_t x = x0; x < x0 + w; ++x) {
+				size_t i = (y * frame_data->frame_width + x) * 4;
+				int moving = 0;
+
+				for (int c = 0; c < 3; ++c) {
+					int diff = abs(src[i + c] - background[i + c]);
+
+					sum += diff;
+					moving |= diff > (int)threshold;
+				}
+				changed += moving;
+			}
+
+		if (stats[t].changed != changed || stats[t].difference != sum / (3 * w * h) ||
+		    stats[t].frame != (frame & 0xff)) {
+			if (errors++ < 10)
+				fprintf(stderr, "Tile %u statistics %u %u %u, expected %u %u %u\n",
+					t, stats[t].changed, stats[t].difference, stats[t].frame,
+					changed, sum / (3 * w * h), frame & 0xff);
+		}
+	}
+
+	return errors;
+}
+
+static int parse_size(const char *arg, int *width, int *height)
+{
+	return sscanf(arg, "%dx%d", width, height) == 2 && *width > 0 && *height > 0 ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+	struct frame_args frame_data = {
+		.frame_width = DEFAULT_FRAME_WIDTH,
+		.frame_height = DEFAULT_FRAME_HEIGHT,
+		.tile_width = DEFAULT_TILE_WIDTH,
+		.tile_height = DEFAULT_TILE_HEIGHT,
+		.pixel_format = PIXEL_FORMAT_RGBA
+	};
+	const char *stages = DEFAULT_STAGES;
+	int width, height, ncores = 1, runs = 1, errors = 0, opt, has_blobs = 0;
+	int tries = DEFAULT_OBJECT_TRIES;
+	struct dsp_struct dsp;
+	struct frame_ref ref;
+	uint8_t *frames[FRAME_COUNT];
+	int fds[FRAME_COUNT];
+
+	while ((opt = getopt(argc, argv, "c:s:f:t:n:b:mkSu2h")) != -1) {
+		switch (opt) {
+		case 'c':
+			ncores = atoi(optarg);
+			break;
+		case 's':
+			stages = optarg;
+			break;
+		case 'f':
+			if (parse_size(optarg, &width, &height)) {
+				print_usage();
+				return EXIT_FAILURE;
+			}
+			frame_data.frame_width = width;
+			frame_data.frame_height = height;
+			break;
+		case 't':
+			if (parse_size(optarg, &width, &height)) {
+				print_usage();
+				return EXIT_FAILURE;
+			}
+			frame_data.tile_width = width;
+			frame_data.tile_height = height;
+			break;
+		case 'n':
+			tries = atoi(optarg);
+			break;
+		case 'b':
+			frame_data.background_shift = atoi(optarg);
+			break;
+		case 'm':
+			frame_data.mask_output = true;
+			break;
+		case 'k':
+			frame_data.mask_output = true;
+			frame_data.mask_with_frame = true;
+			break;
+		case 'S':
+			frame_data.tile_stats = true;
+			break;
+		case 'u':
+			frame_data.skip_unchanged = true;
+			runs = 2;
+			break;
+		case '2':
+			frame_data.two_slots = true;
+			break;
+		default:
+			print_usage();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (dsp_stages_parse(&frame_data, stages)) {
+		fprintf(stderr, "Invalid stages: %s\n", stages);
+		return EXIT_FAILURE;
+	}
+	/* Firmware detector() has no CPU reference */
+	for (int s = 0; s < frame_data.nstages; ++s) {
+		if (frame_data.stages[s].op == TILE_STAGE_DETECT) {
+			fputs("detect stage can not be compared\n", stderr);
+			return EXIT_FAILURE;
+		}
+		has_blobs |= frame_data.stages[s].op == TILE_STAGE_BLOBS;
+	}
+	/* Background of the second run depends on tiles skipped in the first one */
+	if (frame_data.background_shift && frame_data.skip_unchanged) {
+		fputs("-b can not be used with -u\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	width = frame_data.frame_width;
+	height = frame_data.frame_height;
+	size_t size = (size_t)width * height * 4;
+
+	for (int i = 0; i < FRAME_COUNT; ++i) {
+		fds[i] = memfd_create("frame", 0);
+		if (fds[i] < 0 || ftruncate(fds[i], size)) {
+			perror("Failed to create frame");
+			return EXIT_FAILURE;
+		}
+		frames[i] = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[i], 0);
+		if (frames[i] == MAP_FAILED) {
+			perror("Failed to mmap() frame");
+			return EXIT_FAILURE;
+		}
+	}
+	make_frames(frames, width, height, tries);
+	/* Faint noise moves background by less than its step, which is rounded up to 1 */
+	if (frame_data.background_shift)
+		for (size_t i = 0; i < size; ++i)
+			if (i % 4 != 3 && frames[FRAME_OBJECTS][i] < 200)
+				frames[FRAME_OBJECTS][i] += rand() % 7 - 3;
+
+	ref.width = width;
+	ref.height = height;
+	ref.nblobs = 0;
+	ref.pixels = malloc(size);
+	/* The first frame becomes background, which moves towards the frame with objects */
+	uint8_t *background = malloc(size);
+	if (!ref.pixels || !background)
+		return EXIT_FAILURE;
+	memcpy(background, frames[FRAME_BACKGROUND], size);
+	if (frame_data.background_shift)
+		update_background(background, frames[FRAME_OBJECTS], size / 4,
+				  frame_data.background_shift);
+	reference(&frame_data, frames[FRAME_OBJECTS], background, &ref);
+
+	dsp_init(&dsp, frame_data, 2, ncores);
+	dsp_job_create(&dsp, fds, FRAME_COUNT);
+
+	/* The first frame becomes background, nothing moves in it */
+	if (frame_detector(&dsp, fds[FRAME_BACKGROUND], 0))
+		return EXIT_FAILURE;
+	if (frame_data.mask_output)
+		errors += compare_mask(&dsp, &ref, dsp.result_mask_data[0], 1);
+
+	for (int run = 0; run < runs; ++run) {
+		int dest = (run + 1) % dsp.result_count;
+
+		if (frame_detector(&dsp, fds[FRAME_OBJECTS], dest))
+			return EXIT_FAILURE;
+
+		if (frame_data.mask_output)
+			errors += compare_mask(&dsp, &ref, dsp.result_mask_data[dest], 0);
+		if (!frame_data.mask_output || frame_data.mask_with_frame)
+			errors += compare_pixels(&dsp, &ref, dsp.result_frame_data[dest]);
+		if (has_blobs)
+			errors += check_blobs(&dsp, &ref);
+		if (frame_data.tile_stats)
+			errors += check_stats(&dsp, &frame_data, frames[FRAME_OBJECTS],
+					      background, run + 1);
+		/* Unchanged frame must not report changed tiles */
+		if (run) {
+			uint8_t bitmap[DIV_ROUND_UP(dsp.grid_tiles, 8)];
+			uint32_t dirty = frame_dirty_tiles(&dsp, bitmap);
+
+			if (dirty) {
+				fprintf(stderr, "%u tiles changed in the same frame\n", dirty);
+				errors++;
+			}
+		}
+	}
+
+	dsp_free(&dsp);
+	free(ref.pixels);
+	free(background);
+
+	printf("Frame %dx%d, tiles %dx%d, %d cores, stages %s\n", width, height,
+	       frame_data.tile_width, frame_data.tile_height, ncores, stages);
+	puts(errors ? "TEST FAILED" : "TEST PASSED");
+
+	return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
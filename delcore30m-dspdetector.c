@@ -31,6 +31,8 @@
 
 #include "drmdisplay.h"
 #include "dspdetector.h"
+#include "dsptune.h"
+#include "startup.h"
 #define STB_TRUETYPE_IMPLEMENTATION
 #include "stbfont.h"
 
@@ -40,7 +42,16 @@
 #define MAX_LEN 64
 #define DEFAULT_OUTFILE "/dev/fb0"
 
-#define MAX_BUFFERS_COUNT 2
+#define MAX_BUFFERS_COUNT MAX_INPUT_BUFFERS
+#define DEFAULT_DEPTH 2
+#define DEFAULT_CORES 1
+#define DEFAULT_TILE_WIDTH 288
+#define DEFAULT_TILE_HEIGHT 48
+/// Background follows the scene over about 32 frames, as in delcore30m-cpudetector
+#define DEFAULT_BACKGROUND_SHIFT 5
+#define TUNE_FRAMES 32
+/// Maximum number of object boxes drawn on the frame
+#define MAX_DRAWN_BLOBS 64
 
 #define NSEC_IN_SEC 1000000000
 
@@ -60,12 +71,41 @@ struct arguments {
 	int width;
 	int height;
 	int connector_id;
+	int depth;
+	int cores;
+	char *profile;
+	bool tune;
 	bool verbose;
+	struct dsp_roi roi;
+	bool skip_unchanged;
+	/// Only nstages and stages are used
+	struct frame_args stages;
+	/// Resolution switched to by key 'r', 0 if not set
+	int alt_width;
+	int alt_height;
+	int background_shift;
+	bool heatmap;
+	bool mask;
+};
+
+struct tune_data {
+	struct frame_args frame_data;
+	int depth;
+	int cores;
+	int *inbufs;
+	uint32_t buffer_count;
 };
 
 bool stop;
 
-void set_format(int fd, uint32_t pixelformat, uint32_t width, uint32_t height)
+/// Capture buffers are exported by VINC (MMAP) or allocated on DSP and imported (DMABUF)
+enum v4l2_memory memory = V4L2_MEMORY_MMAP;
+
+/// DSP buffers imported by VINC in DMABUF mode
+struct dsp_pool capture_pool;
+int capture_fd = -1;
+
+uint32_t set_format(int fd, uint32_t pixelformat, uint32_t width, uint32_t height)
 {
 	struct v4l2_format format = {
 		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
@@ -80,6 +120,8 @@ void set_format(int fd, uint32_t pixelformat, uint32_t width, uint32_t height)
 	if (format.fmt.pix.width != width || format.fmt.pix.height != height)
 		printf("Requested frame size %ux%u, but VINC will use %ux%u\n",
 		   width, height, format.fmt.pix.width, format.fmt.pix.height);
+
+	return format.fmt.pix.bytesperline;
 }
 
 void request_buffers(int fd, uint32_t *count)
@@ -87,7 +129,7 @@ void request_buffers(int fd, uint32_t *count)
 	struct v4l2_requestbuffers req = {
 		.count = *count,
 		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
-		.memory = V4L2_MEMORY_MMAP
+		.memory = memory
 	};
 	if (ioctl(fd, VIDIOC_REQBUFS, &req) == -1)
 		error(EXIT_FAILURE, errno, "ioctl error VIDIOC_REQBUFS");
@@ -109,6 +151,19 @@ void export_buffers(int const fd, uint32_t const num, int bufs[])
 	}
 }
 
+/* Allocate capture buffers from DSP memory to be imported by VINC */
+void alloc_buffers(struct dsp_pool *pool, uint32_t const num, size_t size, int bufs[])
+{
+	for (uint32_t i = 0; i < num; ++i) {
+		struct delcore30m_buffer *buffer = dsp_pool_alloc(pool, DELCORE30M_MEMORY_SYSTEM,
+								  0, size, NULL);
+
+		if (!buffer)
+			error(EXIT_FAILURE, errno, "Failed to allocate capture buffer #%u", i);
+		bufs[i] = buffer->fd;
+	}
+}
+
 void stream_on(int fd)
 {
 	int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -117,11 +172,16 @@ void stream_on(int fd)
 		error(EXIT_FAILURE, errno, "ioctl error VIDIOC_STREAMON");
 }
 
-void qbuf(int fd, uint32_t index, struct v4l2_buffer *buf)
+void qbuf(int fd, uint32_t index, int dmabuf, struct v4l2_buffer *buf)
 {
 	buf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	buf->memory = V4L2_MEMORY_MMAP;
+	buf->memory = memory;
 	buf->index = index;
+	if (memory == V4L2_MEMORY_DMABUF) {
+		buf->m.fd = dmabuf;
+		/* Zero length makes VINC use the whole dmabuf */
+		buf->length = 0;
+	}
 	if (ioctl(fd, VIDIOC_QBUF, buf) == -1)
 		error(EXIT_FAILURE, errno, "ioctl error VIDIOC_QBUF");
 }
@@ -129,12 +189,80 @@ void qbuf(int fd, uint32_t index, struct v4l2_buffer *buf)
 void dqbuf(int fd, uint32_t index, struct v4l2_buffer *buf)
 {
 	buf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	buf->memory = V4L2_MEMORY_MMAP;
+	buf->memory = memory;
 	buf->index = index;
 	if (ioctl(fd, VIDIOC_DQBUF, buf) == -1)
 		error(EXIT_FAILURE, errno, "ioctl error VIDIOC_DQBUF");
 }
 
+/*
+ * Set capture format to frame size of @frame_data, store line pitch of capture
+ * buffers to @frame_data, get capture buffers to @inbufs and queue them to VINC.
+ * Return number of capture buffers.
+ */
+static uint32_t setup_capture(int fd, struct frame_args *frame_data, int depth, int inbufs[])
+{
+	struct v4l2_buffer buf = { .type = V4L2_BUF_TYPE_VIDEO_CAPTURE };
+	uint32_t buffer_count;
+	uint32_t buffer_size;
+
+	/* DSP reads capture buffers with their own line padding */
+	frame_data->src_pitch = set_format(fd, V4L2_PIX_FMT_BGR32, frame_data->frame_width,
+					   frame_data->frame_height);
+	buffer_size = frame_data->src_pitch * frame_data->frame_height;
+
+	/* DSP holds up to depth buffers, so VINC needs extra ones to capture into */
+	buffer_count = MIN(depth + 2, MAX_BUFFERS_COUNT);
+	request_buffers(fd, &buffer_count);
+	if (buffer_count <= depth || buffer_count > MAX_BUFFERS_COUNT)
+		error(EXIT_FAILURE, 0, "VINC provides %u buffers, but %d..%d are required",
+		      buffer_count, depth + 1, MAX_BUFFERS_COUNT);
+	if (memory == V4L2_MEMORY_DMABUF) {
+		/* The same buffers are passed to DSP jobs without export */
+		if (capture_fd < 0) {
+			capture_fd = open("/dev/elcore0", O_RDWR);
+			if (capture_fd < 0)
+				error(EXIT_FAILURE, errno, "Failed to open /dev/elcore0");
+			dsp_pool_init(&capture_pool, capture_fd);
+		}
+		alloc_buffers(&capture_pool, buffer_count, buffer_size, &inbufs[0]);
+	} else {
+		export_buffers(fd, buffer_count, &inbufs[0]);
+	}
+
+	for (uint32_t i = 0; i < buffer_count && memory == V4L2_MEMORY_MMAP; i++) {
+		buf.memory = V4L2_MEMORY_MMAP;
+		buf.index = i;
+		if (ioctl(fd, VIDIOC_QUERYBUF, &buf) == -1)
+			error(EXIT_FAILURE, errno, "ioctl VIDIOC_QUERYBUF error");
+		if (!buf.length)
+			error(EXIT_FAILURE, 0, "Buffer #%d is empty\n", i);
+		else if (buf.length > buffer_size)
+			error(EXIT_FAILURE, 0, "Buffer #%d is too big\n", i);
+	}
+	for (uint32_t i = 0; i < buffer_count; i++)
+		qbuf(fd, i, inbufs[i], &buf);
+
+	return buffer_count;
+}
+
+/* Stop capture and free @count capture buffers of @inbufs, so the format can be changed */
+static void release_capture(int fd, int inbufs[], uint32_t count)
+{
+	int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	uint32_t none = 0;
+
+	if (ioctl(fd, VIDIOC_STREAMOFF, &type) == -1)
+		error(EXIT_FAILURE, errno, "ioctl error VIDIOC_STREAMOFF");
+
+	if (memory == V4L2_MEMORY_MMAP)
+		for (uint32_t i = 0; i < count; i++)
+			close(inbufs[i]);
+	request_buffers(fd, &none);
+	if (memory == V4L2_MEMORY_DMABUF)
+		dsp_pool_destroy(&capture_pool);
+}
+
 static void print_usage(void)
 {
 	puts("Capture video from V4L2 device, detect moving objects on DSP and write to the framebuffer.\n");
@@ -144,6 +272,30 @@ static void print_usage(void)
 	puts("   -w <width>\twidth of frame (default: autodetect from framebuffer)");
 	puts("   -h <height>\theight of frame (default: autodetect from framebuffer)");
 	puts("   -c <id>\tconnector ID (for DRM mode only) (default: first available connector)");
+	printf("   -d <depth>\tnumber of frames processed by DSP at the same time (2..%d, default: %d)\n",
+	       MAX_PIPELINE_DEPTH, DEFAULT_DEPTH);
+	printf("   -n <cores>\tnumber of DSP cores to split frame between (1..%d, default: %d)\n",
+	       MAX_DSP_CORES, DEFAULT_CORES);
+	puts("   -p <file>\ttile geometry profile (default: " DEFAULT_TILE_PROFILE ")");
+	puts("   -t\t\tfind the fastest tile geometry, store it to the profile and start");
+	puts("   -m <memory>\tcapture buffers: mmap - exported by VINC, dmabuf - allocated on DSP");
+	puts("\t\tand imported by VINC (default: mmap)");
+	printf("   -r <rect>\tregion of interest <width>x<height>+<x>+<y>, up to %d regions\n",
+	       MAX_ROI_RECTS);
+	puts("\t\t(default: whole frame)");
+	puts("   -s\t\tskip detection in tiles which did not change since the previous frame");
+	puts("   -f <stages>\tstages run on each tile in XYRAM, comma separated <name>[:<param>]:");
+	puts("\t\tdetect, motion[:<threshold>], grayscale, threshold[:<luma>], overlay,");
+	puts("\t\terode[:<radius>], dilate[:<radius>], open[:<radius>], close[:<radius>],");
+	puts("\t\tblobs[:<pixels>] - outline objects of at least <pixels>");
+	puts("\t\t(default: detect, the only vectorized stage, others are scalar code)");
+	puts("   -a <size>\talternative resolution <width>x<height>, key 'r' switches to it and back");
+	printf("   -b <shift>\tadd each frame to background with weight 1/2^shift, 0 - frozen\n"
+	       "\t\tbackground (0..%d, default: %d)\n", MAX_BACKGROUND_SHIFT,
+	       DEFAULT_BACKGROUND_SHIFT);
+	puts("   -e\t\tdraw bar on top of each tile with share of pixels changed in the tile");
+	puts("   -k\t\twrite packed mask of stages besides the frame and print share of pixels");
+	puts("\t\tset in the mask, needs -f and one DSP core (-n 1)");
 	puts("   -v\t\tprint additional information");
 
         printf("\nBy default, performance metrics are rendered on the frame with %s.\n",
@@ -208,6 +360,53 @@ static inline float timespec2float(struct timespec const t)
 	return t.tv_sec + (float)t.tv_nsec / 1e9;
 }
 
+struct open_args {
+	struct dsp_struct *data;
+	int depth;
+	int ncores;
+};
+
+static void open_dsp(void *arg)
+{
+	struct open_args *args = arg;
+
+	dsp_open(args->data, args->depth, args->ncores);
+}
+
+/* Process TUNE_FRAMES frames from capture buffers and return time of one frame */
+static double measure_tiles(int tile_width, int tile_height, void *arg)
+{
+	struct tune_data *tune = arg;
+	struct frame_args frame_data = tune->frame_data;
+	struct dsp_struct dsp_data;
+	struct timespec start, stop;
+	int result_id, ret = 0;
+
+	frame_data.tile_width = tile_width;
+	frame_data.tile_height = tile_height;
+	dsp_open(&dsp_data, tune->depth, tune->cores);
+	if (dsp_try_setup(&dsp_data, frame_data, tune->inbufs, tune->buffer_count)) {
+		dsp_free(&dsp_data);
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < TUNE_FRAMES && !ret; ++i) {
+		if (dsp_data.inflight_count == dsp_data.depth)
+			ret = frame_wait(&dsp_data, &result_id);
+		if (!ret)
+			ret = frame_submit(&dsp_data, tune->inbufs[i % tune->buffer_count],
+					   i % dsp_data.result_count);
+	}
+	while (dsp_data.inflight_count && !ret)
+		ret = frame_wait(&dsp_data, &result_id);
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+
+	dsp_free(&dsp_data);
+
+	return ret ? -1 : timespec2float(timespec_subtract(start, stop)) / TUNE_FRAMES;
+}
+
 static void get_cpu_usage()
 {
 	static uint32_t total, total_prev;
@@ -262,18 +461,223 @@ void set_keypress(void)
 	return;
 }
 
+static bool has_stage(const struct frame_args *frame_data, enum tile_stage_op op)
+{
+	for (int i = 0; i < frame_data->nstages; ++i)
+		if (frame_data->stages[i].op == op)
+			return true;
+
+	return false;
+}
+
+/* Share of pixels set in packed mask of result frame @result_id, in percents */
+static uint32_t mask_share(const struct dsp_struct *dsp_data, const struct frame_args *frame_data,
+			   int result_id)
+{
+	const uint8_t *mask = dsp_data->result_mask_data[result_id];
+	size_t size = (size_t)dsp_data->mask_pitch * frame_data->frame_height;
+	uint64_t count = 0;
+
+	/* Padding bits of mask lines are clear */
+	for (size_t i = 0; i < size; ++i)
+		count += __builtin_popcount(mask[i]);
+
+	return count * 100 / ((uint64_t)frame_data->frame_width * frame_data->frame_height);
+}
+
+/* Draw green outlines of @count boxes @blobs on result frame @frame */
+static void draw_blobs(uint8_t *frame, const struct frame_args *frame_data, uint32_t pitch,
+		       const struct tile_blob *blobs, uint32_t count)
+{
+	for (uint32_t i = 0; i < count; ++i) {
+		const struct tile_blob *blob = &blobs[i];
+
+		for (uint32_t y = blob->top; y <= blob->bottom; ++y)
+			for (uint32_t x = blob->left; x <= blob->right; ++x) {
+				uint8_t *pixel = frame + frame_data->dst_offset + y * pitch +
+						 x * frame_data->pixel_format;
+
+				if (y != blob->top && y != blob->bottom && x != blob->left &&
+				    x != blob->right)
+					continue;
+				pixel[0] = 0;
+				pixel[1] = 0xff;
+				pixel[2] = 0;
+			}
+	}
+}
+
+/*
+ * Draw red bar on top of each tile of result frame @frame. Length of the bar is
+ * the share of changed pixels of the tile in @stats.
+ */
+static void draw_heatmap(uint8_t *frame, const struct frame_args *frame_data, uint32_t pitch,
+			 const struct tile_stats *stats, uint32_t ntiles)
+{
+	uint32_t columns = DIV_ROUND_UP(frame_data->frame_width, frame_data->tile_width);
+
+	for (uint32_t i = 0; i < ntiles; ++i) {
+		uint32_t x = i % columns * frame_data->tile_width;
+		uint32_t y = i / columns * frame_data->tile_height;
+		uint32_t width = MIN(frame_data->tile_width, frame_data->frame_width - x);
+		uint32_t height = MIN(frame_data->tile_height, frame_data->frame_height - y);
+		uint32_t length = stats[i].changed / height;
+
+		for (uint32_t j = y; j < y + MIN(height, 2); ++j)
+			for (uint32_t k = x; k < x + MIN(length, width); ++k) {
+				uint8_t *pixel = frame + frame_data->dst_offset + j * pitch +
+						 k * frame_data->pixel_format;
+
+				pixel[0] = 0;
+				pixel[1] = 0;
+				pixel[2] = 0xff;
+			}
+	}
+}
+
+/* Wait for the oldest frame on DSP, draw statistics and objects on it, show it
+ * and return its capture buffer to VINC.
+ */
+static int show_frame(int fd, struct dsp_struct *dsp_data, struct fontData *font_data,
+		      const struct frame_args frame_data, const uint32_t capture_id[])
+{
+	struct v4l2_buffer buf = { .type = V4L2_BUF_TYPE_VIDEO_CAPTURE };
+	int result_id;
+	int ret = frame_wait(dsp_data, &result_id);
+
+	if (!ret) {
+		uint8_t dirty[DIV_ROUND_UP(dsp_data->grid_tiles, 8)];
+		uint32_t changed = frame_dirty_tiles(dsp_data, dirty);
+		struct tile_blob blobs[MAX_DRAWN_BLOBS];
+		uint32_t nblobs = frame_blobs(dsp_data, blobs, MAX_DRAWN_BLOBS);
+		char str[255];
+		int len = sprintf(str, "CPU: %.1f%%, %.1f FPS", cpu_usage, fps);
+
+		if (frame_data.skip_unchanged)
+			len += sprintf(str + len, ", changed %u%%",
+				       changed * 100 / dsp_data->grid_tiles);
+		if (has_stage(&frame_data, TILE_STAGE_BLOBS))
+			len += sprintf(str + len, ", objects %u%s", nblobs,
+				       dsp_data->blob_overflow ? " (overflow)" : "");
+		/* Mask is written besides the frame, so the frame is still drawn on */
+		if (frame_data.mask_output)
+			sprintf(str + len, ", mask %u%%", mask_share(dsp_data, &frame_data, result_id));
+		draw_blobs(dsp_data->result_frame_data[result_id], &frame_data,
+			   dsp_data->result_pitch, blobs, MIN(nblobs, MAX_DRAWN_BLOBS));
+		if (frame_data.tile_stats) {
+			struct tile_stats stats[dsp_data->grid_tiles];
+
+			frame_tile_stats(dsp_data, stats);
+			draw_heatmap(dsp_data->result_frame_data[result_id], &frame_data,
+				     dsp_data->result_pitch, stats, dsp_data->grid_tiles);
+		}
+		draw_string(font_data, dsp_data->result_frame_data[result_id],
+			    dsp_data->result_pitch,
+			    str, 0);
+		/* send message to flip page handler */
+		pthread_cond_signal(&cv);
+		startup_done();
+
+		frames++;
+	}
+
+	qbuf(fd, capture_id[result_id], dsp_data->input_fds[capture_id[result_id]], &buf);
+
+	return ret;
+}
+
+/* Find tile geometry for frame of @frame_data in the profile or use the default one */
+static struct dsp_tile_geometry load_tile(const struct arguments *arguments,
+					  const struct frame_args *frame_data, bool use_profile,
+					  struct dsp_tune_args *tune_args)
+{
+	int halo = dsp_stages_halo(frame_data);
+	/*
+	 * Frame and background tiles of all cores are shared by XYRAM of two cores,
+	 * tiles grow by halo of stages
+	 */
+	struct dsp_tile_geometry tile = {
+		.width = DEFAULT_TILE_WIDTH,
+		.height = max(DEFAULT_TILE_HEIGHT / arguments->cores - 2 * halo, 8)
+	};
+
+	*tune_args = (struct dsp_tune_args) {
+		.frame_width = frame_data->frame_width,
+		.frame_height = frame_data->frame_height,
+		.pixel_format = frame_data->pixel_format,
+		.ncores = arguments->cores,
+		.xyram_tiles = 2 * arguments->cores,
+		.xyram_mask_tiles = frame_data->mask_with_frame ? 2 : 0,
+		.halo = halo,
+		.data_size = dsp_stages_data_size(frame_data),
+		.mask = frame_data->mask_with_frame ? 2 : frame_data->mask_output
+	};
+	if (dsp_stages_format(frame_data, tune_args->stages, sizeof(tune_args->stages)))
+		error(EXIT_FAILURE, 0, "Stages are too long for tile profile");
+	if (use_profile && !dsp_profile_load(arguments->profile, "detector", tune_args, &tile))
+		printf("Tile %dx%d is loaded from %s\n", tile.width, tile.height,
+		       arguments->profile);
+
+	return tile;
+}
+
+/*
+ * Switch capture, DSP and display to @width x @height. V4L2 and DRM devices, DSP
+ * cores with firmware and the flip thread are kept, only buffers are created again.
+ * Frames must not be in processing. Return number of new capture buffers.
+ */
+static uint32_t switch_resolution(int fd, const struct arguments *arguments,
+				  struct frame_args *frame_data, struct dsp_struct *dsp_data,
+				  struct drmdisplay *data_drm, struct fontData *font_data,
+				  int inbufs[], uint32_t buffer_count, int width, int height)
+{
+	struct dsp_tune_args tune_args;
+	int result_fds[MAX_RESULT_FRAMES];
+
+	printf("Switching to %dx%d\n", width, height);
+	release_capture(fd, inbufs, buffer_count);
+
+	frame_data->frame_width = width;
+	frame_data->frame_height = height;
+	frame_data->dst_pitch = drmdisplay_pitch(width, PIXEL_FORMAT_RGBA);
+	buffer_count = setup_capture(fd, frame_data, arguments->depth, inbufs);
+
+	struct dsp_tile_geometry tile = load_tile(arguments, frame_data, true, &tune_args);
+
+	frame_data->tile_width = tile.width;
+	frame_data->tile_height = tile.height;
+	dsp_reconfigure(dsp_data, *frame_data, inbufs, buffer_count);
+
+	resize_font(font_data, height / 12);
+
+	for (int i = 0; i < dsp_data->result_count; i++)
+		result_fds[i] = dsp_data->result_frame[i]->fd;
+	if (drmdisplay_reconfigure(data_drm, width, height, dsp_data->result_pitch, result_fds,
+				   dsp_data->result_count))
+		error(EXIT_FAILURE, errno, "Failed to switch display to %dx%d", width, height);
+
+	stream_on(fd);
+
+	return buffer_count;
+}
+
 int main(int argc, char *argv[])
 {
 	struct v4l2_buffer buf = { .type = V4L2_BUF_TYPE_VIDEO_CAPTURE };
 	int fd, opt;
-	uint32_t buffer_count = MAX_BUFFERS_COUNT;
-	uint32_t buffer_size;
+	uint32_t buffer_count;
 	struct drmdisplay data_drm;
 	struct dsp_struct dsp_data;
 	struct frame_args frame_data;
 	struct fontData font_data = {0};
-	//!< Exported file descriptors of input buffers
+	//!< File descriptors of capture buffers
 	int inbufs[MAX_BUFFERS_COUNT];
+	//!< Keys read by the child process
+	int keys[2];
+	struct startup_phase dsp_phase = { .running = false };
+	double begin;
+
+	startup_init();
 
 	struct arguments arguments = {
 		.iface = MAX_IFACE,
@@ -281,14 +685,26 @@ int main(int argc, char *argv[])
 		.width = 0,
 		.height = 0,
 		.connector_id = -1,
+		.depth = DEFAULT_DEPTH,
+		.cores = DEFAULT_CORES,
+		.profile = DEFAULT_TILE_PROFILE,
+		.tune = false,
 		.verbose = false,
+		.roi = { .nrects = 0 },
+		.skip_unchanged = false,
+		.stages = { .nstages = 0 },
+		.alt_width = 0,
+		.alt_height = 0,
+		.background_shift = DEFAULT_BACKGROUND_SHIFT,
+		.heatmap = false,
+		.mask = false,
 	};
 	struct sigaction new_sigaction = {
 		.sa_handler = signal_handler,
 		.sa_flags = SA_RESTART,
 	};
 
-	while ((opt = getopt(argc, argv, "i:o:w:h:c:v")) != -1) {
+	while ((opt = getopt(argc, argv, "i:o:w:h:c:d:n:p:tm:r:sf:a:b:ekv")) != -1) {
 		switch (opt) {
 		case 'i':
 			arguments.iface = atoi(optarg);
@@ -305,6 +721,58 @@ int main(int argc, char *argv[])
 		case 'c':
 			arguments.connector_id = atoi(optarg);
 			break;
+		case 'd':
+			arguments.depth = atoi(optarg);
+			break;
+		case 'n':
+			arguments.cores = atoi(optarg);
+			break;
+		case 'p':
+			arguments.profile = optarg;
+			break;
+		case 't':
+			arguments.tune = true;
+			break;
+		case 'm':
+			if (!strcmp(optarg, "dmabuf")) {
+				memory = V4L2_MEMORY_DMABUF;
+			} else if (strcmp(optarg, "mmap")) {
+				print_usage();
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'r':
+			if (dsp_roi_add(&arguments.roi, optarg)) {
+				print_usage();
+				return EXIT_FAILURE;
+			}
+			break;
+		case 's':
+			arguments.skip_unchanged = true;
+			break;
+		case 'f':
+			if (dsp_stages_parse(&arguments.stages, optarg)) {
+				print_usage();
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'a':
+			if (sscanf(optarg, "%dx%d", &arguments.alt_width,
+				   &arguments.alt_height) != 2 ||
+			    arguments.alt_width <= 0 || arguments.alt_height <= 0) {
+				print_usage();
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'b':
+			arguments.background_shift = atoi(optarg);
+			break;
+		case 'e':
+			arguments.heatmap = true;
+			break;
+		case 'k':
+			arguments.mask = true;
+			break;
 		case 'v':
 			arguments.verbose = true;
 			break;
@@ -314,112 +782,213 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if (arguments.iface >= MAX_IFACE) {
+	if (arguments.iface >= MAX_IFACE || arguments.depth < 2 ||
+	    arguments.depth > MAX_PIPELINE_DEPTH || arguments.cores < 1 ||
+	    arguments.cores > MAX_DSP_CORES || arguments.background_shift < 0 ||
+	    arguments.background_shift > MAX_BACKGROUND_SHIFT ||
+	    (arguments.mask && (arguments.cores != 1 || !arguments.stages.nstages))) {
 		print_usage();
 		return EXIT_FAILURE;
 	}
 
 	sigaction(SIGINT, &new_sigaction, NULL);
+
+	/*
+	 * Cores and firmware do not depend on frame size, so they are loaded while
+	 * capture and display are set up. Tuning runs its own DSP sessions, so
+	 * cores are requested after it.
+	 */
+	struct open_args open_args = {
+		.data = &dsp_data,
+		.depth = arguments.depth,
+		.ncores = arguments.cores
+	};
+	if (!arguments.tune)
+		startup_start(&dsp_phase, "DSP open", open_dsp, &open_args);
+
 	printf("Opening device with sensor interface %d\n", arguments.iface);
 
+	begin = startup_begin();
 	fd = find_device_on_interface_number(arguments.iface);
 	if (fd < 0)
 		error(EXIT_FAILURE, errno, "Can not open device with interface %d",
 		      arguments.iface);
+	startup_end("V4L2 discovery", begin);
 
+	begin = startup_begin();
 	if (drmdisplay_init(&data_drm, arguments.connector_id, arguments.verbose))
 		error(EXIT_FAILURE, errno, "DRM initialize failed");
 
 	if (drmdisplay_fill_mode(&data_drm, &arguments.width, &arguments.height))
 		printf("No suitable display modes found\n");
+	if (arguments.alt_width &&
+	    !drmdisplay_has_mode(&data_drm, arguments.alt_width, arguments.alt_height))
+		error(EXIT_FAILURE, 0, "Resolution %dx%d is not supported by display",
+		      arguments.alt_width, arguments.alt_height);
+	startup_end("DRM init", begin);
+
+	/* Font is loaded by a thread and waited by the first overlay */
+	init_font(&font_data, arguments.height / 12);
 
 	frame_data = (struct frame_args) {
 		.frame_width = arguments.width,
 		.frame_height = arguments.height,
-		.tile_width = 288,
-		.tile_height = 48,
-		.pixel_format = PIXEL_FORMAT_RGBA
+		.pixel_format = PIXEL_FORMAT_RGBA,
+		.dst_pitch = drmdisplay_pitch(arguments.width, PIXEL_FORMAT_RGBA)
 	};
+	frame_data.roi = arguments.roi;
+	frame_data.skip_unchanged = arguments.skip_unchanged;
+	frame_data.background_shift = arguments.background_shift;
+	frame_data.tile_stats = arguments.heatmap;
+	/* Display needs pixels, so the mask is written only besides the frame */
+	frame_data.mask_output = arguments.mask;
+	frame_data.mask_with_frame = arguments.mask;
+	frame_data.nstages = arguments.stages.nstages;
+	memcpy(frame_data.stages, arguments.stages.stages, sizeof(frame_data.stages));
+
+	struct dsp_tune_args tune_args;
+	struct dsp_tile_geometry tile = load_tile(&arguments, &frame_data, !arguments.tune,
+						  &tune_args);
+
+	begin = startup_begin();
+	buffer_count = setup_capture(fd, &frame_data, arguments.depth, inbufs);
+	startup_end("V4L2 buffers", begin);
+
+	if (arguments.tune) {
+		struct tune_data tune = {
+			.frame_data = frame_data,
+			.depth = arguments.depth,
+			.cores = arguments.cores,
+			.inbufs = inbufs,
+			.buffer_count = buffer_count
+		};
+		double time = dsp_tune(&tune_args, measure_tiles, &tune, &tile,
+				       arguments.verbose);
+
+		if (time < 0)
+			error(EXIT_FAILURE, 0, "No suitable tile geometry found");
+		printf("The fastest tile is %dx%d: %.3f ms\n", tile.width, tile.height,
+		       time * 1e3);
+		if (dsp_profile_save(arguments.profile, "detector", &tune_args, &tile, time))
+			error(0, errno, "Failed to save profile %s", arguments.profile);
+	}
 
-	buffer_size = frame_data.frame_width * frame_data.frame_height * frame_data.pixel_format;
-
-	dsp_init(&dsp_data, frame_data);
-
-	set_format(fd, V4L2_PIX_FMT_BGR32, arguments.width, arguments.height);
-	request_buffers(fd, &buffer_count);
-	export_buffers(fd, buffer_count, &inbufs[0]);
-
-	for (uint32_t i = 0; i < buffer_count; i++) {
-		buf.memory = V4L2_MEMORY_MMAP;
-		buf.index = i;
-		if (ioctl(fd, VIDIOC_QUERYBUF, &buf) == -1)
-			error(EXIT_FAILURE, errno, "ioctl VIDIOC_QUERYBUF error");
-		if (!buf.length)
-			error(EXIT_FAILURE, 0, "Buffer #%d is empty\n", i);
-		else if (buf.length > buffer_size)
-			error(EXIT_FAILURE, 0, "Buffer #%d is too big\n", i);
+	if (arguments.tune) {
+		begin = startup_begin();
+		open_dsp(&open_args);
+		startup_end("DSP open", begin);
 	}
-	for (uint32_t i = 0; i < buffer_count; i++)
-		qbuf(fd, i, &buf);
+	startup_wait(&dsp_phase);
 
+	begin = startup_begin();
+	frame_data.tile_width = tile.width;
+	frame_data.tile_height = tile.height;
+	dsp_setup(&dsp_data, frame_data);
 	dsp_job_create(&dsp_data, inbufs, buffer_count);
+	startup_end("DSP buffers", begin);
 
-	init_font(&font_data, arguments.height / 12);
-
-	drmdisplay_set_mode(&data_drm, arguments.width, arguments.height, frame_data.pixel_format,
+	begin = startup_begin();
+	drmdisplay_set_mode(&data_drm, arguments.width, arguments.height, dsp_data.result_pitch,
 			    dsp_data.result_frame[0]->fd);
+	int result_fds[MAX_RESULT_FRAMES];
+	for (int i = 1; i < dsp_data.result_count; i++)
+		result_fds[i - 1] = dsp_data.result_frame[i]->fd;
 	drmdisplay_start_flipflop(&data_drm, arguments.width, arguments.height,
-				  frame_data.pixel_format, dsp_data.result_frame[1]->fd);
+				  dsp_data.result_pitch, result_fds, dsp_data.result_count - 1);
 	stream_on(fd);
+	startup_end("DRM mode", begin);
+
+	if (pipe(keys) || fcntl(keys[0], F_SETFL, O_NONBLOCK))
+		error(EXIT_FAILURE, errno, "Failed to create pipe");
 
 	set_keypress();
 	int pid = fork();
 	if (pid == 0) {
+		/* DSP buffers and display may be changed, so keys are handled by the parent */
 		while (1) {
-			if (getchar() == 'u') {
-					dsp_data.dsp_global_data->avering_counter = 0;
-					dsp_data.dsp_global_data->flag_avered = 0;
-			}
-			usleep(30 * 1000);
+			int key = getchar();
+
+			/* Closed stdin gives no more keys */
+			if (key == EOF)
+				_exit(EXIT_SUCCESS);
+
+			char c = key;
+
+			if (write(keys[1], &c, 1) != 1)
+				_exit(EXIT_FAILURE);
 		}
 	}
 
 	uint32_t buffer_id = 0;
+	int result_id = 0;
+	//!< Capture buffer index processed into each result frame
+	uint32_t capture_id[MAX_RESULT_FRAMES];
 	while (!stop) {
+		bool reconfigure = false;
+		char key;
+
+		while (read(keys[0], &key, 1) == 1) {
+			if (key == 'u')
+				dsp_reset_background(&dsp_data);
+			else if (key == 'r' && arguments.alt_width)
+				reconfigure = true;
+		}
+
+		if (reconfigure) {
+			bool alt = frame_data.frame_width != arguments.alt_width ||
+				   frame_data.frame_height != arguments.alt_height;
+
+			while (dsp_data.inflight_count)
+				show_frame(fd, &dsp_data, &font_data, frame_data, capture_id);
+			buffer_count = switch_resolution(fd, &arguments, &frame_data, &dsp_data,
+							 &data_drm, &font_data, inbufs, buffer_count,
+							 alt ? arguments.alt_width : arguments.width,
+							 alt ? arguments.alt_height : arguments.height);
+			buffer_id = 0;
+			result_id = 0;
+		}
+
 		if (frames % 30 == 0) {
 			get_fps();
 			get_cpu_usage();
 		}
 		dqbuf(fd, buffer_id, &buf);
 
-		// TODO: Input and output buffers with different stride are not supported.
-		if (frame_detector(&dsp_data, inbufs[buffer_id], buffer_id)) {
-			qbuf(fd, buffer_id, &buf);
+		if (frame_submit(&dsp_data, inbufs[buffer_id], result_id)) {
+			qbuf(fd, buffer_id, inbufs[buffer_id], &buf);
 			break;
 		}
-
-		char str[255];
-		sprintf(str, "CPU: %.1f%%, %.1f FPS", cpu_usage, fps);
-		draw_string(&font_data, dsp_data.result_frame_data[buffer_id],
-			    frame_data.frame_width * frame_data.pixel_format,
-			    str, 0);
-		/* send message to flip page handler */
-		pthread_cond_signal(&cv);
-
-		frames++;
-
-		qbuf(fd, buffer_id, &buf);
+		capture_id[result_id] = buffer_id;
 
 		buffer_id++;
 		if (buffer_id >= buffer_count)
 			buffer_id = 0;
+		result_id++;
+		if (result_id >= dsp_data.result_count)
+			result_id = 0;
+
+		/* Keep DSP busy with next frames while the oldest one is being displayed */
+		if (dsp_data.inflight_count < dsp_data.depth)
+			continue;
+
+		if (show_frame(fd, &dsp_data, &font_data, frame_data, capture_id))
+			break;
 	}
+
+	while (dsp_data.inflight_count)
+		show_frame(fd, &dsp_data, &font_data, frame_data, capture_id);
+
 	drmdisplay_restore_mode(&data_drm);
 
 	dsp_free(&dsp_data);
 
 	close(fd);
 
+	if (memory == V4L2_MEMORY_DMABUF) {
+		dsp_pool_destroy(&capture_pool);
+		close(capture_fd);
+	}
+
 	pthread_cancel(thread);
 	kill(pid, SIGUSR1);
 	reset_keypress();
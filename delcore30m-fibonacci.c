@@ -24,6 +24,8 @@
 
 #include <linux/delcore30m.h>
 
+#include "dsppool.h"
+
 #define MAKE_STR_(s) #s
 #define MAKE_STR(s) MAKE_STR_(s)
 
@@ -32,6 +34,7 @@ int debug_mode = 0;
 int iters = 5;
 char* fw_path = MAKE_STR(FIRMWARE_PATH) "fibonacci.fw.bin";
 
+struct dsp_pool pool;
 struct delcore30m_job jobs[MAX_CORES];
 struct delcore30m_buffer *iter_bufs[MAX_CORES];
 struct delcore30m_buffer *magic_bufs[MAX_CORES];
@@ -46,13 +49,9 @@ void help(const char *pname)
     printf("    -f arg\tSet firmware path. Default is /usr/share/delcore30m-tests/firmware-delcore30m-fibonacci.bin\n");
 }
 
-int read_buffer(int fd)
+int read_buffer(struct delcore30m_buffer *buffer)
 {
-    int *mmap_buf = (int *)mmap(NULL, 4, PROT_READ, MAP_SHARED, fd, 0);
-    int ret = mmap_buf[0];
-
-    munmap((void*)mmap_buf, 4);
-    return ret;
+    return *(volatile int *)dsp_pool_map(buffer);
 }
 
 int check()
@@ -64,62 +63,52 @@ int check()
     int magic = 1788967197;
 
     for (int core = 0; core < MAX_CORES; ++core)
-        it[core] = read_buffer(iter_bufs[core]->fd);
+        it[core] = read_buffer(iter_bufs[core]);
 
     while (!stop && iters--) {
         sleep(sleep_time);
         if (debug_mode) {
             for (int core = 0; core < MAX_CORES; ++core)
-                printf("%d/", (read_buffer(iter_bufs[core]->fd) - it[core]) / sleep_time);
+                printf("%d/", (read_buffer(iter_bufs[core]) - it[core]) / sleep_time);
             printf("\n");
         }
 
         for (int core = 0; core < MAX_CORES; ++core) {
-            if (read_buffer(iter_bufs[core]->fd) == it[core]) {
+            if (read_buffer(iter_bufs[core]) == it[core]) {
                 printf("Iterator is not changed\n");
                 return EXIT_FAILURE;
             }
-            if (read_buffer(magic_bufs[core]->fd) != magic) {
+            if (read_buffer(magic_bufs[core]) != magic) {
                 printf("Calculated fibonacci number is wrong\n");
                 return EXIT_FAILURE;
             }
 
-            it[core] = read_buffer(iter_bufs[core]->fd);
+            it[core] = read_buffer(iter_bufs[core]);
         }
     }
 
     return stop;
 }
 
-struct delcore30m_buffer *buf_alloc(int fd, enum delcore30m_memory_type type,
+struct delcore30m_buffer *buf_alloc(enum delcore30m_memory_type type,
                                     int core_num, int size, int init_val)
 {
-    struct delcore30m_buffer *buffer = (struct delcore30m_buffer *)
-				       malloc(sizeof(struct delcore30m_buffer));
-    buffer->size = size;
-    buffer->type = type;
-    buffer->core_num = core_num;
-
-    if (ioctl(fd, ELCIOC_BUF_ALLOC, buffer) < 0) {
+    struct delcore30m_buffer *buffer = dsp_pool_alloc(&pool, type, core_num,
+                                                      size, NULL);
+    if (!buffer) {
         error(0, errno, "Failed to allocate buffer");
-        goto err;
+        return NULL;
     }
 
-    void *mmap_buf = mmap(NULL, buffer->size, PROT_READ | PROT_WRITE,
-                          MAP_SHARED, buffer->fd, 0);
-    if (mmap_buf == MAP_FAILED) {
+    int *mmap_buf = dsp_pool_map(buffer);
+    if (!mmap_buf) {
         error(0, errno, "Failed to map buffer");
-        goto err;
+        return NULL;
     }
 
-    memcpy(mmap_buf, (void*)&init_val, sizeof(int));
-    munmap(mmap_buf, buffer->size);
+    *mmap_buf = init_val;
 
     return buffer;
-
-err:
-    free(buffer);
-    return NULL;
 }
 
 int load_firmware(int fd, uint8_t core_id, const char *filename)
@@ -178,6 +167,7 @@ int main(int argc, char **argv)
     int fd = open("/dev/elcore0", O_RDWR);
     if (fd < 0)
         error(EXIT_FAILURE, errno, "Failed to open device file");
+    dsp_pool_init(&pool, fd);
 
     int opt;
     while ((opt = getopt(argc, argv, "hvi:f:")) != -1) {
@@ -206,27 +196,28 @@ int main(int argc, char **argv)
             .num = 1
         };
 
-        while (ioctl(fd, ELCIOC_RESOURCE_REQUEST, &cores_res)) {
-            if (errno == EBUSY)
-                continue;
+        /*
+         * The test keeps its own firmware running on all cores until it ends,
+         * so it is not a broker client and does not wait for busy cores.
+         */
+        if (ioctl(fd, ELCIOC_RESOURCE_REQUEST, &cores_res))
             error(EXIT_FAILURE, errno, "Failed to request resource");
-        }
 
         int core_id = ffs(cores_res.mask) - 1;
         if (load_firmware(cores_res.fd, core_id, fw_path))
             return EXIT_FAILURE;
 
-        iter_bufs[core_id] = buf_alloc(fd, DELCORE30M_MEMORY_XYRAM, core_id,
+        iter_bufs[core_id] = buf_alloc(DELCORE30M_MEMORY_XYRAM, core_id,
                                        4, 0);
         if (iter_bufs[core_id] == NULL)
             return EXIT_FAILURE;
 
-        magic_bufs[core_id] = buf_alloc(fd, DELCORE30M_MEMORY_XYRAM, core_id,
+        magic_bufs[core_id] = buf_alloc(DELCORE30M_MEMORY_XYRAM, core_id,
                                         4, 0);
         if (magic_bufs[core_id] == NULL)
                 return EXIT_FAILURE;
 
-        result_bufs[core_id] = buf_alloc(fd, DELCORE30M_MEMORY_XYRAM, core_id,
+        result_bufs[core_id] = buf_alloc(DELCORE30M_MEMORY_XYRAM, core_id,
                                          16384, 0);
         if (result_bufs[core_id] == NULL)
             return EXIT_FAILURE;
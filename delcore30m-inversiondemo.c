@@ -30,6 +30,8 @@
 
 #include "drmdisplay.h"
 #include "dspinverse.h"
+#include "dsptune.h"
+#include "startup.h"
 #define STB_TRUETYPE_IMPLEMENTATION
 #include "stbfont.h"
 
@@ -39,7 +41,12 @@
 #define MAX_LEN 64
 #define DEFAULT_OUTFILE "/dev/fb0"
 
-#define MAX_BUFFERS_COUNT 2
+#define MAX_BUFFERS_COUNT MAX_INPUT_BUFFERS
+#define DEFAULT_DEPTH 2
+#define DEFAULT_CORES 1
+#define DEFAULT_TILE_WIDTH 288
+#define DEFAULT_TILE_HEIGHT 48
+#define TUNE_FRAMES 32
 
 #define NSEC_IN_SEC 1000000000
 
@@ -57,12 +64,28 @@ struct arguments {
 	int width;
 	int height;
 	int connector_id;
+	int depth;
+	int cores;
+	char *profile;
+	bool tune;
 	bool verbose;
+	struct dsp_roi roi;
+};
+
+struct tune_data {
+	struct frame_args frame_data;
+	int depth;
+	int cores;
+	int *inbufs;
+	uint32_t buffer_count;
 };
 
 bool stop;
 
-static void set_format(int fd, uint32_t pixelformat, uint32_t width, uint32_t height)
+/// Capture buffers are exported by VINC (MMAP) or allocated on DSP and imported (DMABUF)
+enum v4l2_memory memory = V4L2_MEMORY_MMAP;
+
+static uint32_t set_format(int fd, uint32_t pixelformat, uint32_t width, uint32_t height)
 {
 	struct v4l2_format format = {
 		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
@@ -77,6 +100,8 @@ static void set_format(int fd, uint32_t pixelformat, uint32_t width, uint32_t he
 	if (format.fmt.pix.width != width || format.fmt.pix.height != height)
 		printf("Requested frame size %ux%u, but VINC will use %ux%u\n",
 		   width, height, format.fmt.pix.width, format.fmt.pix.height);
+
+	return format.fmt.pix.bytesperline;
 }
 
 static void request_buffers(int fd, uint32_t *count)
@@ -84,7 +109,7 @@ static void request_buffers(int fd, uint32_t *count)
 	struct v4l2_requestbuffers req = {
 		.count = *count,
 		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
-		.memory = V4L2_MEMORY_MMAP
+		.memory = memory
 	};
 	if (ioctl(fd, VIDIOC_REQBUFS, &req) == -1)
 		error(EXIT_FAILURE, errno, "ioctl error VIDIOC_REQBUFS");
@@ -106,6 +131,19 @@ static void export_buffers(int const fd, uint32_t const num, int bufs[])
 	}
 }
 
+/* Allocate capture buffers from DSP memory to be imported by VINC */
+static void alloc_buffers(struct dsp_pool *pool, uint32_t const num, size_t size, int bufs[])
+{
+	for (uint32_t i = 0; i < num; ++i) {
+		struct delcore30m_buffer *buffer = dsp_pool_alloc(pool, DELCORE30M_MEMORY_SYSTEM,
+								  0, size, NULL);
+
+		if (!buffer)
+			error(EXIT_FAILURE, errno, "Failed to allocate capture buffer #%u", i);
+		bufs[i] = buffer->fd;
+	}
+}
+
 static void stream_on(int fd)
 {
 	int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -114,11 +152,16 @@ static void stream_on(int fd)
 		error(EXIT_FAILURE, errno, "ioctl error VIDIOC_STREAMON");
 }
 
-static void qbuf(int fd, uint32_t index, struct v4l2_buffer *buf)
+static void qbuf(int fd, uint32_t index, int dmabuf, struct v4l2_buffer *buf)
 {
 	buf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	buf->memory = V4L2_MEMORY_MMAP;
+	buf->memory = memory;
 	buf->index = index;
+	if (memory == V4L2_MEMORY_DMABUF) {
+		buf->m.fd = dmabuf;
+		/* Zero length makes VINC use the whole dmabuf */
+		buf->length = 0;
+	}
 	if (ioctl(fd, VIDIOC_QBUF, buf) == -1)
 		error(EXIT_FAILURE, errno, "ioctl error VIDIOC_QBUF");
 }
@@ -126,7 +169,7 @@ static void qbuf(int fd, uint32_t index, struct v4l2_buffer *buf)
 static void dqbuf(int fd, uint32_t index, struct v4l2_buffer *buf)
 {
 	buf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	buf->memory = V4L2_MEMORY_MMAP;
+	buf->memory = memory;
 	buf->index = index;
 	if (ioctl(fd, VIDIOC_DQBUF, buf) == -1)
 		error(EXIT_FAILURE, errno, "ioctl error VIDIOC_DQBUF");
@@ -141,6 +184,17 @@ static void print_usage(void)
 	puts("   -w <width>\twidth of frame (default: autodetect from framebuffer)");
 	puts("   -h <height>\theight of frame (default: autodetect from framebuffer)");
 	puts("   -c <id>\tconnector ID (for DRM mode only) (default: first available connector)");
+	printf("   -d <depth>\tnumber of frames processed by DSP at the same time (2..%d, default: %d)\n",
+	       MAX_PIPELINE_DEPTH, DEFAULT_DEPTH);
+	printf("   -n <cores>\tnumber of DSP cores to split frame between (1..%d, default: %d)\n",
+	       MAX_DSP_CORES, DEFAULT_CORES);
+	puts("   -p <file>\ttile geometry profile (default: " DEFAULT_TILE_PROFILE ")");
+	puts("   -t\t\tfind the fastest tile geometry, store it to the profile and start");
+	puts("   -m <memory>\tcapture buffers: mmap - exported by VINC, dmabuf - allocated on DSP");
+	puts("\t\tand imported by VINC (default: mmap)");
+	printf("   -r <rect>\tregion of interest <width>x<height>+<x>+<y>, up to %d regions\n",
+	       MAX_ROI_RECTS);
+	puts("\t\t(default: whole frame)");
 	puts("   -v\t\tprint additional information");
 
         printf("\nBy default, performance metrics are rendered on the frame with %s.\n",
@@ -205,6 +259,53 @@ static inline float timespec2float(struct timespec const t)
 	return t.tv_sec + (float)t.tv_nsec / 1e9;
 }
 
+struct open_args {
+	struct dsp_struct *data;
+	int depth;
+	int ncores;
+};
+
+static void open_dsp(void *arg)
+{
+	struct open_args *args = arg;
+
+	dsp_open(args->data, args->depth, args->ncores);
+}
+
+/* Process TUNE_FRAMES frames from capture buffers and return time of one frame */
+static double measure_tiles(int tile_width, int tile_height, void *arg)
+{
+	struct tune_data *tune = arg;
+	struct frame_args frame_data = tune->frame_data;
+	struct dsp_struct dsp_data;
+	struct timespec start, stop;
+	int result_id, ret = 0;
+
+	frame_data.tile_width = tile_width;
+	frame_data.tile_height = tile_height;
+	dsp_open(&dsp_data, tune->depth, tune->cores);
+	if (dsp_try_setup(&dsp_data, frame_data, tune->inbufs, tune->buffer_count)) {
+		dsp_free(&dsp_data);
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < TUNE_FRAMES && !ret; ++i) {
+		if (dsp_data.inflight_count == dsp_data.depth)
+			ret = frame_wait(&dsp_data, &result_id);
+		if (!ret)
+			ret = frame_submit(&dsp_data, tune->inbufs[i % tune->buffer_count],
+					   i % dsp_data.result_count);
+	}
+	while (dsp_data.inflight_count && !ret)
+		ret = frame_wait(&dsp_data, &result_id);
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+
+	dsp_free(&dsp_data);
+
+	return ret ? -1 : timespec2float(timespec_subtract(start, stop)) / TUNE_FRAMES;
+}
+
 static void get_cpu_usage()
 {
 	static uint32_t total, total_prev;
@@ -237,18 +338,53 @@ static void get_fps()
 	frames = 0;
 }
 
+/* Wait for the oldest frame on DSP, draw statistics on it, show it and return
+ * its capture buffer to VINC.
+ */
+static int show_frame(int fd, struct dsp_struct *dsp_data, struct fontData *font_data,
+		      const struct frame_args frame_data, const uint32_t capture_id[])
+{
+	struct v4l2_buffer buf = { .type = V4L2_BUF_TYPE_VIDEO_CAPTURE };
+	int result_id;
+	int ret = frame_wait(dsp_data, &result_id);
+
+	if (!ret) {
+		char str[255];
+		sprintf(str, "CPU: %.1f%%, %.1f FPS", cpu_usage, fps);
+		draw_string(font_data, dsp_data->result_frame_data[result_id],
+			    dsp_data->result_pitch,
+			    str, 0);
+		/* send message to flip page handler */
+		pthread_cond_signal(&cv);
+		startup_done();
+
+		frames++;
+	}
+
+	qbuf(fd, capture_id[result_id], dsp_data->input_fds[capture_id[result_id]], &buf);
+
+	return ret;
+}
+
 int main(int argc, char *argv[])
 {
 	struct v4l2_buffer buf = { .type = V4L2_BUF_TYPE_VIDEO_CAPTURE };
 	int fd, opt;
-	uint32_t buffer_count = MAX_BUFFERS_COUNT;
+	uint32_t buffer_count;
 	uint32_t buffer_size;
 	struct drmdisplay data_drm;
 	struct dsp_struct dsp_data;
 	struct frame_args frame_data;
 	struct fontData font_data = {0};
-	//!< Exported file descriptors of input buffers
+	//!< File descriptors of capture buffers
 	int inbufs[MAX_BUFFERS_COUNT];
+	//!< DSP buffers imported by VINC in DMABUF mode
+	struct dsp_pool capture_pool;
+	int capture_fd = -1;
+	struct startup_phase dsp_phase = { .running = false };
+	double begin;
+
+	startup_init();
 
 	struct arguments arguments = {
 		.iface = MAX_IFACE,
@@ -256,14 +392,19 @@ int main(int argc, char *argv[])
 		.width = 0,
 		.height = 0,
 		.connector_id = -1,
+		.depth = DEFAULT_DEPTH,
+		.cores = DEFAULT_CORES,
+		.profile = DEFAULT_TILE_PROFILE,
+		.tune = false,
 		.verbose = false,
+		.roi = { .nrects = 0 },
 	};
 	struct sigaction new_sigaction = {
 		.sa_handler = signal_handler,
 		.sa_flags = SA_RESTART,
 	};
 
-	while ((opt = getopt(argc, argv, "i:o:w:h:c:v")) != -1) {
+	while ((opt = getopt(argc, argv, "i:o:w:h:c:d:n:p:tm:r:v")) != -1) {
 		switch (opt) {
 		case 'i':
 			arguments.iface = atoi(optarg);
@@ -280,6 +421,32 @@ int main(int argc, char *argv[])
 		case 'c':
 			arguments.connector_id = atoi(optarg);
 			break;
+		case 'd':
+			arguments.depth = atoi(optarg);
+			break;
+		case 'n':
+			arguments.cores = atoi(optarg);
+			break;
+		case 'p':
+			arguments.profile = optarg;
+			break;
+		case 't':
+			arguments.tune = true;
+			break;
+		case 'm':
+			if (!strcmp(optarg, "dmabuf")) {
+				memory = V4L2_MEMORY_DMABUF;
+			} else if (strcmp(optarg, "mmap")) {
+				print_usage();
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'r':
+			if (dsp_roi_add(&arguments.roi, optarg)) {
+				print_usage();
+				return EXIT_FAILURE;
+			}
+			break;
 		case 'v':
 			arguments.verbose = true;
 			break;
@@ -289,42 +456,95 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if (arguments.iface >= MAX_IFACE) {
+	if (arguments.iface >= MAX_IFACE || arguments.depth < 2 ||
+	    arguments.depth > MAX_PIPELINE_DEPTH || arguments.cores < 1 ||
+	    arguments.cores > MAX_DSP_CORES) {
 		print_usage();
 		return EXIT_FAILURE;
 	}
 
 	sigaction(SIGINT, &new_sigaction, NULL);
+
+	/*
+	 * Cores and firmware do not depend on frame size, so they are loaded while
+	 * capture and display are set up. Tuning runs its own DSP sessions, so
+	 * cores are requested after it.
+	 */
+	struct open_args open_args = {
+		.data = &dsp_data,
+		.depth = arguments.depth,
+		.ncores = arguments.cores
+	};
+	if (!arguments.tune)
+		startup_start(&dsp_phase, "DSP open", open_dsp, &open_args);
+
 	printf("Opening device with sensor interface %d\n", arguments.iface);
 
+	begin = startup_begin();
 	fd = find_device_on_interface_number(arguments.iface);
 	if (fd < 0)
 		error(EXIT_FAILURE, errno, "Can not open device with interface %d",
 		      arguments.iface);
+	startup_end("V4L2 discovery", begin);
 
+	begin = startup_begin();
 	if (drmdisplay_init(&data_drm, arguments.connector_id, arguments.verbose))
 		error(EXIT_FAILURE, errno, "DRM initialize failed");
 
 	if (drmdisplay_fill_mode(&data_drm, &arguments.width, &arguments.height))
 		printf("No suitable display modes found\n");
+	startup_end("DRM init", begin);
+
+	/* Font is loaded by a thread and waited by the first overlay */
+	init_font(&font_data, arguments.height / 12);
 
 	frame_data = (struct frame_args) {
 		.frame_width = arguments.width,
 		.frame_height = arguments.height,
-		.tile_width = 288,
-		.tile_height = 48,
-		.pixel_format = PIXEL_FORMAT_RGBA
+		.pixel_format = PIXEL_FORMAT_RGBA,
+		.dst_pitch = drmdisplay_pitch(arguments.width, PIXEL_FORMAT_RGBA)
 	};
+	frame_data.roi = arguments.roi;
 
-	buffer_size = frame_data.frame_width * frame_data.frame_height * frame_data.pixel_format;
-
-	dsp_init(&dsp_data, frame_data);
-
-	set_format(fd, V4L2_PIX_FMT_BGR32, arguments.width, arguments.height);
+	struct dsp_tile_geometry tile = {
+		.width = DEFAULT_TILE_WIDTH,
+		.height = DEFAULT_TILE_HEIGHT
+	};
+	struct dsp_tune_args tune_args = {
+		.frame_width = frame_data.frame_width,
+		.frame_height = frame_data.frame_height,
+		.pixel_format = frame_data.pixel_format,
+		.ncores = arguments.cores,
+		.xyram_tiles = 2
+	};
+	if (!arguments.tune && !dsp_profile_load(arguments.profile, "inverse", &tune_args, &tile))
+		printf("Tile %dx%d is loaded from %s\n", tile.width, tile.height,
+		       arguments.profile);
+
+	begin = startup_begin();
+	/* DSP reads capture buffers with their own line padding */
+	frame_data.src_pitch = set_format(fd, V4L2_PIX_FMT_BGR32, arguments.width,
+					  arguments.height);
+	buffer_size = frame_data.src_pitch * frame_data.frame_height;
+
+	/* DSP holds up to depth buffers, so VINC needs extra ones to capture into */
+	buffer_count = MIN(arguments.depth + 2, MAX_BUFFERS_COUNT);
 	request_buffers(fd, &buffer_count);
-	export_buffers(fd, buffer_count, &inbufs[0]);
+	if (buffer_count <= arguments.depth || buffer_count > MAX_BUFFERS_COUNT)
+		error(EXIT_FAILURE, 0, "VINC provides %u buffers, but %d..%d are required",
+		      buffer_count, arguments.depth + 1, MAX_BUFFERS_COUNT);
+	if (memory == V4L2_MEMORY_DMABUF) {
+		/* The same buffers are passed to DSP jobs without export */
+		capture_fd = open("/dev/elcore0", O_RDWR);
+		if (capture_fd < 0)
+			error(EXIT_FAILURE, errno, "Failed to open /dev/elcore0");
+		dsp_pool_init(&capture_pool, capture_fd);
+		alloc_buffers(&capture_pool, buffer_count, buffer_size, &inbufs[0]);
+	} else {
+		export_buffers(fd, buffer_count, &inbufs[0]);
+	}
 
-	for (uint32_t i = 0; i < buffer_count; i++) {
+	for (uint32_t i = 0; i < buffer_count && memory == V4L2_MEMORY_MMAP; i++) {
 		buf.memory = V4L2_MEMORY_MMAP;
 		buf.index = i;
 		if (ioctl(fd, VIDIOC_QUERYBUF, &buf) == -1)
@@ -335,19 +555,57 @@ int main(int argc, char *argv[])
 			error(EXIT_FAILURE, 0, "Buffer #%d is too big\n", i);
 	}
 	for (uint32_t i = 0; i < buffer_count; i++)
-		qbuf(fd, i, &buf);
+		qbuf(fd, i, inbufs[i], &buf);
+	startup_end("V4L2 buffers", begin);
+
+	if (arguments.tune) {
+		struct tune_data tune = {
+			.frame_data = frame_data,
+			.depth = arguments.depth,
+			.cores = arguments.cores,
+			.inbufs = inbufs,
+			.buffer_count = buffer_count
+		};
+		double time = dsp_tune(&tune_args, measure_tiles, &tune, &tile,
+				       arguments.verbose);
+
+		if (time < 0)
+			error(EXIT_FAILURE, 0, "No suitable tile geometry found");
+		printf("The fastest tile is %dx%d: %.3f ms\n", tile.width, tile.height,
+		       time * 1e3);
+		if (dsp_profile_save(arguments.profile, "inverse", &tune_args, &tile, time))
+			error(0, errno, "Failed to save profile %s", arguments.profile);
+	}
 
-	dsp_job_create(&dsp_data, inbufs, buffer_count);
+	if (arguments.tune) {
+		begin = startup_begin();
+		open_dsp(&open_args);
+		startup_end("DSP open", begin);
+	}
+	startup_wait(&dsp_phase);
 
-	init_font(&font_data, arguments.height / 12);
+	begin = startup_begin();
+	frame_data.tile_width = tile.width;
+	frame_data.tile_height = tile.height;
+	dsp_setup(&dsp_data, frame_data);
+	dsp_job_create(&dsp_data, inbufs, buffer_count);
+	startup_end("DSP buffers", begin);
 
-	drmdisplay_set_mode(&data_drm, arguments.width, arguments.height, frame_data.pixel_format,
+	begin = startup_begin();
+	drmdisplay_set_mode(&data_drm, arguments.width, arguments.height, dsp_data.result_pitch,
 			    dsp_data.result_frame[0]->fd);
+	int result_fds[MAX_RESULT_FRAMES];
+	for (int i = 1; i < dsp_data.result_count; i++)
+		result_fds[i - 1] = dsp_data.result_frame[i]->fd;
 	drmdisplay_start_flipflop(&data_drm, arguments.width, arguments.height,
-				  frame_data.pixel_format, dsp_data.result_frame[1]->fd);
+				  dsp_data.result_pitch, result_fds, dsp_data.result_count - 1);
 	stream_on(fd);
+	startup_end("DRM mode", begin);
 
 	uint32_t buffer_id = 0;
+	int result_id = 0;
+	//!< Capture buffer index processed into each result frame
+	uint32_t capture_id[MAX_RESULT_FRAMES];
 	while (!stop) {
 		if (frames % 30 == 0) {
 			get_fps();
@@ -355,35 +613,41 @@ int main(int argc, char *argv[])
 		}
 		dqbuf(fd, buffer_id, &buf);
 
-		// TODO: Input and output buffers with different stride are not supported.
-		if (frame_inverse(&dsp_data, inbufs[buffer_id], buffer_id)) {
-			qbuf(fd, buffer_id, &buf);
+		if (frame_submit(&dsp_data, inbufs[buffer_id], result_id)) {
+			qbuf(fd, buffer_id, inbufs[buffer_id], &buf);
 			break;
 		}
-
-		char str[255];
-		sprintf(str, "CPU: %.1f%%, %.1f FPS", cpu_usage, fps);
-		draw_string(&font_data, dsp_data.result_frame_data[buffer_id],
-			    frame_data.frame_width * frame_data.pixel_format,
-			    str, 0);
-		/* send message to flip page handler */
-		pthread_cond_signal(&cv);
-
-		frames++;
-
-		qbuf(fd, buffer_id, &buf);
+		capture_id[result_id] = buffer_id;
 
 		buffer_id++;
 		if (buffer_id >= buffer_count)
 			buffer_id = 0;
+		result_id++;
+		if (result_id >= dsp_data.result_count)
+			result_id = 0;
+
+		/* Keep DSP busy with next frames while the oldest one is being displayed */
+		if (dsp_data.inflight_count < dsp_data.depth)
+			continue;
+
+		if (show_frame(fd, &dsp_data, &font_data, frame_data, capture_id))
+			break;
 	}
 
+	while (dsp_data.inflight_count)
+		show_frame(fd, &dsp_data, &font_data, frame_data, capture_id);
+
 	drmdisplay_restore_mode(&data_drm);
 
 	dsp_free(&dsp_data);
 
 	close(fd);
 
+	if (memory == V4L2_MEMORY_DMABUF) {
+		dsp_pool_destroy(&capture_pool);
+		close(capture_fd);
+	}
+
 	pthread_cancel(thread);
 
 	return EXIT_SUCCESS;
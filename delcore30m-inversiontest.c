@@ -32,7 +32,10 @@
 #include "stb/stb_image.h"
 #include "stb/stb_image_write.h"
 
+#include "bundle.h"
 #include "delcore30m-inversiontest.h"
+#include "dspbroker.h"
+#include "dsppool.h"
 
 #define MAKE_STR_(s) #s
 #define MAKE_STR(s) MAKE_STR_(s)
@@ -45,7 +48,19 @@
 const int tile_width = 288;
 const int tile_height = 64;
 const int SDMA_CHANNELS_COUNT = 2;
-int img_width, img_height, img_channels;
+
+/// Images are aligned in batch buffers to keep SDMA bursts aligned
+#define IMAGE_ALIGN 64
+
+struct image {
+	char *input_path;
+	char *output_path;
+	uint8_t *data;
+	int width, height, channels;
+	size_t size;
+	/// Offset of the image in input and output buffers of the job
+	size_t offset;
+};
 
 struct timespec job_begin, job_end, test_begin, test_end;
 double elapsedTime_job, elapsedTime_test;
@@ -54,8 +69,13 @@ uint8_t profile = 0;
 
 char *fw_path = MAKE_STR(FIRMWARE_PATH) "inversiontest.fw.bin";
 
+/// Jobs are run by broker on core 0 with inverse kernel of bundle firmware
+const char *broker;
+
 bool passed = false;
 
+struct dsp_pool pool;
+
 void printresult(void)
 {
 	puts(passed ? "TEST PASSED" : "TEST FAILED");
@@ -63,10 +83,12 @@ void printresult(void)
 
 void help(const char *pname)
 {
-	printf("Usage: %s -i image_file [options]\n\n", pname);
+	printf("Usage: %s -i image_file [-i image_file ...] [options]\n\n", pname);
 	puts("Options:");
-	puts("    -o arg\tSet saving result in file");
+	puts("    -o arg\tSet saving result in file, one per input image");
+	puts("    -b arg\tProcess arg images per DSP job (default: 1)");
 	puts("    -p arg\tSet profiling mode for DSP");
+	puts("    -s arg\tRun jobs by broker listening on socket arg");
 }
 
 static inline struct timespec timespec_subtract(struct timespec const start,
@@ -90,14 +112,11 @@ static inline float timespec2msec(struct timespec const t)
 	return (float)t.tv_sec * MSEC_IN_SEC + (float)t.tv_nsec / (NSEC_IN_SEC / MSEC_IN_SEC);
 }
 
-void printtimings(int core)
+void printtimings(void)
 {
 	struct timespec elapsed;
 
 	clock_gettime(CLOCK_MONOTONIC, &test_end);
-	elapsed = timespec_subtract(job_begin, job_end);
-	fprintf(stdout, "JOB<CORE %d> runtime = %f ms\n", core, timespec2msec(elapsed));
-
 	elapsed = timespec_subtract(test_begin, test_end);
 	fprintf(stdout, "TEST runtime = %f ms\n", timespec2msec(elapsed));
 }
@@ -107,34 +126,29 @@ unsigned int tiles_get_number (int img_width, int img_height, int tile_width, in
 	return DIV_ROUND_UP(img_width, tile_width) * DIV_ROUND_UP(img_height, tile_height);
 }
 
-struct tilesbuffer *tile_generator(int width, int height, int channels)
+/* Fill tiles of @img to @info and return their number */
+uint32_t tile_generator(const struct image *img, struct tileinfo *info)
 {
-	int ntiles = tiles_get_number(width, height, tile_width, tile_height);
-	struct tilesbuffer *tb = malloc(sizeof(struct tileinfo) * ntiles + sizeof(struct tilesbuffer));
-	int i = 0;
-
-	if (!tb)
-		return NULL;
+	uint32_t i = 0;
 
-	tb->ntiles = ntiles;
-	for (uint32_t y = 0; y < height; y+=tile_height)
-		for (uint32_t x = 0; x < width; x+=tile_width)
-			tb->info[i++] = (struct tileinfo){
+	for (uint32_t y = 0; y < img->height; y+=tile_height)
+		for (uint32_t x = 0; x < img->width; x+=tile_width)
+			info[i++] = (struct tileinfo){
 				.x = x,
 				.y = y,
-				.width = min(tile_width, width - x),
-				.height = min(tile_height, height - y),
-				.stride = { channels, channels * width }
+				.width = min(tile_width, img->width - x),
+				.height = min(tile_height, img->height - y),
+				.stride = { img->channels, img->channels * img->width }
 			};
 
-	return tb;
+	return i;
 }
 
-struct sdma_descriptor tile2descriptor(struct tileinfo tile)
+struct sdma_descriptor tile2descriptor(struct tileinfo tile, size_t offset)
 {
 	struct sdma_descriptor const desc = {
-		.a0e = tile.x * tile.stride[0] + tile.y * tile.stride[1],
-		.astride = img_width * tile.stride[0],
+		.a0e = offset + tile.x * tile.stride[0] + tile.y * tile.stride[1],
+		.astride = tile.stride[1],
 		.bcnt = tile.height,
 		.asize = tile.width * tile.stride[0],
 		.ccr = BURST_SIZE_8BYTE << SCR_BURST_SIZE_BIT |
@@ -164,26 +178,14 @@ uint8_t *getbytes(const char *filename, uint32_t *size)
 	return data;
 }
 
-struct delcore30m_buffer *buf_alloc(int fd, enum delcore30m_memory_type type,
+struct delcore30m_buffer *buf_alloc(enum delcore30m_memory_type type,
 		int core_num, int size, void *ptr)
 {
-	struct delcore30m_buffer *buffer = (struct delcore30m_buffer *) malloc(sizeof(struct delcore30m_buffer));
-	buffer->size = size;
-	buffer->type = type;
-	buffer->core_num = core_num;
-
-	if (ioctl(fd, ELCIOC_BUF_ALLOC, buffer))
+	struct delcore30m_buffer *buffer = dsp_pool_alloc(&pool, type, core_num,
+							  size, ptr);
+	if (!buffer)
 		error(EXIT_FAILURE, errno, "Failed to allocate buffer");
 
-	if (ptr != NULL) {
-		void *mmap_buf = mmap(NULL, buffer->size,
-				      PROT_READ | PROT_WRITE, MAP_SHARED,
-				      buffer->fd, 0);
-		if (mmap_buf == MAP_FAILED)
-			error(EXIT_FAILURE, errno, "Failed to mmap buffer");
-		memcpy(mmap_buf, ptr, size);
-		munmap(mmap_buf, buffer->size);
-	}
 	return buffer;
 }
 
@@ -222,6 +224,45 @@ void job_start(int fd, struct delcore30m_job *job)
 		error(EXIT_FAILURE, 0, "Job failed");
 }
 
+/*
+ * Run the job of run_batch() buffers by broker on @core_id, which has tile
+ * buffers in XYRAM. Broker sets up both chains on its channels and writes
+ * them to the channel buffer.
+ */
+void broker_run(const int *input, const int *output, uint8_t core_id)
+{
+	struct dsp_broker_request req = {
+		.kernel = DSP_KERNEL_INVERSE,
+		.core = core_id,
+		.timeout_ms = 2000,
+		.inum = 7,
+		.onum = 3,
+		.nchains = 2,
+		/* Indices of buffers in input and output of run_batch(), outputs follow inputs */
+		.chains = {
+			{ SDMA_CHANNEL_INPUT, 0, { 1, 3 }, 4, 8 },
+			{ SDMA_CHANNEL_OUTPUT, 7, { 1, 3 }, 5, 9 }
+		},
+		.channels = 2
+	};
+	struct dsp_broker_reply reply;
+	int sock = dsp_broker_connect(broker);
+
+	if (sock < 0)
+		error(EXIT_FAILURE, errno, "Failed to connect to broker");
+
+	clock_gettime(CLOCK_MONOTONIC, &job_begin);
+	if (dsp_broker_submit(sock, &req, input, output) || dsp_broker_wait(sock, &reply))
+		error(EXIT_FAILURE, errno, "Failed to run job by broker");
+	clock_gettime(CLOCK_MONOTONIC, &job_end);
+	close(sock);
+
+	if (reply.rc < 0)
+		error(EXIT_FAILURE, -reply.rc, "Broker failed to run job");
+	if (reply.rc != DELCORE30M_JOB_SUCCESS)
+		error(EXIT_FAILURE, 0, "Job failed");
+}
+
 void job_create(int fd, struct delcore30m_job *job,
 		int *in_buffers, int in_size,
 		int *out_buffers, int out_size,
@@ -242,58 +283,180 @@ void job_create(int fd, struct delcore30m_job *job,
 		error(EXIT_FAILURE, errno, "Failed to create job");
 }
 
-int main(int argc, char **argv)
+/*
+ * Inverse @count images in one job: images are placed one after another in
+ * input and output buffers, and tiles of all images form one DMA chain, so
+ * firmware processes them back-to-back.
+ */
+void run_batch(int fd, struct image *images, int count, uint8_t core_id,
+	       int cores_fd, int sdmas_fd, uint32_t *channels)
 {
-	int opt, fd;
-	uint8_t core_id;
-	char *image_input_path = NULL, *image_output_path = NULL;
+	size_t total_size = 0;
+	uint32_t ntiles = 0;
+	int max_channels = 0;
+
+	for (int i = 0; i < count; ++i) {
+		struct image *img = &images[i];
+
+		img->data = stbi_load(img->input_path, &img->width, &img->height,
+				      &img->channels, 0);
+		if (img->data == NULL)
+			error(EXIT_FAILURE, 0, "Failed to open image %s: %s", img->input_path,
+			      stbi_failure_reason());
+
+		img->size = img->width * img->height * img->channels;
+		img->offset = total_size;
+		total_size += DIV_ROUND_UP(img->size, IMAGE_ALIGN) * IMAGE_ALIGN;
+		ntiles += tiles_get_number(img->width, img->height, tile_width, tile_height);
+		max_channels = max(max_channels, img->channels);
+	}
 
-	clock_gettime(CLOCK_MONOTONIC, &test_begin);
-	atexit(printresult);
+	struct tilesbuffer *tb = malloc(sizeof(struct tilesbuffer) +
+					sizeof(struct tileinfo) * ntiles);
+	struct sdma_descriptor *descs = malloc(sizeof(struct sdma_descriptor) * ntiles);
+	if (!tb || !descs)
+		error(EXIT_FAILURE, errno, "Failed to allocate tiles");
 
-	while ((opt = getopt(argc, argv, "i:o:ph")) != -1) {
-		switch (opt) {
-		case 'i':
-			image_input_path = optarg;
-			break;
-		case 'o':
-			image_output_path = optarg;
-			break;
-		case 'p':
-			fw_path = MAKE_STR(FIRMWARE_PATH) "inversiontest-profile.fw.bin";
-			profile = 1;
-			break;
-		case 'h':
-			help(argv[0]);
-			return EXIT_SUCCESS;
-		default:
-			error(EXIT_FAILURE, 0, "Try %s -h for help.", argv[0]);
+	tb->ntiles = ntiles;
+	tb->tilesize = tile_width * tile_height * max_channels;
+	for (int i = 0, k = 0; i < count; ++i) {
+		uint32_t n = tile_generator(&images[i], &tb->info[k]);
+
+		for (uint32_t j = 0; j < n; ++j, ++k) {
+			descs[k] = tile2descriptor(tb->info[k], images[i].offset);
+			descs[k].a_init = (k + 1) * sizeof(struct sdma_descriptor);
 		}
 	}
+	descs[ntiles - 1].a_init = 0;
+
+	struct delcore30m_buffer *img_buffer = buf_alloc(
+			DELCORE30M_MEMORY_SYSTEM, core_id, total_size, NULL);
+	uint8_t *img_in = dsp_pool_map(img_buffer);
+	if (!img_in)
+		error(EXIT_FAILURE, errno, "Failed to mmap input buffer");
+	for (int i = 0; i < count; ++i)
+		memcpy(img_in + images[i].offset, images[i].data, images[i].size);
+
+	/* Input and output tiles are at the same positions */
+	struct delcore30m_buffer *chain_buffer1 = buf_alloc(
+			DELCORE30M_MEMORY_SYSTEM, core_id,
+			sizeof(struct sdma_descriptor) * ntiles, descs);
 
-	if (image_input_path == NULL)
-		error(EXIT_FAILURE, 0, "Not enough arguments");
+	struct delcore30m_buffer *chain_buffer2 = buf_alloc(
+			DELCORE30M_MEMORY_SYSTEM, core_id,
+			sizeof(struct sdma_descriptor) * ntiles, descs);
 
-	fd = open("/dev/elcore0", O_RDWR);
-	if (fd < 0)
-		error(EXIT_FAILURE, errno, "Failed to open device file");
+	struct delcore30m_buffer *tb_buffer = buf_alloc(
+			DELCORE30M_MEMORY_XYRAM, core_id,
+			sizeof(struct tilesbuffer) + sizeof(struct tileinfo) * ntiles,
+			tb);
 
-	struct delcore30m_resource cores_res = {
-		.type = DELCORE30M_CORE,
-		.num = 1
-	};
+	struct delcore30m_buffer *tile_buffers[2];
+	for (int i = 0; i < 2; ++i)
+		tile_buffers[i] = buf_alloc(DELCORE30M_MEMORY_XYRAM, core_id,
+					    tb->tilesize, NULL);
+
+	struct delcore30m_buffer *out_img_buffer = buf_alloc(
+			DELCORE30M_MEMORY_SYSTEM, core_id, total_size, NULL);
+
+	struct delcore30m_buffer *code_buffer1 = buf_alloc(
+			DELCORE30M_MEMORY_SYSTEM, core_id, 60 * ntiles, NULL);
+
+	struct delcore30m_buffer *channel_buffer = buf_alloc(
+				DELCORE30M_MEMORY_XYRAM, core_id,
+				SDMA_CHANNELS_COUNT * sizeof(uint32_t), channels);
+
+	struct delcore30m_buffer *code_buffer2 = buf_alloc(
+				DELCORE30M_MEMORY_SYSTEM, core_id, 60 * ntiles, NULL);
+
+	int input[] = {img_buffer->fd,
+			tile_buffers[0]->fd, channel_buffer->fd, tile_buffers[1]->fd,
+			chain_buffer1->fd, chain_buffer2->fd, tb_buffer->fd};
+	int output[] = {out_img_buffer->fd, code_buffer1->fd, code_buffer2->fd};
+
+	if (broker) {
+		broker_run(input, output, core_id);
+	} else {
+		struct delcore30m_job job;
+
+		job_create(fd, &job, input, 7, output, 3, cores_fd, sdmas_fd);
+
+		struct delcore30m_dmachain dmachain_input = {
+			.job = job.fd,
+			.core = core_id,
+			.external = img_buffer->fd,
+			.internal = { tile_buffers[0]->fd, tile_buffers[1]->fd },
+			.chain = chain_buffer1->fd,
+			.codebuf = code_buffer1->fd,
+			.channel = {SDMA_CHANNEL_INPUT,  channels[0]}
+		};
+		if (ioctl(fd, ELCIOC_DMACHAIN_SETUP, &dmachain_input))
+			error(EXIT_FAILURE, errno, "Failed to setup input dmachain");
+
+		struct delcore30m_dmachain dmachain_output = {
+			.job = job.fd,
+			.core = core_id,
+			.external = out_img_buffer->fd,
+			.internal = { tile_buffers[0]->fd, tile_buffers[1]->fd},
+			.chain = chain_buffer2->fd,
+			.codebuf = code_buffer2->fd,
+			.channel = {SDMA_CHANNEL_OUTPUT,  channels[1]}
+		};
+		if (ioctl(fd, ELCIOC_DMACHAIN_SETUP, &dmachain_output))
+			error(EXIT_FAILURE, errno, "Failed to setup output dmachain");
+
+		job_start(fd, &job);
+		close(job.fd);
+	}
+
+	fprintf(stdout, "JOB<CORE %d> runtime = %f ms (%d image%s)\n", core_id,
+		timespec2msec(timespec_subtract(job_begin, job_end)), count,
+		count > 1 ? "s" : "");
+
+	uint8_t *img_out = dsp_pool_map(out_img_buffer);
+	if (!img_out)
+		error(EXIT_FAILURE, errno, "Failed to mmap output buffer");
+
+	for (int i = 0; i < count; ++i) {
+		struct image *img = &images[i];
 
-	if (ioctl(fd, ELCIOC_RESOURCE_REQUEST, &cores_res))
+		results_check((uint64_t *)img->data, (uint64_t *)(img_out + img->offset),
+			      img->size);
+
+		if (img->output_path &&
+		    !stbi_write_png(img->output_path, img->width, img->height, img->channels,
+				    img_out + img->offset, img->width * img->channels))
+			error(EXIT_FAILURE, 0, "Failed to write image");
+
+		stbi_image_free(img->data);
+		img->data = NULL;
+	}
+
+	free(descs);
+	free(tb);
+	/* Buffers of the next batch have other sizes, so they are not reused */
+	dsp_pool_destroy(&pool);
+}
+
+/* Request a core with inversion firmware and SDMA channels. Return the core. */
+uint8_t request_resources(int fd, struct delcore30m_resource *cores_res,
+			  struct delcore30m_resource *sdmas_res, uint32_t *channels)
+{
+	uint8_t core_id;
+
+	cores_res->type = DELCORE30M_CORE;
+	cores_res->num = 1;
+	if (ioctl(fd, ELCIOC_RESOURCE_REQUEST, cores_res))
 		error(EXIT_FAILURE, errno, "Failed to request DELCORE30M_CORE");
 
 	uint32_t fwsize;
 	uint8_t *fwdata = getbytes(fw_path, &fwsize);
-	uint8_t mask = cores_res.mask;
+	uint8_t mask = cores_res->mask;
 	for (core_id = 0; mask; core_id++, mask >>= 1) {
 		if (!(mask & 1))
 			continue;
 		void *buf_cores = mmap(NULL, fwsize, PROT_WRITE,
-				       MAP_SHARED, cores_res.fd,
+				       MAP_SHARED, cores_res->fd,
 				       sysconf(_SC_PAGESIZE) * core_id);
 		if (buf_cores == MAP_FAILED)
 			error(EXIT_FAILURE, errno, "Failed to load firmware");
@@ -302,136 +465,89 @@ int main(int argc, char **argv)
 	}
 	core_id--;
 
-	struct delcore30m_resource sdmas_res = {
-		.type = DELCORE30M_SDMA,
-		.num = SDMA_CHANNELS_COUNT
-	};
-
-	if (ioctl(fd, ELCIOC_RESOURCE_REQUEST, &sdmas_res))
+	sdmas_res->type = DELCORE30M_SDMA;
+	sdmas_res->num = SDMA_CHANNELS_COUNT;
+	if (ioctl(fd, ELCIOC_RESOURCE_REQUEST, sdmas_res))
 		error(EXIT_FAILURE, errno, "Failed to request DELCORE30M_SDMA");
 
-	uint32_t channels[SDMA_CHANNELS_COUNT];
-	mask = sdmas_res.mask;
+	mask = sdmas_res->mask;
 	for (int channel = 0, k = 0; mask; channel++, mask >>= 1) {
 		if (mask & 1)
 			channels[k++] = channel;
 	}
 
-	void *image = stbi_load(image_input_path, &img_width,
-				&img_height, &img_channels, 0);
-	if (image == NULL)
-		error(EXIT_FAILURE, 0, "Failed to open image %s: %s", image_input_path,
-		      stbi_failure_reason());
-
-	int img_size = img_width * img_height * img_channels;
-
-	struct delcore30m_buffer *img_buffer = buf_alloc(fd,
-			DELCORE30M_MEMORY_SYSTEM, core_id, img_size, image);
+	return core_id;
+}
 
-	struct tilesbuffer *tb = tile_generator(img_width, img_height, img_channels);
-	tb->tilesize = tile_width * tile_height * img_channels;
-	struct sdma_descriptor descs[tb->ntiles];
+int main(int argc, char **argv)
+{
+	int opt, fd;
+	uint8_t core_id;
+	int nimages = 0, noutputs = 0, batch = 1;
+	struct image *images = calloc(argc, sizeof(struct image));
 
-	for (uint32_t i = 0; i < tb->ntiles; ++i) {
-		descs[i] = tile2descriptor(tb->info[i]);
-		descs[i].a_init = (i + 1) * sizeof(struct sdma_descriptor);
-	}
-	descs[tb->ntiles - 1].a_init = 0;
+	clock_gettime(CLOCK_MONOTONIC, &test_begin);
+	atexit(printresult);
 
-	struct tilesbuffer *tb_out = tile_generator(img_width, img_height, img_channels);
-	tb_out->tilesize = tb->tilesize;
-	struct sdma_descriptor descs_out[tb_out->ntiles];
+	if (!images)
+		error(EXIT_FAILURE, errno, "Failed to allocate images");
 
-	for (uint32_t i = 0; i < tb_out->ntiles; ++i) {
-		descs_out[i] = tile2descriptor(tb_out->info[i]);
-		descs_out[i].a_init = (i + 1) * sizeof(struct sdma_descriptor);
+	while ((opt = getopt(argc, argv, "i:o:b:s:ph")) != -1) {
+		switch (opt) {
+		case 'i':
+			images[nimages++].input_path = optarg;
+			break;
+		case 'o':
+			images[noutputs++].output_path = optarg;
+			break;
+		case 'b':
+			batch = atoi(optarg);
+			break;
+		case 's':
+			broker = optarg;
+			break;
+		case 'p':
+			fw_path = MAKE_STR(FIRMWARE_PATH) "inversiontest-profile.fw.bin";
+			profile = 1;
+			break;
+		case 'h':
+			help(argv[0]);
+			return EXIT_SUCCESS;
+		default:
+			error(EXIT_FAILURE, 0, "Try %s -h for help.", argv[0]);
+		}
 	}
-	descs_out[tb->ntiles - 1].a_init = 0;
-
-	struct delcore30m_buffer *chain_buffer1 = buf_alloc(fd,
-			DELCORE30M_MEMORY_SYSTEM, core_id,
-			sizeof(struct sdma_descriptor) * tb->ntiles, descs_out);
-
-	struct delcore30m_buffer *chain_buffer2 = buf_alloc(fd,
-			DELCORE30M_MEMORY_SYSTEM, core_id,
-			sizeof(struct sdma_descriptor) * tb->ntiles, descs);
-
-	struct delcore30m_buffer *tb_buffer = buf_alloc(fd,
-			DELCORE30M_MEMORY_XYRAM, core_id,
-			sizeof(struct tilesbuffer) + sizeof(struct tileinfo) * tb->ntiles,
-			tb);
-
-	struct delcore30m_buffer *tile_buffers[2];
-	for (int i = 0; i < 2; ++i)
-		tile_buffers[i] = buf_alloc(fd, DELCORE30M_MEMORY_XYRAM, core_id,
-					    tile_width * tile_height * img_channels,
-					    NULL);
-
-	struct delcore30m_buffer *out_img_buffer = buf_alloc(fd,
-			DELCORE30M_MEMORY_SYSTEM, core_id, img_size, NULL);
-
-	struct delcore30m_buffer *code_buffer1 = buf_alloc(fd,
-			DELCORE30M_MEMORY_SYSTEM, core_id, 60 * tb->ntiles, NULL);
-
-	struct delcore30m_buffer *channel_buffer = buf_alloc(fd,
-				DELCORE30M_MEMORY_XYRAM, core_id,
-				SDMA_CHANNELS_COUNT * sizeof(uint32_t), channels);
-
-	struct delcore30m_buffer *code_buffer2 = buf_alloc(fd,
-				DELCORE30M_MEMORY_SYSTEM, core_id, 60 * tb->ntiles, NULL);
 
-	struct delcore30m_job job;
-	int input[] = {img_buffer->fd,
-			tile_buffers[0]->fd, channel_buffer->fd, tile_buffers[1]->fd,
-			chain_buffer1->fd, chain_buffer2->fd, tb_buffer->fd};
-	int output[] = {out_img_buffer->fd, code_buffer1->fd, code_buffer2->fd};
-	job_create(fd, &job, input, 7, output, 3, cores_res.fd, sdmas_res.fd);
-
-	struct delcore30m_dmachain dmachain_input = {
-		.job = job.fd,
-		.core = core_id,
-		.external = img_buffer->fd,
-		.internal = { tile_buffers[0]->fd, tile_buffers[1]->fd },
-		.chain = chain_buffer1->fd,
-		.codebuf = code_buffer1->fd,
-		.channel = {SDMA_CHANNEL_INPUT,  channels[0]}
-	};
-	if (ioctl(fd, ELCIOC_DMACHAIN_SETUP, &dmachain_input))
-		error(EXIT_FAILURE, errno, "Failed to setup input dmachain");
-
-	struct delcore30m_dmachain dmachain_output = {
-		.job = job.fd,
-		.core = core_id,
-		.external = out_img_buffer->fd,
-		.internal = { tile_buffers[0]->fd, tile_buffers[1]->fd},
-		.chain = chain_buffer2->fd,
-		.codebuf = code_buffer2->fd,
-		.channel = {SDMA_CHANNEL_OUTPUT,  channels[1]}
-	};
-	if (ioctl(fd, ELCIOC_DMACHAIN_SETUP, &dmachain_output))
-		error(EXIT_FAILURE, errno, "Failed to setup output dmachain");
+	if (nimages == 0)
+		error(EXIT_FAILURE, 0, "Not enough arguments");
+	if (noutputs && noutputs != nimages)
+		error(EXIT_FAILURE, 0, "Number of output files must match number of images");
+	if (batch < 1)
+		error(EXIT_FAILURE, 0, "Number of images per job must be positive");
+	if (broker && profile)
+		error(EXIT_FAILURE, 0, "Profiling is not supported with broker");
 
-	job_start(fd, &job);
+	fd = open("/dev/elcore0", O_RDWR);
+	if (fd < 0)
+		error(EXIT_FAILURE, errno, "Failed to open device file");
+	dsp_pool_init(&pool, fd);
 
-	void *img_out = mmap(NULL, out_img_buffer->size,
-			     PROT_READ | PROT_WRITE, MAP_SHARED,
-			     out_img_buffer->fd, 0);
-	if (img_out == MAP_FAILED)
-		error(EXIT_FAILURE, errno, "Failed to mmap output buffer");
-	void* output_img = malloc(img_size);
-	memcpy(output_img, img_out, img_size);
-	munmap(img_out, out_img_buffer->size);
+	/* Broker owns cores and SDMA channels and has firmware loaded */
+	struct delcore30m_resource cores_res = { .fd = -1 }, sdmas_res = { .fd = -1 };
+	uint32_t channels[SDMA_CHANNELS_COUNT];
 
-	results_check(image, output_img, img_size);
+	memset(channels, 0, sizeof(channels));
+	core_id = 0;
+	if (!broker)
+		core_id = request_resources(fd, &cores_res, &sdmas_res, channels);
 
-	if (image_output_path) {
-		if (!stbi_write_png(image_output_path, img_width, img_height, img_channels,
-				   output_img, img_width * img_channels))
-			error(EXIT_FAILURE, 0, "Failed to write image");
-	}
+	/* Firmware and resources are shared by all jobs */
+	for (int i = 0; i < nimages; i += batch)
+		run_batch(fd, &images[i], min(batch, nimages - i), core_id, cores_res.fd,
+			  sdmas_res.fd, channels);
 
-	printtimings(core_id);
-	stbi_image_free(image);
+	printtimings();
+	free(images);
 	passed = true;
 	return EXIT_SUCCESS;
 }
@@ -28,11 +28,18 @@
 
 #include <linux/delcore30m.h>
 
+#include "bundle.h"
+#include "dspbroker.h"
+#include "dspfirmware.h"
+
 #define KiB 1024
 
 #define MAKE_STR_(s) #s
 #define MAKE_STR(s) MAKE_STR_(s)
 
+/// Delay between requests of busy cores
+#define RESOURCE_RETRY_US 1000
+
 unsigned long max_cores_mask = 0;
 int max_cores = 0;
 
@@ -58,6 +65,12 @@ void add_job(int fd, struct delcore30m_job *job, uint32_t *args, uint8_t size, u
 		.core_num = (cores == ELCORE30M_CORE_1)
 	};
 
+	struct delcore30m_buffer bufkernel = {
+		.type = DELCORE30M_MEMORY_XYRAM,
+		.size = sizeof(uint32_t),
+		.core_num = (cores == ELCORE30M_CORE_1)
+	};
+
 	if (ioctl(fd, ELCIOC_BUF_ALLOC, &bufin))
 		error(EXIT_FAILURE, errno, "Failed to allocate input buffer");
 
@@ -75,9 +88,22 @@ void add_job(int fd, struct delcore30m_job *job, uint32_t *args, uint8_t size, u
 	if (ioctl(fd, ELCIOC_BUF_ALLOC, &bufout))
 		error(EXIT_FAILURE, errno, "Failed to allocate output buffer");
 
-	job->input[0] = bufin.fd;
+	if (ioctl(fd, ELCIOC_BUF_ALLOC, &bufkernel))
+		error(EXIT_FAILURE, errno, "Failed to allocate kernel buffer");
+
+	uint32_t *kernel = (uint32_t *)mmap(NULL, bufkernel.size,
+					    PROT_READ | PROT_WRITE,
+					    MAP_SHARED, bufkernel.fd, 0);
+	if (kernel == MAP_FAILED)
+		error(EXIT_FAILURE, errno, "Failed to mmap kernel buffer");
+
+	*kernel = DSP_KERNEL_SUM;
+	munmap((void *)kernel, bufkernel.size);
+
+	job->input[0] = bufkernel.fd;
+	job->input[1] = bufin.fd;
 	job->output[0] = bufout.fd;
-	job->inum = 1;
+	job->inum = 2;
 	job->onum = 1;
 	job->cores_fd = cores_fd;
 	job->flags = 0;
@@ -109,13 +135,13 @@ int wait_job(int fd, struct delcore30m_job *job)
 	return job->rc;
 }
 
-int check_result(struct delcore30m_job *job, uint32_t mask, uint32_t *args, uint8_t job_index)
+int check_result(int output_fd, uint32_t mask, uint32_t *args, uint8_t job_index)
 {
 	int rc = 0;
 
 	uint32_t *output_arg = (uint32_t *)mmap(NULL, sysconf(_SC_PAGESIZE),
 						PROT_READ | PROT_WRITE,
-						MAP_SHARED, job->output[0], 0);
+						MAP_SHARED, output_fd, 0);
 
 	if (output_arg == MAP_FAILED)
 		error(EXIT_FAILURE, errno, "Failed to mmap output buffer");
@@ -144,8 +170,69 @@ struct thread_private_data {
 	uint8_t errors;
 	uint32_t cores;
 	int cores_fd;
+	const char *broker;
 };
 
+/* Run the job by broker on any free core */
+int broker_job(struct thread_private_data *data, uint32_t *args)
+{
+	long sz = sysconf(_SC_PAGESIZE);
+	struct delcore30m_buffer bufin = {
+		.type = DELCORE30M_MEMORY_SYSTEM,
+		.size = sz
+	};
+	struct delcore30m_buffer bufout = {
+		.type = DELCORE30M_MEMORY_SYSTEM,
+		.size = sz
+	};
+	struct dsp_broker_request req = {
+		.tag = data->id,
+		.kernel = DSP_KERNEL_SUM,
+		.core = DSP_BROKER_ANY_CORE,
+		.timeout_ms = 2000,
+		.inum = 1,
+		.onum = 1
+	};
+	struct dsp_broker_reply reply;
+	int sock, rc = 1;
+
+	if (ioctl(data->fd, ELCIOC_BUF_ALLOC, &bufin) ||
+	    ioctl(data->fd, ELCIOC_BUF_ALLOC, &bufout))
+		error(EXIT_FAILURE, errno, "Failed to allocate buffers");
+
+	uint32_t *input_arg = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED, bufin.fd, 0);
+	if (input_arg == MAP_FAILED)
+		error(EXIT_FAILURE, errno, "Failed to mmap input buffer");
+	/* Core of the job is not known in advance, so arguments are set for any */
+	for (int core = 0; core < max_cores; ++core) {
+		input_arg[core * 2] = args[0];
+		input_arg[core * 2 + 1] = args[1];
+	}
+	munmap(input_arg, sz);
+
+	sock = dsp_broker_connect(data->broker);
+	if (sock < 0)
+		error(EXIT_FAILURE, errno, "Failed to connect to broker");
+
+	if (dsp_broker_submit(sock, &req, &bufin.fd, &bufout.fd) ||
+	    dsp_broker_wait(sock, &reply)) {
+		fprintf(stderr, "[%d] Failed to run job by broker: %s\n", data->id,
+			strerror(errno));
+	} else if (reply.rc) {
+		fprintf(stderr, "[%d] Job failed: %d\n", data->id, reply.rc);
+	} else {
+		args[reply.core * 2] = args[0];
+		args[reply.core * 2 + 1] = args[1];
+		rc = check_result(bufout.fd, 1 << reply.core, args, data->id);
+	}
+
+	close(sock);
+	close(bufin.fd);
+	close(bufout.fd);
+
+	return rc;
+}
+
 void *worker(void *private_data)
 {
 	struct thread_private_data *data = private_data;
@@ -159,6 +246,11 @@ void *worker(void *private_data)
 
 	data->errors = 0;
 
+	if (data->broker) {
+		data->errors += broker_job(data, args);
+		return NULL;
+	}
+
 	add_job(data->fd, &job, args, 2, data->cores, data->cores_fd);
 
 	if (wait_job(data->fd, &job)) {
@@ -167,29 +259,34 @@ void *worker(void *private_data)
 		return NULL;
 	}
 
-	data->errors += check_result(&job, data->cores, args, data->id);
+	data->errors += check_result(job.output[0], data->cores, args, data->id);
 	return NULL;
 }
 
-uint8_t *getbytes(const char *filename, uint32_t *size)
+void request_cores(int fd, struct delcore30m_resource *cores_res)
 {
-	uint8_t *data;
-
-	FILE *f = fopen(filename, "r");
-	if (f == NULL) {
-		*size = 0;
-		return NULL;
+	while (ioctl(fd, ELCIOC_RESOURCE_REQUEST, cores_res)) {
+		if (errno == EBUSY) {
+			usleep(RESOURCE_RETRY_US);
+			continue;
+		}
+		error(EXIT_FAILURE, errno, "Failed to request DELCORE30M_CORE");
 	}
-	fseek(f, 0, SEEK_END);
-	*size = ftell(f);
-	fseek(f, 0, SEEK_SET);
 
-	data = malloc(*size);
-	fread(data, 1, *size, f);
+	struct dsp_firmware fw;
+	if (dsp_firmware_open(&fw, MAKE_STR(FIRMWARE_PATH) "bundle.fw.bin"))
+		error(EXIT_FAILURE, errno, "Failed to open firmware");
 
-	fclose(f);
+	uint8_t mask = cores_res->mask;
+	for (int core = 0; mask; core++, mask >>= 1) {
+		uint32_t loaded = 0;
 
-	return data;
+		if (!(mask & 1))
+			continue;
+		if (dsp_firmware_load(&fw, cores_res->fd, core, &loaded))
+			error(EXIT_FAILURE, errno, "Failed to load firmware");
+	}
+	dsp_firmware_close(&fw);
 }
 
 int main (int argc, char **argv)
@@ -197,12 +294,15 @@ int main (int argc, char **argv)
 	int jobs, cores, i, ret;
 	pthread_t *threads;
 	struct thread_private_data *data;
+	const char *broker = argc > 3 ? argv[3] : NULL;
 
 	atexit(printresult);
 	if (argc < 3)
 		error(EXIT_FAILURE, 0, "Arguments error occured\n"
 				       "First argument - job count\n"
-				       "Second argument - core count\n");
+				       "Second argument - core count\n"
+				       "Third argument (optional) - broker socket, jobs are\n"
+				       "run by broker on one core each\n");
 
 	jobs = strtol(argv[1], NULL, 10);
 	cores = strtol(argv[2], NULL, 10);
@@ -218,33 +318,13 @@ int main (int argc, char **argv)
 	max_cores = hw.ncores;
 	max_cores_mask = (1 << hw.ncores) - 1;
 
+	/* Broker owns the cores and runs jobs on them itself */
 	struct delcore30m_resource cores_res = {
 		.type = DELCORE30M_CORE,
 		.num = cores
 	};
-
-	while (ioctl(fd, ELCIOC_RESOURCE_REQUEST, &cores_res)) {
-		if (errno == EBUSY)
-			continue;
-		error(EXIT_FAILURE, errno, "Failed to request DELCORE30M_CORE");
-	}
-
-	uint32_t fwsize;
-	uint8_t *fwdata = getbytes(MAKE_STR(FIRMWARE_PATH) "sum.fw.bin", &fwsize);
-	uint8_t mask = cores_res.mask;
-	for (int core = 0; mask; core++, mask >>= 1) {
-		if (!(mask & 1))
-			continue;
-		uint32_t *buf_cores = (uint32_t *)mmap(NULL, fwsize,
-						       PROT_WRITE,
-						       MAP_SHARED,
-						       cores_res.fd,
-						       4096 * core);
-		if (buf_cores == MAP_FAILED)
-			error(EXIT_FAILURE, errno, "Failed to load firmware");
-		memcpy((void *)buf_cores, (void *)fwdata, fwsize);
-		munmap((void *)buf_cores, fwsize);
-	}
+	if (!broker)
+		request_cores(fd, &cores_res);
 
 	threads = malloc(sizeof(pthread_t) * jobs);
 	data = (struct thread_private_data *)malloc(sizeof(struct thread_private_data) * jobs);
@@ -256,6 +336,7 @@ int main (int argc, char **argv)
 		data[i].id = i;
 		data[i].cores = cores_res.mask;
 		data[i].cores_fd = cores_res.fd;
+		data[i].broker = broker;
 		ret = pthread_create(&threads[i], NULL, worker, &data[i]);
 		if (ret)
 			error(EXIT_FAILURE, ret, "Failed to create pthread");
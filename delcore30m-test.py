@@ -117,6 +117,12 @@ class TestcaseDSP(unittest.TestCase):
         for _ in range(cycles):
             self.exec_command("delcore30m-inversiontest", "-i", self.images[1])
 
+    def test_dma_batch(self):
+        cycles = 20
+        images = [arg for image in self.images for arg in ("-i", image)]
+        for _ in range(cycles):
+            self.exec_command("delcore30m-inversiontest", "-b", str(len(self.images)), *images)
+
     def test_dma2core_async(self):
         def exec_command(cmd, *args):
             options = {}
@@ -154,6 +160,34 @@ class TestcaseDSP(unittest.TestCase):
     def test_fibonacci(self):
         self.exec_command("delcore30m-fibonacci", "-i", "10", "-v")
 
+    def test_detector(self):
+        # fmt: off
+        cases = [["-s", "grayscale,threshold:100,overlay"],
+                 ["-c", "2", "-s", "motion:40,open:1,dilate:2,overlay"],
+                 ["-u", "-t", "64x8", "-s", "erode:2"],
+                 ["-c", "2", "-s", "threshold:100,blobs:1"],
+                 ["-c", "2", "-n", "200", "-t", "32x8", "-s", "threshold:100,blobs:16"],
+                 ["-m", "-t", "72x16", "-s", "threshold:100,close:2"],
+                 ["-k", "-t", "72x16", "-s", "motion:40,close:2,overlay"],
+                 ["-c", "2", "-S", "-u", "-s", "motion:40,erode:1"],
+                 ["-c", "2", "-S", "-b", "4", "-s", "motion:40,overlay"],
+                 ["-2", "-k", "-t", "72x16", "-s", "motion:40,open:1,overlay"]]
+        # fmt: on
+        for args in cases:
+            self.exec_command("delcore30m-detectortest", *args)
+
+    def test_broker(self):
+        sock = "/tmp/delcore30m-broker.sock"
+        self.exec_command("delcore30m-broker", "-d", "-s", sock)
+        try:
+            for _ in range(100):
+                self.exec_command("delcore30m-paralleltest", "15", "1", sock)
+            images = [arg for image in self.images for arg in ("-i", image)]
+            for _ in range(20):
+                self.exec_command("delcore30m-inversiontest", "-s", sock, *images)
+        finally:
+            subprocess.call(["pkill", "-f", "delcore30m-broker -d -s " + sock])
+
 
 if __name__ == "__main__":
     unittest.main(verbosity=2)
@@ -12,6 +12,8 @@
 #include <stdint.h>
 #include <string.h>
 
+#include "stages.h"
+
 #define PADDR(a) (a&0x7fffffff)
 
 #define DMA_REG_INTMIS 0x37220028
@@ -26,25 +28,6 @@
 
 #define HW_SPINLOCK 0x38081804
 
-struct tileinfo {
-	uint32_t x, y;
-	uint32_t width, height;
-	uint32_t stride[2];
-};
-
-struct tilesbuffer {
-	uint32_t ntiles;
-	uint32_t tilesize;
-	uint32_t pixel_size;
-	struct tileinfo info[];
-};
-
-struct dsp_struct_data {
-	uint32_t channels[8];
-	uint32_t avering_counter;
-	uint32_t flag_avered;
-};
-
 /*
 * Function: int readFromExtMem(int addr)
 * Description: loads value from external memory.
@@ -249,74 +232,77 @@ void detector(uint32_t *src, size_t pixels, struct dsp_struct_data* data,
 	);
 }
 
+/* dsp_memcpy() copies groups of 4 pixels, tiles with halo may have a tail */
+static void copy_tile(uint32_t *src, uint32_t *dst, size_t pixels)
+{
+	size_t head = pixels & ~(size_t)3;
+
+	if (head)
+		dsp_memcpy(src, dst, head);
+	for (size_t i = head; i < pixels; ++i)
+		dst[i] = src[i];
+}
+
+/* Channels are started by events and end by DMA interrupt */
+struct tile_dma {
+	volatile uint32_t *busy_reg;
+};
+
+static int tile_dma_start(struct tile_dma *dma, uint32_t channel)
+{
+	start_dma_channel(channel);
+	return 0;
+}
+
 /*
  * FIXME: If used functon for waiting dma_channels with loop
  * while ((* (uint32_t *) 0x3A43FFF0) & (1 << channel)) - no loop hanging
  * occured.But if use while (get_dma_channel_busy_reg() & (1 << channel)) -
  * loop hanging occures
  */
-int start(uint32_t thread_num, uint32_t unused0, uint32_t unused1,
-	  uint32_t *src_img, uint32_t *tile_buf1,
-	  struct dsp_struct_data *dsp_struct_data, uint32_t *tile_buf2,
-	  uint32_t *unused2, uint32_t *unused3, struct tilesbuffer *tileinfo,
-	  uint32_t *background_tile1, uint32_t *background_tile2)
+static uint32_t tile_dma_busy(struct tile_dma *dma)
 {
-	uint32_t dma_channels[4] = {
-		dsp_struct_data->channels[0],
-		dsp_struct_data->channels[1],
-		dsp_struct_data->channels[2],
-		dsp_struct_data->channels[3]
-	};
-
-	uint32_t dma_channels_mask[4];
+	return *dma->busy_reg;
+}
 
-	for (int i = 0; i < 4; ++i)
-		dma_channels_mask[i] = 1 << dma_channels[i];
+/* Stages and the tile pipeline in C are built into the emulator as well */
+#include "stages.c"
 
-	uint32_t *tile_buffers[] = {tile_buf1, tile_buf2};
-	uint32_t *background_buffers[] = {background_tile1, background_tile2};
+/*
+ * Capture buffer and DMA chains are job inputs only for SDMA, firmware starts
+ * channels set up by the host and does not access them. Optional arguments
+ * follow in order: mask tiles with mask_with_frame, then frame and background
+ * tiles of the output slot with output_slot.
+ */
+int start(uint32_t thread_num, uint32_t *unused0, uint32_t *tile_buf1,
+	  struct dsp_struct_data *dsp_struct_data, uint32_t *tile_buf2,
+	  uint32_t *unused1, uint32_t *unused2, uint32_t *background_tile1,
+	  uint32_t *background_tile2, uint32_t *opt0, uint32_t *opt1, uint32_t *opt2,
+	  uint32_t *opt3)
+{
+	uint32_t *opts[] = { opt0, opt1, opt2, opt3 };
+	int nopts = 0;
+	struct tile_slot slots[] = {
+		{ tile_buf1, background_tile1, 0 },
+		{ tile_buf2, background_tile2, 0 }
+	};
+	struct tile_slot out = { 0, 0, 0 };
+	struct tile_dma dma = { (volatile uint32_t *) DMA_READY_REG };
+	struct tilesbuffer *tileinfo = (struct tilesbuffer *)
+		((uint8_t *)dsp_struct_data + dsp_struct_data->tiles_offset);
+
+	if (dsp_struct_data->mask_output && dsp_struct_data->mask_with_frame) {
+		slots[0].mask = (uint8_t *)opts[nopts++];
+		slots[1].mask = (uint8_t *)opts[nopts++];
+	}
+	if (dsp_struct_data->output_slot) {
+		out.tile = opts[nopts++];
+		out.background = opts[nopts++];
+	}
 
 	set_dma_channel_busy_reg(0);
 
-	uint32_t tile_odd = 0;
-	uint32_t stride = tileinfo->info[0].stride[0];
-
-	uint32_t *dma_channel_busy_reg = (uint32_t *) DMA_READY_REG;
-
-	/*
-	 * FIXME: Can't to run overlap input and output channels
-	 * FIXME: Doesn't work with clang keys -O1, -O2, -O3
-	 */
-	for (size_t i = 0, tile_odd = 0; i < tileinfo->ntiles; ++i, tile_odd ^= 1) {
-		start_dma_channel(dma_channels[0]);
-		start_dma_channel(dma_channels[2]);
-
-		size_t size = tileinfo->info[i].height *
-			      tileinfo->info[i].width *
-			      tileinfo->info[i].stride[0];
-		size /= stride;
-		while (*dma_channel_busy_reg &
-			(dma_channels_mask[0] | dma_channels_mask[2]));
-
-		if(!dsp_struct_data->flag_avered && dsp_struct_data->avering_counter >= 30)
-			dsp_memcpy(tile_buffers[tile_odd],
-				   background_buffers[tile_odd], size);
-		else
-			detector(tile_buffers[tile_odd], size, dsp_struct_data,
-				 background_buffers[tile_odd]);
-
-		/*
-		 * FIXME: Can't to run in parallel 2 output DMA-channels
-		 */
-		start_dma_channel(dma_channels[1]);
-		while (*dma_channel_busy_reg & dma_channels_mask[1]);
-		start_dma_channel(dma_channels[3]);
-		while (*dma_channel_busy_reg & dma_channels_mask[3]);
-	}
-
-	if (dsp_struct_data->avering_counter >= 30)
-		dsp_struct_data->flag_avered = 1;
-	else
-		dsp_struct_data->avering_counter += 1;
-	return 0;
+	/* FIXME: Doesn't work with clang keys -O1, -O2, -O3 */
+	return process_tiles(dsp_struct_data, tileinfo, slots,
+			     dsp_struct_data->output_slot ? &out : 0, &dma);
 }
@@ -24,18 +24,20 @@ static void page_flip_handler(int fd, unsigned int frame, unsigned int sec,
 {
 	struct drmdisplay *pipe = data;
 
-	/* wait buffer ready event */
+	/* wait buffer ready event, framebuffers are not changed until the flip is queued */
 	pthread_mutex_lock(&lock);
 	pthread_cond_wait(&cv, &lock);
-	pthread_mutex_unlock(&lock);
 
-	if (pipe->current_fb_id == pipe->fb_id[0])
-		pipe->current_fb_id = pipe->fb_id[1];
-	else
-		pipe->current_fb_id = pipe->fb_id[0];
+	for (int i = 0; i < pipe->fb_count; i++) {
+		if (pipe->current_fb_id == pipe->fb_id[i]) {
+			pipe->current_fb_id = pipe->fb_id[(i + 1) % pipe->fb_count];
+			break;
+		}
+	}
 
 	drmModePageFlip(fd, pipe->crtc_id, pipe->current_fb_id,
 			DRM_MODE_PAGE_FLIP_EVENT, pipe);
+	pthread_mutex_unlock(&lock);
 }
 
 static void *pthread_worker(void *private_data)
@@ -70,34 +72,44 @@ static void *pthread_worker(void *private_data)
 	pthread_exit(NULL);
 }
 
-void drmdisplay_start_flipflop(struct drmdisplay *data, int width, int height, int bpp, int fd)
+void drmdisplay_start_flipflop(struct drmdisplay *data, int width, int height,
+			       uint32_t pitch, const int fds[], int count)
 {
 	uint32_t handle;
-	uint32_t another_fb;
+	int ret;
 
-	int ret = drmPrimeFDToHandle(data->fd, fd, &handle);
-	if (ret < 0)
-		error(EXIT_FAILURE, errno, "Can not import dmabuf");
+	if (count + 1 > DRMDISPLAY_MAX_FBS)
+		error(EXIT_FAILURE, 0, "Too many framebuffers: %d (max %d)", count + 1,
+		      DRMDISPLAY_MAX_FBS);
 
-	data->fb_size = height * width * bpp;
-	uint32_t pitch = width * bpp;
-	ret = drmModeAddFB(data->fd, width, height, 24, 32, pitch, handle, &another_fb);
-	if (ret)
-		error(EXIT_FAILURE, errno, "Can not create framebuffer via drmModeAddFB()");
+	data->fb_id[0] = data->fb;
+	data->fb_count = 1;
+
+	data->fb_size = height * pitch;
+	for (int i = 0; i < count; i++) {
+		ret = drmPrimeFDToHandle(data->fd, fds[i], &handle);
+		if (ret < 0)
+			error(EXIT_FAILURE, errno, "Can not import dmabuf");
+
+		ret = drmModeAddFB(data->fd, width, height, 24, 32, pitch, handle,
+				   &data->fb_id[data->fb_count]);
+		if (ret)
+			error(EXIT_FAILURE, errno, "Can not create framebuffer via drmModeAddFB()");
+		data->fb_count++;
+	}
 
-	ret = drmModePageFlip(data->fd, data->crtc_id, another_fb, DRM_MODE_PAGE_FLIP_EVENT, data);
+	/* The first frame from the caller goes to fb_id[0], so start from the last one */
+	data->current_fb_id = data->fb_id[data->fb_count - 1];
+	ret = drmModePageFlip(data->fd, data->crtc_id, data->current_fb_id,
+			      DRM_MODE_PAGE_FLIP_EVENT, data);
 	if (ret)
 		error(EXIT_FAILURE, errno, "Can not page flip = %d", errno);
 
-	data->fb_id[0] = data->fb;
-	data->fb_id[1] = another_fb;
-	data->current_fb_id = another_fb;
-
 	if (pthread_create(&thread, NULL, pthread_worker, data))
 		error(EXIT_FAILURE, errno, "PThread creation failed");
 }
 
-static void create_fb(struct drmdisplay *data, int width, int height, int bpp, int fd)
+static void create_fb(struct drmdisplay *data, int width, int height, uint32_t pitch, int fd)
 {
 	int ret;
 	uint32_t handle;
@@ -106,8 +118,8 @@ static void create_fb(struct drmdisplay *data, int width, int height, int bpp, i
 	if (ret < 0)
 		error(EXIT_FAILURE, errno, "Can not import dmabuf");
 
-	data->fb_size = height * width * bpp;
-	uint32_t pitch = width * bpp;
+	data->fb_size = height * pitch;
+	data->pitch = pitch;
 	ret = drmModeAddFB(data->fd, width, height, 24, 32, pitch, handle, &data->fb);
 	if (ret)
 		error(EXIT_FAILURE, errno, "Can not create framebuffer via drmModeAddFB()");
@@ -326,26 +338,88 @@ int drmdisplay_fill_mode(struct drmdisplay *data, int *width, int *height)
 	return -1;
 }
 
-void drmdisplay_set_mode(struct drmdisplay *data, int width, int height, int bpp, int fd)
+uint32_t drmdisplay_pitch(int width, int bpp)
 {
-	drmModeModeInfo mode = {0};
+	return (width * bpp + DRMDISPLAY_PITCH_ALIGN - 1) / DRMDISPLAY_PITCH_ALIGN *
+	       DRMDISPLAY_PITCH_ALIGN;
+}
 
+static int find_mode(struct drmdisplay *data, int width, int height, drmModeModeInfo *mode)
+{
 	for (int i = 0; i < data->count_modes; i++) {
 		if ((data->modes[i].hdisplay == width) && (data->modes[i].vdisplay == height)) {
-			mode = data->modes[i];
-			break;
+			*mode = data->modes[i];
+			return 0;
 		}
 	}
-	if (mode.hdisplay == 0)
+
+	return -1;
+}
+
+bool drmdisplay_has_mode(struct drmdisplay *data, int width, int height)
+{
+	drmModeModeInfo mode;
+
+	return !find_mode(data, width, height, &mode);
+}
+
+void drmdisplay_set_mode(struct drmdisplay *data, int width, int height, uint32_t pitch, int fd)
+{
+	drmModeModeInfo mode = {0};
+
+	if (find_mode(data, width, height, &mode))
 		error(EXIT_FAILURE, 0, "Resolution %dx%d is not supported by display", width, height);
 
-	create_fb(data, width, height, bpp, fd);
+	create_fb(data, width, height, pitch, fd);
 
 	printf("Setting resolution %s %d Hz\n", mode.name, mode.vrefresh);
 	if (drmModeSetCrtc(data->fd, data->crtc_id, data->fb, 0, 0, &data->conn_id, 1, &mode))
 		error(EXIT_FAILURE, errno, "Can not change mode for DRM crtc %d", data->crtc_id);
 }
 
+int drmdisplay_reconfigure(struct drmdisplay *data, int width, int height, uint32_t pitch,
+			   const int fds[], int count)
+{
+	unsigned int old_fb_id[DRMDISPLAY_MAX_FBS];
+	int old_count = data->fb_count;
+	drmModeModeInfo mode;
+	uint32_t handle;
+
+	if (count < 1 || count > DRMDISPLAY_MAX_FBS ||
+	    find_mode(data, width, height, &mode)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memcpy(old_fb_id, data->fb_id, sizeof(old_fb_id));
+
+	pthread_mutex_lock(&lock);
+	for (int i = 0; i < count; i++) {
+		if (drmPrimeFDToHandle(data->fd, fds[i], &handle) < 0)
+			error(EXIT_FAILURE, errno, "Can not import dmabuf");
+		if (drmModeAddFB(data->fd, width, height, 24, 32, pitch, handle, &data->fb_id[i]))
+			error(EXIT_FAILURE, errno, "Can not create framebuffer via drmModeAddFB()");
+	}
+	data->fb = data->fb_id[0];
+	data->fb_count = count;
+	data->fb_size = height * pitch;
+	data->pitch = pitch;
+
+	/* As after drmdisplay_start_flipflop(), the first frame goes to fb_id[0] */
+	data->current_fb_id = data->fb_id[count - 1];
+	printf("Setting resolution %s %d Hz\n", mode.name, mode.vrefresh);
+	if (drmModeSetCrtc(data->fd, data->crtc_id, data->current_fb_id, 0, 0, &data->conn_id, 1,
+			   &mode))
+		error(EXIT_FAILURE, errno, "Can not change mode for DRM crtc %d", data->crtc_id);
+	pthread_mutex_unlock(&lock);
+
+	for (int i = 0; i < old_count; i++)
+		if (drmModeRmFB(data->fd, old_fb_id[i]))
+			error(0, errno, "Can not remove framebuffer%d", i + 1);
+
+	return 0;
+}
+
 int drmdisplay_restore_mode(struct drmdisplay *data)
 {
 	int err = 0;
@@ -365,9 +439,9 @@ int drmdisplay_restore_mode(struct drmdisplay *data)
 		}
 	}
 
-	if (data->fb_id[1]) {
-		if (drmModeRmFB(data->fd, data->fb_id[1])) {
-			error(0, errno, "Can not remove framebuffer2");
+	for (int i = 1; i < data->fb_count; i++) {
+		if (drmModeRmFB(data->fd, data->fb_id[i])) {
+			error(0, errno, "Can not remove framebuffer%d", i + 1);
 			err = -1;
 		}
 	}
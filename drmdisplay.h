@@ -15,6 +15,11 @@ extern pthread_t thread;
 extern pthread_cond_t cv;
 extern pthread_mutex_t lock;
 
+#define DRMDISPLAY_MAX_FBS 4
+
+/// Alignment of framebuffer lines in bytes
+#define DRMDISPLAY_PITCH_ALIGN 64
+
 struct drmdisplay {
 	int fd;
 	uint32_t conn_id;
@@ -25,7 +30,8 @@ struct drmdisplay {
 	int count_modes;
 	uint32_t old_fb;
 	drmModeModeInfo old_mode;
-	unsigned int fb_id[2], current_fb_id;
+	unsigned int fb_id[DRMDISPLAY_MAX_FBS], current_fb_id;
+	int fb_count;
 	uint32_t pitch;
 };
 
@@ -41,18 +47,36 @@ int drmdisplay_init(struct drmdisplay *data, int connector_id, bool verbose);
  */
 int drmdisplay_fill_mode(struct drmdisplay *data, int *width, int *height);
 
+/* Return bytes per line of framebuffer with @width pixels of @bpp bytes */
+uint32_t drmdisplay_pitch(int width, int bpp);
+
 /* Create new framebuffer with specified sizes and change resolution to
  * use this framebuffer.
  * Return 0 on success or -1 on error.
  */
-void drmdisplay_set_mode(struct drmdisplay *data, int width, int height, int bpp, int fd);
+void drmdisplay_set_mode(struct drmdisplay *data, int width, int height, uint32_t pitch,
+			 int fd);
+
+/* Return true if display supports resolution @width x @height */
+bool drmdisplay_has_mode(struct drmdisplay *data, int width, int height);
+
+/* Switch display to @width x @height without reopening DRM and stopping the flip
+ * thread. Framebuffers are created for all @count dmabufs of @fds, and flipping
+ * continues over them from fds[0], as after drmdisplay_start_flipflop().
+ * Old framebuffers are removed. Return 0 or -1 if the resolution is not supported.
+ */
+int drmdisplay_reconfigure(struct drmdisplay *data, int width, int height, uint32_t pitch,
+			   const int fds[], int count);
 
 /* Restore old mode and free all resources.
  * Return 0 on success or -1 on error.
  */
 int drmdisplay_restore_mode(struct drmdisplay *data);
 
-/* Start flipflop */
-void drmdisplay_start_flipflop(struct drmdisplay *data, int width, int height, int bpp, int fd);
+/* Create framebuffers for @count dmabufs in addition to the one passed to
+ * drmdisplay_set_mode() and start flipping between all of them in round-robin order.
+ */
+void drmdisplay_start_flipflop(struct drmdisplay *data, int width, int height,
+			       uint32_t pitch, const int fds[], int count);
 
 #endif
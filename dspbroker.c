@@ -0,0 +1,84 @@
+/*
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ */
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "dspbroker.h"
+
+int dsp_broker_connect(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int sock;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return -1;
+
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+		int err = errno;
+
+		close(sock);
+		errno = err;
+		return -1;
+	}
+
+	return sock;
+}
+
+int dsp_broker_submit(int sock, const struct dsp_broker_request *req,
+		      const int *input, const int *output)
+{
+	union {
+		char buf[CMSG_SPACE(sizeof(int) *
+				    (DSP_BROKER_MAX_INPUTS + DSP_BROKER_MAX_OUTPUTS))];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = {
+		.iov_base = (void *)req,
+		.iov_len = sizeof(*req)
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf
+	};
+	int nfds = req->inum + req->onum;
+
+	if (req->inum > DSP_BROKER_MAX_INPUTS || req->onum > DSP_BROKER_MAX_OUTPUTS ||
+	    !nfds) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+	memcpy(CMSG_DATA(cmsg), input, sizeof(int) * req->inum);
+	memcpy(CMSG_DATA(cmsg) + sizeof(int) * req->inum, output, sizeof(int) * req->onum);
+
+	return sendmsg(sock, &msg, MSG_NOSIGNAL) == sizeof(*req) ? 0 : -1;
+}
+
+int dsp_broker_wait(int sock, struct dsp_broker_reply *reply)
+{
+	ssize_t ret = recv(sock, reply, sizeof(*reply), 0);
+
+	if (ret == sizeof(*reply))
+		return 0;
+	if (ret >= 0)
+		errno = ECONNRESET;
+
+	return -1;
+}
@@ -0,0 +1,93 @@
+/*
+ * \file
+ * \brief Protocol and client of delcore30m-broker
+ *
+ * Broker owns DSP cores with preloaded bundle firmware and SDMA channels of
+ * every core, and runs jobs of its clients one by one on every core. Client
+ * sends struct dsp_broker_request over SOCK_SEQPACKET Unix socket with input
+ * and output buffer fds attached as SCM_RIGHTS, broker replies with struct
+ * dsp_broker_reply when the job is finished. Kernel number buffer is added by
+ * the broker before inputs.
+ *
+ * SDMA chains are bound to the job, so the broker sets them up on its own
+ * channels from struct dsp_broker_chain of the request and writes numbers of
+ * the channels to the job input, where the kernel reads them.
+ *
+ * \copyright
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ */
+#ifndef _DSPBROKER_H_
+#define _DSPBROKER_H_
+
+#include <stdint.h>
+
+#define DEFAULT_BROKER_SOCKET "/run/delcore30m-broker.sock"
+
+/// Any core can run the job. Buffers of such job must be in system memory
+#define DSP_BROKER_ANY_CORE -1
+
+/// Broker passes kernel number as the first input, so one input less is left
+#define DSP_BROKER_MAX_INPUTS 15
+#define DSP_BROKER_MAX_OUTPUTS 16
+
+/// SDMA channels the broker owns on each core, if the hardware has enough of them
+#define DSP_BROKER_MAX_CHAINS 5
+
+/* SDMA chain of the job, buffers are indices of request fds, inputs first */
+struct dsp_broker_chain {
+	/// enum sdma_channel_type
+	uint32_t type;
+	uint32_t external;
+	uint32_t internal[2];
+	uint32_t chain;
+	uint32_t codebuf;
+};
+
+struct dsp_broker_request {
+	/// Value returned in reply to match it with the request
+	uint32_t tag;
+	/// Kernel of bundle firmware, enum dsp_kernel
+	uint32_t kernel;
+	/// Core number or DSP_BROKER_ANY_CORE
+	int32_t core;
+	/// Requests with higher priority are run first, equal ones in FIFO order
+	int32_t priority;
+	/// Job is cancelled if it runs longer, 0 - no limit
+	uint32_t timeout_ms;
+	uint32_t inum;
+	uint32_t onum;
+	/// Chains need XYRAM of the core, so @core must be set
+	uint32_t nchains;
+	struct dsp_broker_chain chains[DSP_BROKER_MAX_CHAINS];
+	/// Channel of chain i is written as uint32_t to input @channels at @channels_offset + 4 * i
+	uint32_t channels;
+	uint32_t channels_offset;
+};
+
+struct dsp_broker_reply {
+	uint32_t tag;
+	/// enum delcore30m_job_rc if job was run, negative errno otherwise
+	int32_t rc;
+	int32_t core;
+	/// Time spent in the queue and on the core
+	uint32_t wait_us;
+	uint32_t run_us;
+};
+
+/* Connect to broker socket @path. Return socket fd or -1 and set errno. */
+int dsp_broker_connect(const char *path);
+
+/*
+ * Send request @req with @req->inum buffer fds of @input and @req->onum of
+ * @output. Fds may be closed after return. Return -1 and set errno on failure.
+ */
+int dsp_broker_submit(int sock, const struct dsp_broker_request *req,
+		      const int *input, const int *output);
+
+/*
+ * Block until reply to one of submitted requests is received. Replies come
+ * in order of job completion. Return -1 and set errno on failure.
+ */
+int dsp_broker_wait(int sock, struct dsp_broker_reply *reply);
+
+#endif
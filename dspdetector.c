@@ -17,47 +17,122 @@
 #include <sys/mman.h>
 #include <unistd.h>
 
+#include "bundle.h"
 #include "dspdetector.h"
+#include "dspxyram.h"
 
 const int sdma_burst_size = 8;
 
 #define MAKE_STR_(s) #s
 #define MAKE_STR(s) MAKE_STR_(s)
 
+/// Names of stages and their default parameters
+static const struct {
+	const char *name;
+	uint32_t param;
+} stage_names[TILE_STAGE_COUNT] = {
+	[TILE_STAGE_DETECT] = { "detect", 0 },
+	[TILE_STAGE_MOTION] = { "motion", 0x3f },
+	[TILE_STAGE_GRAYSCALE] = { "grayscale", 0 },
+	[TILE_STAGE_THRESHOLD] = { "threshold", 0x80 },
+	[TILE_STAGE_OVERLAY] = { "overlay", 0 },
+	[TILE_STAGE_ERODE] = { "erode", 1 },
+	[TILE_STAGE_DILATE] = { "dilate", 1 },
+	[TILE_STAGE_OPEN] = { "open", 1 },
+	[TILE_STAGE_CLOSE] = { "close", 1 },
+	[TILE_STAGE_BLOBS] = { "blobs", 16 },
+};
+
 static unsigned int tiles_get_number (const struct frame_args frame_data)
 {
 	return DIV_ROUND_UP(frame_data.frame_width, frame_data.tile_width) * DIV_ROUND_UP(frame_data.frame_height, frame_data.tile_height);
 }
 
+/* Generate tiles of the frame grid which intersect region of interest */
 static struct tilesbuffer *tile_generator(const struct frame_args frame_data)
 {
 	int ntiles = tiles_get_number(frame_data);
 	struct tilesbuffer *tb = malloc(sizeof(struct tileinfo) * ntiles + sizeof(struct tilesbuffer));
+	uint32_t index = 0;
 	int i = 0;
 
 	if (!tb)
 		return NULL;
 
-	tb->ntiles = ntiles;
 	for (uint32_t y = 0; y < frame_data.frame_height; y+=frame_data.tile_height)
-		for (uint32_t x = 0; x < frame_data.frame_width; x+=frame_data.tile_width)
+		for (uint32_t x = 0; x < frame_data.frame_width; x+=frame_data.tile_width, index++) {
+			uint32_t width = min(frame_data.tile_width, frame_data.frame_width - x);
+			uint32_t height = min(frame_data.tile_height, frame_data.frame_height - y);
+
+			/* Skipped tiles are neither read nor written by SDMA */
+			if (!dsp_roi_selects(&frame_data.roi, index, x, y, width, height))
+				continue;
+
 			tb->info[i++] = (struct tileinfo){
 				.x = x,
 				.y = y,
-				.width = min(frame_data.tile_width, frame_data.frame_width - x),
-				.height = min(frame_data.tile_height, frame_data.frame_height - y),
+				.width = width,
+				.height = height,
 				.stride = { frame_data.pixel_format, frame_data.pixel_format * frame_data.frame_width }
 			};
+		}
+	tb->ntiles = i;
 
 	return tb;
 }
 
-static struct sdma_descriptor tile2descriptor(const struct frame_args frame_data,
-					      struct tileinfo tile)
+static uint32_t frame_pitch(const struct frame_args frame_data, uint32_t pitch)
+{
+	return pitch ? pitch : frame_data.frame_width * frame_data.pixel_format;
+}
+
+/* Extend @tile by @halo rows and columns, but not beyond the frame */
+static struct tileinfo tile_halo(struct tileinfo tile, const struct frame_args frame_data,
+				 uint32_t halo)
+{
+	uint32_t left = min(halo, tile.x);
+	uint32_t top = min(halo, tile.y);
+
+	tile.width += left + min(halo, (uint32_t)frame_data.frame_width - tile.x - tile.width);
+	tile.height += top + min(halo, (uint32_t)frame_data.frame_height - tile.y - tile.height);
+	tile.x -= left;
+	tile.y -= top;
+
+	return tile;
+}
+
+/* Return blob stage of @frame_data or NULL */
+static const struct tile_stage *blob_stage(const struct frame_args *frame_data)
+{
+	for (int i = 0; i < frame_data->nstages && i < MAX_TILE_STAGES; ++i)
+		if (frame_data->stages[i].op == TILE_STAGE_BLOBS)
+			return &frame_data->stages[i];
+
+	return NULL;
+}
+
+/* Size of detector data of a core with @ntiles tiles */
+static size_t data_size(const struct frame_args frame_data, uint32_t ntiles)
+{
+	return sizeof(struct dsp_struct_data) + sizeof(struct tile_state) * ntiles +
+	       dsp_stages_data_size(&frame_data);
+}
+
+/* Size of XYRAM tile buffer, which holds a tile with halo */
+static size_t tile_buffer_size(const struct frame_args frame_data)
+{
+	uint32_t halo = dsp_stages_halo(&frame_data);
+
+	return (frame_data.tile_height + 2 * halo) * (frame_data.tile_width + 2 * halo) *
+	       frame_data.pixel_format;
+}
+
+static struct sdma_descriptor tile2descriptor(struct tileinfo tile, uint32_t pitch,
+					      uint32_t offset)
 {
 	struct sdma_descriptor const desc = {
-			.a0e = tile.x * tile.stride[0] + tile.y * tile.stride[1],
-			.astride = frame_data.frame_width * tile.stride[0],
+			.a0e = offset + tile.x * tile.stride[0] + tile.y * pitch,
+			.astride = pitch,
 			.bcnt = tile.height,
 			.asize = tile.width * tile.stride[0],
 			.ccr = BURST_SIZE_8BYTE << SCR_BURST_SIZE_BIT |
@@ -69,143 +144,557 @@ static struct sdma_descriptor tile2descriptor(const struct frame_args frame_data
 	return desc;
 }
 
-static struct delcore30m_buffer *buf_alloc(int fd, enum delcore30m_memory_type type,
-					   int core_num, int size, void *ptr)
+/* Largest SDMA burst which divides @bytes */
+static uint32_t burst_size(uint32_t bytes)
 {
-	struct delcore30m_buffer *buffer = (struct delcore30m_buffer *) malloc(sizeof(struct delcore30m_buffer));
-	buffer->size = size;
-	buffer->type = type;
-	buffer->core_num = core_num;
+	uint32_t burst = BURST_SIZE_8BYTE;
 
-	if (ioctl(fd, ELCIOC_BUF_ALLOC, buffer))
-		error(EXIT_FAILURE, errno, "Failed to allocate buffer");
+	while (burst > BURST_SIZE_1BYTE && bytes % (1u << burst))
+		burst--;
 
-	if (ptr != NULL) {
-		void *mmap_buf = mmap(NULL, buffer->size,
-				      PROT_READ | PROT_WRITE, MAP_SHARED,
-				      buffer->fd, 0);
-		if (mmap_buf == MAP_FAILED)
-			error(EXIT_FAILURE, errno, "Failed to mmap buffer");
-		memcpy(mmap_buf, ptr, size);
-		munmap(mmap_buf, buffer->size);
-	}
-	return buffer;
+	return burst;
 }
 
-void *getbytes(const char *filename, uint32_t *size)
+/*
+ * Descriptor of mask of @tile in mask lines of @pitch bytes. Lines of a tile
+ * may be not aligned to 8 bytes, so burst is chosen by the tile.
+ */
+static struct sdma_descriptor mask2descriptor(struct tileinfo tile, uint32_t pitch)
 {
-	void *data;
-
-	FILE *f = fopen(filename, "r");
-	if (f == NULL)
-		error(EXIT_FAILURE, errno, "Failed to open firmware");
-	fseek(f, 0, SEEK_END);
-	*size = ftell(f);
-	fseek(f, 0, SEEK_SET);
+	uint32_t a0e = tile.y * pitch + tile.x / 8;
+	uint32_t asize = DIV_ROUND_UP(tile.width, 8);
+	uint32_t burst = burst_size(a0e | asize);
+	struct sdma_descriptor const desc = {
+			.a0e = a0e,
+			.astride = pitch,
+			.bcnt = tile.height,
+			.asize = asize,
+			.ccr = burst << SCR_BURST_SIZE_BIT |
+			       burst << DST_BURST_SIZE_BIT |
+			       AUTO_INCREMENT << SRC_AUTO_INCREMENT_BIT |
+			       AUTO_INCREMENT << DST_AUTO_INCREMENT_BIT
+	};
 
-	data = malloc(*size);
-	fread(data, 1, *size, f);
+	return desc;
+}
 
-	fclose(f);
+/* Fill chain of descriptors for @ntiles tiles of frame with @pitch and @offset */
+static void tile_chain(struct sdma_descriptor *descs, const struct tileinfo *info,
+		       uint32_t ntiles, uint32_t pitch, uint32_t offset)
+{
+	for (uint32_t i = 0; i < ntiles; ++i) {
+		descs[i] = tile2descriptor(info[i], pitch, offset);
+		descs[i].a_init = (i + 1) * sizeof(struct sdma_descriptor);
+	}
+	descs[ntiles - 1].a_init = 0;
+}
 
-	return data;
+/* Fill chain of descriptors for masks of @ntiles tiles with lines of @pitch bytes */
+static void mask_chain(struct sdma_descriptor *descs, const struct tileinfo *info,
+		       uint32_t ntiles, uint32_t pitch)
+{
+	for (uint32_t i = 0; i < ntiles; ++i) {
+		descs[i] = mask2descriptor(info[i], pitch);
+		descs[i].a_init = (i + 1) * sizeof(struct sdma_descriptor);
+	}
+	descs[ntiles - 1].a_init = 0;
 }
 
-static void load_firmware(struct dsp_struct *data)
+static void load_firmware(struct dsp_struct *data, struct dsp_core *core)
 {
-	uint32_t size;
-	void *fw_data = getbytes(MAKE_STR(FIRMWARE_PATH) "detector.fw.bin", &size);
-	void *buf_cores = mmap(NULL, size, PROT_WRITE, MAP_SHARED, data->core.fd,
-			       sysconf(_SC_PAGESIZE) * (__builtin_ffs(data->core.mask) - 1));
-	if (buf_cores == MAP_FAILED)
+	if (dsp_firmware_load(&data->firmware, core->core.fd, core->id,
+			      &core->firmware_checksum))
 		error(EXIT_FAILURE, errno, "Failed to load firmware");
-	memcpy(buf_cores, fw_data, size);
-	munmap(buf_cores, size);
 }
 
-static void check_frame_args(const struct frame_args data)
+static int check_frame_args(const struct frame_args data)
 {
+	const char *reason = NULL;
+
 	if (data.frame_width <= 0 || data.frame_height <= 0 ||
 	    data.tile_width <= 0 || data.tile_height <= 0 ||
 	    data.tile_width >= data.frame_width ||
 	    data.tile_height >= data.frame_height)
-		error(EXIT_FAILURE, 0, "Incorrect frame/tile sizes");
-	if ((data.tile_width * data.pixel_format) % sdma_burst_size)
-		error(EXIT_FAILURE, 0, "Tile width in bytes must be multiple of 8");
+		reason = "Incorrect frame/tile sizes";
+	else if ((data.tile_width * data.pixel_format) % sdma_burst_size)
+		reason = "Tile width in bytes must be multiple of 8";
+	else if (frame_pitch(data, data.src_pitch) < data.frame_width * data.pixel_format ||
+		 frame_pitch(data, data.dst_pitch) < data.frame_width * data.pixel_format)
+		reason = "Line pitch is less than frame width";
+	else if ((data.src_pitch | data.src_offset | data.dst_pitch | data.dst_offset) %
+		 sdma_burst_size)
+		reason = "Line pitch and offset must be multiple of 8";
+	else if (data.background_shift < 0 || data.background_shift > MAX_BACKGROUND_SHIFT)
+		reason = "Background shift must be in range 0.." MAKE_STR(MAX_BACKGROUND_SHIFT);
+	else if (data.nstages < 0 || data.nstages > MAX_TILE_STAGES)
+		reason = "Number of stages must be in range 0.." MAKE_STR(MAX_TILE_STAGES);
+	else if (data.mask_output && (!data.nstages || data.tile_width % 8))
+		reason = "Mask output needs stages and tile width multiple of 8";
+	else if (data.mask_with_frame && !data.mask_output)
+		reason = "Mask with frame needs mask output";
+
+	for (int i = 0, blobs = 0; !reason && i < data.nstages; ++i)
+		if (data.stages[i].op >= TILE_STAGE_COUNT)
+			reason = "Unknown stage";
+		else if (data.stages[i].op == TILE_STAGE_BLOBS && blobs++)
+			reason = "Only one blobs stage is allowed";
+
+	if (!reason && dsp_stages_halo(&data) > MAX_TILE_HALO)
+		reason = "Stages need more than " MAKE_STR(MAX_TILE_HALO) " rows around tiles";
+
+	if (reason) {
+		error(0, 0, "%s", reason);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* XYRAM buffers of one core in order of priority for XYRAM of the core */
+enum core_xyram_buffer {
+	XYRAM_TILE0,
+	XYRAM_TILE1,
+	XYRAM_KERNEL,
+	XYRAM_DATA,
+	XYRAM_BACKGROUND0,
+	XYRAM_BACKGROUND1,
+	XYRAM_MASK0,
+	XYRAM_MASK1,
+	XYRAM_OUTPUT_TILE,
+	XYRAM_OUTPUT_BACKGROUND,
+	XYRAM_CORE_BUFFERS
+};
+
+static const char *const xyram_names[XYRAM_CORE_BUFFERS] = {
+	[XYRAM_TILE0] = "tile 0",
+	[XYRAM_TILE1] = "tile 1",
+	[XYRAM_KERNEL] = "kernel number",
+	[XYRAM_DATA] = "detector data and tile list",
+	[XYRAM_BACKGROUND0] = "background tile 0",
+	[XYRAM_BACKGROUND1] = "background tile 1",
+	[XYRAM_MASK0] = "mask tile 0",
+	[XYRAM_MASK1] = "mask tile 1",
+	[XYRAM_OUTPUT_TILE] = "output tile",
+	[XYRAM_OUTPUT_BACKGROUND] = "output background tile",
+};
+
+/* Size of XYRAM buffer of packed tile mask, which is used only with mask_with_frame */
+static size_t mask_tile_size(const struct frame_args frame_data)
+{
+	if (!frame_data.mask_with_frame)
+		return 0;
+
+	return DIV_ROUND_UP(frame_data.tile_width, 8) * frame_data.tile_height;
+}
+
+/* Size of XYRAM buffer of output slot, which holds a tile without halo */
+static size_t output_tile_size(const struct frame_args frame_data)
+{
+	return frame_data.tile_width * frame_data.tile_height * frame_data.pixel_format;
+}
+
+/*
+ * Plan XYRAM of all cores, where core @i processes @ntiles[i] tiles, with
+ * @output_slot or without it. Background tiles go to XYRAM of another core
+ * only if the core can not hold them with frame tiles.
+ * Return -1 if buffers do not fit XYRAM.
+ */
+static int plan_xyram(struct dsp_xyram_plan *plan, const struct dsp_struct *data,
+		      const struct frame_args frame_data, const uint32_t *ntiles,
+		      bool output_slot)
+{
+	size_t tile_size = tile_buffer_size(frame_data);
+	size_t output_size = output_slot ? output_tile_size(frame_data) : 0;
+
+	dsp_xyram_init(plan);
+	for (int c = 0; c < data->ncores; ++c) {
+		size_t sizes[XYRAM_CORE_BUFFERS] = {
+			[XYRAM_TILE0] = tile_size,
+			[XYRAM_TILE1] = tile_size,
+			[XYRAM_KERNEL] = sizeof(uint32_t),
+			[XYRAM_DATA] = DIV_ROUND_UP(data_size(frame_data, ntiles[c]),
+						    DSP_POOL_PART_ALIGN) * DSP_POOL_PART_ALIGN +
+				       sizeof(struct tilesbuffer) +
+				       sizeof(struct tileinfo) * ntiles[c],
+			[XYRAM_BACKGROUND0] = tile_size,
+			[XYRAM_BACKGROUND1] = tile_size,
+			[XYRAM_MASK0] = mask_tile_size(frame_data),
+			[XYRAM_MASK1] = mask_tile_size(frame_data),
+			[XYRAM_OUTPUT_TILE] = output_size,
+			[XYRAM_OUTPUT_BACKGROUND] = output_size,
+		};
+
+		for (int i = 0; i < XYRAM_CORE_BUFFERS; ++i)
+			dsp_xyram_add(plan, xyram_names[i], data->cores[c].id, sizes[i]);
+	}
+
+	/* Plan with output slots is only a try, the one without them reports failure */
+	return output_slot ? dsp_xyram_try_place(plan) : dsp_xyram_place(plan);
+}
+
+/*
+ * Allocate buffers of one core for its part of tiles @first..@first + @ntiles - 1.
+ * XYRAM buffers are placed by @plan, where buffers of the core start at @base.
+ * Return -1 if a buffer can not be allocated, buffers taken so far stay in the pool.
+ */
+static int allocate_core_buffers(struct dsp_struct *data, struct dsp_core *core,
+				  const struct frame_args frame_data,
+				  const struct tilesbuffer *frame_tb,
+				  uint32_t first, uint32_t ntiles,
+				  const struct dsp_xyram_plan *plan, int base)
+{
+	size_t tile_size = tile_buffer_size(frame_data);
+	uint32_t halo = dsp_stages_halo(&frame_data);
+	size_t tb_size = sizeof(struct tilesbuffer) + sizeof(struct tileinfo) * ntiles;
+
+	int ret = -1;
+
+	/* Tile count grows with frame size, so chains are built on heap one by one */
+	struct tilesbuffer *tb = malloc(tb_size);
+	struct sdma_descriptor *descs = malloc(sizeof(struct sdma_descriptor) * ntiles);
+	struct tileinfo *halo_info = malloc(sizeof(struct tileinfo) * ntiles);
+	size_t chain_size = sizeof(struct sdma_descriptor) * ntiles;
+
+	if (!tb || !descs || !halo_info) {
+		error(0, errno, "Failed to allocate tiles and DMA chains");
+		goto free_chains;
+	}
+	tb->ntiles = ntiles;
+	tb->tilesize = tile_size;
+	memcpy(tb->info, &frame_tb->info[first], sizeof(struct tileinfo) * ntiles);
+
+	for (uint32_t i = 0; i < ntiles; ++i)
+		halo_info[i] = tile_halo(tb->info[i], frame_data, halo);
+
+	core->background_core_id = dsp_xyram_core(plan, base + XYRAM_BACKGROUND0);
+	for (int i = 0; i < 2; ++i) {
+		core->tile_buffers[i] = dsp_pool_alloc(&data->pool, DELCORE30M_MEMORY_XYRAM,
+						       dsp_xyram_core(plan, base + XYRAM_TILE0 + i),
+						       tile_size, NULL);
+		core->background_tile_buffers[i] = dsp_pool_alloc(&data->pool,
+								  DELCORE30M_MEMORY_XYRAM,
+								  dsp_xyram_core(plan, base +
+										 XYRAM_BACKGROUND0 + i),
+								  tile_size, NULL);
+		if (!core->tile_buffers[i] || !core->background_tile_buffers[i])
+			goto free_buffer;
+	}
+
+	/*
+	 * Input chain reads capture buffer, output chain writes result frame or
+	 * mask. Tiles are read with halo, firmware cuts it off before output.
+	 * With mask_with_frame one more chain writes masks to their own buffers.
+	 */
+	tile_chain(descs, halo_info, ntiles, frame_pitch(frame_data, frame_data.src_pitch),
+		   frame_data.src_offset);
+	core->chain_buffers[0] = dsp_pool_alloc(&data->pool, DELCORE30M_MEMORY_SYSTEM, core->id,
+						chain_size, descs);
+	if (!core->chain_buffers[0])
+		goto free_buffer;
+	if (frame_data.mask_output && !frame_data.mask_with_frame)
+		mask_chain(descs, tb->info, ntiles, dsp_mask_pitch(&frame_data));
+	else
+		tile_chain(descs, tb->info, ntiles,
+			   frame_pitch(frame_data, frame_data.dst_pitch), frame_data.dst_offset);
+	core->chain_buffers[1] = dsp_pool_alloc(&data->pool, DELCORE30M_MEMORY_SYSTEM, core->id,
+						chain_size, descs);
+	if (!core->chain_buffers[1])
+		goto free_buffer;
+
+	/* Background frame is kept without padding */
+	tile_chain(descs, halo_info, ntiles, frame_pitch(frame_data, 0), 0);
+	core->background_chain_buffers[0] = dsp_pool_alloc(&data->pool,
+							   DELCORE30M_MEMORY_SYSTEM,
+							   core->background_core_id,
+							   chain_size, descs);
+	if (!core->background_chain_buffers[0])
+		goto free_buffer;
+	tile_chain(descs, tb->info, ntiles, frame_pitch(frame_data, 0), 0);
+	core->background_chain_buffers[1] = dsp_pool_alloc(&data->pool,
+							   DELCORE30M_MEMORY_SYSTEM,
+							   core->background_core_id,
+							   chain_size, descs);
+	if (!core->background_chain_buffers[1])
+		goto free_buffer;
+	core->code_buffer_size = 60 * ntiles;
+
+	core->mask_chain_buffer = NULL;
+	if (frame_data.mask_with_frame) {
+		mask_chain(descs, tb->info, ntiles, dsp_mask_pitch(&frame_data));
+		for (int i = 0; i < 2; ++i)
+			core->mask_tile_buffers[i] = dsp_pool_alloc(&data->pool,
+								    DELCORE30M_MEMORY_XYRAM,
+								    dsp_xyram_core(plan, base +
+										   XYRAM_MASK0 + i),
+								    mask_tile_size(frame_data),
+								    NULL);
+		core->mask_chain_buffer = dsp_pool_alloc(&data->pool, DELCORE30M_MEMORY_SYSTEM,
+							 core->id, chain_size, descs);
+		if (!core->mask_tile_buffers[0] || !core->mask_tile_buffers[1] ||
+		    !core->mask_chain_buffer)
+			goto free_buffer;
+	}
+
+	core->output_tile_buffer = NULL;
+	core->output_background_buffer = NULL;
+	if (data->output_slot) {
+		core->output_tile_buffer = dsp_pool_alloc(&data->pool, DELCORE30M_MEMORY_XYRAM,
+							  dsp_xyram_core(plan, base +
+									 XYRAM_OUTPUT_TILE),
+							  output_tile_size(frame_data), NULL);
+		core->output_background_buffer = dsp_pool_alloc(&data->pool,
+								DELCORE30M_MEMORY_XYRAM,
+								dsp_xyram_core(plan, base +
+									       XYRAM_OUTPUT_BACKGROUND),
+								output_tile_size(frame_data),
+								NULL);
+		if (!core->output_tile_buffer || !core->output_background_buffer)
+			goto free_buffer;
+	}
+
+	core->ntiles = ntiles;
+	core->tile_index = malloc(sizeof(uint32_t) * ntiles);
+	if (!core->tile_index) {
+		error(0, errno, "Failed to allocate tile indexes");
+		goto free_chains;
+	}
+	for (uint32_t i = 0; i < ntiles; ++i)
+		core->tile_index[i] = tb->info[i].y / frame_data.tile_height *
+				      DIV_ROUND_UP(frame_data.frame_width, frame_data.tile_width) +
+				      tb->info[i].x / frame_data.tile_width;
+
+	const uint32_t kernel = DSP_KERNEL_DETECTOR;
+	core->kernel_buffer = dsp_pool_alloc(&data->pool, DELCORE30M_MEMORY_XYRAM,
+					     dsp_xyram_core(plan, base + XYRAM_KERNEL),
+					     sizeof(kernel), &kernel);
+	if (!core->kernel_buffer)
+		goto free_buffer;
+
+	/* Firmware finds the tile list by offset, so it shares the data buffer */
+	const size_t sizes[] = { data_size(frame_data, ntiles), tb_size };
+	const void *const init[] = { NULL, tb };
+	size_t offsets[2];
+
+	core->dsp_global_data_buffer = dsp_pool_alloc_parts(&data->pool,
+							    DELCORE30M_MEMORY_XYRAM,
+							    dsp_xyram_core(plan, base + XYRAM_DATA),
+							    2, sizes, init, offsets);
+	if (!core->dsp_global_data_buffer)
+		goto free_buffer;
+	core->dsp_global_data = dsp_pool_map(core->dsp_global_data_buffer);
+	if (!core->dsp_global_data) {
+		error(0, errno, "Failed to mmap DSP data");
+		goto free_chains;
+	}
+
+	core->dsp_global_data->tiles_offset = offsets[1];
+	core->dsp_global_data->output_slot = data->output_slot;
+	core->dsp_global_data->background_shift = frame_data.background_shift;
+	core->dsp_global_data->flag_avered = 0;
+	core->dsp_global_data->skip_unchanged = frame_data.skip_unchanged;
+	core->dsp_global_data->frame = 0;
+	core->dsp_global_data->nstages = frame_data.nstages;
+	core->dsp_global_data->halo = halo;
+	core->dsp_global_data->frame_width = frame_data.frame_width;
+	core->dsp_global_data->frame_height = frame_data.frame_height;
+	core->dsp_global_data->mask_output = frame_data.mask_output;
+	core->dsp_global_data->mask_with_frame = frame_data.mask_with_frame;
+	core->dsp_global_data->tile_stats = frame_data.tile_stats;
+	/* Default of motion stage is the threshold of detector() */
+	core->dsp_global_data->stats_threshold = stage_names[TILE_STAGE_MOTION].param;
+	for (int i = 0; i < frame_data.nstages; ++i)
+		if (frame_data.stages[i].op == TILE_STAGE_MOTION)
+			core->dsp_global_data->stats_threshold = frame_data.stages[i].param;
+	memcpy(core->dsp_global_data->stages, frame_data.stages,
+	       sizeof(struct tile_stage) * frame_data.nstages);
+	memset(core->dsp_global_data->tiles, 0, sizeof(struct tile_state) * ntiles);
+	core->blobs = NULL;
+	if (blob_stage(&frame_data)) {
+		core->blobs = (struct blob_data *)&core->dsp_global_data->tiles[ntiles];
+		memset(core->blobs, 0, sizeof(struct blob_data));
+	}
+	/* Channels of the core fill the start of channels, the rest is unused */
+	for (uint32_t i = 0; i < ARRAY_SIZE(core->dsp_global_data->channels); ++i)
+		core->dsp_global_data->channels[i] = i < core->sdma.num &&
+						     i < ARRAY_SIZE(core->sdma_channels) ?
+						     core->sdma_channels[i] : 0;
+	ret = 0;
+
+free_chains:
+	free(tb);
+	free(descs);
+	free(halo_info);
+
+	return ret;
+
+free_buffer:
+	error(0, errno, "Failed to allocate buffers of core %d", core->id);
+	goto free_chains;
+}
+
+/*
+ * Request @num SDMA channels for @core instead of the ones it has. Channels
+ * may be requested again only when jobs of the core are closed.
+ */
+static int request_sdma(struct dsp_struct *data, struct dsp_core *core, int num)
+{
+	if (core->sdma.num == num)
+		return 0;
+	if (num > (int)ARRAY_SIZE(core->sdma_channels)) {
+		error(0, 0, "Core can not use %d SDMA channels", num);
+		return -1;
+	}
+	if (core->sdma.num)
+		close(core->sdma.fd);
+
+	core->sdma.type = DELCORE30M_SDMA;
+	core->sdma.num = num;
+
+	if (ioctl(data->fd, ELCIOC_RESOURCE_REQUEST, &core->sdma)) {
+		error(0, errno, "Failed to request DELCORE30M_SDMA");
+		/* Nothing is left to close */
+		core->sdma.num = 0;
+		return -1;
+	}
+
+	uint8_t sdma_msk = core->sdma.mask;
+	for (int i = 0; i < core->sdma.num; ++i) {
+		core->sdma_channels[i] = __builtin_ffs(sdma_msk) - 1;
+		sdma_msk &= ~(1 << core->sdma_channels[i]);
+	}
+
+	return 0;
 }
 
-static void allocate_buffers(struct dsp_struct *data, const struct frame_args frame_data)
+/* Return -1 if buffers for @frame_data can not be allocated */
+static int allocate_buffers(struct dsp_struct *data, const struct frame_args frame_data)
 {
-	uint8_t core_id = __builtin_ffsl(data->core.mask) - 1;
 	size_t img_size = frame_data.frame_height * frame_data.frame_width * frame_data.pixel_format;
-	size_t tile_size = frame_data.tile_height * frame_data.tile_width * frame_data.pixel_format;
+
+	if (frame_data.mask_with_frame && data->ncores > 1) {
+		error(0, 0, "Mask with frame needs one DSP core, two cores take all 8 SDMA channels");
+		return -1;
+	}
+	/* Jobs are closed here, so channels of the cores may be requested again */
+	for (int i = 0; i < data->ncores; ++i)
+		if (request_sdma(data, &data->cores[i], frame_data.mask_with_frame ? 5 : 4))
+			return -1;
 
 	struct tilesbuffer *tb = tile_generator(frame_data);
-	tb->tilesize = tile_size;
+	if (!tb) {
+		error(0, errno, "Failed to allocate tiles buffer");
+		return -1;
+	}
+	if (tb->ntiles < data->ncores) {
+		error(0, 0, "Frame or its region of interest has less tiles than DSP cores");
+		free(tb);
+		return -1;
+	}
+	if (tb->ntiles < tiles_get_number(frame_data))
+		printf("Region of interest: %u of %u tiles\n", tb->ntiles,
+		       tiles_get_number(frame_data));
 
-	struct sdma_descriptor descs[tb->ntiles];
+	/* Split tiles to contiguous equal parts, so each core processes its band of frame */
+	uint32_t first[MAX_DSP_CORES + 1];
+	uint32_t ntiles[MAX_DSP_CORES];
 
-	for (uint32_t i = 0; i < tb->ntiles; ++i) {
-		descs[i] = tile2descriptor(frame_data, tb->info[i]);
-		descs[i].a_init = (i + 1) * sizeof(struct sdma_descriptor);
+	for (int i = 0; i <= data->ncores; ++i)
+		first[i] = tb->ntiles * i / data->ncores;
+	for (int i = 0; i < data->ncores; ++i)
+		ntiles[i] = first[i + 1] - first[i];
+
+	struct dsp_xyram_plan plan;
+	int ret = 0;
+
+	/* Output slots take two more tiles of XYRAM, without them tiles share two slots */
+	data->output_slot = !frame_data.two_slots &&
+			    !plan_xyram(&plan, data, frame_data, ntiles, true);
+	if (!data->output_slot && plan_xyram(&plan, data, frame_data, ntiles, false)) {
+		error(0, 0, "Tiles %ux%u do not fit XYRAM", frame_data.tile_width,
+		      frame_data.tile_height);
+		ret = -1;
+	} else {
+		dsp_xyram_print(&plan);
 	}
-	descs[tb->ntiles - 1].a_init = 0;
 
-	data->background = buf_alloc(data->fd, DELCORE30M_MEMORY_SYSTEM, 0,
-				     img_size, NULL);
+	for (int i = 0; i < data->ncores && !ret; ++i)
+		ret = allocate_core_buffers(data, &data->cores[i], frame_data, tb, first[i],
+					    ntiles[i], &plan, i * XYRAM_CORE_BUFFERS);
+	free(tb);
+	if (ret)
+		return -1;
+
+	data->background = dsp_pool_alloc(&data->pool, DELCORE30M_MEMORY_SYSTEM, 0,
+					  img_size, NULL);
+	if (!data->background) {
+		error(0, errno, "Failed to allocate background");
+		return -1;
+	}
 
-	uint8_t *byte_array = (uint8_t *)mmap(NULL, data->background->size,
-					      PROT_READ | PROT_WRITE,
-					      MAP_SHARED,
-					      data->background->fd, 0);
+	uint8_t *byte_array = dsp_pool_map(data->background);
+	if (!byte_array) {
+		error(0, errno, "Failed to mmap background");
+		return -1;
+	}
 	memset(byte_array, 255, img_size);
 
-	for (int i = 0; i < 2; ++i) {
-		data->tile_buffers[i] = buf_alloc(data->fd, DELCORE30M_MEMORY_XYRAM,
-						  0, tile_size, NULL);
-		data->background_tile_buffers[i] = buf_alloc(data->fd, DELCORE30M_MEMORY_XYRAM,
-							     1, tile_size, NULL);
-		data->background_chain_buffers[i] = buf_alloc(data->fd, DELCORE30M_MEMORY_SYSTEM,
-							      1,
-							      sizeof(struct sdma_descriptor) * tb->ntiles,
-							      descs);
-		data->background_code_buffers[i] = buf_alloc(data->fd, DELCORE30M_MEMORY_SYSTEM,
-							     1, 60 * tb->ntiles, NULL);
-		data->chain_buffers[i] = buf_alloc(data->fd, DELCORE30M_MEMORY_SYSTEM,
-						   core_id,
-						   sizeof(struct sdma_descriptor) * tb->ntiles,
-						   descs);
-		data->code_buffers[i] = buf_alloc(data->fd, DELCORE30M_MEMORY_SYSTEM,
-						  core_id, 60 * tb->ntiles, NULL);
-		data->result_frame[i] = buf_alloc(data->fd, DELCORE30M_MEMORY_SYSTEM,
-						  core_id, img_size, NULL);
-		data->result_frame_data[i] = mmap(NULL, data->result_frame[i]->size,
-						  PROT_READ | PROT_WRITE, MAP_SHARED,
-						  data->result_frame[i]->fd, 0);
-	}
-	data->tileinfo_buffer = buf_alloc(data->fd,
-					  DELCORE30M_MEMORY_XYRAM,
-					  core_id,
-					  sizeof(struct tilesbuffer) + sizeof(struct tileinfo) * tb->ntiles,
-					  tb);
-	data->dsp_global_data_buffer = buf_alloc(data->fd,
-						 DELCORE30M_MEMORY_XYRAM,
-						 core_id, 2 * sizeof(uint32_t),
-						 NULL);
-	data->dsp_global_data = (struct dsp_struct_data *) mmap(NULL,
-								data->dsp_global_data_buffer->size,
-								PROT_READ | PROT_WRITE,
-								MAP_SHARED,
-								data->dsp_global_data_buffer->fd,
-								0);
-
-	data->dsp_global_data->avering_counter = 0;
-	data->dsp_global_data->flag_avered = 0;
-	for (uint8_t i = 0; i < 8; ++i)
-		data->dsp_global_data->channels[i] = data->sdma_channels[i];
-}
-
-static void job_create(int fd, struct delcore30m_job *job,
+	data->grid_tiles = tiles_get_number(frame_data);
+
+	const struct tile_stage *blobs = blob_stage(&frame_data);
+
+	data->blob_min_pixels = blobs ? blobs->param : 0;
+	data->blob_overflow = 0;
+
+	data->result_pitch = frame_pitch(frame_data, frame_data.dst_pitch);
+	size_t result_size = frame_data.dst_offset + data->result_pitch * frame_data.frame_height;
+
+	if (frame_data.mask_output && !frame_data.mask_with_frame) {
+		data->result_pitch = dsp_mask_pitch(&frame_data);
+		result_size = data->result_pitch * frame_data.frame_height;
+	}
+
+	for (int i = 0; i < data->result_count; ++i) {
+		data->result_frame[i] = dsp_pool_alloc(&data->pool, DELCORE30M_MEMORY_SYSTEM,
+						       data->cores[0].id, result_size, NULL);
+		if (!data->result_frame[i]) {
+			error(0, errno, "Failed to allocate result frame");
+			return -1;
+		}
+		data->result_frame_data[i] = dsp_pool_map(data->result_frame[i]);
+		if (!data->result_frame_data[i]) {
+			error(0, errno, "Failed to mmap result frame");
+			return -1;
+		}
+	}
+
+	data->mask_with_frame = frame_data.mask_with_frame;
+	data->mask_pitch = frame_data.mask_output ? dsp_mask_pitch(&frame_data) : 0;
+	for (int i = 0; i < data->result_count; ++i) {
+		data->result_mask[i] = NULL;
+		data->result_mask_data[i] = frame_data.mask_output ? data->result_frame_data[i] :
+								     NULL;
+		if (!frame_data.mask_with_frame)
+			continue;
+
+		data->result_mask[i] = dsp_pool_alloc(&data->pool, DELCORE30M_MEMORY_SYSTEM,
+						      data->cores[0].id,
+						      data->mask_pitch * frame_data.frame_height,
+						      NULL);
+		if (!data->result_mask[i]) {
+			error(0, errno, "Failed to allocate result mask");
+			return -1;
+		}
+		data->result_mask_data[i] = dsp_pool_map(data->result_mask[i]);
+		if (!data->result_mask_data[i]) {
+			error(0, errno, "Failed to mmap result mask");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int job_create(int fd, struct delcore30m_job *job,
 		       int *in_buffers, int in_size,
 		       int *out_buffers, int out_size,
 		       int cores_fd, int sdmas_fd)
@@ -221,93 +710,174 @@ static void job_create(int fd, struct delcore30m_job *job,
 	for (int i = 0; i < out_size; ++i)
 		job->output[i] = out_buffers[i];
 
-	if (ioctl(fd, ELCIOC_JOB_CREATE, job))
-		error(EXIT_FAILURE, 0, "Failed to create job");
+	if (ioctl(fd, ELCIOC_JOB_CREATE, job)) {
+		error(0, errno, "Failed to create job");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Close jobs and release buffers, which depend on frame size, to the pool.
+ * Buffers of the same size are taken again by the next configuration.
+ */
+static void free_buffers(struct dsp_struct *data)
+{
+	/* Jobs of a failed dsp_job_create() are created only in part */
+	for (int c = 0; c < data->ncores; c++)
+		for (int i = 0; i < data->input_count; i++)
+			for (int j = 0; j < data->result_count; j++)
+				if (data->cores[c].chains[i][j].job.fd >= 0)
+					close(data->cores[c].chains[i][j].job.fd);
+	data->input_count = 0;
+
+	dsp_pool_release(&data->pool);
+
+	for (int c = 0; c < data->ncores; c++) {
+		free(data->cores[c].tile_index);
+		data->cores[c].tile_index = NULL;
+	}
 }
 
-static void dsp_deinit(const struct dsp_struct *data)
+static void dsp_deinit(struct dsp_struct *data)
 {
-	close(data->job.fd);
-	close(data->dsp_global_data_buffer->fd);
-	close(data->tileinfo_buffer->fd);
-	for (int i = 0; i < 2; i++) {
-		close(data->chain_buffers[i]->fd);
-		close(data->code_buffers[i]->fd);
-		close(data->tile_buffers[i]->fd);
-		close(data->result_frame[i]->fd);
+	free_buffers(data);
+	/* Buffers are closed and unmapped by the pool */
+	dsp_pool_destroy(&data->pool);
+
+	for (int c = 0; c < data->ncores; c++) {
+		if (data->cores[c].sdma.num)
+			close(data->cores[c].sdma.fd);
+		close(data->cores[c].core.fd);
 	}
-	close(data->sdma.fd);
-	close(data->core.fd);
 	close(data->fd);
+	dsp_firmware_close(&data->firmware);
+}
+
+static void core_init(struct dsp_struct *data, struct dsp_core *core)
+{
+	core->core.type = DELCORE30M_CORE;
+	core->core.num = 1;
+
+	if (ioctl(data->fd, ELCIOC_RESOURCE_REQUEST, &core->core))
+		error(EXIT_FAILURE, errno, "Failed to request DELCORE30M_CORE");
+	core->id = __builtin_ffs(core->core.mask) - 1;
+	core->firmware_checksum = 0;
+	core->tile_index = NULL;
+
+	load_firmware(data, core);
+
+	core->sdma.num = 0;
+	if (request_sdma(data, core, 4))
+		exit(EXIT_FAILURE);
 }
 
-void dsp_init(struct dsp_struct *data, const struct frame_args frame_data)
+
+void dsp_open(struct dsp_struct *data, int depth, int ncores)
 {
-	check_frame_args(frame_data);
+	if (depth < 2 || depth > MAX_PIPELINE_DEPTH)
+		error(EXIT_FAILURE, 0, "Pipeline depth must be in range 2..%d",
+		      MAX_PIPELINE_DEPTH);
+	if (ncores < 1 || ncores > MAX_DSP_CORES)
+		error(EXIT_FAILURE, 0, "Number of DSP cores must be in range 1..%d",
+		      MAX_DSP_CORES);
+	data->depth = depth;
+	data->ncores = ncores;
+	data->result_count = depth + 1;
+	data->inflight_head = 0;
+	data->submitted_frames = 0;
+	data->inflight_count = 0;
+	data->input_count = 0;
 
 	data->fd = open("/dev/elcore0", O_RDWR);
 	if (data->fd < 0)
 		error(EXIT_FAILURE, errno, "Failed to open device file");
+	dsp_pool_init(&data->pool, data->fd);
 
-	data->core.type = DELCORE30M_CORE;
-	data->core.num = 1;
+	if (dsp_firmware_open(&data->firmware, MAKE_STR(FIRMWARE_PATH) "bundle.fw.bin"))
+		error(EXIT_FAILURE, errno, "Failed to open firmware");
 
-	if (ioctl(data->fd, ELCIOC_RESOURCE_REQUEST, &data->core))
-		error(EXIT_FAILURE, errno, "Failed to request DELCORE30M_CORE");
+	/* Cores are requested one by one, so each core gets its own firmware instance */
+	for (int i = 0; i < ncores; ++i)
+		core_init(data, &data->cores[i]);
+}
 
-	load_firmware(data);
+void dsp_setup(struct dsp_struct *data, const struct frame_args frame_data)
+{
+	if (check_frame_args(frame_data) || allocate_buffers(data, frame_data))
+		exit(EXIT_FAILURE);
+	printf("DELcore-30M initialize OK (%d core%s)\n", data->ncores,
+	       data->ncores > 1 ? "s" : "");
+}
 
-	data->sdma.type = DELCORE30M_SDMA;
-	data->sdma.num = 4;
+void dsp_init(struct dsp_struct *data, const struct frame_args frame_data, int depth,
+	      int ncores)
+{
+	dsp_open(data, depth, ncores);
+	dsp_setup(data, frame_data);
+}
 
-	if (ioctl(data->fd, ELCIOC_RESOURCE_REQUEST, &data->sdma))
-		error(EXIT_FAILURE, errno, "Failed to request DELCORE30M_SDMA");
+static int create_jobs(struct dsp_struct *data, const int bufs_fd[], const int count);
 
-	uint8_t sdma_msk = data->sdma.mask;
-	for (int i = 0; i < data->sdma.num; ++i) {
-		data->sdma_channels[i] = __builtin_ffs(sdma_msk) - 1;
-		sdma_msk &= ~(1 << data->sdma_channels[i]);
+int dsp_try_setup(struct dsp_struct *data, const struct frame_args frame_data,
+		  const int bufs_fd[], const int count)
+{
+	if (check_frame_args(frame_data) || allocate_buffers(data, frame_data) ||
+	    create_jobs(data, bufs_fd, count)) {
+		free_buffers(data);
+		return -1;
 	}
 
-	allocate_buffers(data, frame_data);
-	printf("DELcore-30M initialize OK\n");
+	return 0;
 }
 
-void dsp_job_create(struct dsp_struct *data, const int bufs_fd[], const int count)
+void dsp_reconfigure(struct dsp_struct *data, const struct frame_args frame_data,
+		     const int bufs_fd[], const int count)
 {
-	int input_temp[] = {
-			data->result_frame[1]->fd, data->tile_buffers[0]->fd, data->dsp_global_data_buffer->fd, data->tile_buffers[1]->fd,
-			data->chain_buffers[0]->fd, data->chain_buffers[1]->fd, data->tileinfo_buffer->fd};
-	int input_temp_size = 7;
+	int dest_buf;
 
-	int *input = (int *) malloc(sizeof(int) * (input_temp_size + count));
-
-	for (int i = 0; i < count; ++i)
-		input[i] = bufs_fd[i];
-	for (int i = count; i < input_temp_size + count; ++i)
-		input[i] = input_temp[i - count];
+	if (check_frame_args(frame_data))
+		exit(EXIT_FAILURE);
 
-	int output[] = {data->background_tile_buffers[0]->fd, data->background_tile_buffers[1]->fd,
-			data->background_code_buffers[0]->fd, data->background_code_buffers[1]->fd,
-			data->background->fd,
-			data->background_chain_buffers[0]->fd, data->background_chain_buffers[1]->fd,
-			data->result_frame[0]->fd, data->code_buffers[0]->fd, data->code_buffers[1]->fd};
+	while (data->inflight_count)
+		frame_wait(data, &dest_buf);
 
-	job_create(data->fd, &data->job, input, input_temp_size + count, output, 10,
-		   data->core.fd, data->sdma.fd);
+	free_buffers(data);
+	data->inflight_head = 0;
+	data->submitted_frames = 0;
 
-	free(input);
+	if (allocate_buffers(data, frame_data))
+		exit(EXIT_FAILURE);
+	dsp_job_create(data, bufs_fd, count);
+	dsp_pool_trim(&data->pool);
+	printf("DELcore-30M reconfigured to %ux%u, tile %ux%u\n", frame_data.frame_width,
+	       frame_data.frame_height, frame_data.tile_width, frame_data.tile_height);
 }
 
-static int dma_init(struct dsp_struct *data, int fd_src, int fd_dst) {
+static int dma_init(struct dsp_struct *data, struct dsp_core *core, struct dsp_chain *chain,
+		    int input, int result)
+{
+	int fd_src = data->input_fds[input];
+	int fd_dst = data->result_frame[result]->fd;
+	/* Output slot holds every tile written out instead of the input slots */
+	int output[2] = { core->tile_buffers[0]->fd, core->tile_buffers[1]->fd };
+	int background_output[2] = { core->background_tile_buffers[0]->fd,
+				     core->background_tile_buffers[1]->fd };
+
+	if (data->output_slot) {
+		output[0] = output[1] = core->output_tile_buffer->fd;
+		background_output[0] = background_output[1] = core->output_background_buffer->fd;
+	}
+
 	struct delcore30m_dmachain dmachain_input = {
-		.job = data->job.fd,
-		.core = __builtin_ffs(data->core.mask) - 1,
+		.job = chain->job.fd,
+		.core = core->id,
 		.external = fd_src,
-		.internal = { data->tile_buffers[0]->fd, data->tile_buffers[1]->fd },
-		.chain = data->chain_buffers[0]->fd,
-		.codebuf = data->code_buffers[0]->fd,
-		.channel = {SDMA_CHANNEL_INPUT,  data->sdma_channels[0]}
+		.internal = { core->tile_buffers[0]->fd, core->tile_buffers[1]->fd },
+		.chain = core->chain_buffers[0]->fd,
+		.codebuf = core->input_code_buffers[input]->fd,
+		.channel = {SDMA_CHANNEL_INPUT,  core->sdma_channels[0]}
 	};
 	if (ioctl(data->fd, ELCIOC_DMACHAIN_SETUP, &dmachain_input)) {
 		printf("Failed to setup input[0] dmachain: %s\n", strerror(errno));
@@ -315,13 +885,13 @@ static int dma_init(struct dsp_struct *data, int fd_src, int fd_dst) {
 	}
 
 	struct delcore30m_dmachain dmachain_output = {
-		.job = data->job.fd,
-		.core = __builtin_ffs(data->core.mask) - 1,
+		.job = chain->job.fd,
+		.core = core->id,
 		.external = fd_dst,
-		.internal = { data->tile_buffers[0]->fd, data->tile_buffers[1]->fd },
-		.chain = data->chain_buffers[1]->fd,
-		.codebuf = data->code_buffers[1]->fd,
-		.channel = {SDMA_CHANNEL_OUTPUT,  data->sdma_channels[1]}
+		.internal = { output[0], output[1] },
+		.chain = core->chain_buffers[1]->fd,
+		.codebuf = core->result_code_buffers[result]->fd,
+		.channel = {SDMA_CHANNEL_OUTPUT,  core->sdma_channels[1]}
 	};
 	if (ioctl(data->fd, ELCIOC_DMACHAIN_SETUP, &dmachain_output)) {
 		printf("Failed to setup output[0] dmachain: %s\n", strerror(errno));
@@ -329,13 +899,14 @@ static int dma_init(struct dsp_struct *data, int fd_src, int fd_dst) {
 	}
 
 	struct delcore30m_dmachain dmachain_background_input = {
-		.job = data->job.fd,
-		.core = __builtin_ffs(data->core.mask) - 1,
+		.job = chain->job.fd,
+		.core = core->id,
 		.external = data->background->fd,
-		.internal = { data->background_tile_buffers[0]->fd, data->background_tile_buffers[1]->fd },
-		.chain = data->background_chain_buffers[0]->fd,
-		.codebuf = data->background_code_buffers[0]->fd,
-		.channel = {SDMA_CHANNEL_INPUT,  data->sdma_channels[2]}
+		.internal = { core->background_tile_buffers[0]->fd,
+			      core->background_tile_buffers[1]->fd },
+		.chain = core->background_chain_buffers[0]->fd,
+		.codebuf = core->background_code_buffers[0]->fd,
+		.channel = {SDMA_CHANNEL_INPUT,  core->sdma_channels[2]}
 	};
 	if (ioctl(data->fd, ELCIOC_DMACHAIN_SETUP, &dmachain_background_input)) {
 		printf("Failed to setup input[1] dmachain: %s\n", strerror(errno));
@@ -343,34 +914,172 @@ static int dma_init(struct dsp_struct *data, int fd_src, int fd_dst) {
 	}
 
 	struct delcore30m_dmachain dmachain_background_output = {
-		.job = data->job.fd,
-		.core = __builtin_ffs(data->core.mask) - 1,
+		.job = chain->job.fd,
+		.core = core->id,
 		.external = data->background->fd,
-		.internal = { data->background_tile_buffers[0]->fd, data->background_tile_buffers[1]->fd },
-		.chain = data->background_chain_buffers[1]->fd,
-		.codebuf = data->background_code_buffers[1]->fd,
-		.channel = {SDMA_CHANNEL_OUTPUT,  data->sdma_channels[3]}
+		.internal = { background_output[0], background_output[1] },
+		.chain = core->background_chain_buffers[1]->fd,
+		.codebuf = core->background_code_buffers[1]->fd,
+		.channel = {SDMA_CHANNEL_OUTPUT,  core->sdma_channels[3]}
 	};
 	if (ioctl(data->fd, ELCIOC_DMACHAIN_SETUP, &dmachain_background_output)) {
 		printf("Failed to setup output[1] dmachain: %s\n", strerror(errno));
 		return EXIT_FAILURE;
 	}
 
+	if (!data->mask_with_frame)
+		return EXIT_SUCCESS;
+
+	struct delcore30m_dmachain dmachain_mask_output = {
+		.job = chain->job.fd,
+		.core = core->id,
+		.external = data->result_mask[result]->fd,
+		.internal = { core->mask_tile_buffers[0]->fd, core->mask_tile_buffers[1]->fd },
+		.chain = core->mask_chain_buffer->fd,
+		.codebuf = core->mask_code_buffers[result]->fd,
+		.channel = {SDMA_CHANNEL_OUTPUT,  core->sdma_channels[4]}
+	};
+	if (ioctl(data->fd, ELCIOC_DMACHAIN_SETUP, &dmachain_mask_output)) {
+		printf("Failed to setup output[2] dmachain: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
 	return EXIT_SUCCESS;
 }
 
-static int job_start(struct dsp_struct *data)
+/* Allocate SDMA code buffers of @core, driver writes each one from the start */
+static int allocate_code_buffers(struct dsp_struct *data, struct dsp_core *core, int count)
 {
-	int ret;
-	sigset_t mask;
+	struct dsp_pool *pool = &data->pool;
+	size_t size = core->code_buffer_size;
 
-	if (ioctl(data->fd, ELCIOC_JOB_ENQUEUE, &data->job) < 0) {
-		puts("Failed to enqueue job");
-		return EXIT_FAILURE;
+	for (int i = 0; i < count; ++i)
+		if (!(core->input_code_buffers[i] = dsp_pool_alloc(pool, DELCORE30M_MEMORY_SYSTEM,
+								   core->id, size, NULL)))
+			return -1;
+	for (int j = 0; j < data->result_count; ++j)
+		if (!(core->result_code_buffers[j] = dsp_pool_alloc(pool, DELCORE30M_MEMORY_SYSTEM,
+								    core->id, size, NULL)))
+			return -1;
+	for (int k = 0; k < 2; ++k)
+		if (!(core->background_code_buffers[k] = dsp_pool_alloc(pool,
+									DELCORE30M_MEMORY_SYSTEM,
+									core->background_core_id,
+									size, NULL)))
+			return -1;
+	for (int j = 0; data->mask_with_frame && j < data->result_count; ++j)
+		if (!(core->mask_code_buffers[j] = dsp_pool_alloc(pool, DELCORE30M_MEMORY_SYSTEM,
+								  core->id, size, NULL)))
+			return -1;
+
+	return 0;
+}
+
+/*
+ * Create one job per (capture buffer, result buffer) pair on each core and set up
+ * its DMA chains. SDMA code does not depend on frame contents, so it is generated
+ * only once here and frame_submit() just picks the prepared jobs.
+ * Return -1 on failure, jobs created so far are closed by free_buffers().
+ */
+static int create_jobs(struct dsp_struct *data, const int bufs_fd[], const int count)
+{
+	if (count < 1 || count > MAX_INPUT_BUFFERS) {
+		error(0, 0, "Number of input buffers must be in range 1..%d", MAX_INPUT_BUFFERS);
+		return -1;
+	}
+
+	for (int i = 0; i < count; ++i)
+		data->input_fds[i] = bufs_fd[i];
+	for (int c = 0; c < data->ncores; ++c)
+		for (int i = 0; i < count; ++i)
+			for (int j = 0; j < data->result_count; ++j)
+				data->cores[c].chains[i][j].job.fd = -1;
+	data->input_count = count;
+
+	for (int c = 0; c < data->ncores; ++c) {
+		struct dsp_core *core = &data->cores[c];
+
+		if (allocate_code_buffers(data, core, count)) {
+			error(0, errno, "Failed to allocate DMA code buffers");
+			return -1;
+		}
+
+		for (int i = 0; i < count; ++i)
+			for (int j = 0; j < data->result_count; ++j) {
+				struct dsp_chain *chain = &core->chains[i][j];
+
+				/*
+				 * Bundle firmware takes kernel number first. XYRAM
+				 * buffers firmware gets are inputs, so outputs stay
+				 * within MAX_OUTPUTS with all optional tiles.
+				 */
+				int input[13] = {
+					core->kernel_buffer->fd, bufs_fd[i],
+					core->tile_buffers[0]->fd,
+					core->dsp_global_data_buffer->fd,
+					core->tile_buffers[1]->fd, core->chain_buffers[0]->fd,
+					core->chain_buffers[1]->fd,
+					core->background_tile_buffers[0]->fd,
+					core->background_tile_buffers[1]->fd};
+				int ninputs = 9;
+				int output[11];
+				int noutputs = 0;
+
+				/* Optional tiles are the last arguments firmware gets */
+				if (data->mask_with_frame) {
+					input[ninputs++] = core->mask_tile_buffers[0]->fd;
+					input[ninputs++] = core->mask_tile_buffers[1]->fd;
+				}
+				if (data->output_slot) {
+					input[ninputs++] = core->output_tile_buffer->fd;
+					input[ninputs++] = core->output_background_buffer->fd;
+				}
+				output[noutputs++] = core->background_code_buffers[0]->fd;
+				output[noutputs++] = core->background_code_buffers[1]->fd;
+				output[noutputs++] = data->background->fd;
+				output[noutputs++] = core->background_chain_buffers[0]->fd;
+				output[noutputs++] = core->background_chain_buffers[1]->fd;
+				output[noutputs++] = data->result_frame[j]->fd;
+				output[noutputs++] = core->input_code_buffers[i]->fd;
+				output[noutputs++] = core->result_code_buffers[j]->fd;
+				if (data->mask_with_frame) {
+					output[noutputs++] = core->mask_chain_buffer->fd;
+					output[noutputs++] = core->mask_code_buffers[j]->fd;
+					output[noutputs++] = data->result_mask[j]->fd;
+				}
+
+				if (job_create(data->fd, &chain->job, input, ninputs, output, noutputs,
+					       core->core.fd, core->sdma.fd))
+					return -1;
+				if (dma_init(data, core, chain, i, j)) {
+					error(0, errno, "Failed to setup DMA chains");
+					return -1;
+				}
+			}
 	}
 
+	return 0;
+}
+
+void dsp_job_create(struct dsp_struct *data, const int bufs_fd[], const int count)
+{
+	if (create_jobs(data, bufs_fd, count))
+		exit(EXIT_FAILURE);
+}
+
+void dsp_reset_background(struct dsp_struct *data)
+{
+	for (int c = 0; c < data->ncores; ++c)
+		data->cores[c].dsp_global_data->flag_avered = 0;
+}
+
+static int job_wait(struct dsp_struct *data, struct delcore30m_job *job)
+{
+	int ret;
+	sigset_t mask;
+
 	struct pollfd fds = {
-		.fd = data->job.fd,
+		.fd = job->fd,
 		.events = POLLIN | POLLPRI | POLLOUT | POLLHUP
 	};
 
@@ -384,18 +1093,18 @@ static int job_start(struct dsp_struct *data)
 		return EXIT_FAILURE;
 	}
 	if (ret == 0) {
-		if (ioctl(data->fd, ELCIOC_JOB_CANCEL, &data->job)) {
+		if (ioctl(data->fd, ELCIOC_JOB_CANCEL, job)) {
 			puts("Failed to cancel job");
 			return EXIT_FAILURE;
 		}
 		puts("Job timed out");
 		return EXIT_FAILURE;
 	}
-	if (ioctl(data->fd, ELCIOC_JOB_STATUS, &data->job)) {
+	if (ioctl(data->fd, ELCIOC_JOB_STATUS, job)) {
 		puts("Failed to get job status");
 		return EXIT_FAILURE;
 	}
-	if (data->job.rc != DELCORE30M_JOB_SUCCESS) {
+	if (job->rc != DELCORE30M_JOB_SUCCESS) {
 		puts("Job failed");
 		return EXIT_FAILURE;
 	}
@@ -403,20 +1112,319 @@ static int job_start(struct dsp_struct *data)
 	return EXIT_SUCCESS;
 }
 
+/* Wait for jobs of cores 0..@ncores - 1 for one frame */
+static int frame_join(struct dsp_struct *data, int input_ind, int dma_buf_ind, int ncores)
+{
+	int ret = EXIT_SUCCESS;
+
+	for (int c = 0; c < ncores; ++c)
+		if (job_wait(data, &data->cores[c].chains[input_ind][dma_buf_ind].job))
+			ret = EXIT_FAILURE;
+
+	return ret;
+}
+
 void dsp_free(struct dsp_struct *data)
 {
-	munmap(data->result_frame_data[0], data->result_frame[0]->size);
-	munmap(data->result_frame_data[1], data->result_frame[1]->size);
+	int dest_buf;
+
+	while (data->inflight_count)
+		frame_wait(data, &dest_buf);
+
 	dsp_deinit(data);
 }
 
-int frame_detector(struct dsp_struct *data, int buf_fd, int dma_buf_ind)
+static int find_input(struct dsp_struct *data, int buf_fd)
 {
-	if (dma_init(data, buf_fd, data->result_frame[dma_buf_ind]->fd))
+	for (int i = 0; i < data->input_count; ++i)
+		if (data->input_fds[i] == buf_fd)
+			return i;
+
+	return -1;
+}
+
+int frame_submit(struct dsp_struct *data, int buf_fd, int dma_buf_ind)
+{
+	int input_ind = find_input(data, buf_fd);
+
+	if (input_ind < 0 || dma_buf_ind < 0 || dma_buf_ind >= data->result_count) {
+		puts("Unknown input or result buffer");
 		return EXIT_FAILURE;
+	}
 
-	if (job_start(data))
+	if (data->inflight_count == data->depth) {
+		puts("Too many frames submitted");
 		return EXIT_FAILURE;
+	}
+
+	for (int c = 0; c < data->ncores; ++c)
+		if (ioctl(data->fd, ELCIOC_JOB_ENQUEUE,
+			  &data->cores[c].chains[input_ind][dma_buf_ind].job)) {
+			puts("Failed to enqueue job");
+			/* Do not leave a half of frame running on other cores */
+			frame_join(data, input_ind, dma_buf_ind, c);
+			return EXIT_FAILURE;
+		}
+
+	int tail = (data->inflight_head + data->inflight_count) % data->depth;
+	data->inflight_src[tail] = input_ind;
+	data->inflight_dest[tail] = dma_buf_ind;
+	data->inflight_frame[tail] = data->submitted_frames++;
+	data->inflight_count++;
 
 	return EXIT_SUCCESS;
 }
+
+int frame_wait(struct dsp_struct *data, int *dma_buf_ind)
+{
+	if (!data->inflight_count) {
+		puts("No frames submitted");
+		return EXIT_FAILURE;
+	}
+
+	int input_ind = data->inflight_src[data->inflight_head];
+	*dma_buf_ind = data->inflight_dest[data->inflight_head];
+	data->waited_frame = data->inflight_frame[data->inflight_head];
+	data->inflight_head = (data->inflight_head + 1) % data->depth;
+	data->inflight_count--;
+
+	/* Result frame is complete only when all cores have written their tiles */
+	return frame_join(data, input_ind, *dma_buf_ind, data->ncores);
+}
+
+uint32_t frame_dirty_tiles(struct dsp_struct *data, uint8_t *bitmap)
+{
+	uint32_t count = 0;
+
+	memset(bitmap, 0, DIV_ROUND_UP(data->grid_tiles, 8));
+
+	for (int c = 0; c < data->ncores; ++c) {
+		struct dsp_core *core = &data->cores[c];
+
+		for (uint32_t i = 0; i < core->ntiles; ++i) {
+			/* Firmware may already process next frames, history is kept for them */
+			uint32_t history = __atomic_load_n(&core->dsp_global_data->tiles[i].history,
+							   __ATOMIC_RELAXED);
+			uint32_t age = (history - data->waited_frame) & TILE_HISTORY_FRAME_MASK;
+			bool dirty = age >= 32 - TILE_HISTORY_SHIFT ||
+				     history >> (TILE_HISTORY_SHIFT + age) & 1;
+
+			if (dirty) {
+				bitmap[core->tile_index[i] / 8] |= 1 << core->tile_index[i] % 8;
+				count++;
+			}
+		}
+	}
+
+	return count;
+}
+
+uint32_t frame_tile_stats(struct dsp_struct *data, struct tile_stats *stats)
+{
+	uint32_t count = 0;
+
+	memset(stats, 0, sizeof(struct tile_stats) * data->grid_tiles);
+
+	for (int c = 0; c < data->ncores; ++c) {
+		struct dsp_core *core = &data->cores[c];
+
+		if (!core->dsp_global_data->tile_stats)
+			return 0;
+
+		for (uint32_t i = 0; i < core->ntiles; ++i) {
+			/* Slot of the frame is not reused until the frame is waited again */
+			const struct tile_stats *slot =
+				&core->dsp_global_data->tiles[i].stats[data->waited_frame %
+								      TILE_STATS_SLOTS];
+
+			if (slot->frame != (data->waited_frame & 0xff))
+				continue;
+			stats[core->tile_index[i]] = *slot;
+			count++;
+		}
+	}
+
+	return count;
+}
+
+static bool edges_touch(const struct blob_edge *a, const struct blob_edge *b)
+{
+	return a->left <= b->right + 1 && b->left <= a->right + 1 &&
+	       a->top <= b->bottom + 1 && b->top <= a->bottom + 1;
+}
+
+static uint32_t blob_root(const uint32_t *parent, uint32_t i)
+{
+	while (parent[i] != i)
+		i = parent[i];
+
+	return i;
+}
+
+uint32_t frame_blobs(struct dsp_struct *data, struct tile_blob *blobs, uint32_t max)
+{
+	const struct blob_list *lists[MAX_DSP_CORES] = { NULL };
+	struct tile_blob merged[MAX_DSP_CORES * MAX_FRAME_BLOBS];
+	uint32_t parent[MAX_DSP_CORES * MAX_FRAME_BLOBS];
+	uint32_t first[MAX_DSP_CORES];
+	uint32_t count = 0, ret = 0;
+
+	data->blob_overflow = 0;
+	for (int c = 0; c < data->ncores; ++c) {
+		const struct blob_list *list = data->cores[c].blobs ?
+			&data->cores[c].blobs->frames[data->waited_frame % TILE_BLOB_SLOTS] : NULL;
+
+		/* Slot is filled when the frame is finished, it is stale otherwise */
+		first[c] = count;
+		if (!list || list->frame != data->waited_frame)
+			continue;
+		lists[c] = list;
+		data->blob_overflow |= list->overflow;
+		for (uint32_t i = 0; i < list->count && i < MAX_FRAME_BLOBS; ++i) {
+			merged[count] = list->blobs[i];
+			parent[count] = count;
+			count++;
+		}
+	}
+
+	/* Blobs of a core are merged by firmware, join the ones whose border runs touch */
+	for (int c = 0; c < data->ncores; ++c)
+		for (int d = c + 1; lists[c] && d < data->ncores; ++d)
+			for (uint32_t i = 0; lists[d] && i < lists[c]->nedges &&
+			     i < MAX_BLOB_EDGES; ++i)
+				for (uint32_t j = 0; j < lists[d]->nedges && j < MAX_BLOB_EDGES; ++j) {
+					const struct blob_edge *a = &lists[c]->edges[i];
+					const struct blob_edge *b = &lists[d]->edges[j];
+
+					if (!edges_touch(a, b) || a->blob >= lists[c]->count ||
+					    b->blob >= lists[d]->count)
+						continue;
+
+					uint32_t x = blob_root(parent, first[c] + a->blob);
+					uint32_t y = blob_root(parent, first[d] + b->blob);
+
+					if (x == y)
+						continue;
+					if (y < x) {
+						uint32_t t = x;
+
+						x = y;
+						y = t;
+					}
+					parent[y] = x;
+					merged[x].left = min(merged[x].left, merged[y].left);
+					merged[x].top = min(merged[x].top, merged[y].top);
+					merged[x].right = max(merged[x].right, merged[y].right);
+					merged[x].bottom = max(merged[x].bottom, merged[y].bottom);
+					merged[x].pixels += merged[y].pixels;
+				}
+
+	/* Firmware keeps small blobs only on borders of cores */
+	for (uint32_t i = 0; i < count; ++i)
+		if (parent[i] == i && merged[i].pixels >= data->blob_min_pixels) {
+			if (ret < max)
+				blobs[ret] = merged[i];
+			ret++;
+		}
+
+	return ret;
+}
+
+int dsp_stages_parse(struct frame_args *frame_data, const char *list)
+{
+	const char *p = list;
+
+	frame_data->nstages = 0;
+	while (*p) {
+		size_t len = strcspn(p, ",:");
+		uint32_t op;
+
+		for (op = 0; op < TILE_STAGE_COUNT; ++op)
+			if (strlen(stage_names[op].name) == len &&
+			    !strncmp(p, stage_names[op].name, len))
+				break;
+		if (op == TILE_STAGE_COUNT || frame_data->nstages == MAX_TILE_STAGES)
+			return -1;
+
+		struct tile_stage stage = { .op = op, .param = stage_names[op].param };
+
+		p += len;
+		if (*p == ':') {
+			char *end;
+			unsigned long param = strtoul(p + 1, &end, 0);
+
+			if (end == p + 1 || param > UINT8_MAX)
+				return -1;
+			stage.param = param;
+			p = end;
+		}
+		frame_data->stages[frame_data->nstages++] = stage;
+
+		if (*p == ',')
+			p++;
+		else if (*p)
+			return -1;
+	}
+
+	return frame_data->nstages ? 0 : -1;
+}
+
+int dsp_stages_format(const struct frame_args *frame_data, char *buf, size_t size)
+{
+	size_t len = 0;
+
+	if (!frame_data->nstages)
+		return snprintf(buf, size, "-") < (int)size ? 0 : -1;
+
+	for (int i = 0; i < frame_data->nstages && i < MAX_TILE_STAGES; ++i) {
+		len += snprintf(buf + len, size - len, "%s%s:%u", i ? "," : "",
+				stage_names[frame_data->stages[i].op].name,
+				frame_data->stages[i].param);
+		if (len >= size)
+			return -1;
+	}
+
+	return 0;
+}
+
+int dsp_stages_halo(const struct frame_args *frame_data)
+{
+	int halo = 0;
+
+	for (int i = 0; i < frame_data->nstages && i < MAX_TILE_STAGES; ++i)
+		switch (frame_data->stages[i].op) {
+		case TILE_STAGE_ERODE:
+		case TILE_STAGE_DILATE:
+			halo += frame_data->stages[i].param;
+			break;
+		case TILE_STAGE_OPEN:
+		case TILE_STAGE_CLOSE:
+			halo += 2 * frame_data->stages[i].param;
+			break;
+		}
+
+	/* Lines of tiles with halo must start at SDMA burst boundary */
+	while ((halo * frame_data->pixel_format) % sdma_burst_size)
+		halo++;
+
+	return halo;
+}
+
+uint32_t dsp_mask_pitch(const struct frame_args *frame_data)
+{
+	return DIV_ROUND_UP(DIV_ROUND_UP(frame_data->frame_width, 8), sdma_burst_size) *
+	       sdma_burst_size;
+}
+
+size_t dsp_stages_data_size(const struct frame_args *frame_data)
+{
+	return blob_stage(frame_data) ? sizeof(struct blob_data) : 0;
+}
+
+int frame_detector(struct dsp_struct *data, int buf_fd, int dma_buf_ind)
+{
+	if (frame_submit(data, buf_fd, dma_buf_ind))
+		return EXIT_FAILURE;
+
+	return frame_wait(data, &dma_buf_ind);
+}
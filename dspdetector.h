@@ -5,11 +5,17 @@
 #define _DSPDETECTOR_H_
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <asm/types.h>
 
 #include <linux/delcore30m.h>
 
+#include "dspfirmware.h"
+#include "dsppool.h"
+#include "dsproi.h"
+#include "stages.h"
+
 #define SCR_BURST_SIZE_BIT 1
 #define DST_BURST_SIZE_BIT 15
 
@@ -24,9 +30,27 @@
 
 #define AUTO_INCREMENT 1
 
+/// Maximum number of capture buffers that can be passed to dsp_job_create()
+#define MAX_INPUT_BUFFERS 8
+
+/// Maximum number of frames processed by DSP at the same time
+#define MAX_PIPELINE_DEPTH 3
+
+/// One more result frame than pipeline depth is kept for the frame on display
+#define MAX_RESULT_FRAMES (MAX_PIPELINE_DEPTH + 1)
+
+/// Maximum number of DSP cores sharing tiles of one frame
+#define MAX_DSP_CORES 2
+
+/// Background follows frames with weight of at least 1/2^MAX_BACKGROUND_SHIFT
+#define MAX_BACKGROUND_SHIFT 8
+
 /// Integer division with rounding up
 #define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
 
+/// Number of elements of array @a
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
 /// Get a minimum of two arguments
 #define min(x, y) ({ \
 		typeof(x) _x = (x); \
@@ -40,19 +64,6 @@
 		_x > _y ? _x : _y; })
 
 
-struct tileinfo {
-	uint32_t x, y;
-	uint32_t width, height;
-	uint32_t stride[2];
-};
-
-struct tilesbuffer {
-	uint32_t ntiles;
-	uint32_t tilesize;
-	uint32_t pixel_size;
-	struct tileinfo info[];
-};
-
 enum pixel_format {
 	PIXEL_FORMAT_RGB = 3,
 	PIXEL_FORMAT_RGBA = 4
@@ -64,43 +75,256 @@ struct frame_args {
 	uint16_t tile_width;
 	uint16_t tile_height;
 	enum pixel_format pixel_format;
+	/// Bytes per line of capture buffers, 0 for lines without padding
+	uint32_t src_pitch;
+	/// Offset of the first pixel in capture buffers
+	uint32_t src_offset;
+	/// Bytes per line of result frames, 0 for lines without padding
+	uint32_t dst_pitch;
+	/// Offset of the first pixel in result frames
+	uint32_t dst_offset;
+	/// Tiles to process, whole frame if the region is empty
+	struct dsp_roi roi;
+	/// Skip detection in tiles which did not change and had no motion
+	bool skip_unchanged;
+	/// Stages run on each tile in XYRAM, only motion detection if there are none
+	int nstages;
+	struct tile_stage stages[MAX_TILE_STAGES];
+	/*
+	 * Background is the first frame, then each frame is added to it with
+	 * weight 1/2^background_shift. Background is frozen if the shift is 0.
+	 */
+	int background_shift;
+	/*
+	 * Result frames hold the mask packed 1 bit per pixel, least significant bit
+	 * first, instead of pixels, see dsp_mask_pitch(). Needs stages, which set the
+	 * mask, and tile width multiple of 8. dst_pitch and dst_offset are not used.
+	 */
+	bool mask_output;
+	/*
+	 * With mask_output, result frames keep pixels and the packed mask is written
+	 * to result_mask of struct dsp_struct by one more SDMA channel of the core.
+	 * Needs one DSP core, two cores take all 8 channels.
+	 */
+	bool mask_with_frame;
+	/*
+	 * Collect statistics of each tile, see frame_tile_stats(). Threshold of
+	 * changed pixels is the one of motion stage or of detector.
+	 */
+	bool tile_stats;
+	/// Pipeline tiles over two XYRAM slots even if output slots fit XYRAM
+	bool two_slots;
 };
 
-struct dsp_struct_data {
-	uint32_t channels[8];
-	uint32_t avering_counter;
-	uint32_t flag_avered;
+/* Job with DMA chains prepared for one (capture buffer, result buffer) pair */
+struct dsp_chain {
+	struct delcore30m_job job;
 };
 
-struct dsp_struct {
-	int fd;
+/* DSP core with its own firmware instance, which processes a band of frame tiles */
+struct dsp_core {
+	int id;
 	struct delcore30m_resource core;
 	struct delcore30m_resource sdma;
-	struct delcore30m_job job;
 
-	//source and result frames
-	struct delcore30m_buffer *result_frame[2];
 	struct delcore30m_buffer *tile_buffers[2];
-	struct delcore30m_buffer *code_buffers[2];
 	struct delcore30m_buffer *chain_buffers[2];
-	struct delcore30m_buffer *tileinfo_buffer;
-	struct delcore30m_buffer *dsp_global_data_buffer;;
+	/// Detector data followed by the tile list at dsp_global_data->tiles_offset
+	struct delcore30m_buffer *dsp_global_data_buffer;
+	struct delcore30m_buffer *kernel_buffer;
 
-	struct delcore30m_buffer *background;
 	struct delcore30m_buffer *background_tile_buffers[2];
-	struct delcore30m_buffer *background_code_buffers[2];
 	struct delcore30m_buffer *background_chain_buffers[2];
+	/// Core whose XYRAM holds background tiles
+	int background_core_id;
+
+	/// Packed masks of tiles and their chain, only with mask_with_frame
+	struct delcore30m_buffer *mask_tile_buffers[2];
+	struct delcore30m_buffer *mask_chain_buffer;
+
+	/// Frame and background tiles read by output chains, only with output_slot
+	struct delcore30m_buffer *output_tile_buffer;
+	struct delcore30m_buffer *output_background_buffer;
 
 	struct dsp_struct_data* dsp_global_data;
+	/// Blob lists after tile states of dsp_global_data, NULL without blob stage
+	struct blob_data *blobs;
+
+	/// Frame and background input and output, mask output with mask_with_frame
+	uint32_t sdma_channels[5];
+
+	uint32_t ntiles;
+	/// Index of each tile of the core in the frame grid
+	uint32_t *tile_index;
+
+	struct dsp_chain chains[MAX_INPUT_BUFFERS][MAX_RESULT_FRAMES];
+	/*
+	 * SDMA code of a chain depends only on its external buffer, so jobs share
+	 * code of each capture buffer, result frame and background chain.
+	 */
+	struct delcore30m_buffer *input_code_buffers[MAX_INPUT_BUFFERS];
+	struct delcore30m_buffer *result_code_buffers[MAX_RESULT_FRAMES];
+	struct delcore30m_buffer *background_code_buffers[2];
+	struct delcore30m_buffer *mask_code_buffers[MAX_RESULT_FRAMES];
+	size_t code_buffer_size;
+
+	/// Checksum of firmware loaded to the core
+	uint32_t firmware_checksum;
+};
+
+struct dsp_struct {
+	int fd;
+	struct dsp_pool pool;
+	struct dsp_firmware firmware;
+	int ncores;
+	struct dsp_core cores[MAX_DSP_CORES];
+
+	//result frames and background are shared by all cores
+	struct delcore30m_buffer *result_frame[MAX_RESULT_FRAMES];
+	struct delcore30m_buffer *background;
+
+	void *result_frame_data[MAX_RESULT_FRAMES];
+	/// Bytes per line of result frames
+	uint32_t result_pitch;
 
-	void *result_frame_data[2];
+	/// Output chains read tiles from output slots of cores, see process_tiles() of stages.c
+	bool output_slot;
+	/// Masks of result frames with mask_with_frame
+	bool mask_with_frame;
+	struct delcore30m_buffer *result_mask[MAX_RESULT_FRAMES];
+	/// Packed mask of each result frame with mask_output, the frame itself without mask_with_frame
+	void *result_mask_data[MAX_RESULT_FRAMES];
+	/// Bytes per line of packed masks
+	uint32_t mask_pitch;
+	int result_count;
+	int depth;
 
-	uint32_t sdma_channels[8];
+	int input_fds[MAX_INPUT_BUFFERS];
+	int input_count;
+
+	//submitted frames in order of submission
+	int inflight_src[MAX_PIPELINE_DEPTH];
+	int inflight_dest[MAX_PIPELINE_DEPTH];
+	uint32_t inflight_frame[MAX_PIPELINE_DEPTH];
+	int inflight_head;
+	int inflight_count;
+
+	/// Number of tiles in the frame grid
+	uint32_t grid_tiles;
+	uint32_t submitted_frames;
+	/// Number of the frame returned by the last frame_wait()
+	uint32_t waited_frame;
+	/// Parameter of blob stage
+	uint32_t blob_min_pixels;
+	/// BLOB_OVERFLOW_* flags of cores for the frame of the last frame_blobs()
+	uint32_t blob_overflow;
 };
 
-void dsp_init(struct dsp_struct *data, const struct frame_args frame_data);
+/* Open DSP and allocate @depth + 1 result frames, so up to @depth frames can be
+ * processed at the same time (2 <= depth <= MAX_PIPELINE_DEPTH) while one more is
+ * on display. Tiles of each frame are split between @ncores DSP cores
+ * (1 <= ncores <= MAX_DSP_CORES).
+ */
+void dsp_init(struct dsp_struct *data, const struct frame_args frame_data, int depth,
+	      int ncores);
+
+/*
+ * dsp_init() in two steps. dsp_open() opens the device, requests cores and
+ * loads firmware, it does not depend on frame size and may run concurrently
+ * with capture and display setup. dsp_setup() allocates buffers for @frame_data.
+ */
+void dsp_open(struct dsp_struct *data, int depth, int ncores);
+void dsp_setup(struct dsp_struct *data, const struct frame_args frame_data);
 void dsp_free(struct dsp_struct *data);
 void dsp_job_create(struct dsp_struct *data, const int bufs_fd[], const int count);
+
+/*
+ * dsp_setup() and dsp_job_create() after dsp_open(), which return -1 instead of
+ * exit if @frame_data can not be set up, so other tiles can be tried.
+ */
+int dsp_try_setup(struct dsp_struct *data, const struct frame_args frame_data,
+		  const int bufs_fd[], const int count);
+
+/*
+ * Switch to new frame size, tiles or stages of @frame_data with capture buffers
+ * @bufs_fd. Submitted frames are waited, then tiles, DMA chains, jobs and frame
+ * buffers are created again. Cores, SDMA channels and firmware are kept, and
+ * background is taken from the next frame.
+ */
+void dsp_reconfigure(struct dsp_struct *data, const struct frame_args frame_data,
+		     const int bufs_fd[], const int count);
+
+/* Take background from the next frame on all cores */
+void dsp_reset_background(struct dsp_struct *data);
+
+/* Enqueue motion detection for capture buffer @source_fd to result frame @dest_buf
+ * and return without waiting for the DSP.
+ * Return EXIT_SUCCESS or EXIT_FAILURE.
+ */
+int frame_submit(struct dsp_struct *data, int source_fd, int dest_buf);
+
+/* Wait for the oldest submitted frame and store its result frame index to @dest_buf.
+ * Return EXIT_SUCCESS or EXIT_FAILURE.
+ */
+int frame_wait(struct dsp_struct *data, int *dest_buf);
+
+/*
+ * Store bitmap of tiles which changed in the frame returned by the last frame_wait()
+ * to @bitmap of DIV_ROUND_UP(data->grid_tiles, 8) bytes, bit per tile of the frame
+ * grid in row-major order. Tiles are compared only with skip_unchanged, otherwise
+ * all tiles are reported. Tiles out of region of interest are not set.
+ * Return number of changed tiles.
+ */
+uint32_t frame_dirty_tiles(struct dsp_struct *data, uint8_t *bitmap);
+
+/*
+ * Store statistics of tiles in the frame returned by the last frame_wait() to
+ * @stats of data->grid_tiles entries in row-major order of the frame grid.
+ * Tiles out of region of interest are zero, tiles skipped as unchanged keep
+ * statistics of the previous frame. Return number of tiles with statistics,
+ * 0 without tile_stats.
+ */
+uint32_t frame_tile_stats(struct dsp_struct *data, struct tile_stats *stats);
+
+/*
+ * Store up to @max boxes of objects found by blob stage in the frame returned by
+ * the last frame_wait() to @blobs. Blobs of neighbouring bands of cores are
+ * merged where their border runs touch, boxes with less pixels than the stage
+ * parameter are dropped. Flags of lost or joined blobs are left in blob_overflow.
+ * Return number of boxes, which may exceed @max, or 0 without blob stage.
+ */
+uint32_t frame_blobs(struct dsp_struct *data, struct tile_blob *blobs, uint32_t max);
+
+/*
+ * Parse comma separated list of stages "<name>[:<param>],..." to @frame_data.
+ * Names are detect, motion, grayscale, threshold, overlay, erode, dilate, open,
+ * close and blobs, see enum tile_stage_op.
+ * Return 0 or -1 if @list is malformed or too long.
+ */
+int dsp_stages_parse(struct frame_args *frame_data, const char *list);
+
+/*
+ * Write stages of @frame_data to @buf in the format of dsp_stages_parse() with all
+ * parameters, or "-" without stages. Return -1 if @size is too small.
+ */
+int dsp_stages_format(const struct frame_args *frame_data, char *buf, size_t size);
+
+/*
+ * Return number of rows and columns of neighbouring tiles, which stages of
+ * @frame_data need around each tile. XYRAM tiles grow by twice the halo.
+ */
+int dsp_stages_halo(const struct frame_args *frame_data);
+
+/*
+ * Return bytes of XYRAM of each core, which stages of @frame_data keep after
+ * detector data. XYRAM left for tiles is smaller by this size.
+ */
+size_t dsp_stages_data_size(const struct frame_args *frame_data);
+
+/* Return bytes per line of packed mask of frame @frame_data */
+uint32_t dsp_mask_pitch(const struct frame_args *frame_data);
+
+/* Process one frame synchronously: frame_submit() followed by frame_wait() */
 int frame_detector(struct dsp_struct *data, int source_fd, int dest_buf);
 
 #endif
@@ -0,0 +1,79 @@
+/*
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "dspfirmware.h"
+
+/* FNV-1a hash, 0 is reserved for "no firmware loaded" */
+static uint32_t checksum(const uint8_t *data, uint32_t size)
+{
+	uint32_t hash = 2166136261u;
+
+	for (uint32_t i = 0; i < size; ++i) {
+		hash ^= data[i];
+		hash *= 16777619u;
+	}
+
+	return hash ? hash : 1;
+}
+
+int dsp_firmware_open(struct dsp_firmware *fw, const char *path)
+{
+	FILE *f = fopen(path, "r");
+	long size;
+
+	if (f == NULL)
+		return -1;
+
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	fw->data = malloc(size);
+	if (!fw->data || fread(fw->data, 1, size, f) != size) {
+		int err = fw->data ? EIO : ENOMEM;
+
+		free(fw->data);
+		fclose(f);
+		errno = err;
+		return -1;
+	}
+	fclose(f);
+
+	fw->size = size;
+	fw->checksum = checksum(fw->data, fw->size);
+
+	return 0;
+}
+
+void dsp_firmware_close(struct dsp_firmware *fw)
+{
+	free(fw->data);
+	fw->data = NULL;
+	fw->size = 0;
+	fw->checksum = 0;
+}
+
+int dsp_firmware_load(const struct dsp_firmware *fw, int core_fd, int core_id,
+		      uint32_t *loaded)
+{
+	if (*loaded == fw->checksum)
+		return 0;
+
+	void *pram = mmap(NULL, fw->size, PROT_WRITE, MAP_SHARED, core_fd,
+			  sysconf(_SC_PAGESIZE) * core_id);
+	if (pram == MAP_FAILED)
+		return -1;
+
+	memcpy(pram, fw->data, fw->size);
+	munmap(pram, fw->size);
+	*loaded = fw->checksum;
+
+	return 0;
+}
@@ -0,0 +1,29 @@
+/*
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ */
+#ifndef _DSPFIRMWARE_H_
+#define _DSPFIRMWARE_H_
+
+#include <stdint.h>
+
+struct dsp_firmware {
+	void *data;
+	uint32_t size;
+	uint32_t checksum;
+};
+
+/* Read firmware image from @path. Return -1 and set errno on failure. */
+int dsp_firmware_open(struct dsp_firmware *fw, const char *path);
+
+void dsp_firmware_close(struct dsp_firmware *fw);
+
+/*
+ * Load firmware to PRAM of core @core_id of core resource @core_fd.
+ * @loaded keeps checksum of the image loaded to the core earlier (0 if none):
+ * the load is skipped if it matches, otherwise it is updated.
+ * Return -1 and set errno on failure.
+ */
+int dsp_firmware_load(const struct dsp_firmware *fw, int core_fd, int core_id,
+		      uint32_t *loaded);
+
+#endif
@@ -18,6 +18,7 @@
 #include <unistd.h>
 
 #include "dspinverse.h"
+#include "dspxyram.h"
 
 const int sdma_burst_size = 8;
 
@@ -29,35 +30,50 @@ static unsigned int tiles_get_number (const struct frame_args frame_data)
 	return DIV_ROUND_UP(frame_data.frame_width, frame_data.tile_width) * DIV_ROUND_UP(frame_data.frame_height, frame_data.tile_height);
 }
 
+/* Generate tiles of the frame grid which intersect region of interest */
 static struct tilesbuffer *tile_generator(const struct frame_args frame_data)
 {
 	int ntiles = tiles_get_number(frame_data);
 	struct tilesbuffer *tb = malloc(sizeof(struct tileinfo) * ntiles + sizeof(struct tilesbuffer));
+	uint32_t index = 0;
 	int i = 0;
 
 	if (!tb)
 		return NULL;
 
-	tb->ntiles = ntiles;
 	for (uint32_t y = 0; y < frame_data.frame_height; y+=frame_data.tile_height)
-		for (uint32_t x = 0; x < frame_data.frame_width; x+=frame_data.tile_width)
+		for (uint32_t x = 0; x < frame_data.frame_width; x+=frame_data.tile_width, index++) {
+			uint32_t width = min(frame_data.tile_width, frame_data.frame_width - x);
+			uint32_t height = min(frame_data.tile_height, frame_data.frame_height - y);
+
+			/* Skipped tiles are neither read nor written by SDMA */
+			if (!dsp_roi_selects(&frame_data.roi, index, x, y, width, height))
+				continue;
+
 			tb->info[i++] = (struct tileinfo){
 				.x = x,
 				.y = y,
-				.width = min(frame_data.tile_width, frame_data.frame_width - x),
-				.height = min(frame_data.tile_height, frame_data.frame_height - y),
+				.width = width,
+				.height = height,
 				.stride = { frame_data.pixel_format, frame_data.pixel_format * frame_data.frame_width }
 			};
+		}
+	tb->ntiles = i;
 
 	return tb;
 }
 
-static struct sdma_descriptor tile2descriptor(const struct frame_args frame_data,
-					      struct tileinfo tile)
+static uint32_t frame_pitch(const struct frame_args frame_data, uint32_t pitch)
+{
+	return pitch ? pitch : frame_data.frame_width * frame_data.pixel_format;
+}
+
+static struct sdma_descriptor tile2descriptor(struct tileinfo tile, uint32_t pitch,
+					      uint32_t offset)
 {
 	struct sdma_descriptor const desc = {
-			.a0e = tile.x * tile.stride[0] + tile.y * tile.stride[1],
-			.astride = frame_data.frame_width * tile.stride[0],
+			.a0e = offset + tile.x * tile.stride[0] + tile.y * pitch,
+			.astride = pitch,
 			.bcnt = tile.height,
 			.asize = tile.width * tile.stride[0],
 			.ccr = BURST_SIZE_8BYTE << SCR_BURST_SIZE_BIT |
@@ -69,118 +85,216 @@ static struct sdma_descriptor tile2descriptor(const struct frame_args frame_data
 	return desc;
 }
 
-static struct delcore30m_buffer *buf_alloc(int fd, enum delcore30m_memory_type type,
-					   int core_num, int size, void *ptr)
+/* Fill chain of descriptors for @ntiles tiles of frame with @pitch and @offset */
+static void tile_chain(struct sdma_descriptor *descs, const struct tileinfo *info,
+		       uint32_t ntiles, uint32_t pitch, uint32_t offset)
 {
-	struct delcore30m_buffer *buffer = (struct delcore30m_buffer *) malloc(sizeof(struct delcore30m_buffer));
-	buffer->size = size;
-	buffer->type = type;
-	buffer->core_num = core_num;
-
-	if (ioctl(fd, ELCIOC_BUF_ALLOC, buffer))
-		error(EXIT_FAILURE, errno, "Failed to allocate buffer");
-
-	if (ptr != NULL) {
-		void *mmap_buf = mmap(NULL, buffer->size,
-				       PROT_READ | PROT_WRITE, MAP_SHARED,
-				       buffer->fd, 0);
-		if (mmap_buf == MAP_FAILED)
-			error(EXIT_FAILURE, errno, "Failed to mmap buffer");
-		memcpy(mmap_buf, ptr, size);
-		munmap(mmap_buf, buffer->size);
+	for (uint32_t i = 0; i < ntiles; ++i) {
+		descs[i] = tile2descriptor(info[i], pitch, offset);
+		descs[i].a_init = (i + 1) * sizeof(struct sdma_descriptor);
 	}
-	return buffer;
-}
-
-void *getbytes(const char *filename, uint32_t *size)
-{
-	void *data;
-
-	FILE *f = fopen(filename, "r");
-	if (f == NULL)
-		error(EXIT_FAILURE, errno, "Failed to open firmware");
-	fseek(f, 0, SEEK_END);
-	*size = ftell(f);
-	fseek(f, 0, SEEK_SET);
-
-	data = malloc(*size);
-	fread(data, 1, *size, f);
-
-	fclose(f);
-
-	return data;
+	descs[ntiles - 1].a_init = 0;
 }
 
-static void load_firmware(struct dsp_struct *data)
+static void load_firmware(struct dsp_struct *data, struct dsp_core *core)
 {
-	uint32_t size;
-	void *fw_data = getbytes(MAKE_STR(FIRMWARE_PATH) "inverse-demo.fw.bin", &size);
-	void *buf_cores = mmap(NULL, size, PROT_WRITE, MAP_SHARED, data->core.fd,
-			       sysconf(_SC_PAGESIZE) * (__builtin_ffs(data->core.mask) - 1));
-	if (buf_cores == MAP_FAILED)
+	if (dsp_firmware_load(&data->firmware, core->core.fd, core->id,
+			      &core->firmware_checksum))
 		error(EXIT_FAILURE, errno, "Failed to load firmware");
-	memcpy(buf_cores, fw_data, size);
-	munmap(buf_cores, size);
 }
 
-static void check_frame_args(const struct frame_args data)
+/* Return -1 if @data can not be processed */
+static int check_frame_args(const struct frame_args data)
 {
+	const char *reason = NULL;
+
 	if (data.frame_width <= 0 || data.frame_height <= 0 ||
 	    data.tile_width <= 0 || data.tile_height <= 0 ||
 	    data.tile_width >= data.frame_width ||
 	    data.tile_height >= data.frame_height)
-		error(EXIT_FAILURE, 0, "Incorrect frame/tile sizes");
-	if ((data.tile_width * data.pixel_format) % sdma_burst_size)
-		error(EXIT_FAILURE, 0, "Tile width in bytes must be multiple of 8");
+		reason = "Incorrect frame/tile sizes";
+	else if ((data.tile_width * data.pixel_format) % sdma_burst_size)
+		reason = "Tile width in bytes must be multiple of 8";
+	else if (frame_pitch(data, data.src_pitch) < data.frame_width * data.pixel_format ||
+		 frame_pitch(data, data.dst_pitch) < data.frame_width * data.pixel_format)
+		reason = "Line pitch is less than frame width";
+	else if ((data.src_pitch | data.src_offset | data.dst_pitch | data.dst_offset) %
+		 sdma_burst_size)
+		reason = "Line pitch and offset must be multiple of 8";
+
+	if (reason) {
+		error(0, 0, "%s", reason);
+		return -1;
+	}
+
+	return 0;
 }
 
-static void allocate_buffers(struct dsp_struct *data, const struct frame_args frame_data)
+/* XYRAM buffers of one core in order of priority for XYRAM of the core */
+enum core_xyram_buffer {
+	XYRAM_TILE0,
+	XYRAM_TILE1,
+	XYRAM_TILEINFO,
+	XYRAM_CHANNELS,
+	XYRAM_CORE_BUFFERS
+};
+
+static const char *const xyram_names[XYRAM_CORE_BUFFERS] = {
+	[XYRAM_TILE0] = "tile 0",
+	[XYRAM_TILE1] = "tile 1",
+	[XYRAM_TILEINFO] = "tile list",
+	[XYRAM_CHANNELS] = "SDMA channels",
+};
+
+/* Plan XYRAM of all cores, where core @i processes @ntiles[i] tiles */
+static int plan_xyram(struct dsp_xyram_plan *plan, const struct dsp_struct *data,
+		      const struct frame_args frame_data, const uint32_t *ntiles)
 {
-	uint8_t core_id = __builtin_ffsl(data->core.mask) - 1;
-	size_t img_size = frame_data.frame_height * frame_data.frame_width * frame_data.pixel_format;
 	size_t tile_size = frame_data.tile_height * frame_data.tile_width * frame_data.pixel_format;
 
-	struct tilesbuffer *tb = tile_generator(frame_data);
-	tb->tilesize = tile_size;
+	dsp_xyram_init(plan);
+	for (int c = 0; c < data->ncores; ++c) {
+		size_t sizes[XYRAM_CORE_BUFFERS] = {
+			[XYRAM_TILE0] = tile_size,
+			[XYRAM_TILE1] = tile_size,
+			[XYRAM_TILEINFO] = sizeof(struct tilesbuffer) +
+					   sizeof(struct tileinfo) * ntiles[c],
+			[XYRAM_CHANNELS] = 2 * sizeof(uint32_t),
+		};
+
+		for (int i = 0; i < XYRAM_CORE_BUFFERS; ++i)
+			dsp_xyram_add(plan, xyram_names[i], data->cores[c].id, sizes[i]);
+	}
 
-	struct sdma_descriptor descs[tb->ntiles];
+	if (dsp_xyram_place(plan)) {
+		error(0, 0, "Tiles %ux%u do not fit XYRAM", frame_data.tile_width,
+		      frame_data.tile_height);
+		return -1;
+	}
+	dsp_xyram_print(plan);
 
-	for (uint32_t i = 0; i < tb->ntiles; ++i) {
-		descs[i] = tile2descriptor(frame_data, tb->info[i]);
-		descs[i].a_init = (i + 1) * sizeof(struct sdma_descriptor);
+	return 0;
+}
+
+/*
+ * Allocate buffers of one core for its part of tiles @first..@first + @ntiles - 1.
+ * XYRAM buffers are placed by @plan, where buffers of the core start at @base.
+ */
+static int allocate_core_buffers(struct dsp_struct *data, struct dsp_core *core,
+				 const struct frame_args frame_data,
+				 const struct tilesbuffer *frame_tb,
+				 uint32_t first, uint32_t ntiles,
+				 const struct dsp_xyram_plan *plan, int base)
+{
+	size_t tile_size = frame_data.tile_height * frame_data.tile_width * frame_data.pixel_format;
+	size_t tb_size = sizeof(struct tilesbuffer) + sizeof(struct tileinfo) * ntiles;
+	int ret = -1;
+
+	struct tilesbuffer *tb = malloc(tb_size);
+	if (!tb) {
+		error(0, errno, "Failed to allocate tiles buffer");
+		return -1;
 	}
-	descs[tb->ntiles - 1].a_init = 0;
+	tb->ntiles = ntiles;
+	tb->tilesize = tile_size;
+	memcpy(tb->info, &frame_tb->info[first], sizeof(struct tileinfo) * ntiles);
+
+	struct sdma_descriptor descs[2][ntiles];
+
+	/* Input chain reads capture buffer, output chain writes result frame */
+	tile_chain(descs[0], tb->info, ntiles, frame_pitch(frame_data, frame_data.src_pitch),
+		   frame_data.src_offset);
+	tile_chain(descs[1], tb->info, ntiles, frame_pitch(frame_data, frame_data.dst_pitch),
+		   frame_data.dst_offset);
 
 	for (int i = 0; i < 2; ++i) {
-		data->tile_buffers[i] = buf_alloc(data->fd, DELCORE30M_MEMORY_XYRAM,
-						  0, tile_size, NULL);
-		data->chain_buffers[i] = buf_alloc(data->fd, DELCORE30M_MEMORY_SYSTEM, core_id,
-						   sizeof(struct sdma_descriptor) * tb->ntiles,
-						   descs);
-		data->code_buffers[i] = buf_alloc(data->fd, DELCORE30M_MEMORY_SYSTEM,
-						  core_id, 60 * tb->ntiles, NULL);
-		data->result_frame[i] = buf_alloc(data->fd, DELCORE30M_MEMORY_SYSTEM,
-						  core_id, img_size, NULL);
-		data->result_frame_data[i] = mmap(NULL, data->result_frame[i]->size,
-						  PROT_READ | PROT_WRITE, MAP_SHARED,
-						  data->result_frame[i]->fd, 0);
-
-		if (data->result_frame_data[i] == MAP_FAILED)
-			error(EXIT_FAILURE, 0, "Failed to mmap result frame");
+		core->tile_buffers[i] = dsp_pool_alloc(&data->pool, DELCORE30M_MEMORY_XYRAM,
+						       dsp_xyram_core(plan, base + XYRAM_TILE0 + i),
+						       tile_size, NULL);
+		core->chain_buffers[i] = dsp_pool_alloc(&data->pool, DELCORE30M_MEMORY_SYSTEM,
+							core->id,
+							sizeof(struct sdma_descriptor) * ntiles,
+							descs[i]);
+		if (!core->tile_buffers[i] || !core->chain_buffers[i])
+			goto free_tb;
+	}
+
+	core->code_buffer_size = 60 * ntiles;
+
+	/* inverse-demo.s takes the tile list and the channels as separate arguments */
+	core->tileinfo_buffer = dsp_pool_alloc(&data->pool, DELCORE30M_MEMORY_XYRAM,
+					       dsp_xyram_core(plan, base + XYRAM_TILEINFO),
+					       tb_size, tb);
+	core->channel_buffer = dsp_pool_alloc(&data->pool, DELCORE30M_MEMORY_XYRAM,
+					      dsp_xyram_core(plan, base + XYRAM_CHANNELS),
+					      2 * sizeof(uint32_t), core->sdma_channels);
+	if (core->tileinfo_buffer && core->channel_buffer)
+		ret = 0;
+free_tb:
+	if (ret)
+		error(0, errno, "Failed to allocate buffers of core %d", core->id);
+	free(tb);
+
+	return ret;
+}
+
+/* Return -1 if buffers for @frame_data can not be allocated */
+static int allocate_buffers(struct dsp_struct *data, const struct frame_args frame_data)
+{
+	struct tilesbuffer *tb = tile_generator(frame_data);
+	if (!tb) {
+		error(0, errno, "Failed to allocate tiles buffer");
+		return -1;
+	}
+	if (tb->ntiles < data->ncores) {
+		error(0, 0, "Frame or its region of interest has less tiles than DSP cores");
+		free(tb);
+		return -1;
+	}
+	if (tb->ntiles < tiles_get_number(frame_data))
+		printf("Region of interest: %u of %u tiles\n", tb->ntiles,
+		       tiles_get_number(frame_data));
+
+	/* Split tiles to contiguous equal parts, so each core processes its band of frame */
+	uint32_t first[MAX_DSP_CORES + 1];
+	uint32_t ntiles[MAX_DSP_CORES];
+
+	for (int i = 0; i <= data->ncores; ++i)
+		first[i] = tb->ntiles * i / data->ncores;
+	for (int i = 0; i < data->ncores; ++i)
+		ntiles[i] = first[i + 1] - first[i];
+
+	struct dsp_xyram_plan plan;
+	int ret = plan_xyram(&plan, data, frame_data, ntiles);
+
+	for (int i = 0; i < data->ncores && !ret; ++i)
+		ret = allocate_core_buffers(data, &data->cores[i], frame_data, tb, first[i],
+					    ntiles[i], &plan, i * XYRAM_CORE_BUFFERS);
+	free(tb);
+	if (ret)
+		return -1;
+
+	data->result_pitch = frame_pitch(frame_data, frame_data.dst_pitch);
+	size_t result_size = frame_data.dst_offset + data->result_pitch * frame_data.frame_height;
+
+	for (int i = 0; i < data->result_count; ++i) {
+		data->result_frame[i] = dsp_pool_alloc(&data->pool, DELCORE30M_MEMORY_SYSTEM,
+						       data->cores[0].id, result_size, NULL);
+		if (!data->result_frame[i]) {
+			error(0, errno, "Failed to allocate result frame");
+			return -1;
+		}
+		data->result_frame_data[i] = dsp_pool_map(data->result_frame[i]);
+		if (!data->result_frame_data[i]) {
+			error(0, errno, "Failed to mmap result frame");
+			return -1;
+		}
 	}
 
-	data->tileinfo_buffer = buf_alloc(data->fd,
-					  DELCORE30M_MEMORY_XYRAM,
-					  core_id,
-					  sizeof(struct tilesbuffer) + sizeof(struct tileinfo) * tb->ntiles,
-					  tb);
-	data->channel_buffer = buf_alloc(data->fd,
-					 DELCORE30M_MEMORY_XYRAM,
-					 core_id, 2 * sizeof(uint32_t),
-					 data->sdma_channels);
+	return 0;
 }
 
-static void job_create(int fd, struct delcore30m_job *job,
+static int job_create(int fd, struct delcore30m_job *job,
 		int *in_buffers, int in_size,
 		int *out_buffers, int out_size,
 		int cores_fd, int sdmas_fd)
@@ -196,89 +310,136 @@ static void job_create(int fd, struct delcore30m_job *job,
 	for (int i = 0; i < out_size; ++i)
 		job->output[i] = out_buffers[i];
 
-	if (ioctl(fd, ELCIOC_JOB_CREATE, job))
-		error(EXIT_FAILURE, 0, "Failed to create job");
+	if (ioctl(fd, ELCIOC_JOB_CREATE, job)) {
+		error(0, errno, "Failed to create job");
+		return -1;
+	}
+
+	return 0;
 }
 
-static void dsp_deinit(const struct dsp_struct *data)
+static void free_buffers(struct dsp_struct *data)
 {
-	close(data->job.fd);
-	close(data->channel_buffer->fd);
-	close(data->tileinfo_buffer->fd);
-	for (int i = 0; i < 2; i++) {
-		close(data->chain_buffers[i]->fd);
-		close(data->code_buffers[i]->fd);
-		close(data->tile_buffers[i]->fd);
-		close(data->result_frame[i]->fd);
-	}
-	close(data->sdma.fd);
-	close(data->core.fd);
-	close(data->fd);
+	/* Jobs of a failed dsp_job_create() are created only in part */
+	for (int c = 0; c < data->ncores; c++)
+		for (int i = 0; i < data->input_count; i++)
+			for (int j = 0; j < data->result_count; j++)
+				if (data->cores[c].chains[i][j].job.fd >= 0)
+					close(data->cores[c].chains[i][j].job.fd);
+	data->input_count = 0;
+
+	dsp_pool_release(&data->pool);
 }
 
-void dsp_init(struct dsp_struct *data, const struct frame_args frame_data)
+static void dsp_deinit(struct dsp_struct *data)
 {
-	check_frame_args(frame_data);
+	free_buffers(data);
+	/* Buffers are closed and unmapped by the pool */
+	dsp_pool_destroy(&data->pool);
 
-	data->fd = open("/dev/elcore0", O_RDWR);
-	if (data->fd < 0)
-		error(EXIT_FAILURE, errno, "Failed to open device file");
+	for (int c = 0; c < data->ncores; c++) {
+		close(data->cores[c].sdma.fd);
+		close(data->cores[c].core.fd);
+	}
+	close(data->fd);
+	dsp_firmware_close(&data->firmware);
+}
 
-	data->core.type = DELCORE30M_CORE;
-	data->core.num = 1;
+static void core_init(struct dsp_struct *data, struct dsp_core *core)
+{
+	core->core.type = DELCORE30M_CORE;
+	core->core.num = 1;
 
-	if (ioctl(data->fd, ELCIOC_RESOURCE_REQUEST, &data->core))
+	if (ioctl(data->fd, ELCIOC_RESOURCE_REQUEST, &core->core))
 		error(EXIT_FAILURE, errno, "Failed to request DELCORE30M_CORE");
+	core->id = __builtin_ffs(core->core.mask) - 1;
+	core->firmware_checksum = 0;
 
-	load_firmware(data);
+	load_firmware(data, core);
 
-	data->sdma.type = DELCORE30M_SDMA;
-	data->sdma.num = 2;
+	core->sdma.type = DELCORE30M_SDMA;
+	core->sdma.num = 2;
 
-	if (ioctl(data->fd, ELCIOC_RESOURCE_REQUEST, &data->sdma))
+	if (ioctl(data->fd, ELCIOC_RESOURCE_REQUEST, &core->sdma))
 		error(EXIT_FAILURE, errno, "Failed to request DELCORE30M_SDMA");
 
-	uint8_t sdma_msk = data->sdma.mask;
+	uint8_t sdma_msk = core->sdma.mask;
 	for (int i = 0; i < 2; ++i) {
-		data->sdma_channels[i] = __builtin_ffs(sdma_msk) - 1;
-		sdma_msk &= ~(1 << data->sdma_channels[i]);
+		core->sdma_channels[i] = __builtin_ffs(sdma_msk) - 1;
+		sdma_msk &= ~(1 << core->sdma_channels[i]);
 	}
-
-	allocate_buffers(data, frame_data);
-	printf("DELcore-30M initialize OK\n");
 }
 
-void dsp_job_create(struct dsp_struct *data, const int bufs_fd[], const int count)
+void dsp_open(struct dsp_struct *data, int depth, int ncores)
 {
-	int input_temp[] = {
-			data->result_frame[1]->fd, data->tile_buffers[0]->fd, data->channel_buffer->fd, data->tile_buffers[1]->fd,
-			data->chain_buffers[0]->fd, data->chain_buffers[1]->fd, data->tileinfo_buffer->fd};
-	int input_temp_size = 7;
+	if (depth < 2 || depth > MAX_PIPELINE_DEPTH)
+		error(EXIT_FAILURE, 0, "Pipeline depth must be in range 2..%d",
+		      MAX_PIPELINE_DEPTH);
+	if (ncores < 1 || ncores > MAX_DSP_CORES)
+		error(EXIT_FAILURE, 0, "Number of DSP cores must be in range 1..%d",
+		      MAX_DSP_CORES);
+	data->depth = depth;
+	data->ncores = ncores;
+	data->result_count = depth + 1;
+	data->inflight_head = 0;
+	data->inflight_count = 0;
+	data->input_count = 0;
 
-	int *input = (int *) malloc(sizeof(int) * (input_temp_size + count));
+	data->fd = open("/dev/elcore0", O_RDWR);
+	if (data->fd < 0)
+		error(EXIT_FAILURE, errno, "Failed to open device file");
+	dsp_pool_init(&data->pool, data->fd);
 
-	for (int i = 0; i < count; ++i)
-		input[i] = bufs_fd[i];
-	for (int i = count; i < input_temp_size + count; ++i)
-		input[i] = input_temp[i - count];
+	if (dsp_firmware_open(&data->firmware, MAKE_STR(FIRMWARE_PATH) "inverse-demo.fw.bin"))
+		error(EXIT_FAILURE, errno, "Failed to open firmware");
+
+	/* Cores are requested one by one, so each core gets its own firmware instance */
+	for (int i = 0; i < ncores; ++i)
+		core_init(data, &data->cores[i]);
+}
+
+void dsp_setup(struct dsp_struct *data, const struct frame_args frame_data)
+{
+	if (check_frame_args(frame_data) || allocate_buffers(data, frame_data))
+		exit(EXIT_FAILURE);
+	printf("DELcore-30M initialize OK (%d core%s)\n", data->ncores,
+	       data->ncores > 1 ? "s" : "");
+}
+
+void dsp_init(struct dsp_struct *data, const struct frame_args frame_data, int depth,
+	      int ncores)
+{
+	if (check_frame_args(frame_data))
+		exit(EXIT_FAILURE);
+	dsp_open(data, depth, ncores);
+	dsp_setup(data, frame_data);
+}
 
-	int output[] = {data->result_frame[0]->fd, data->code_buffers[0]->fd, data->code_buffers[1]->fd};
+static int create_jobs(struct dsp_struct *data, const int bufs_fd[], const int count);
 
-	job_create(data->fd, &data->job, input, input_temp_size + count,
-		   output, 3, data->core.fd, data->sdma.fd);
+int dsp_try_setup(struct dsp_struct *data, const struct frame_args frame_data,
+		  const int bufs_fd[], const int count)
+{
+	if (check_frame_args(frame_data) || allocate_buffers(data, frame_data) ||
+	    create_jobs(data, bufs_fd, count)) {
+		free_buffers(data);
+		return -1;
+	}
 
-	free(input);
+	return 0;
 }
 
-static int dma_init(struct dsp_struct *data, int fd_src, int fd_dst) {
+static int dma_init(struct dsp_struct *data, struct dsp_core *core, struct dsp_chain *chain,
+		    int fd_src, int fd_dst)
+{
 	struct delcore30m_dmachain dmachain_input = {
-		.job = data->job.fd,
-		.core = __builtin_ffs(data->core.mask) - 1,
+		.job = chain->job.fd,
+		.core = core->id,
 		.external = fd_src,
-		.internal = { data->tile_buffers[0]->fd, data->tile_buffers[1]->fd },
-		.chain = data->chain_buffers[0]->fd,
-		.codebuf = data->code_buffers[0]->fd,
-		.channel = {SDMA_CHANNEL_INPUT,  data->sdma_channels[0]}
+		.internal = { core->tile_buffers[0]->fd, core->tile_buffers[1]->fd },
+		.chain = core->chain_buffers[0]->fd,
+		.codebuf = chain->code_buffers[0]->fd,
+		.channel = {SDMA_CHANNEL_INPUT,  core->sdma_channels[0]}
 	};
 	if (ioctl(data->fd, ELCIOC_DMACHAIN_SETUP, &dmachain_input)) {
 		printf("Failed to setup input dmachain\n");
@@ -286,13 +447,13 @@ static int dma_init(struct dsp_struct *data, int fd_src, int fd_dst) {
 	}
 
 	struct delcore30m_dmachain dmachain_output = {
-		.job = data->job.fd,
-		.core = __builtin_ffs(data->core.mask) - 1,
+		.job = chain->job.fd,
+		.core = core->id,
 		.external = fd_dst,
-		.internal = { data->tile_buffers[0]->fd, data->tile_buffers[1]->fd },
-		.chain = data->chain_buffers[1]->fd,
-		.codebuf = data->code_buffers[1]->fd,
-		.channel = {SDMA_CHANNEL_OUTPUT,  data->sdma_channels[1]}
+		.internal = { core->tile_buffers[0]->fd, core->tile_buffers[1]->fd },
+		.chain = core->chain_buffers[1]->fd,
+		.codebuf = chain->code_buffers[1]->fd,
+		.channel = {SDMA_CHANNEL_OUTPUT,  core->sdma_channels[1]}
 	};
 	if (ioctl(data->fd, ELCIOC_DMACHAIN_SETUP, &dmachain_output)) {
 		printf("Failed to setup output dmachain\n");
@@ -302,18 +463,87 @@ static int dma_init(struct dsp_struct *data, int fd_src, int fd_dst) {
 	return EXIT_SUCCESS;
 }
 
-static int job_start(struct dsp_struct *data)
+/*
+ * Create one job per (capture buffer, result buffer) pair on each core and set up
+ * its DMA chains. SDMA code does not depend on frame contents, so it is generated
+ * only once here and frame_submit() just picks the prepared jobs.
+ * Return -1 on failure, jobs created so far are closed by free_buffers().
+ */
+static int create_jobs(struct dsp_struct *data, const int bufs_fd[], const int count)
 {
-	int ret;
-	sigset_t mask;
+	if (count < 2 || count > MAX_INPUT_BUFFERS) {
+		error(0, 0, "Number of input buffers must be in range 2..%d", MAX_INPUT_BUFFERS);
+		return -1;
+	}
 
-	if (ioctl(data->fd, ELCIOC_JOB_ENQUEUE, &data->job)) {
-		puts("Failed to enqueue job");
-		return EXIT_FAILURE;
+	for (int i = 0; i < count; ++i)
+		data->input_fds[i] = bufs_fd[i];
+	for (int c = 0; c < data->ncores; ++c)
+		for (int i = 0; i < count; ++i)
+			for (int j = 0; j < data->result_count; ++j)
+				data->cores[c].chains[i][j].job.fd = -1;
+	data->input_count = count;
+
+	for (int c = 0; c < data->ncores; ++c) {
+		struct dsp_core *core = &data->cores[c];
+
+		for (int i = 0; i < count; ++i)
+			for (int j = 0; j < data->result_count; ++j) {
+				struct dsp_chain *chain = &core->chains[i][j];
+
+				for (int k = 0; k < 2; ++k)
+					if (!(chain->code_buffers[k] =
+						      dsp_pool_alloc(&data->pool,
+								     DELCORE30M_MEMORY_SYSTEM,
+								     core->id,
+								     core->code_buffer_size,
+								     NULL))) {
+						error(0, errno,
+						      "Failed to allocate DMA code buffer");
+						return -1;
+					}
+
+				/*
+				 * Firmware expects exactly two capture buffers in front of
+				 * its arguments, so pass the paired one and its neighbour.
+				 */
+				int input[] = {
+					bufs_fd[i], bufs_fd[(i + 1) % count],
+					data->result_frame[(j + 1) % data->result_count]->fd,
+					core->tile_buffers[0]->fd, core->channel_buffer->fd,
+					core->tile_buffers[1]->fd, core->chain_buffers[0]->fd,
+					core->chain_buffers[1]->fd, core->tileinfo_buffer->fd};
+				int output[] = {data->result_frame[j]->fd,
+						chain->code_buffers[0]->fd,
+						chain->code_buffers[1]->fd};
+
+				if (job_create(data->fd, &chain->job, input, 9, output, 3,
+					       core->core.fd, core->sdma.fd))
+					return -1;
+				if (dma_init(data, core, chain, bufs_fd[i],
+					     data->result_frame[j]->fd)) {
+					error(0, errno, "Failed to setup DMA chains");
+					return -1;
+				}
+			}
 	}
 
+	return 0;
+}
+
+void dsp_job_create(struct dsp_struct *data, const int bufs_fd[], const int count)
+{
+	if (create_jobs(data, bufs_fd, count))
+		exit(EXIT_FAILURE);
+}
+
+static int job_wait(struct dsp_struct *data, struct delcore30m_job *job)
+{
+	int ret;
+	sigset_t mask;
+
 	struct pollfd fds = {
-		.fd = data->job.fd,
+		.fd = job->fd,
 		.events = POLLIN | POLLPRI | POLLOUT | POLLHUP
 	};
 
@@ -327,18 +557,18 @@ static int job_start(struct dsp_struct *data)
 		return EXIT_FAILURE;
 	}
 	if (ret == 0) {
-		if (ioctl(data->fd, ELCIOC_JOB_CANCEL, &data->job)) {
+		if (ioctl(data->fd, ELCIOC_JOB_CANCEL, job)) {
 			puts("Failed to cancel job");
 			return EXIT_FAILURE;
 		}
 		puts("Job timed out");
 		return EXIT_FAILURE;
 	}
-	if (ioctl(data->fd, ELCIOC_JOB_STATUS, &data->job)) {
+	if (ioctl(data->fd, ELCIOC_JOB_STATUS, job)) {
 		puts("Failed to get job status");
 		return EXIT_FAILURE;
 	}
-	if (data->job.rc != DELCORE30M_JOB_SUCCESS) {
+	if (job->rc != DELCORE30M_JOB_SUCCESS) {
 		puts("Job failed");
 		return EXIT_FAILURE;
 	}
@@ -346,20 +576,88 @@ static int job_start(struct dsp_struct *data)
 	return EXIT_SUCCESS;
 }
 
+/* Wait for jobs of cores 0..@ncores - 1 for one frame */
+static int frame_join(struct dsp_struct *data, int input_ind, int dma_buf_ind, int ncores)
+{
+	int ret = EXIT_SUCCESS;
+
+	for (int c = 0; c < ncores; ++c)
+		if (job_wait(data, &data->cores[c].chains[input_ind][dma_buf_ind].job))
+			ret = EXIT_FAILURE;
+
+	return ret;
+}
+
 void dsp_free(struct dsp_struct *data)
 {
-	munmap(data->result_frame_data[0], data->result_frame[0]->size);
-	munmap(data->result_frame_data[1], data->result_frame[1]->size);
+	int dest_buf;
+
+	while (data->inflight_count)
+		frame_wait(data, &dest_buf);
+
 	dsp_deinit(data);
 }
 
-int frame_inverse(struct dsp_struct *data, int buf_fd, int dma_buf_ind)
+static int find_input(struct dsp_struct *data, int buf_fd)
 {
-	if (dma_init(data, buf_fd, data->result_frame[dma_buf_ind]->fd))
+	for (int i = 0; i < data->input_count; ++i)
+		if (data->input_fds[i] == buf_fd)
+			return i;
+
+	return -1;
+}
+
+int frame_submit(struct dsp_struct *data, int buf_fd, int dma_buf_ind)
+{
+	int input_ind = find_input(data, buf_fd);
+
+	if (input_ind < 0 || dma_buf_ind < 0 || dma_buf_ind >= data->result_count) {
+		puts("Unknown input or result buffer");
 		return EXIT_FAILURE;
+	}
 
-	if (job_start(data))
+	if (data->inflight_count == data->depth) {
+		puts("Too many frames submitted");
 		return EXIT_FAILURE;
+	}
+
+	for (int c = 0; c < data->ncores; ++c)
+		if (ioctl(data->fd, ELCIOC_JOB_ENQUEUE,
+			  &data->cores[c].chains[input_ind][dma_buf_ind].job)) {
+			puts("Failed to enqueue job");
+			/* Do not leave a half of frame running on other cores */
+			frame_join(data, input_ind, dma_buf_ind, c);
+			return EXIT_FAILURE;
+		}
+
+	int tail = (data->inflight_head + data->inflight_count) % data->depth;
+	data->inflight_src[tail] = input_ind;
+	data->inflight_dest[tail] = dma_buf_ind;
+	data->inflight_count++;
 
 	return EXIT_SUCCESS;
 }
+
+int frame_wait(struct dsp_struct *data, int *dma_buf_ind)
+{
+	if (!data->inflight_count) {
+		puts("No frames submitted");
+		return EXIT_FAILURE;
+	}
+
+	int input_ind = data->inflight_src[data->inflight_head];
+	*dma_buf_ind = data->inflight_dest[data->inflight_head];
+	data->inflight_head = (data->inflight_head + 1) % data->depth;
+	data->inflight_count--;
+
+	/* Result frame is complete only when all cores have written their tiles */
+	return frame_join(data, input_ind, *dma_buf_ind, data->ncores);
+}
+
+int frame_inverse(struct dsp_struct *data, int buf_fd, int dma_buf_ind)
+{
+	if (frame_submit(data, buf_fd, dma_buf_ind))
+		return EXIT_FAILURE;
+
+	return frame_wait(data, &dma_buf_ind);
+}
@@ -10,6 +10,10 @@
 
 #include <linux/delcore30m.h>
 
+#include "dspfirmware.h"
+#include "dsppool.h"
+#include "dsproi.h"
+
 #define SCR_BURST_SIZE_BIT 1
 #define DST_BURST_SIZE_BIT 15
 
@@ -24,6 +28,18 @@
 
 #define AUTO_INCREMENT 1
 
+/// Maximum number of capture buffers that can be passed to dsp_job_create()
+#define MAX_INPUT_BUFFERS 8
+
+/// Maximum number of frames processed by DSP at the same time
+#define MAX_PIPELINE_DEPTH 3
+
+/// One more result frame than pipeline depth is kept for the frame on display
+#define MAX_RESULT_FRAMES (MAX_PIPELINE_DEPTH + 1)
+
+/// Maximum number of DSP cores sharing tiles of one frame
+#define MAX_DSP_CORES 2
+
 /// Integer division with rounding up
 #define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
 
@@ -64,30 +80,107 @@ struct frame_args {
 	uint16_t tile_width;
 	uint16_t tile_height;
 	enum pixel_format pixel_format;
+	/// Bytes per line of capture buffers, 0 for lines without padding
+	uint32_t src_pitch;
+	/// Offset of the first pixel in capture buffers
+	uint32_t src_offset;
+	/// Bytes per line of result frames, 0 for lines without padding
+	uint32_t dst_pitch;
+	/// Offset of the first pixel in result frames
+	uint32_t dst_offset;
+	/// Tiles to process, whole frame if the region is empty
+	struct dsp_roi roi;
 };
 
-struct dsp_struct {
-	int fd;
+/* Job with DMA chains prepared for one (capture buffer, result buffer) pair */
+struct dsp_chain {
+	struct delcore30m_job job;
+	struct delcore30m_buffer *code_buffers[2];
+};
+
+/* DSP core with its own firmware instance, which processes a band of frame tiles */
+struct dsp_core {
+	int id;
 	struct delcore30m_resource core;
 	struct delcore30m_resource sdma;
-	struct delcore30m_job job;
 
-	//source and result frames
-	struct delcore30m_buffer *result_frame[2];
 	struct delcore30m_buffer *tile_buffers[2];
-	struct delcore30m_buffer *code_buffers[2];
 	struct delcore30m_buffer *chain_buffers[2];
 	struct delcore30m_buffer *tileinfo_buffer;
 	struct delcore30m_buffer *channel_buffer;
 
-	uint8_t *result_frame_data[2];
-
 	uint32_t sdma_channels[2];
+
+	struct dsp_chain chains[MAX_INPUT_BUFFERS][MAX_RESULT_FRAMES];
+	size_t code_buffer_size;
+
+	/// Checksum of firmware loaded to the core
+	uint32_t firmware_checksum;
 };
 
-void dsp_init(struct dsp_struct *data, const struct frame_args frame_data);
+struct dsp_struct {
+	int fd;
+	struct dsp_pool pool;
+	struct dsp_firmware firmware;
+	int ncores;
+	struct dsp_core cores[MAX_DSP_CORES];
+
+	//result frames are shared by all cores
+	struct delcore30m_buffer *result_frame[MAX_RESULT_FRAMES];
+
+	uint8_t *result_frame_data[MAX_RESULT_FRAMES];
+	/// Bytes per line of result frames
+	uint32_t result_pitch;
+	int result_count;
+	int depth;
+
+	int input_fds[MAX_INPUT_BUFFERS];
+	int input_count;
+
+	//submitted frames in order of submission
+	int inflight_src[MAX_PIPELINE_DEPTH];
+	int inflight_dest[MAX_PIPELINE_DEPTH];
+	int inflight_head;
+	int inflight_count;
+};
+
+/* Open DSP and allocate @depth + 1 result frames, so up to @depth frames can be
+ * processed at the same time (2 <= depth <= MAX_PIPELINE_DEPTH) while one more is
+ * on display. Tiles of each frame are split between @ncores DSP cores
+ * (1 <= ncores <= MAX_DSP_CORES).
+ */
+void dsp_init(struct dsp_struct *data, const struct frame_args frame_data, int depth,
+	      int ncores);
+
+/*
+ * dsp_init() in two steps. dsp_open() opens the device, requests cores and
+ * loads firmware, it does not depend on frame size and may run concurrently
+ * with capture and display setup. dsp_setup() allocates buffers for @frame_data.
+ */
+void dsp_open(struct dsp_struct *data, int depth, int ncores);
+void dsp_setup(struct dsp_struct *data, const struct frame_args frame_data);
 void dsp_free(struct dsp_struct *data);
 void dsp_job_create(struct dsp_struct *data, const int bufs_fd[], const int count);
+
+/*
+ * dsp_setup() and dsp_job_create() after dsp_open(), which return -1 instead of
+ * exit if @frame_data can not be set up, so other tiles can be tried.
+ */
+int dsp_try_setup(struct dsp_struct *data, const struct frame_args frame_data,
+		  const int bufs_fd[], const int count);
+
+/* Enqueue inversion of capture buffer @source_fd to result frame @dest_buf and
+ * return without waiting for the DSP.
+ * Return EXIT_SUCCESS or EXIT_FAILURE.
+ */
+int frame_submit(struct dsp_struct *data, int source_fd, int dest_buf);
+
+/* Wait for the oldest submitted frame and store its result frame index to @dest_buf.
+ * Return EXIT_SUCCESS or EXIT_FAILURE.
+ */
+int frame_wait(struct dsp_struct *data, int *dest_buf);
+
+/* Process one frame synchronously: frame_submit() followed by frame_wait() */
 int frame_inverse(struct dsp_struct *data, int source_fd, int dest_buf);
 
 #endif
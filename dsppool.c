@@ -0,0 +1,174 @@
+/*
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "dsppool.h"
+
+struct dsp_pool_buffer {
+	struct delcore30m_buffer buffer;
+	void *data;
+	struct dsp_pool_buffer *next;
+};
+
+static struct dsp_pool_buffer *to_pool_buffer(struct delcore30m_buffer *buffer)
+{
+	return (struct dsp_pool_buffer *)buffer;
+}
+
+void dsp_pool_init(struct dsp_pool *pool, int fd)
+{
+	pool->fd = fd;
+	pool->used = NULL;
+	pool->free = NULL;
+}
+
+static void free_list(struct dsp_pool_buffer *buf)
+{
+	while (buf) {
+		struct dsp_pool_buffer *next = buf->next;
+
+		if (buf->data)
+			munmap(buf->data, buf->buffer.size);
+		close(buf->buffer.fd);
+		free(buf);
+		buf = next;
+	}
+}
+
+void dsp_pool_destroy(struct dsp_pool *pool)
+{
+	free_list(pool->used);
+	dsp_pool_trim(pool);
+	pool->used = NULL;
+}
+
+static struct dsp_pool_buffer *take_free(struct dsp_pool *pool,
+					 enum delcore30m_memory_type type,
+					 int core_num, size_t size)
+{
+	for (struct dsp_pool_buffer **it = &pool->free; *it; it = &(*it)->next) {
+		struct dsp_pool_buffer *buf = *it;
+
+		if (buf->buffer.type == type && buf->buffer.core_num == core_num &&
+		    buf->buffer.size == size) {
+			*it = buf->next;
+			return buf;
+		}
+	}
+
+	return NULL;
+}
+
+struct delcore30m_buffer *dsp_pool_alloc(struct dsp_pool *pool,
+					 enum delcore30m_memory_type type,
+					 int core_num, size_t size, const void *init)
+{
+	struct dsp_pool_buffer *buf = take_free(pool, type, core_num, size);
+
+	if (!buf) {
+		buf = calloc(1, sizeof(*buf));
+		if (!buf)
+			return NULL;
+
+		buf->buffer.type = type;
+		buf->buffer.core_num = core_num;
+		buf->buffer.size = size;
+		if (ioctl(pool->fd, ELCIOC_BUF_ALLOC, &buf->buffer)) {
+			int err = errno;
+
+			free(buf);
+			errno = err;
+			return NULL;
+		}
+	}
+
+	buf->next = pool->used;
+	pool->used = buf;
+
+	if (init) {
+		void *data = dsp_pool_map(&buf->buffer);
+
+		if (!data)
+			return NULL;
+		memcpy(data, init, size);
+	}
+
+	return &buf->buffer;
+}
+
+struct delcore30m_buffer *dsp_pool_alloc_parts(struct dsp_pool *pool,
+					       enum delcore30m_memory_type type,
+					       int core_num, int count, const size_t *sizes,
+					       const void *const *init, size_t *offsets)
+{
+	size_t size = 0;
+	bool copy = false;
+
+	for (int i = 0; i < count; ++i) {
+		size = (size + DSP_POOL_PART_ALIGN - 1) & ~(size_t)(DSP_POOL_PART_ALIGN - 1);
+		offsets[i] = size;
+		size += sizes[i];
+		copy |= init[i] != NULL;
+	}
+
+	struct delcore30m_buffer *buffer = dsp_pool_alloc(pool, type, core_num, size, NULL);
+
+	if (!buffer || !copy)
+		return buffer;
+
+	uint8_t *data = dsp_pool_map(buffer);
+
+	if (!data)
+		return NULL;
+	for (int i = 0; i < count; ++i)
+		if (init[i])
+			memcpy(data + offsets[i], init[i], sizes[i]);
+
+	return buffer;
+}
+
+void dsp_pool_release(struct dsp_pool *pool)
+{
+	while (pool->used) {
+		struct dsp_pool_buffer *buf = pool->used;
+
+		pool->used = buf->next;
+		buf->next = NULL;
+		if (buf->buffer.type == DELCORE30M_MEMORY_XYRAM) {
+			free_list(buf);
+			continue;
+		}
+		buf->next = pool->free;
+		pool->free = buf;
+	}
+}
+
+void dsp_pool_trim(struct dsp_pool *pool)
+{
+	free_list(pool->free);
+	pool->free = NULL;
+}
+
+void *dsp_pool_map(struct delcore30m_buffer *buffer)
+{
+	struct dsp_pool_buffer *buf = to_pool_buffer(buffer);
+
+	if (!buf->data) {
+		void *data = mmap(NULL, buf->buffer.size, PROT_READ | PROT_WRITE,
+				  MAP_SHARED, buf->buffer.fd, 0);
+
+		if (data == MAP_FAILED)
+			return NULL;
+		buf->data = data;
+	}
+
+	return buf->data;
+}
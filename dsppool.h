@@ -0,0 +1,66 @@
+/*
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ */
+#ifndef _DSPPOOL_H_
+#define _DSPPOOL_H_
+
+#include <stddef.h>
+
+#include <linux/delcore30m.h>
+
+struct dsp_pool_buffer;
+
+/*
+ * Pool of DSP buffers. Buffers of a released pipeline are kept for reuse by
+ * next allocation of the same type, core and size when the pipeline is created
+ * again. Driver passes whole buffers to firmware, so only objects which
+ * firmware finds by offsets are carved from one buffer by dsp_pool_alloc_parts().
+ * All buffers are closed by dsp_pool_destroy().
+ */
+struct dsp_pool {
+	int fd;
+	struct dsp_pool_buffer *used;
+	struct dsp_pool_buffer *free;
+};
+
+void dsp_pool_init(struct dsp_pool *pool, int fd);
+
+/* Close all buffers of the pool, including ones which are still in use.
+ * The pool can allocate new buffers after that.
+ */
+void dsp_pool_destroy(struct dsp_pool *pool);
+
+/* Allocate buffer and copy @size bytes of @init to it unless @init is NULL.
+ * Return NULL and set errno on failure.
+ */
+struct delcore30m_buffer *dsp_pool_alloc(struct dsp_pool *pool,
+					 enum delcore30m_memory_type type,
+					 int core_num, size_t size, const void *init);
+
+/// Alignment of parts carved from one buffer, DSP loads 64-bit words
+#define DSP_POOL_PART_ALIGN 8
+
+/* Allocate one buffer for @count parts of @sizes bytes, store offsets of parts
+ * to @offsets and copy @init[i] to part i unless it is NULL. Parts share one
+ * fd, job argument and XYRAM placement instead of taking a buffer each.
+ * Return NULL and set errno on failure.
+ */
+struct delcore30m_buffer *dsp_pool_alloc_parts(struct dsp_pool *pool,
+					       enum delcore30m_memory_type type,
+					       int core_num, int count, const size_t *sizes,
+					       const void *const *init, size_t *offsets);
+
+/* Return all buffers to the pool for reuse with their mappings. XYRAM buffers
+ * are closed, as a core has too little XYRAM to keep unused ones.
+ */
+void dsp_pool_release(struct dsp_pool *pool);
+
+/* Close buffers, which were released and not allocated again */
+void dsp_pool_trim(struct dsp_pool *pool);
+
+/* Return host mapping of the buffer. Mapping is created once and kept until
+ * the buffer is closed. Return NULL on failure.
+ */
+void *dsp_pool_map(struct delcore30m_buffer *buffer);
+
+#endif
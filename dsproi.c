@@ -0,0 +1,46 @@
+/*
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ */
+#include <stdio.h>
+
+#include "dsproi.h"
+
+int dsp_roi_add(struct dsp_roi *roi, const char *arg)
+{
+	unsigned int x, y, width, height;
+	char end;
+
+	if (roi->nrects == MAX_ROI_RECTS ||
+	    sscanf(arg, "%ux%u+%u+%u%c", &width, &height, &x, &y, &end) != 4 ||
+	    !width || !height || x + width > UINT16_MAX || y + height > UINT16_MAX)
+		return -1;
+
+	roi->rects[roi->nrects++] = (struct dsp_rect) {
+		.x = x,
+		.y = y,
+		.width = width,
+		.height = height
+	};
+
+	return 0;
+}
+
+bool dsp_roi_selects(const struct dsp_roi *roi, uint32_t index, uint32_t x, uint32_t y,
+		     uint32_t width, uint32_t height)
+{
+	if (roi->tile_mask)
+		return roi->tile_mask[index / 8] & (1 << index % 8);
+
+	if (!roi->nrects)
+		return true;
+
+	for (int i = 0; i < roi->nrects; ++i) {
+		const struct dsp_rect *r = &roi->rects[i];
+
+		if (x < r->x + r->width && r->x < x + width &&
+		    y < r->y + r->height && r->y < y + height)
+			return true;
+	}
+
+	return false;
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ */
+#ifndef _DSPROI_H_
+#define _DSPROI_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/// Maximum number of rectangles of region of interest
+#define MAX_ROI_RECTS 8
+
+struct dsp_rect {
+	uint16_t x, y;
+	uint16_t width, height;
+};
+
+/*
+ * Region of interest of a frame. DSP processes only tiles which intersect
+ * the region, other parts of result frames are left untouched. Empty region
+ * covers the whole frame.
+ */
+struct dsp_roi {
+	int nrects;
+	struct dsp_rect rects[MAX_ROI_RECTS];
+	/// Bit per tile of the tile grid in row-major order, @rects are ignored if set
+	const uint8_t *tile_mask;
+};
+
+/*
+ * Add rectangle given as "<width>x<height>+<x>+<y>" to @roi.
+ * Return 0 or -1 if @arg is malformed or @roi is full.
+ */
+int dsp_roi_add(struct dsp_roi *roi, const char *arg);
+
+/* Return true if tile @index at @x, @y of @width x @height has to be processed */
+bool dsp_roi_selects(const struct dsp_roi *roi, uint32_t index, uint32_t x, uint32_t y,
+		     uint32_t width, uint32_t height);
+
+#endif
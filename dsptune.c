@@ -0,0 +1,180 @@
+/*
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dsptune.h"
+#include "stages.h"
+
+#define TILE_WIDTH_STEP 32
+#define TILE_HEIGHT_STEP 8
+#define SDMA_BURST_SIZE 8
+
+/// XYRAM reserved for channels, kernel number and other small buffers
+#define XYRAM_RESERVE 1024
+
+/// XYRAM taken by description and state of each tile
+#define TILEINFO_SIZE (sizeof(struct tileinfo) + sizeof(struct tile_state))
+
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+
+static size_t xyram_budget(const struct dsp_tune_args *args)
+{
+	return (DSP_XYRAM_SIZE - XYRAM_RESERVE - args->data_size) / args->xyram_tiles;
+}
+
+/* Return true if tiles of one core and their descriptions fit XYRAM */
+static int tile_fits(const struct dsp_tune_args *args, int tile_width, int tile_height)
+{
+	size_t tile_size = (size_t)(tile_width + 2 * args->halo) *
+			   (tile_height + 2 * args->halo) * args->pixel_format;
+	size_t mask_size = (size_t)DIV_ROUND_UP(tile_width, 8) * tile_height;
+	int ntiles = DIV_ROUND_UP(args->frame_width, tile_width) *
+		     DIV_ROUND_UP(args->frame_height, tile_height);
+	int core_tiles = DIV_ROUND_UP(ntiles, args->ncores);
+
+	if ((tile_width * args->pixel_format) % SDMA_BURST_SIZE ||
+	    tile_width >= args->frame_width || tile_height >= args->frame_height ||
+	    ntiles < args->ncores)
+		return 0;
+
+	return tile_size * args->xyram_tiles + mask_size * args->xyram_mask_tiles +
+	       sizeof(struct tilesbuffer) +
+	       TILEINFO_SIZE * core_tiles + XYRAM_RESERVE + args->data_size <= DSP_XYRAM_SIZE;
+}
+
+double dsp_tune(const struct dsp_tune_args *args, dsp_tune_measure measure, void *arg,
+		struct dsp_tile_geometry *tile, int verbose)
+{
+	double best = -1;
+
+	for (int w = TILE_WIDTH_STEP; w < args->frame_width; w += TILE_WIDTH_STEP)
+		for (int h = TILE_HEIGHT_STEP; h < args->frame_height; h += TILE_HEIGHT_STEP) {
+			size_t tile_size = (size_t)w * h * args->pixel_format;
+
+			/*
+			 * Per-tile overhead dominates for tiles which use less than half
+			 * of XYRAM, skip them unless the frame is too small for bigger ones
+			 */
+			if (tile_size * 2 < xyram_budget(args) && tile_fits(args, w, h * 2))
+				continue;
+			if (!tile_fits(args, w, h))
+				break;
+
+			double time = measure(w, h, arg);
+
+			if (verbose)
+				printf("Tile %dx%d: %.3f ms\n", w, h, time * 1e3);
+			if (time >= 0 && (best < 0 || time < best)) {
+				best = time;
+				tile->width = w;
+				tile->height = h;
+			}
+		}
+
+	return best;
+}
+
+/* Entries of other stage lists, halo or mask output are kept apart */
+static const char *entry_stages(const struct dsp_tune_args *args)
+{
+	return args->stages[0] ? args->stages : "-";
+}
+
+static int parse_entry(const char *line, char *kernel, struct dsp_tune_args *args,
+		       int *tile_width, int *tile_height, double *time)
+{
+	return sscanf(line, "%31s %dx%d %d %d %127s %d %d %dx%d %lf", kernel,
+		      &args->frame_width, &args->frame_height, &args->pixel_format,
+		      &args->ncores, args->stages, &args->halo, &args->mask, tile_width,
+		      tile_height, time) == 11 ? 0 : -1;
+}
+
+static int entry_matches(const char *kernel, const struct dsp_tune_args *args,
+			 const char *entry_kernel, const struct dsp_tune_args *entry)
+{
+	return !strcmp(kernel, entry_kernel) && args->frame_width == entry->frame_width &&
+	       args->frame_height == entry->frame_height &&
+	       args->pixel_format == entry->pixel_format && args->ncores == entry->ncores &&
+	       !strcmp(entry_stages(args), entry_stages(entry)) && args->halo == entry->halo &&
+	       args->mask == entry->mask;
+}
+
+int dsp_profile_load(const char *path, const char *kernel,
+		     const struct dsp_tune_args *args, struct dsp_tile_geometry *tile)
+{
+	FILE *f = fopen(path, "r");
+	char line[256];
+	int ret = -1;
+
+	if (!f)
+		return -1;
+
+	while (fgets(line, sizeof(line), f)) {
+		struct dsp_tune_args entry;
+		char entry_kernel[32];
+		int w, h;
+		double time;
+
+		if (line[0] == '#' || parse_entry(line, entry_kernel, &entry, &w, &h, &time))
+			continue;
+		if (entry_matches(kernel, args, entry_kernel, &entry) &&
+		    tile_fits(args, w, h)) {
+			tile->width = w;
+			tile->height = h;
+			ret = 0;
+		}
+	}
+	fclose(f);
+
+	return ret;
+}
+
+int dsp_profile_save(const char *path, const char *kernel,
+		     const struct dsp_tune_args *args, const struct dsp_tile_geometry *tile,
+		     double time)
+{
+	char tmp_path[256];
+	char line[256];
+	FILE *f, *tmp;
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	tmp = fopen(tmp_path, "w");
+	if (!tmp)
+		return -1;
+
+	fputs("# kernel frame pixel_format cores stages halo mask tile time\n", tmp);
+
+	/* Keep entries of other frames and kernels, entries of the old format are dropped */
+	f = fopen(path, "r");
+	while (f && fgets(line, sizeof(line), f)) {
+		struct dsp_tune_args entry;
+		char entry_kernel[32];
+		int w, h;
+		double t;
+
+		if (line[0] == '#' || parse_entry(line, entry_kernel, &entry, &w, &h, &t) ||
+		    entry_matches(kernel, args, entry_kernel, &entry))
+			continue;
+		fputs(line, tmp);
+	}
+	if (f)
+		fclose(f);
+
+	fprintf(tmp, "%s %dx%d %d %d %s %d %d %dx%d %f\n", kernel, args->frame_width,
+		args->frame_height, args->pixel_format, args->ncores, entry_stages(args),
+		args->halo, args->mask, tile->width, tile->height, time);
+
+	if (fclose(tmp) || rename(tmp_path, path)) {
+		int err = errno;
+
+		remove(tmp_path);
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
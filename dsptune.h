@@ -0,0 +1,64 @@
+/*
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ */
+#ifndef _DSPTUNE_H_
+#define _DSPTUNE_H_
+
+#include "dspxyram.h"
+
+#define DEFAULT_TILE_PROFILE "/etc/delcore30m-tiles.conf"
+
+struct dsp_tune_args {
+	int frame_width;
+	int frame_height;
+	int pixel_format;
+	int ncores;
+	/// Number of tile buffers placed to XYRAM of one core
+	int xyram_tiles;
+	/// Rows and columns loaded around each tile to XYRAM
+	int halo;
+	/// XYRAM of one core taken by data of stages
+	int data_size;
+	/// Number of packed tile masks placed to XYRAM of one core
+	int xyram_mask_tiles;
+	/// Stages of the kernel as written by dsp_stages_format(), empty or "-" without stages
+	char stages[128];
+	/// Mask output: 0 none, 1 in place of frame pixels, 2 next to frame
+	int mask;
+};
+
+struct dsp_tile_geometry {
+	int width;
+	int height;
+};
+
+/*
+ * Measure processing time of one frame with tile geometry @tile_width x
+ * @tile_height. Return time in seconds, or negative value on failure.
+ */
+typedef double (*dsp_tune_measure)(int tile_width, int tile_height, void *arg);
+
+/*
+ * Run @measure for every tile geometry which satisfies SDMA burst size and
+ * fits XYRAM, and return the fastest one in @tile.
+ * Return time of the fastest geometry, or negative value if none succeeded.
+ */
+double dsp_tune(const struct dsp_tune_args *args, dsp_tune_measure measure, void *arg,
+		struct dsp_tile_geometry *tile, int verbose);
+
+/*
+ * Find tile geometry for @kernel and frame in profile file @path.
+ * Return 0 if found, -1 otherwise.
+ */
+int dsp_profile_load(const char *path, const char *kernel,
+		     const struct dsp_tune_args *args, struct dsp_tile_geometry *tile);
+
+/*
+ * Store tile geometry for @kernel and frame to profile file @path, replacing
+ * the previous entry. Return -1 and set errno on failure.
+ */
+int dsp_profile_save(const char *path, const char *kernel,
+		     const struct dsp_tune_args *args, const struct dsp_tile_geometry *tile,
+		     double time);
+
+#endif
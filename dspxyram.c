@@ -0,0 +1,109 @@
+/*
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "dspxyram.h"
+
+/// Buffers are placed with SDMA burst alignment
+#define XYRAM_ALIGN 8
+
+static size_t aligned_size(const struct dsp_xyram_buffer *buf)
+{
+	return (buf->size + XYRAM_ALIGN - 1) / XYRAM_ALIGN * XYRAM_ALIGN;
+}
+
+static int fits(const struct dsp_xyram_plan *plan, int core, const struct dsp_xyram_buffer *buf)
+{
+	return plan->used[core] + aligned_size(buf) <= DSP_XYRAM_SIZE;
+}
+
+void dsp_xyram_init(struct dsp_xyram_plan *plan)
+{
+	memset(plan, 0, sizeof(*plan));
+}
+
+int dsp_xyram_add(struct dsp_xyram_plan *plan, const char *name, int owner, size_t size)
+{
+	if (plan->nbuffers == MAX_XYRAM_BUFFERS || owner < 0 || owner >= MAX_CORES)
+		return -1;
+
+	plan->buffers[plan->nbuffers] = (struct dsp_xyram_buffer) {
+		.name = name,
+		.owner = owner,
+		.core = -1,
+		.size = size
+	};
+
+	return plan->nbuffers++;
+}
+
+static int place(struct dsp_xyram_plan *plan, bool report)
+{
+	memset(plan->used, 0, sizeof(plan->used));
+	for (int i = 0; i < plan->nbuffers; ++i)
+		plan->buffers[i].core = -1;
+
+	/* Owners get their XYRAM first, so spilled buffers do not push out local ones */
+	for (int i = 0; i < plan->nbuffers; ++i) {
+		struct dsp_xyram_buffer *buf = &plan->buffers[i];
+
+		if (fits(plan, buf->owner, buf)) {
+			buf->core = buf->owner;
+			plan->used[buf->core] += aligned_size(buf);
+		}
+	}
+
+	for (int i = 0; i < plan->nbuffers; ++i) {
+		struct dsp_xyram_buffer *buf = &plan->buffers[i];
+		int best = 0;
+
+		if (buf->core >= 0)
+			continue;
+
+		for (int c = 1; c < MAX_CORES; ++c)
+			if (plan->used[c] < plan->used[best])
+				best = c;
+		if (!fits(plan, best, buf)) {
+			if (report)
+				fprintf(stderr, "XYRAM: %s of core %d (%zu bytes) does not fit\n",
+					buf->name, buf->owner, buf->size);
+			return -1;
+		}
+		buf->core = best;
+		plan->used[best] += aligned_size(buf);
+	}
+
+	return 0;
+}
+
+int dsp_xyram_place(struct dsp_xyram_plan *plan)
+{
+	return place(plan, true);
+}
+
+int dsp_xyram_try_place(struct dsp_xyram_plan *plan)
+{
+	return place(plan, false);
+}
+
+int dsp_xyram_core(const struct dsp_xyram_plan *plan, int index)
+{
+	return plan->buffers[index].core;
+}
+
+void dsp_xyram_print(const struct dsp_xyram_plan *plan)
+{
+	for (int c = 0; c < MAX_CORES; ++c)
+		if (plan->used[c])
+			printf("XYRAM of core %d: %zu of %d bytes used (%zu%%)\n", c,
+			       plan->used[c], DSP_XYRAM_SIZE, plan->used[c] * 100 / DSP_XYRAM_SIZE);
+
+	for (int i = 0; i < plan->nbuffers; ++i)
+		if (plan->buffers[i].core != plan->buffers[i].owner)
+			printf("XYRAM: %s of core %d is placed to core %d\n",
+			       plan->buffers[i].name, plan->buffers[i].owner,
+			       plan->buffers[i].core);
+}
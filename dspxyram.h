@@ -0,0 +1,63 @@
+/*
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ */
+#ifndef _DSPXYRAM_H_
+#define _DSPXYRAM_H_
+
+#include <stddef.h>
+
+#include <linux/delcore30m.h>
+
+/// Size of XYRAM of one DSP core
+#define DSP_XYRAM_SIZE (128 * 1024)
+
+/// Maximum number of XYRAM buffers in a plan
+#define MAX_XYRAM_BUFFERS 32
+
+struct dsp_xyram_buffer {
+	const char *name;
+	/// Core which accesses the buffer
+	int owner;
+	/// Core whose XYRAM holds the buffer, set by dsp_xyram_place()
+	int core;
+	size_t size;
+};
+
+/*
+ * Layout of XYRAM buffers of a pipeline over all cores. Buffers are added
+ * before allocation, so a configuration which does not fit is refused before
+ * any buffer is allocated.
+ */
+struct dsp_xyram_plan {
+	int nbuffers;
+	struct dsp_xyram_buffer buffers[MAX_XYRAM_BUFFERS];
+	/// Bytes of XYRAM of each core taken by the plan
+	size_t used[MAX_CORES];
+};
+
+void dsp_xyram_init(struct dsp_xyram_plan *plan);
+
+/*
+ * Add buffer of @size bytes accessed by core @owner. Buffers added first are
+ * the first to get XYRAM of their owner.
+ * Return index of the buffer or -1 if the plan is full.
+ */
+int dsp_xyram_add(struct dsp_xyram_plan *plan, const char *name, int owner, size_t size);
+
+/*
+ * Place each buffer to XYRAM of its owner. Buffers which do not fit there
+ * are moved to the core with the most free XYRAM.
+ * Return 0 or -1 if some buffer does not fit XYRAM of any core.
+ */
+int dsp_xyram_place(struct dsp_xyram_plan *plan);
+
+/* Place buffers as dsp_xyram_place() does, but do not report ones which do not fit */
+int dsp_xyram_try_place(struct dsp_xyram_plan *plan);
+
+/* Return core whose XYRAM holds buffer @index */
+int dsp_xyram_core(const struct dsp_xyram_plan *plan, int index);
+
+/* Print XYRAM utilization of each core and buffers placed out of their owner */
+void dsp_xyram_print(const struct dsp_xyram_plan *plan);
+
+#endif
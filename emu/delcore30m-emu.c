@@ -0,0 +1,737 @@
+/*
+ * \file
+ * \brief delcore30m-emu - user-space stand-in for /dev/elcore0
+ *
+ * The library is loaded with LD_PRELOAD. It intercepts open() of /dev/elcore0,
+ * ioctl() and close() and implements the delcore30m driver interface on memfd
+ * buffers. Jobs are executed by CPU reference kernels on a worker thread per core.
+ * Firmware is identified by the name written to PRAM by the host firmware images.
+ *
+ * \copyright
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ */
+
+#define _GNU_SOURCE
+/* Fortified open() is an inline wrapper, which can not be redefined */
+#undef _FORTIFY_SOURCE
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "delcore30m-emu.h"
+
+#define EMU_DEVICE "/dev/elcore0"
+
+/// File descriptors above this limit are not tracked
+#define EMU_MAX_FDS 1024
+
+/// Size of PRAM window of one core, it matches offset used to mmap firmware
+#define EMU_PRAM_SIZE ((size_t)sysconf(_SC_PAGESIZE))
+
+enum emu_object_type {
+	EMU_NONE,
+	EMU_DEVICE_FD,
+	EMU_RESOURCE_FD,
+	EMU_BUFFER_FD,
+	EMU_JOB_FD,
+};
+
+/* Transfer state of SDMA channel set up by ELCIOC_DMACHAIN_SETUP */
+struct emu_chain {
+	bool used;
+	enum sdma_channel_type type;
+	struct emu_map external;
+	struct emu_map internal[2];
+	struct emu_map chain;
+	uint32_t offset;
+	uint32_t count;
+};
+
+struct emu_job {
+	int fd;
+	int event_fd;
+	uint32_t cores;
+	int nargs;
+	struct emu_map args[MAX_INPUTS + MAX_OUTPUTS];
+	struct emu_chain chains[EMU_SDMA_CHANNELS];
+
+	enum delcore30m_job_status status;
+	enum delcore30m_job_rc rc;
+	bool cancel;
+	struct emu_job *next;
+};
+
+struct emu_object {
+	enum emu_object_type type;
+	union {
+		struct delcore30m_resource resource;
+		struct delcore30m_buffer buffer;
+		struct emu_job *job;
+	};
+};
+
+struct emu_core {
+	bool started;
+	pthread_t thread;
+	pthread_cond_t cv;
+	struct emu_job *head, *tail;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cv = PTHREAD_COND_INITIALIZER;
+
+static struct emu_object objects[EMU_MAX_FDS];
+static struct emu_core cores[MAX_CORES];
+static uint32_t busy_cores, busy_sdmas;
+static size_t xyram_used[MAX_CORES];
+
+static int pram_fd = -1;
+static uint8_t *pram;
+
+static int (*real_open)(const char *, int, ...);
+static int (*real_ioctl)(int, unsigned long, ...);
+static int (*real_close)(int);
+
+static void emu_init(void)
+{
+	if (!real_open) {
+		real_open = dlsym(RTLD_NEXT, "open");
+		real_ioctl = dlsym(RTLD_NEXT, "ioctl");
+		real_close = dlsym(RTLD_NEXT, "close");
+	}
+}
+
+static struct emu_object *get_object(int fd, enum emu_object_type type)
+{
+	if (fd < 0 || fd >= EMU_MAX_FDS || objects[fd].type != type)
+		return NULL;
+
+	return &objects[fd];
+}
+
+static int track_fd(int fd, enum emu_object_type type)
+{
+	if (fd < 0)
+		return -1;
+	if (fd >= EMU_MAX_FDS) {
+		real_close(fd);
+		errno = EMFILE;
+		return -1;
+	}
+	memset(&objects[fd], 0, sizeof(objects[fd]));
+	objects[fd].type = type;
+
+	return fd;
+}
+
+static int map_fd(int fd, struct emu_map *map)
+{
+	off_t size = lseek(fd, 0, SEEK_END);
+
+	lseek(fd, 0, SEEK_SET);
+	if (size <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	map->ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map->ptr == MAP_FAILED) {
+		map->ptr = NULL;
+		return -1;
+	}
+	map->size = size;
+
+	return 0;
+}
+
+static void unmap(struct emu_map *map)
+{
+	if (map->ptr)
+		munmap(map->ptr, map->size);
+	map->ptr = NULL;
+	map->size = 0;
+}
+
+static void unmap_chain(struct emu_chain *chain)
+{
+	unmap(&chain->external);
+	unmap(&chain->internal[0]);
+	unmap(&chain->internal[1]);
+	unmap(&chain->chain);
+	chain->used = false;
+}
+
+static void job_free(struct emu_job *job)
+{
+	for (int i = 0; i < job->nargs; ++i)
+		unmap(&job->args[i]);
+	for (int i = 0; i < EMU_SDMA_CHANNELS; ++i)
+		unmap_chain(&job->chains[i]);
+	real_close(job->event_fd);
+	free(job);
+}
+
+int emu_dma_start(struct emu_run *run, uint32_t channel)
+{
+	struct emu_job *job = run->job;
+
+	if (emu_cancelled(run))
+		return -1;
+
+	if (channel >= EMU_SDMA_CHANNELS || !job->chains[channel].used) {
+		fprintf(stderr, "delcore30m-emu: SDMA channel %u is not set up\n", channel);
+		return -1;
+	}
+
+	struct emu_chain *chain = &job->chains[channel];
+	if (chain->offset + sizeof(struct sdma_descriptor) > chain->chain.size) {
+		fprintf(stderr, "delcore30m-emu: SDMA channel %u is out of descriptors\n",
+			channel);
+		return -1;
+	}
+
+	struct sdma_descriptor *desc = chain->chain.ptr + chain->offset;
+	struct emu_map *internal = &chain->internal[chain->count % 2];
+	size_t last_row = desc->a0e + (size_t)desc->astride * (desc->bcnt - 1);
+
+	if ((size_t)desc->asize * desc->bcnt > internal->size || !desc->bcnt ||
+	    last_row + desc->asize > chain->external.size) {
+		fprintf(stderr, "delcore30m-emu: SDMA channel %u transfer is out of buffer\n",
+			channel);
+		return -1;
+	}
+
+	uint8_t *ext = chain->external.ptr + desc->a0e;
+	uint8_t *in = internal->ptr;
+	for (uint32_t row = 0; row < desc->bcnt; ++row) {
+		if (chain->type == SDMA_CHANNEL_INPUT)
+			memcpy(in, ext, desc->asize);
+		else
+			memcpy(ext, in, desc->asize);
+		in += desc->asize;
+		ext += desc->astride;
+	}
+
+	/* Last descriptor points to the first one */
+	chain->offset = desc->a_init;
+	chain->count++;
+
+	return 0;
+}
+
+bool emu_cancelled(const struct emu_run *run)
+{
+	return __atomic_load_n(&run->job->cancel, __ATOMIC_RELAXED);
+}
+
+void *emu_arg(struct emu_run *run, int index, size_t size)
+{
+	if (index >= run->nargs || run->args[index].size < size) {
+		fprintf(stderr, "delcore30m-emu: firmware argument %d is missing or too small\n",
+			index);
+		return NULL;
+	}
+
+	return run->args[index].ptr;
+}
+
+static const struct emu_kernel *find_kernel(int core_id)
+{
+	char name[64];
+	const char *fw = (const char *)pram + EMU_PRAM_SIZE * core_id;
+
+	if (strncmp(fw, EMU_FIRMWARE_MAGIC, strlen(EMU_FIRMWARE_MAGIC))) {
+		fprintf(stderr, "delcore30m-emu: no firmware for host is loaded to core %d\n",
+			core_id);
+		return NULL;
+	}
+
+	fw += strlen(EMU_FIRMWARE_MAGIC);
+	size_t len = strcspn(fw, "\n");
+	if (len >= sizeof(name))
+		len = sizeof(name) - 1;
+	memcpy(name, fw, len);
+	name[len] = '\0';
+
+	for (const struct emu_kernel *kernel = emu_kernels; kernel->name; ++kernel)
+		if (!strcmp(kernel->name, name))
+			return kernel;
+
+	fprintf(stderr, "delcore30m-emu: unknown firmware %s on core %d\n", name, core_id);
+	return NULL;
+}
+
+/* Run firmware on every core of the job, as hardware does */
+static int job_run(struct emu_job *job)
+{
+	struct emu_run run = {
+		.job = job,
+		.nargs = job->nargs,
+	};
+
+	memcpy(run.args, job->args, sizeof(run.args));
+
+	for (int i = 0; i < EMU_SDMA_CHANNELS; ++i) {
+		job->chains[i].offset = 0;
+		job->chains[i].count = 0;
+	}
+
+	for (run.core_id = 0; run.core_id < MAX_CORES; ++run.core_id) {
+		if (!(job->cores & (1 << run.core_id)))
+			continue;
+
+		const struct emu_kernel *kernel = find_kernel(run.core_id);
+		if (!kernel || kernel->fn(&run))
+			return -1;
+	}
+
+	return 0;
+}
+
+static void *core_worker(void *arg)
+{
+	struct emu_core *core = arg;
+
+	pthread_mutex_lock(&lock);
+	while (1) {
+		while (!core->head)
+			pthread_cond_wait(&core->cv, &lock);
+
+		struct emu_job *job = core->head;
+		core->head = job->next;
+		if (!core->head)
+			core->tail = NULL;
+		job->status = DELCORE30M_JOB_RUNNING;
+		pthread_mutex_unlock(&lock);
+
+		int ret = job_run(job);
+
+		pthread_mutex_lock(&lock);
+		job->status = DELCORE30M_JOB_IDLE;
+		if (job->cancel)
+			job->rc = DELCORE30M_JOB_CANCELLED;
+		else
+			job->rc = ret ? DELCORE30M_JOB_ERROR : DELCORE30M_JOB_SUCCESS;
+		if (write(job->event_fd, "", 1) < 0)
+			perror("delcore30m-emu: failed to signal job");
+		pthread_cond_broadcast(&done_cv);
+	}
+
+	return NULL;
+}
+
+static int sys_info(struct delcore30m_hardware *hw)
+{
+	hw->ncores = MAX_CORES;
+	hw->nsdmas = EMU_SDMA_CHANNELS;
+
+	return 0;
+}
+
+static int resource_request(struct delcore30m_resource *res)
+{
+	uint32_t *busy;
+	int count;
+
+	switch (res->type) {
+	case DELCORE30M_CORE:
+		busy = &busy_cores;
+		count = MAX_CORES;
+		break;
+	case DELCORE30M_SDMA:
+		busy = &busy_sdmas;
+		count = EMU_SDMA_CHANNELS;
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (res->num <= 0 || res->num > count) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	uint32_t mask = 0;
+	for (int i = 0, n = 0; i < count && n < res->num; ++i)
+		if (!(*busy & (1 << i))) {
+			mask |= 1 << i;
+			n++;
+		}
+	if (__builtin_popcount(mask) != res->num) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	/* Core resource maps PRAM of the cores at offset pagesize * core */
+	int fd = res->type == DELCORE30M_CORE ? dup(pram_fd) :
+					       memfd_create("elcore30m-sdma", MFD_CLOEXEC);
+	if (track_fd(fd, EMU_RESOURCE_FD) < 0)
+		return -1;
+
+	*busy |= mask;
+	res->mask = mask;
+	res->fd = fd;
+	objects[fd].resource = *res;
+
+	return 0;
+}
+
+static int buf_alloc(struct delcore30m_buffer *buf)
+{
+	long page = sysconf(_SC_PAGESIZE);
+
+	if (!buf->size || buf->core_num < 0 || buf->core_num >= MAX_CORES ||
+	    (buf->type != DELCORE30M_MEMORY_XYRAM && buf->type != DELCORE30M_MEMORY_SYSTEM)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (buf->type == DELCORE30M_MEMORY_XYRAM &&
+	    xyram_used[buf->core_num] + buf->size > EMU_XYRAM_SIZE) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	int fd = memfd_create(buf->type == DELCORE30M_MEMORY_XYRAM ? "elcore30m-xyram" :
+								     "elcore30m-system",
+			      MFD_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (ftruncate(fd, (buf->size + page - 1) / page * page)) {
+		real_close(fd);
+		return -1;
+	}
+	if (track_fd(fd, EMU_BUFFER_FD) < 0)
+		return -1;
+
+	if (buf->type == DELCORE30M_MEMORY_XYRAM)
+		xyram_used[buf->core_num] += buf->size;
+	buf->fd = fd;
+	objects[fd].buffer = *buf;
+
+	return 0;
+}
+
+static int job_create(struct delcore30m_job *job)
+{
+	struct emu_object *cores_obj = get_object(job->cores_fd, EMU_RESOURCE_FD);
+	int pipe_fds[2];
+
+	if (!cores_obj || cores_obj->resource.type != DELCORE30M_CORE ||
+	    job->inum < 0 || job->inum > MAX_INPUTS ||
+	    job->onum < 0 || job->onum > MAX_OUTPUTS) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct emu_job *emu_job = calloc(1, sizeof(*emu_job));
+	if (!emu_job)
+		return -1;
+
+	emu_job->cores = cores_obj->resource.mask;
+	emu_job->nargs = job->inum + job->onum;
+	for (int i = 0; i < emu_job->nargs; ++i) {
+		int fd = i < job->inum ? job->input[i] : job->output[i - job->inum];
+
+		if (map_fd(fd, &emu_job->args[i])) {
+			emu_job->nargs = i;
+			goto err;
+		}
+	}
+
+	/* Job is done when its fd becomes readable */
+	if (pipe2(pipe_fds, O_CLOEXEC | O_NONBLOCK))
+		goto err;
+	emu_job->event_fd = pipe_fds[1];
+	emu_job->fd = pipe_fds[0];
+	if (track_fd(emu_job->fd, EMU_JOB_FD) < 0) {
+		real_close(emu_job->event_fd);
+		emu_job->event_fd = -1;
+		goto err;
+	}
+	objects[emu_job->fd].job = emu_job;
+
+	emu_job->status = DELCORE30M_JOB_IDLE;
+	emu_job->rc = DELCORE30M_JOB_SUCCESS;
+	job->fd = emu_job->fd;
+
+	return 0;
+
+err:
+	for (int i = 0; i < emu_job->nargs; ++i)
+		unmap(&emu_job->args[i]);
+	free(emu_job);
+	return -1;
+}
+
+static int dmachain_setup(struct delcore30m_dmachain *dmachain)
+{
+	struct emu_object *job_obj = get_object(dmachain->job, EMU_JOB_FD);
+	int channel = dmachain->channel[1];
+
+	if (!job_obj || channel < 0 || channel >= EMU_SDMA_CHANNELS ||
+	    !(busy_sdmas & (1 << channel)) ||
+	    (dmachain->channel[0] != SDMA_CHANNEL_INPUT &&
+	     dmachain->channel[0] != SDMA_CHANNEL_OUTPUT)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct emu_job *job = job_obj->job;
+	struct emu_chain *chain = &job->chains[channel];
+
+	if (job->status != DELCORE30M_JOB_IDLE) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	unmap_chain(chain);
+	if (map_fd(dmachain->external, &chain->external) ||
+	    map_fd(dmachain->internal[0], &chain->internal[0]) ||
+	    map_fd(dmachain->internal[1], &chain->internal[1]) ||
+	    map_fd(dmachain->chain, &chain->chain)) {
+		unmap_chain(chain);
+		return -1;
+	}
+	chain->type = dmachain->channel[0];
+	chain->used = true;
+
+	return 0;
+}
+
+static int job_enqueue(struct delcore30m_job *job)
+{
+	struct emu_object *job_obj = get_object(job->fd, EMU_JOB_FD);
+	char drain[16];
+
+	if (!job_obj) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct emu_job *emu_job = job_obj->job;
+	if (emu_job->status != DELCORE30M_JOB_IDLE) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	while (read(emu_job->fd, drain, sizeof(drain)) > 0)
+		continue;
+
+	struct emu_core *core = &cores[__builtin_ffs(emu_job->cores) - 1];
+	if (!core->started) {
+		pthread_cond_init(&core->cv, NULL);
+		if (pthread_create(&core->thread, NULL, core_worker, core)) {
+			errno = EAGAIN;
+			return -1;
+		}
+		pthread_detach(core->thread);
+		core->started = true;
+	}
+
+	emu_job->status = DELCORE30M_JOB_ENQUEUED;
+	emu_job->cancel = false;
+	emu_job->next = NULL;
+	if (core->tail)
+		core->tail->next = emu_job;
+	else
+		core->head = emu_job;
+	core->tail = emu_job;
+	pthread_cond_signal(&core->cv);
+
+	return 0;
+}
+
+static void job_cancel_locked(struct emu_job *job)
+{
+	struct emu_core *core = &cores[__builtin_ffs(job->cores) - 1];
+
+	if (job->status == DELCORE30M_JOB_ENQUEUED) {
+		struct emu_job **prev = &core->head;
+
+		while (*prev != job)
+			prev = &(*prev)->next;
+		*prev = job->next;
+		if (core->tail == job) {
+			core->tail = NULL;
+			for (struct emu_job *it = core->head; it; it = it->next)
+				core->tail = it;
+		}
+		job->status = DELCORE30M_JOB_IDLE;
+		job->rc = DELCORE30M_JOB_CANCELLED;
+		if (write(job->event_fd, "", 1) < 0)
+			perror("delcore30m-emu: failed to signal job");
+		return;
+	}
+
+	__atomic_store_n(&job->cancel, true, __ATOMIC_RELAXED);
+	while (job->status == DELCORE30M_JOB_RUNNING)
+		pthread_cond_wait(&done_cv, &lock);
+}
+
+static int job_cancel(struct delcore30m_job *job)
+{
+	struct emu_object *job_obj = get_object(job->fd, EMU_JOB_FD);
+
+	if (!job_obj) {
+		errno = EINVAL;
+		return -1;
+	}
+	job_cancel_locked(job_obj->job);
+
+	return 0;
+}
+
+static int job_status(struct delcore30m_job *job)
+{
+	struct emu_object *job_obj = get_object(job->fd, EMU_JOB_FD);
+
+	if (!job_obj) {
+		errno = EINVAL;
+		return -1;
+	}
+	job->status = job_obj->job->status;
+	job->rc = job_obj->job->rc;
+
+	return 0;
+}
+
+static int emu_ioctl(unsigned long request, void *arg)
+{
+	switch (request) {
+	case ELCIOC_SYS_INFO:
+		return sys_info(arg);
+	case ELCIOC_RESOURCE_REQUEST:
+		return resource_request(arg);
+	case ELCIOC_BUF_ALLOC:
+		return buf_alloc(arg);
+	case ELCIOC_JOB_CREATE:
+		return job_create(arg);
+	case ELCIOC_DMACHAIN_SETUP:
+		return dmachain_setup(arg);
+	case ELCIOC_JOB_ENQUEUE:
+		return job_enqueue(arg);
+	case ELCIOC_JOB_STATUS:
+		return job_status(arg);
+	case ELCIOC_JOB_CANCEL:
+		return job_cancel(arg);
+	default:
+		errno = ENOTTY;
+		return -1;
+	}
+}
+
+static int emu_open(void)
+{
+	int fd;
+
+	pthread_mutex_lock(&lock);
+	if (pram_fd < 0) {
+		size_t size = EMU_PRAM_SIZE * MAX_CORES;
+
+		pram_fd = memfd_create("elcore30m-pram", MFD_CLOEXEC);
+		if (pram_fd < 0 || ftruncate(pram_fd, size))
+			goto err;
+		pram = mmap(NULL, size, PROT_READ, MAP_SHARED, pram_fd, 0);
+		if (pram == MAP_FAILED)
+			goto err;
+	}
+
+	fd = track_fd(memfd_create("elcore0", MFD_CLOEXEC), EMU_DEVICE_FD);
+	pthread_mutex_unlock(&lock);
+
+	return fd;
+
+err:
+	if (pram_fd >= 0)
+		real_close(pram_fd);
+	pram_fd = -1;
+	pthread_mutex_unlock(&lock);
+	return -1;
+}
+
+int open(const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+	va_list ap;
+
+	emu_init();
+	if (!strcmp(path, EMU_DEVICE))
+		return emu_open();
+
+	if (flags & (O_CREAT | O_TMPFILE)) {
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+
+	return real_open(path, flags, mode);
+}
+
+int open64(const char *path, int flags, ...)
+	__attribute__((alias("open")));
+
+int ioctl(int fd, unsigned long request, ...)
+{
+	va_list ap;
+	void *arg;
+	int ret;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	emu_init();
+	pthread_mutex_lock(&lock);
+	if (!get_object(fd, EMU_DEVICE_FD)) {
+		pthread_mutex_unlock(&lock);
+		return real_ioctl(fd, request, arg);
+	}
+	ret = emu_ioctl(request, arg);
+	pthread_mutex_unlock(&lock);
+
+	return ret;
+}
+
+int close(int fd)
+{
+	emu_init();
+	pthread_mutex_lock(&lock);
+	if (fd >= 0 && fd < EMU_MAX_FDS) {
+		struct emu_object *obj = &objects[fd];
+
+		switch (obj->type) {
+		case EMU_RESOURCE_FD:
+			if (obj->resource.type == DELCORE30M_CORE)
+				busy_cores &= ~obj->resource.mask;
+			else
+				busy_sdmas &= ~obj->resource.mask;
+			break;
+		case EMU_BUFFER_FD:
+			if (obj->buffer.type == DELCORE30M_MEMORY_XYRAM)
+				xyram_used[obj->buffer.core_num] -= obj->buffer.size;
+			break;
+		case EMU_JOB_FD:
+			/* Wait for the worker to leave the job before releasing it */
+			job_cancel_locked(obj->job);
+			job_free(obj->job);
+			break;
+		default:
+			break;
+		}
+		obj->type = EMU_NONE;
+	}
+	pthread_mutex_unlock(&lock);
+
+	return real_close(fd);
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ */
+#ifndef _DELCORE30M_EMU_H_
+#define _DELCORE30M_EMU_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <linux/delcore30m.h>
+
+/// Firmware images built for the host contain this string followed by kernel name
+#define EMU_FIRMWARE_MAGIC "DELCORE30M-EMU "
+
+/// Number of SDMA channels
+#define EMU_SDMA_CHANNELS 8
+
+/// Size of XYRAM of one core
+#define EMU_XYRAM_SIZE (128 * 1024)
+
+struct emu_job;
+
+struct emu_map {
+	void *ptr;
+	size_t size;
+};
+
+/* Job arguments as firmware on core @core_id sees them: inputs followed by outputs */
+struct emu_run {
+	struct emu_job *job;
+	int core_id;
+	int nargs;
+	struct emu_map args[MAX_INPUTS + MAX_OUTPUTS];
+};
+
+/* Reference kernel. Return 0 on success */
+typedef int (*emu_kernel_fn)(struct emu_run *run);
+
+struct emu_kernel {
+	const char *name;
+	emu_kernel_fn fn;
+};
+
+/// Reference kernels, terminated by entry with NULL name
+extern const struct emu_kernel emu_kernels[];
+
+/* Emulate sending event to SDMA @channel: transfer next tile of its DMA chain.
+ * Return 0 on success, -1 if the chain is not set up or the job is cancelled.
+ */
+int emu_dma_start(struct emu_run *run, uint32_t channel);
+
+/* Return true if the job has been cancelled. Endless kernels must poll it. */
+bool emu_cancelled(const struct emu_run *run);
+
+/* Return pointer to job argument @index if it is at least @size bytes, else NULL */
+void *emu_arg(struct emu_run *run, int index, size_t size);
+
+#endif
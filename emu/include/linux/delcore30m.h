@@ -0,0 +1,111 @@
+/*
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ *
+ * Host copy of the delcore30m driver uAPI. It is used only by the host
+ * emulation build when kernel headers do not provide linux/delcore30m.h.
+ */
+#ifndef _UAPI_LINUX_DELCORE30M_H
+#define _UAPI_LINUX_DELCORE30M_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define MAX_CORES 2
+#define MAX_INPUTS 16
+#define MAX_OUTPUTS 16
+
+#define ELCORE30M_CORE_0 (1 << 0)
+#define ELCORE30M_CORE_1 (1 << 1)
+
+#define DELCORE30M_PROFILE (1 << 0)
+
+enum delcore30m_job_status {
+	DELCORE30M_JOB_IDLE,
+	DELCORE30M_JOB_ENQUEUED,
+	DELCORE30M_JOB_RUNNING,
+};
+
+enum delcore30m_job_rc {
+	DELCORE30M_JOB_SUCCESS,
+	DELCORE30M_JOB_CANCELLED,
+	DELCORE30M_JOB_ERROR,
+};
+
+enum delcore30m_memory_type {
+	DELCORE30M_MEMORY_XYRAM,
+	DELCORE30M_MEMORY_SYSTEM,
+};
+
+enum delcore30m_resource_type {
+	DELCORE30M_NONE,
+	DELCORE30M_CORE,
+	DELCORE30M_SDMA,
+};
+
+enum sdma_channel_type {
+	SDMA_CHANNEL_INPUT,
+	SDMA_CHANNEL_OUTPUT,
+};
+
+struct delcore30m_hardware {
+	__u32 ncores;
+	__u32 nsdmas;
+};
+
+struct delcore30m_resource {
+	enum delcore30m_resource_type type;
+	int num;
+	__u32 mask;
+	int fd;
+};
+
+struct delcore30m_buffer {
+	int fd;
+	enum delcore30m_memory_type type;
+	int core_num;
+	__u32 size;
+};
+
+struct delcore30m_job {
+	int fd;
+	int inum, onum;
+	int input[MAX_INPUTS];
+	int output[MAX_OUTPUTS];
+	int cores_fd;
+	int sdmas_fd;
+	int flags;
+	enum delcore30m_job_status status;
+	enum delcore30m_job_rc rc;
+};
+
+struct sdma_descriptor {
+	__u32 a_init;
+	__u32 a0e;
+	__u32 astride;
+	__u32 bcnt;
+	__u32 asize;
+	__u32 ccr;
+};
+
+struct delcore30m_dmachain {
+	int job;
+	int core;
+	int external;
+	int internal[2];
+	int chain;
+	int codebuf;
+	int channel[2];
+};
+
+#define ELCIOC_MAGIC 'e'
+
+#define ELCIOC_JOB_CREATE _IOWR(ELCIOC_MAGIC, 1, struct delcore30m_job *)
+#define ELCIOC_JOB_ENQUEUE _IOWR(ELCIOC_MAGIC, 2, struct delcore30m_job *)
+#define ELCIOC_JOB_STATUS _IOWR(ELCIOC_MAGIC, 3, struct delcore30m_job *)
+#define ELCIOC_JOB_CANCEL _IOWR(ELCIOC_MAGIC, 4, struct delcore30m_job *)
+#define ELCIOC_SYS_INFO _IOR(ELCIOC_MAGIC, 5, struct delcore30m_hardware *)
+#define ELCIOC_RESOURCE_REQUEST _IOWR(ELCIOC_MAGIC, 6, struct delcore30m_resource *)
+#define ELCIOC_BUF_ALLOC _IOWR(ELCIOC_MAGIC, 7, struct delcore30m_buffer *)
+#define ELCIOC_DMACHAIN_SETUP _IOW(ELCIOC_MAGIC, 8, struct delcore30m_dmachain *)
+
+#endif
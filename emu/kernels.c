@@ -0,0 +1,275 @@
+/*
+ * \file
+ * \brief CPU reference versions of DELcore-30M firmware for the emulator
+ *
+ * Each kernel takes arguments at the same positions as start() of the
+ * corresponding firmware and starts SDMA channels in the same order.
+ * Detector runs tile stages and the tile pipeline of the firmware from
+ * stages.c.
+ *
+ * \copyright
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bundle.h"
+#include "delcore30m-emu.h"
+#include "stages.h"
+
+static struct tilesbuffer *get_tiles(struct emu_run *run, int index)
+{
+	struct tilesbuffer *tb = emu_arg(run, index, sizeof(struct tilesbuffer));
+
+	if (tb && !emu_arg(run, index, sizeof(struct tilesbuffer) +
+			   sizeof(struct tileinfo) * tb->ntiles))
+		return NULL;
+
+	return tb;
+}
+
+/* sum.c: add two numbers for each core */
+static int sum(struct emu_run *run)
+{
+	uint32_t *data = emu_arg(run, 0, sizeof(uint32_t) * 2 * MAX_CORES);
+	uint32_t *result = emu_arg(run, 1, sizeof(uint32_t) * MAX_CORES);
+
+	if (!data || !result)
+		return -1;
+
+	result[run->core_id] = data[2 * run->core_id] + data[2 * run->core_id + 1];
+
+	return 0;
+}
+
+/* fibonacci.s: find Fibonacci number in endless loop until job is cancelled */
+static int fibonacci(struct emu_run *run)
+{
+	uint32_t *iter = emu_arg(run, 0, sizeof(uint32_t));
+	uint32_t *magic = emu_arg(run, 1, sizeof(uint32_t));
+	uint32_t *result = emu_arg(run, 2, sizeof(uint32_t));
+	size_t result_size = run->args[2].size / sizeof(uint32_t);
+
+	if (!iter || !magic || !result)
+		return -1;
+
+	while (!emu_cancelled(run)) {
+		uint32_t prev = 1, cur = 1;
+
+		for (size_t i = 0; i < 16383; ++i) {
+			uint32_t next = (prev + cur) & INT32_MAX;
+
+			prev = cur;
+			cur = next;
+			result[i % result_size] = cur;
+		}
+		*magic = cur;
+		(*iter)++;
+	}
+
+	return 0;
+}
+
+/*
+ * inverse-demo.s, inversiontest.s, inverse.c: inverse each tile, which is
+ * loaded to one of two tile buffers by the input channel
+ */
+static int inverse(struct emu_run *run, int channels_arg, int tile0_arg, int tile1_arg,
+		   int tileinfo_arg)
+{
+	uint32_t *channels = emu_arg(run, channels_arg, sizeof(uint32_t) * 2);
+	struct tilesbuffer *tb = get_tiles(run, tileinfo_arg);
+	uint8_t *tiles[2] = {
+		emu_arg(run, tile0_arg, 0),
+		emu_arg(run, tile1_arg, 0)
+	};
+
+	if (!channels || !tb || !tiles[0] || !tiles[1])
+		return -1;
+
+	for (uint32_t i = 0; i < tb->ntiles; ++i) {
+		int odd = i % 2;
+		size_t size = run->args[odd ? tile1_arg : tile0_arg].size;
+
+		if (emu_dma_start(run, channels[0]))
+			return -1;
+		for (size_t j = 0; j < size && j < tb->tilesize; ++j)
+			tiles[odd][j] ^= 0xff;
+		if (emu_dma_start(run, channels[1]))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int inverse_demo(struct emu_run *run)
+{
+	return inverse(run, 4, 3, 5, 8);
+}
+
+static int inversiontest(struct emu_run *run)
+{
+	return inverse(run, 2, 1, 3, 6);
+}
+
+/*
+ * Approximation of detector() assembly: pixel is moving if any color differs
+ * from background by more than the threshold, red component of moving pixels
+ * is raised to make them visible.
+ */
+static void detect(uint32_t *src, size_t pixels, struct dsp_struct_data *data,
+		   uint32_t *background)
+{
+	const int threshold = 0x3f;
+
+	for (size_t i = 0; i < pixels; ++i) {
+		uint32_t red = src[i] >> 16 & 0xff;
+		bool moving = false;
+
+		for (int c = 0; c < 24; c += 8) {
+			int diff = (int)(src[i] >> c & 0xff) - (int)(background[i] >> c & 0xff);
+
+			if (diff > threshold || -diff > threshold)
+				moving = true;
+		}
+		if (moving)
+			src[i] = (src[i] & ~0xff0000u) | (red > 0x7f ? 0xff : red + 0x80) << 16;
+	}
+}
+
+static void copy_tile(uint32_t *src, uint32_t *dst, size_t pixels)
+{
+	memcpy(dst, src, pixels * sizeof(*dst));
+}
+
+/* Emulated transfers are done at once on start, so channels are never busy */
+struct tile_dma {
+	struct emu_run *run;
+};
+
+static int tile_dma_start(struct tile_dma *dma, uint32_t channel)
+{
+	return emu_dma_start(dma->run, channel);
+}
+
+static uint32_t tile_dma_busy(struct tile_dma *dma)
+{
+	return 0;
+}
+
+/* Stages and the tile pipeline of the firmware with detect() in place of the assembly */
+#define detector detect
+#include "stages.c"
+#undef detector
+
+/*
+ * detector.c: check that buffers of the job hold its tiles and run the
+ * tile pipeline of the firmware. Input of the next tile is started as soon
+ * as the current one is loaded, since outputs of the previous tile are done.
+ * Mask tiles and the output slot follow background tiles only when enabled.
+ */
+static int detector(struct emu_run *run)
+{
+	struct dsp_struct_data *data = emu_arg(run, 2, sizeof(struct dsp_struct_data));
+	struct tile_slot slots[2] = {
+		{ emu_arg(run, 1, 0), emu_arg(run, 6, 0), NULL },
+		{ emu_arg(run, 3, 0), emu_arg(run, 7, 0), NULL }
+	};
+	struct tile_slot out = { NULL, NULL, NULL };
+	struct tile_dma dma = { run };
+	int out_arg = 8;
+
+	if (!data || !emu_arg(run, 2, data->tiles_offset + sizeof(struct tilesbuffer)))
+		return -1;
+
+	/* Tile list follows the data in the same buffer */
+	struct tilesbuffer *tb = (struct tilesbuffer *)((uint8_t *)data + data->tiles_offset);
+
+	if (!emu_arg(run, 2, data->tiles_offset + sizeof(struct tilesbuffer) +
+		     sizeof(struct tileinfo) * tb->ntiles) ||
+	    !slots[0].tile || !slots[1].tile || !slots[0].background ||
+	    !slots[1].background ||
+	    !emu_arg(run, 2, sizeof(struct dsp_struct_data) +
+		     sizeof(struct tile_state) * tb->ntiles))
+		return -1;
+
+	bool mask_with_frame = data->mask_output && data->mask_with_frame;
+
+	if (mask_with_frame) {
+		slots[0].mask = emu_arg(run, 8, 0);
+		slots[1].mask = emu_arg(run, 9, 0);
+		if (!slots[0].mask || !slots[1].mask)
+			return -1;
+		out_arg = 10;
+	}
+
+	if (data->output_slot) {
+		out.tile = emu_arg(run, out_arg, 0);
+		out.background = emu_arg(run, out_arg + 1, 0);
+		if (!out.tile || !out.background)
+			return -1;
+	}
+
+	if (blob_stage_data(data, tb->ntiles) &&
+	    !emu_arg(run, 2, sizeof(struct dsp_struct_data) +
+		     sizeof(struct tile_state) * tb->ntiles + sizeof(struct blob_data)))
+		return -1;
+
+	for (uint32_t i = 0; i < tb->ntiles; ++i) {
+		const struct tileinfo *tile = &tb->info[i];
+		struct tile_extent e = tile_extent(data, tile);
+		size_t pixels = e.width * e.height;
+		int odd = i % 2;
+
+		if (pixels * 4 > run->args[odd ? 3 : 1].size ||
+		    pixels * 4 > run->args[odd ? 7 : 6].size ||
+		    (mask_with_frame && (tile->width + 7) / 8 * tile->height >
+					run->args[odd ? 9 : 8].size) ||
+		    (data->output_slot && (tile->width * tile->height * 4 >
+					   run->args[out_arg].size ||
+					   tile->width * tile->height * 4 >
+					   run->args[out_arg + 1].size))) {
+			fprintf(stderr, "delcore30m-emu: tile %u does not fit tile buffer\n", i);
+			return -1;
+		}
+	}
+
+	return process_tiles(data, tb, slots, data->output_slot ? &out : NULL, &dma);
+}
+
+/* bundle.c: run kernel chosen by the first argument with the rest arguments */
+static int bundle(struct emu_run *run)
+{
+	uint32_t *kernel = emu_arg(run, 0, sizeof(uint32_t));
+	struct emu_run sub = *run;
+
+	if (!kernel)
+		return -1;
+
+	sub.nargs = run->nargs - 1;
+	memmove(sub.args, sub.args + 1, sizeof(sub.args[0]) * sub.nargs);
+
+	switch (*kernel) {
+	case DSP_KERNEL_DETECTOR:
+		return detector(&sub);
+	case DSP_KERNEL_SUM:
+		return sum(&sub);
+	case DSP_KERNEL_INVERSE:
+		return inversiontest(&sub);
+	default:
+		return -1;
+	}
+}
+
+const struct emu_kernel emu_kernels[] = {
+	{ "sum", sum },
+	{ "fibonacci", fibonacci },
+	{ "inverse-demo", inverse_demo },
+	{ "inversiontest", inversiontest },
+	{ "inversiontest-profile", inversiontest },
+	{ "detector", detector },
+	{ "bundle", bundle },
+	{ NULL, NULL }
+};
@@ -0,0 +1,56 @@
+/*
+ * \file
+ * \brief inverse - Inversion of tiles loaded by SDMA chains
+ * on Elcore-30M
+ *
+ * Kernel takes arguments of inversiontest.s, so the same jobs run on bundle
+ * firmware, e.g. by delcore30m-broker. It is built only into bundle.c after
+ * detector.c, whose functions start SDMA channels.
+ *
+ * \copyright
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ */
+
+#include <stdint.h>
+
+#include "stages.h"
+
+/*
+ * @core_id - in register R0
+ * @tile_buf1, @tile_buf2 - tile buffers, which DMA chains switch on each tile
+ * @channels - input and output SDMA channels
+ * Images and DMA chains are job inputs only for SDMA.
+ */
+int start(uint32_t core_id, uint32_t *unused0, uint8_t *tile_buf1, uint32_t *channels,
+	  uint8_t *tile_buf2, uint32_t *unused1, uint32_t *unused2,
+	  struct tilesbuffer *tileinfo)
+{
+	uint8_t *tile_buffers[] = {tile_buf1, tile_buf2};
+	volatile uint32_t *dma_channel_busy_reg = (volatile uint32_t *) DMA_READY_REG;
+	uint32_t input_mask = 1 << channels[0];
+	uint32_t output_mask = 1 << channels[1];
+	uint32_t words = tileinfo->tilesize / 4;
+
+	set_dma_channel_busy_reg(0);
+	start_dma_channel(channels[0]);
+
+	for (uint32_t i = 0; i < tileinfo->ntiles; ++i) {
+		uint8_t *tile = tile_buffers[i % 2];
+
+		/* Tile i is loaded, tile i - 1 has left the other buffer */
+		while (*dma_channel_busy_reg & (input_mask | output_mask));
+		if (i + 1 < tileinfo->ntiles)
+			start_dma_channel(channels[0]);
+
+		for (uint32_t j = 0; j < words; ++j)
+			((uint32_t *)tile)[j] ^= UINT32_MAX;
+		for (uint32_t j = words * 4; j < tileinfo->tilesize; ++j)
+			tile[j] ^= 0xff;
+
+		start_dma_channel(channels[1]);
+	}
+
+	while (*dma_channel_busy_reg & output_mask);
+
+	return 0;
+}
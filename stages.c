@@ -0,0 +1,1018 @@
+/*
+ * \file
+ * \brief Tile stages of detector firmware in plain C
+ *
+ * The file is included by detector.c and by the emulator, so host tests run
+ * the firmware code. Both define before the include:
+ * - detector(), the emulator replaces its assembly;
+ * - copy_tile(src, dst, pixels);
+ * - struct tile_dma, tile_dma_start(dma, channel), which starts the next
+ *   transfer of SDMA chain of the channel and returns nonzero on error, and
+ *   tile_dma_busy(dma), which returns the mask of channels in flight.
+ *
+ * Only detector() is vectorized. Background update packs two components in
+ * 16-bit lanes of a word, the rest of code here handles one pixel per
+ * iteration, so each stage, statistics and mask packing run only when they
+ * are asked for, and the default stage list is detector() alone.
+ *
+ * \copyright
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "stages.h"
+
+static uint32_t tile_signature(const uint32_t *src, size_t pixels)
+{
+	uint32_t a = 0, b = 0;
+
+	for (size_t i = 0; i < pixels; ++i) {
+		a += src[i];
+		b += a;
+	}
+
+	return a ^ (b << 16 | b >> 16);
+}
+
+static uint32_t luma(uint32_t pixel)
+{
+	return (29 * (pixel & 0xff) + 150 * (pixel >> 8 & 0xff) +
+		77 * (pixel >> 16 & 0xff)) >> 8;
+}
+
+static uint32_t set_mask(uint32_t pixel, uint32_t mask)
+{
+	return (pixel & ~(0xffu << TILE_MASK_SHIFT)) | (mask ? 0xffu << TILE_MASK_SHIFT : 0);
+}
+
+/*
+ * Stages return nonzero if they changed any pixel, so start() knows whether
+ * the output of the tile equals its input without one more pass over it.
+ */
+static uint32_t stage_motion(uint32_t *src, size_t pixels, const uint32_t *background,
+			     uint32_t threshold)
+{
+	uint32_t modified = 0;
+
+	for (size_t i = 0; i < pixels; ++i) {
+		uint32_t moving = 0, pixel;
+
+		for (int shift = 0; shift < 24; shift += 8) {
+			int diff = (int)(src[i] >> shift & 0xff) -
+				   (int)(background[i] >> shift & 0xff);
+
+			if (diff > (int)threshold || -diff > (int)threshold)
+				moving = 1;
+		}
+		pixel = set_mask(src[i], moving);
+		modified |= pixel ^ src[i];
+		src[i] = pixel;
+	}
+
+	return modified;
+}
+
+static uint32_t stage_grayscale(uint32_t *src, size_t pixels)
+{
+	uint32_t modified = 0;
+
+	for (size_t i = 0; i < pixels; ++i) {
+		uint32_t y = luma(src[i]);
+		uint32_t pixel = (src[i] & 0xffu << TILE_MASK_SHIFT) | y << 16 | y << 8 | y;
+
+		modified |= pixel ^ src[i];
+		src[i] = pixel;
+	}
+
+	return modified;
+}
+
+static uint32_t stage_threshold(uint32_t *src, size_t pixels, uint32_t level)
+{
+	uint32_t modified = 0;
+
+	for (size_t i = 0; i < pixels; ++i) {
+		uint32_t pixel = set_mask(src[i], luma(src[i]) > level);
+
+		modified |= pixel ^ src[i];
+		src[i] = pixel;
+	}
+
+	return modified;
+}
+
+static uint32_t stage_overlay(uint32_t *src, size_t pixels)
+{
+	uint32_t modified = 0;
+
+	for (size_t i = 0; i < pixels; ++i) {
+		uint32_t red = src[i] >> 16 & 0xff;
+
+		if (!(src[i] >> TILE_MASK_SHIFT) || red == 0xff)
+			continue;
+		red = red > 0x7f ? 0xff : red + 0x80;
+		src[i] = (src[i] & ~0xff0000u) | red << 16;
+		modified = 1;
+	}
+
+	return modified;
+}
+
+/// Low byte of each 16-bit lane, so a word holds two color components
+#define LANES 0x00ff00ffu
+#define LANE_CARRY 0x01000100u
+#define LANE_ONE 0x00010001u
+
+/* Return lanes of @v, which are not zero, as 1 */
+static uint32_t lanes_nonzero(uint32_t v)
+{
+	return (v + LANES) >> 8 & LANE_ONE;
+}
+
+/*
+ * Move components in the low bytes of 16-bit lanes of @bg towards @src by
+ * 1/2^@shift of their difference, but at least by 1. Lanes of @src are
+ * 256 + src - bg after subtraction, so their bit 8 tells the sign.
+ */
+static uint32_t lanes_update(uint32_t src, uint32_t bg, uint32_t shift)
+{
+	uint32_t up = (src | LANE_CARRY) - bg;
+	uint32_t down = (bg | LANE_CARRY) - src;
+	uint32_t above = (up & LANE_CARRY) - ((up & LANE_CARRY) >> 8);
+	uint32_t diff = (up & above) | (down & ~above & LANES);
+	uint32_t step = diff >> shift & LANES;
+
+	step += lanes_nonzero(diff) & ~lanes_nonzero(step);
+
+	/* Steps do not pass @src, so lanes never carry */
+	return bg + (step & above) - (step & ~above);
+}
+
+/*
+ * Move color components of @background by 1/2^@shift of their difference with
+ * @src, but at least by 1, so background reaches the scene exactly.
+ * Components are updated in 16-bit lanes without branches: blue and red of a
+ * pixel share a word, green of two pixels shares another one. Alpha is kept.
+ */
+static void background_update(const uint32_t *src, uint32_t *background, size_t pixels,
+			      uint32_t shift)
+{
+	size_t i = 0;
+
+	for (; i + 1 < pixels; i += 2) {
+		uint32_t bg0 = background[i], bg1 = background[i + 1];
+		uint32_t br0 = lanes_update(src[i] & LANES, bg0 & LANES, shift);
+		uint32_t br1 = lanes_update(src[i + 1] & LANES, bg1 & LANES, shift);
+		uint32_t g = lanes_update((src[i] >> 8 & 0xff) | (src[i + 1] & 0xff00) << 8,
+					  (bg0 >> 8 & 0xff) | (bg1 & 0xff00) << 8, shift);
+
+		background[i] = (bg0 & 0xff000000u) | br0 | (g & 0xff) << 8;
+		background[i + 1] = (bg1 & 0xff000000u) | br1 | (g >> 8 & 0xff00);
+	}
+	if (i < pixels) {
+		uint32_t bg = background[i];
+		uint32_t br = lanes_update(src[i] & LANES, bg & LANES, shift);
+		uint32_t g = lanes_update(src[i] >> 8 & 0xff, bg >> 8 & 0xff, shift);
+
+		background[i] = (bg & 0xff000000u) | br | g << 8;
+	}
+}
+
+/*
+ * Bits of alpha byte: mask of the pixel, mask computed by morph_line() and
+ * count of MORPH_BIT in the rows of the column window. Stages radius is at
+ * most MAX_TILE_HALO, so the count of 2 * radius + 1 rows fits COUNT_BITS.
+ */
+#define MASK_BIT (1u << (TILE_MASK_SHIFT + 7))
+#define MORPH_BIT (1u << (TILE_MASK_SHIFT + 6))
+#define COUNT_BITS (0x3fu << TILE_MASK_SHIFT)
+
+/*
+ * Set MORPH_BIT of each of @n pixels of line @p if MASK_BIT is set in all
+ * (@erode) or any pixels of the line within @radius. Pixels outside of the
+ * line are not counted, so frame edges are neither eroded nor dilated.
+ * Return nonzero if alpha of a pixel is neither clear nor set, as the stage
+ * changes it even if the mask stays.
+ */
+static uint32_t morph_line(uint32_t *p, int n, int radius, int erode)
+{
+	uint32_t modified = 0;
+	int count = 0;
+
+	for (int i = 0; i < radius && i < n; ++i)
+		count += p[i] >> 31;
+
+	for (int i = 0; i < n; ++i) {
+		int first = i - radius < 0 ? 0 : i - radius;
+		int last = i + radius < n ? i + radius : n - 1;
+		uint32_t alpha = p[i] >> TILE_MASK_SHIFT;
+
+		if (i + radius < n)
+			count += p[i + radius] >> 31;
+		if (i - radius > 0)
+			count -= p[i - radius - 1] >> 31;
+
+		modified |= alpha && alpha != 0xff;
+		if (erode ? count == last - first + 1 : count > 0)
+			p[i] |= MORPH_BIT;
+		else
+			p[i] &= ~MORPH_BIT;
+	}
+
+	return modified;
+}
+
+static uint32_t column_count(uint32_t pixel)
+{
+	return (pixel & COUNT_BITS) >> TILE_MASK_SHIFT;
+}
+
+/*
+ * Erode or dilate mask of @width x @height tile by square in one sweep over
+ * rows. Row y + @radius gets its line result in MORPH_BIT, then counts of
+ * MORPH_BIT in rows y - @radius..y + @radius of each column give the mask of
+ * row y. The counts move down with the window in the last row of it, and the
+ * row which leaves the window gets its alpha set by its final mask.
+ */
+static uint32_t stage_morph(uint32_t *src, uint32_t width, uint32_t height, uint32_t radius,
+			    int erode)
+{
+	uint32_t modified = 0;
+
+	for (uint32_t y = 0; y < radius && y < height; ++y) {
+		uint32_t *line = src + y * width;
+
+		modified |= morph_line(line, width, radius, erode);
+		for (uint32_t x = 0; x < width; ++x) {
+			uint32_t count = (y ? column_count((line - width)[x]) : 0) +
+					 !!(line[x] & MORPH_BIT);
+
+			line[x] = (line[x] & ~COUNT_BITS) | count << TILE_MASK_SHIFT;
+		}
+	}
+
+	for (uint32_t y = 0; y < height; ++y) {
+		uint32_t *line = src + y * width;
+		uint32_t first = y < radius ? 0 : y - radius;
+		uint32_t last = y + radius < height ? y + radius : height - 1;
+		uint32_t rows = last - first + 1;
+		/* Rows which enter and leave the window and the row with counts before */
+		uint32_t *enter = y + radius < height ? src + last * width : NULL;
+		uint32_t *leave = y > radius ? src + (y - radius - 1) * width : NULL;
+		uint32_t *counts = enter ? (last ? enter - width : NULL) : src + last * width;
+
+		if (enter)
+			modified |= morph_line(enter, width, radius, erode);
+		for (uint32_t x = 0; x < width; ++x) {
+			uint32_t count = counts ? column_count(counts[x]) : 0;
+			uint32_t mask;
+
+			if (enter)
+				count += !!(enter[x] & MORPH_BIT);
+			if (leave) {
+				count -= !!(leave[x] & MORPH_BIT);
+				leave[x] = set_mask(leave[x], leave[x] & MASK_BIT);
+			}
+			src[last * width + x] = (src[last * width + x] & ~COUNT_BITS) |
+						count << TILE_MASK_SHIFT;
+
+			mask = (erode ? count == rows : count > 0) ? MASK_BIT : 0;
+			modified |= (line[x] ^ mask) & MASK_BIT;
+			line[x] = (line[x] & ~MASK_BIT) | mask;
+		}
+	}
+
+	/* Rows which never left the window */
+	for (uint32_t y = height > radius + 1 ? height - radius - 1 : 0; y < height; ++y)
+		for (uint32_t x = 0; x < width; ++x)
+			src[y * width + x] = set_mask(src[y * width + x],
+						      src[y * width + x] & MASK_BIT);
+
+	return modified;
+}
+
+static uint32_t blob_find(const uint32_t *parent, uint32_t label)
+{
+	while (parent[label] != label)
+		label = parent[label];
+
+	return label;
+}
+
+static void blob_extend(struct tile_blob *box, const struct tile_blob *other)
+{
+	if (other->left < box->left)
+		box->left = other->left;
+	if (other->top < box->top)
+		box->top = other->top;
+	if (other->right > box->right)
+		box->right = other->right;
+	if (other->bottom > box->bottom)
+		box->bottom = other->bottom;
+	box->pixels += other->pixels;
+}
+
+/* Join labels @a and @b, the smaller root stays, so boxes keep order of first pixels */
+static uint32_t blob_union(struct blob_data *blobs, uint32_t a, uint32_t b)
+{
+	a = blob_find(blobs->parent, a);
+	b = blob_find(blobs->parent, b);
+	if (a == b)
+		return a;
+	if (b < a) {
+		uint32_t t = a;
+
+		a = b;
+		b = t;
+	}
+	blobs->parent[b] = a;
+	blob_extend(&blobs->boxes[a], &blobs->boxes[b]);
+
+	return a;
+}
+
+static int edges_touch(const struct blob_edge *a, const struct blob_edge *b)
+{
+	return a->left <= b->right + 1 && b->left <= a->right + 1 &&
+	       a->top <= b->bottom + 1 && b->top <= a->bottom + 1;
+}
+
+static void rename_edges(struct blob_edge *edges, uint32_t count, uint32_t from, uint32_t to)
+{
+	for (uint32_t i = 0; i < count; ++i)
+		if (edges[i].blob == from)
+			edges[i].blob = to;
+}
+
+/* Replace list entry @from by @to everywhere it is referenced */
+static void blob_rename(struct blob_data *blobs, struct blob_list *list, uint32_t from,
+			uint32_t to)
+{
+	rename_edges(blobs->seams, blobs->nseams, from, to);
+	rename_edges(list->edges, list->nedges, from, to);
+	rename_edges(blobs->top, blobs->ntop, from, to);
+	rename_edges(blobs->left, blobs->nleft, from, to);
+	rename_edges(blobs->right, blobs->nright, from, to);
+	for (uint32_t i = 0; i < blobs->nlabels; ++i)
+		if (blobs->entry[i] == from)
+			blobs->entry[i] = to;
+}
+
+/* Remove list entry @i, its references are replaced by @to */
+static void blob_remove(struct blob_data *blobs, struct blob_list *list, uint32_t i,
+			uint32_t to)
+{
+	uint32_t last = --list->count;
+
+	blob_rename(blobs, list, i, to);
+	if (i != last) {
+		list->blobs[i] = list->blobs[last];
+		blob_rename(blobs, list, last, i);
+	}
+}
+
+/* Join list entries @a and @b, whose pixels touch */
+static void blob_merge(struct blob_data *blobs, struct blob_list *list, uint32_t a, uint32_t b)
+{
+	if (a == b || a == BLOB_NONE || b == BLOB_NONE)
+		return;
+	if (b < a) {
+		uint32_t t = a;
+
+		a = b;
+		b = t;
+	}
+	blob_extend(&list->blobs[a], &list->blobs[b]);
+	blob_remove(blobs, list, b, a);
+}
+
+static int blob_referenced(const struct blob_data *blobs, const struct blob_list *list,
+			   uint32_t blob)
+{
+	for (uint32_t i = 0; i < blobs->nseams; ++i)
+		if (blobs->seams[i].blob == blob)
+			return 1;
+	for (uint32_t i = 0; i < list->nedges; ++i)
+		if (list->edges[i].blob == blob)
+			return 1;
+
+	return 0;
+}
+
+/* Drop blobs below the pixel count of the stage, which no later tile can touch */
+static void drop_closed_blobs(struct blob_data *blobs, struct blob_list *list)
+{
+	for (uint32_t i = list->count; i-- > 0;)
+		if (list->blobs[i].pixels < blobs->min_pixels && !blob_referenced(blobs, list, i))
+			blob_remove(blobs, list, i, BLOB_NONE);
+}
+
+static void add_edge(struct blob_edge *edges, uint32_t *count, uint32_t max,
+		     const struct blob_edge *edge, uint32_t *overflow)
+{
+	if (edge->blob == BLOB_NONE)
+		return;
+	if (*count < max)
+		edges[(*count)++] = *edge;
+	else
+		*overflow |= BLOB_OVERFLOW_SEAMS;
+}
+
+/* Columns @left..@right of lines @top..@bottom of @tile in frame coordinates */
+static struct blob_edge run_edge(const struct tileinfo *tile, uint32_t left, uint32_t right,
+				 uint32_t top, uint32_t bottom, uint32_t label)
+{
+	return (struct blob_edge){ tile->x + left, tile->y + top, tile->x + right,
+				   tile->y + bottom, label };
+}
+
+/* Append the part of column run of line @y to @edges, continuing the last one */
+static void column_run(struct blob_edge *edges, uint32_t *count, const struct tileinfo *tile,
+		       uint32_t x, uint32_t y, uint32_t label, uint32_t *overflow)
+{
+	if (*count && edges[*count - 1].bottom + 1 == tile->y + y) {
+		edges[*count - 1].bottom++;
+		return;
+	}
+
+	struct blob_edge edge = run_edge(tile, x, x, y, y, label);
+
+	add_edge(edges, count, MAX_BLOB_COLUMN_RUNS, &edge, overflow);
+}
+
+/*
+ * Label 8-connected pixels with mask set in @tile, which starts in @src with
+ * @width pixels per line, by runs of pixels. Runs of the first line and of the
+ * first and last columns are kept in @blobs with their labels.
+ */
+static uint32_t label_tile(const uint32_t *src, uint32_t width, const struct tileinfo *tile,
+			   struct blob_data *blobs, struct blob_run **last, uint32_t *nlast,
+			   uint32_t *overflow)
+{
+	struct blob_run *prev = blobs->runs[0], *cur = blobs->runs[1];
+	uint32_t nlabels = 0, nprev = 0;
+
+	blobs->ntop = blobs->nleft = blobs->nright = 0;
+	for (uint32_t y = 0; y < tile->height; ++y) {
+		const uint32_t *line = src + y * width;
+		uint32_t ncur = 0, j = 0;
+
+		for (uint32_t x = 0; x < tile->width;) {
+			if (!(line[x] & MASK_BIT)) {
+				++x;
+				continue;
+			}
+
+			struct tile_blob run = { .left = x, .top = y, .bottom = y };
+			uint32_t label = MAX_BLOB_LABELS;
+
+			while (x < tile->width && line[x] & MASK_BIT)
+				++x;
+			run.right = x - 1;
+			run.pixels = x - run.left;
+
+			/* Runs of the previous line, which touch the run or its corners */
+			while (j < nprev && prev[j].right + 1 < run.left)
+				++j;
+			for (uint32_t k = j; k < nprev && prev[k].left <= run.right + 1; ++k)
+				label = label == MAX_BLOB_LABELS ?
+					blob_find(blobs->parent, prev[k].label) :
+					blob_union(blobs, label, prev[k].label);
+
+			if (label == MAX_BLOB_LABELS && nlabels < MAX_BLOB_LABELS) {
+				label = nlabels++;
+				blobs->parent[label] = label;
+				blobs->boxes[label] = run;
+			} else {
+				if (label == MAX_BLOB_LABELS) {
+					label = blob_find(blobs->parent, nlabels - 1);
+					*overflow |= BLOB_OVERFLOW_TILE;
+				}
+				blob_extend(&blobs->boxes[label], &run);
+			}
+
+			if (ncur < MAX_BLOB_RUNS) {
+				cur[ncur++] = (struct blob_run){ run.left, run.right, label };
+			} else {
+				cur[ncur - 1].right = run.right;
+				cur[ncur - 1].label = blob_union(blobs, cur[ncur - 1].label, label);
+				*overflow |= BLOB_OVERFLOW_TILE;
+			}
+
+			if (!y) {
+				struct blob_edge edge = run_edge(tile, run.left, run.right, 0, 0,
+								 label);
+
+				add_edge(blobs->top, &blobs->ntop, MAX_BLOB_RUNS, &edge, overflow);
+			}
+			if (!run.left)
+				column_run(blobs->left, &blobs->nleft, tile, 0, y, label, overflow);
+			if (run.right == tile->width - 1)
+				column_run(blobs->right, &blobs->nright, tile, run.right, y, label,
+					   overflow);
+		}
+
+		struct blob_run *t = prev;
+
+		prev = cur;
+		cur = t;
+		nprev = ncur;
+	}
+
+	*last = prev;
+	*nlast = nprev;
+
+	return nlabels;
+}
+
+/* Replace labels of @edges by list entries of their areas */
+static void label_entries(struct blob_data *blobs, struct blob_edge *edges, uint32_t count)
+{
+	for (uint32_t i = 0; i < count; ++i)
+		edges[i].blob = blobs->entry[blob_find(blobs->parent, edges[i].blob)];
+}
+
+/* Return nonzero if @seam may touch tiles after @tile in raster order */
+static int seam_alive(const struct blob_edge *seam, const struct tileinfo *tile)
+{
+	return seam->bottom + 1u >= tile->y + tile->height ||
+	       (seam->right + 1u >= tile->x + tile->width && seam->bottom + 1u >= tile->y &&
+		seam->top <= tile->y + tile->height);
+}
+
+/*
+ * Add areas of @tile to the list of the current frame. Areas are merged with
+ * blobs of the previous tiles, whose border runs touch the first line or
+ * column of the tile. Runs on borders with tiles of other cores go to edges
+ * of the list, where the host joins blobs of the cores.
+ */
+static void stage_blobs(const uint32_t *src, uint32_t width, const struct tileinfo *tile,
+			const struct dsp_struct_data *data, struct blob_data *blobs)
+{
+	struct blob_list *list = &blobs->frames[data->frame % TILE_BLOB_SLOTS];
+	struct blob_run *last;
+	uint32_t nlast;
+
+	blobs->nlabels = 0;
+	uint32_t nlabels = label_tile(src, width, tile, blobs, &last, &nlast, &list->overflow);
+
+	for (uint32_t i = 0; i < nlabels; ++i) {
+		struct tile_blob *box = &blobs->boxes[i];
+
+		blobs->entry[i] = BLOB_NONE;
+		if (blobs->parent[i] != i)
+			continue;
+		if (list->count == MAX_FRAME_BLOBS) {
+			list->overflow |= BLOB_OVERFLOW_LIST;
+			continue;
+		}
+		box->left += tile->x;
+		box->right += tile->x;
+		box->top += tile->y;
+		box->bottom += tile->y;
+		blobs->entry[i] = list->count;
+		list->blobs[list->count++] = *box;
+	}
+	blobs->nlabels = nlabels;
+	label_entries(blobs, blobs->top, blobs->ntop);
+	label_entries(blobs, blobs->left, blobs->nleft);
+	label_entries(blobs, blobs->right, blobs->nright);
+
+	for (uint32_t s = 0; s < blobs->nseams; ++s) {
+		for (uint32_t i = 0; i < blobs->ntop; ++i)
+			if (edges_touch(&blobs->top[i], &blobs->seams[s]))
+				blob_merge(blobs, list, blobs->top[i].blob, blobs->seams[s].blob);
+		for (uint32_t i = 0; i < blobs->nleft; ++i)
+			if (edges_touch(&blobs->left[i], &blobs->seams[s]))
+				blob_merge(blobs, list, blobs->left[i].blob, blobs->seams[s].blob);
+	}
+
+	/* Tiles above and left of the first tile of the core are processed by other cores */
+	for (uint32_t i = 0; i < blobs->ntop && tile->y; ++i)
+		if (tile->y == blobs->first_y ||
+		    (tile->y == blobs->first_y + blobs->first_height &&
+		     blobs->top[i].left <= blobs->first_x))
+			add_edge(list->edges, &list->nedges, MAX_BLOB_EDGES, &blobs->top[i],
+				 &list->overflow);
+	for (uint32_t i = 0; i < blobs->nleft && tile->x; ++i)
+		if (tile->x == blobs->first_x && tile->y == blobs->first_y)
+			add_edge(list->edges, &list->nedges, MAX_BLOB_EDGES, &blobs->left[i],
+				 &list->overflow);
+
+	uint32_t nseams = 0;
+
+	for (uint32_t s = 0; s < blobs->nseams; ++s)
+		if (seam_alive(&blobs->seams[s], tile))
+			blobs->seams[nseams++] = blobs->seams[s];
+	blobs->nseams = nseams;
+
+	/* Nothing follows the last line and column of the frame */
+	for (uint32_t i = 0; i < blobs->nright &&
+	     tile->x + tile->width < data->frame_width; ++i)
+		add_edge(blobs->seams, &blobs->nseams, MAX_BLOB_SEAMS, &blobs->right[i],
+			 &list->overflow);
+	for (uint32_t i = 0; i < nlast && tile->y + tile->height < data->frame_height; ++i) {
+		struct blob_edge edge = run_edge(tile, last[i].left, last[i].right,
+						 tile->height - 1, tile->height - 1,
+						 blobs->entry[blob_find(blobs->parent,
+									last[i].label)]);
+
+		add_edge(blobs->seams, &blobs->nseams, MAX_BLOB_SEAMS, &edge, &list->overflow);
+	}
+
+	drop_closed_blobs(blobs, list);
+	blobs->nlabels = 0;
+	blobs->ntop = blobs->nleft = blobs->nright = 0;
+}
+
+/* Return blob data after states of @ntiles tiles, or NULL without blob stage */
+static struct blob_data *blob_stage_data(struct dsp_struct_data *data, uint32_t ntiles)
+{
+	for (uint32_t i = 0; i < data->nstages && i < MAX_TILE_STAGES; ++i)
+		if (data->stages[i].op == TILE_STAGE_BLOBS)
+			return (struct blob_data *)&data->tiles[ntiles];
+
+	return NULL;
+}
+
+/* Start the list of the current frame, whose tiles on the core start with @first */
+static void blobs_begin(const struct dsp_struct_data *data, struct blob_data *blobs,
+			const struct tileinfo *first)
+{
+	struct blob_list *list = &blobs->frames[data->frame % TILE_BLOB_SLOTS];
+
+	list->count = 0;
+	list->overflow = 0;
+	list->nedges = 0;
+	blobs->nseams = 0;
+	blobs->nlabels = 0;
+	blobs->ntop = blobs->nleft = blobs->nright = 0;
+	blobs->first_x = first->x;
+	blobs->first_y = first->y;
+	blobs->first_height = first->height;
+	for (uint32_t i = 0; i < data->nstages && i < MAX_TILE_STAGES; ++i)
+		if (data->stages[i].op == TILE_STAGE_BLOBS)
+			blobs->min_pixels = data->stages[i].param;
+}
+
+/*
+ * Finish the list of the current frame. Border runs left may touch tiles of
+ * the next cores, so they go to edges and their blobs are kept for the host.
+ */
+static void blobs_end(const struct dsp_struct_data *data, struct blob_data *blobs)
+{
+	struct blob_list *list = &blobs->frames[data->frame % TILE_BLOB_SLOTS];
+
+	for (uint32_t s = 0; s < blobs->nseams; ++s)
+		add_edge(list->edges, &list->nedges, MAX_BLOB_EDGES, &blobs->seams[s],
+			 &list->overflow);
+	blobs->nseams = 0;
+	drop_closed_blobs(blobs, list);
+	list->frame = data->frame;
+}
+
+static uint32_t halo_size(uint32_t halo, uint32_t space)
+{
+	return space < halo ? space : halo;
+}
+
+/*
+ * Run stages of @data on @tile with halo, which is @width x @height in XYRAM.
+ * Return nonzero if the tile may be changed. detector() does not tell it.
+ */
+static uint32_t run_stages(uint32_t *src, uint32_t width, uint32_t height,
+			   const struct tileinfo *tile, struct dsp_struct_data *data,
+			   uint32_t *background, struct blob_data *blobs)
+{
+	size_t pixels = width * height;
+	uint32_t modified = 0;
+
+	if (!data->nstages) {
+		detector(src, pixels, data, background);
+		return 1;
+	}
+
+	for (uint32_t i = 0; i < data->nstages && i < MAX_TILE_STAGES; ++i) {
+		const struct tile_stage *stage = &data->stages[i];
+
+		switch (stage->op) {
+		case TILE_STAGE_DETECT:
+			detector(src, pixels, data, background);
+			modified = 1;
+			break;
+		case TILE_STAGE_MOTION:
+			modified |= stage_motion(src, pixels, background, stage->param);
+			break;
+		case TILE_STAGE_GRAYSCALE:
+			modified |= stage_grayscale(src, pixels);
+			break;
+		case TILE_STAGE_THRESHOLD:
+			modified |= stage_threshold(src, pixels, stage->param);
+			break;
+		case TILE_STAGE_OVERLAY:
+			modified |= stage_overlay(src, pixels);
+			break;
+		case TILE_STAGE_ERODE:
+		case TILE_STAGE_DILATE:
+			modified |= stage_morph(src, width, height, stage->param,
+						stage->op == TILE_STAGE_ERODE);
+			break;
+		case TILE_STAGE_OPEN:
+		case TILE_STAGE_CLOSE:
+			modified |= stage_morph(src, width, height, stage->param,
+						stage->op == TILE_STAGE_OPEN);
+			modified |= stage_morph(src, width, height, stage->param,
+						stage->op == TILE_STAGE_CLOSE);
+			break;
+		case TILE_STAGE_BLOBS:
+			stage_blobs(src + halo_size(data->halo, tile->y) * width +
+				    halo_size(data->halo, tile->x), width, tile, data, blobs);
+			break;
+		}
+	}
+
+	return modified;
+}
+
+/*
+ * Copy @tile without halo of @left columns and @top rows from @src of @width
+ * pixels per line to the beginning of @dst, which may be @src, as output SDMA
+ * reads lines without gaps.
+ */
+static void crop_halo(uint32_t *dst, const uint32_t *src, uint32_t width,
+		      const struct tileinfo *tile, uint32_t left, uint32_t top)
+{
+	for (uint32_t y = 0; y < tile->height; ++y) {
+		const uint32_t *line = src + (y + top) * width + left;
+		uint32_t *out = dst + y * tile->width;
+
+		for (uint32_t x = 0; x < tile->width; ++x)
+			out[x] = line[x];
+	}
+}
+
+/*
+ * Count pixels of @tile without halo of @left columns and @top rows in @src
+ * of @width pixels per line, which differ from @background by more than
+ * @threshold, and mean absolute difference of their color components.
+ * Components are compared one by one in one more pass over the tile.
+ */
+static void collect_stats(const uint32_t *src, const uint32_t *background, uint32_t width,
+			  const struct tileinfo *tile, uint32_t left, uint32_t top,
+			  uint32_t threshold, struct tile_stats *stats)
+{
+	uint32_t changed = 0, sum = 0;
+
+	for (uint32_t y = 0; y < tile->height; ++y) {
+		const uint32_t *p = src + (y + top) * width + left;
+		const uint32_t *b = background + (y + top) * width + left;
+
+		for (uint32_t x = 0; x < tile->width; ++x) {
+			uint32_t moving = 0;
+
+			for (int c = 0; c < 24; c += 8) {
+				int diff = abs((int)(p[x] >> c & 0xff) - (int)(b[x] >> c & 0xff));
+
+				sum += diff;
+				if (diff > (int)threshold)
+					moving = 1;
+			}
+			changed += moving;
+		}
+	}
+
+	stats->changed = changed;
+	stats->difference = sum / (3 * tile->width * tile->height);
+}
+
+/*
+ * Pack mask of @tile without halo of @left columns and @top rows in @buf of
+ * @width pixels per line to @dst, 1 bit per pixel, least significant bit
+ * first. Lines take (tile->width + 7) / 8 bytes, as output SDMA reads them
+ * without gaps. @dst may be @buf: packed line is shorter than a line of
+ * pixels, so bytes are stored behind pixels which are not read yet.
+ */
+static void pack_mask(uint8_t *dst, const uint32_t *buf, uint32_t width,
+		      const struct tileinfo *tile, uint32_t left, uint32_t top)
+{
+	uint32_t pitch = (tile->width + 7) / 8;
+
+	for (uint32_t y = 0; y < tile->height; ++y) {
+		const uint32_t *src = buf + (y + top) * width + left;
+
+		for (uint32_t x = 0; x < tile->width; x += 8) {
+			uint32_t bits = 0;
+
+			for (uint32_t i = 0; i < 8 && x + i < tile->width; ++i)
+				bits |= (src[x + i] >> 31) << i;
+			dst[y * pitch + x / 8] = bits;
+		}
+	}
+}
+
+/* Tile with halo in XYRAM */
+struct tile_extent {
+	/// Halo columns and rows before the tile
+	uint32_t left, top;
+	uint32_t width, height;
+};
+
+static struct tile_extent tile_extent(const struct dsp_struct_data *data,
+				      const struct tileinfo *tile)
+{
+	struct tile_extent e;
+
+	e.left = halo_size(data->halo, tile->x);
+	e.top = halo_size(data->halo, tile->y);
+	e.width = tile->width + e.left +
+		  halo_size(data->halo, data->frame_width - tile->x - tile->width);
+	e.height = tile->height + e.top +
+		   halo_size(data->halo, data->frame_height - tile->y - tile->height);
+
+	return e;
+}
+
+/* XYRAM buffers of a tile in flight, @mask is used only with mask_with_frame */
+struct tile_slot {
+	uint32_t *tile;
+	uint32_t *background;
+	uint8_t *mask;
+};
+
+/*
+ * Start channels of @pending input mask, whose output pairs have written
+ * the previous tile out of the same XYRAM buffers. Frame and background
+ * inputs wait for their own outputs only, started ones are cleared.
+ */
+static int start_inputs(struct tile_dma *dma, const uint32_t *channels, uint32_t *pending)
+{
+	for (int k = 0; k < 4; k += 2)
+		if (*pending & 1u << channels[k] && !(tile_dma_busy(dma) & 1u << channels[k + 1])) {
+			if (tile_dma_start(dma, channels[k]))
+				return -1;
+			*pending &= ~(1u << channels[k]);
+		}
+
+	return 0;
+}
+
+/*
+ * Process tile @i loaded to @slot and leave the result in @out, which is
+ * either @slot or the output slot. Inputs of @pending are started between
+ * steps as soon as the outputs of the previous tile are done.
+ */
+static int process_tile(struct dsp_struct_data *data, uint32_t i, const struct tileinfo *tile,
+			const struct tile_slot *slot, const struct tile_slot *out,
+			struct blob_data *blobs, struct tile_dma *dma, uint32_t *pending)
+{
+	struct tile_extent e = tile_extent(data, tile);
+	size_t size = e.width * e.height;
+	struct tile_state *state = &data->tiles[i];
+	uint32_t mask_with_frame = data->mask_output && data->mask_with_frame;
+	uint32_t signature, changed = 1, modified;
+
+	if (data->skip_unchanged) {
+		signature = tile_signature(slot->tile, size);
+		changed = signature != state->signature;
+		state->signature = signature;
+		if (start_inputs(dma, data->channels, pending))
+			return -1;
+	}
+	state->history = (state->history & ~TILE_HISTORY_FRAME_MASK) << 1 |
+			 changed << TILE_HISTORY_SHIFT |
+			 (data->frame & TILE_HISTORY_FRAME_MASK);
+
+	/*
+	 * Output DMA of the tile can not be skipped, because SDMA chain moves
+	 * to the next tile on each start. So the tile is left as loaded, which
+	 * is its result if nothing moved in it last time. Background tile is
+	 * written back by its output channel, so the update stays in XYRAM
+	 * pass of the tile.
+	 */
+	struct tile_stats *stats = &state->stats[data->frame % TILE_STATS_SLOTS];
+
+	if (!data->flag_avered) {
+		copy_tile(slot->tile, slot->background, size);
+		/* Nothing moves in the frame, which becomes background */
+		if (data->mask_output)
+			for (size_t j = 0; j < size; ++j)
+				slot->tile[j] = set_mask(slot->tile[j], 0);
+		state->passthrough = 0;
+		*stats = (struct tile_stats){ 0 };
+	} else if (changed || !state->passthrough) {
+		if (data->background_shift)
+			background_update(slot->tile, slot->background, size,
+					  data->background_shift);
+		/* Stages may change colors, so statistics are taken before them */
+		if (data->tile_stats)
+			collect_stats(slot->tile, slot->background, e.width, tile, e.left, e.top,
+				      data->stats_threshold, stats);
+		if (start_inputs(dma, data->channels, pending))
+			return -1;
+		/*
+		 * Signature of the input is taken once, stages tell if they change
+		 * it. Blob lists are built anew each frame, so such tiles are not
+		 * passed through.
+		 */
+		modified = run_stages(slot->tile, e.width, e.height, tile, data, slot->background,
+				      blobs);
+		state->passthrough = data->skip_unchanged && !modified && !blobs;
+	} else {
+		/* Skipped tile keeps statistics of the previous frame */
+		*stats = state->stats[(data->frame - 1) % TILE_STATS_SLOTS];
+	}
+	stats->frame = data->frame;
+
+	if (mask_with_frame) {
+		/* Mask of tile i - 1 is small, its output ends before the frame one */
+		while (tile_dma_busy(dma) & 1u << data->channels[4]);
+		pack_mask(slot->mask, slot->tile, e.width, tile, e.left, e.top);
+	}
+	/* Output slot is read by outputs of the previous tile until they are done */
+	if (out != slot)
+		while (tile_dma_busy(dma) & (1u << data->channels[1] | 1u << data->channels[3]));
+	if (data->mask_output && !mask_with_frame)
+		pack_mask((uint8_t *)out->tile, slot->tile, e.width, tile, e.left, e.top);
+	else if (data->halo)
+		crop_halo(out->tile, slot->tile, e.width, tile, e.left, e.top);
+	else if (out != slot)
+		copy_tile(slot->tile, out->tile, size);
+	if (data->halo)
+		crop_halo(out->background, slot->background, e.width, tile, e.left, e.top);
+	else if (out != slot)
+		copy_tile(slot->background, out->background, size);
+
+	return 0;
+}
+
+/*
+ * Process a frame of @tiles. Tiles are loaded to two @slots, which are
+ * switched by input DMA chains on each tile. Without @out, output chains
+ * switch the same slots: while tile i is processed in one slot, the other
+ * one writes tile i - 1 back and then loads tile i + 1, whose inputs are
+ * started between steps of processing as soon as the outputs are done.
+ * With the output slot @out, where output chains read every tile, results
+ * are copied there, so the input of tile i + 1, processing of tile i and the
+ * output of tile i - 1 overlap. Processing waits only for its own input.
+ */
+static int process_tiles(struct dsp_struct_data *data, const struct tilesbuffer *tiles,
+			 const struct tile_slot *slots, const struct tile_slot *out,
+			 struct tile_dma *dma)
+{
+	const uint32_t *channels = data->channels;
+	uint32_t mask_with_frame = data->mask_output && data->mask_with_frame;
+	uint32_t input_mask = 1u << channels[0] | 1u << channels[2];
+	uint32_t output_mask = 1u << channels[1] | 1u << channels[3];
+
+	if (mask_with_frame)
+		output_mask |= 1u << channels[4];
+
+	/* List of the frame is read by the host while the next frames are processed */
+	struct blob_data *blobs = blob_stage_data(data, tiles->ntiles);
+
+	if (blobs)
+		blobs_begin(data, blobs, &tiles->info[0]);
+
+	if (tile_dma_start(dma, channels[0]) || tile_dma_start(dma, channels[2]))
+		return -1;
+
+	for (uint32_t i = 0; i < tiles->ntiles; ++i) {
+		uint32_t pending = i + 1 < tiles->ntiles ? input_mask : 0;
+
+		/* Tile i is loaded */
+		while (tile_dma_busy(dma) & input_mask);
+
+		/* Tile i - 1 has been copied to the output slot, tile i + 1 replaces it */
+		if (out && pending) {
+			if (tile_dma_start(dma, channels[0]) || tile_dma_start(dma, channels[2]))
+				return -1;
+			pending = 0;
+		}
+
+		if (start_inputs(dma, channels, &pending) ||
+		    process_tile(data, i, &tiles->info[i], &slots[i % 2], out ? out : &slots[i % 2],
+				 blobs, dma, &pending))
+			return -1;
+
+		/* Tile i - 1 has left the other slot, tile i + 1 goes there */
+		while (pending)
+			if (start_inputs(dma, channels, &pending))
+				return -1;
+
+		if (tile_dma_start(dma, channels[1]) || tile_dma_start(dma, channels[3]) ||
+		    (mask_with_frame && tile_dma_start(dma, channels[4])))
+			return -1;
+	}
+
+	while (tile_dma_busy(dma) & output_mask);
+
+	if (blobs)
+		blobs_end(data, blobs);
+	data->frame += 1;
+	data->flag_avered = 1;
+
+	return 0;
+}
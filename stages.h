@@ -0,0 +1,219 @@
+/*
+ * \file
+ * \brief Tile stages and data of detector firmware, shared by firmware and host
+ *
+ * Detector runs a list of stages on each tile while the tile is in XYRAM,
+ * so a pipeline of stages costs one read and one write of the frame in DDR.
+ * Stages which find pixels of interest store the mask to the alpha byte of
+ * the pixel (0xff - set, 0 - clear) for the next stages.
+ *
+ * Morphology stages need neighbours of the tile pixels, so tiles are loaded
+ * with a halo of rows and columns of the neighbouring tiles, which is cut off
+ * before the tile is written back.
+ *
+ * Blob stage labels 8-connected pixels of the mask in the tile and adds their
+ * bounding boxes to the list of the frame. Runs of mask pixels on tile borders
+ * are kept while the next tiles may touch them, and blobs are merged when runs
+ * of neighbouring tiles touch. Closed blobs below the pixel count of the stage
+ * are dropped at once. Lists of frames in flight are kept in XYRAM after
+ * detector data, where the host reads them.
+ *
+ * \copyright
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ */
+#ifndef _STAGES_H_
+#define _STAGES_H_
+
+#include <stdint.h>
+
+/// Maximum number of stages run on a tile
+#define MAX_TILE_STAGES 8
+
+/// Bit position of the mask in RGBA pixel
+#define TILE_MASK_SHIFT 24
+
+/// Maximum number of rows and columns loaded around a tile
+#define MAX_TILE_HALO 16
+
+enum tile_stage_op {
+	/// Raise red component of pixels which differ from background
+	TILE_STAGE_DETECT,
+	/// Set mask of pixels, which differ from background by more than @param
+	TILE_STAGE_MOTION,
+	/// Replace color of pixels by their luma
+	TILE_STAGE_GRAYSCALE,
+	/// Set mask of pixels with luma above @param
+	TILE_STAGE_THRESHOLD,
+	/// Raise red component of pixels with mask set
+	TILE_STAGE_OVERLAY,
+	/// Clear mask of pixels which have a clear one in square of radius @param
+	TILE_STAGE_ERODE,
+	/// Set mask of pixels which have a set one in square of radius @param
+	TILE_STAGE_DILATE,
+	/// Erode and dilate by @param to remove specks of the mask
+	TILE_STAGE_OPEN,
+	/// Dilate and erode by @param to fill holes of the mask
+	TILE_STAGE_CLOSE,
+	/// Add bounding boxes of the mask to struct blob_list, boxes below @param pixels are dropped
+	TILE_STAGE_BLOBS,
+	TILE_STAGE_COUNT
+};
+
+struct tile_stage {
+	uint32_t op;
+	uint32_t param;
+};
+
+/// Blob lists kept for frames in flight, at least MAX_RESULT_FRAMES of dspdetector.h
+#define TILE_BLOB_SLOTS 4
+
+/// Maximum number of blobs one core reports for a frame, the rest are lost
+#define MAX_FRAME_BLOBS 32
+
+/// Labels of one tile and runs of one tile line, extra ones join the last one
+#define MAX_BLOB_LABELS 128
+#define MAX_BLOB_RUNS 64
+
+/// Runs of the first or the last column of one tile
+#define MAX_BLOB_COLUMN_RUNS 32
+
+/// Border runs kept for the next tiles of the core and passed to the host for other cores
+#define MAX_BLOB_SEAMS 96
+#define MAX_BLOB_EDGES 32
+
+/// Blob of no list entry
+#define BLOB_NONE UINT16_MAX
+
+/// Labels or runs of a tile ran out, some areas of the tile are joined
+#define BLOB_OVERFLOW_TILE (1 << 0)
+/// List of the frame is full, blobs are lost
+#define BLOB_OVERFLOW_LIST (1 << 1)
+/// Border runs ran out, blobs crossing tile borders may be split
+#define BLOB_OVERFLOW_SEAMS (1 << 2)
+
+/// Bounding box of connected pixels with mask set, inclusive frame coordinates
+struct tile_blob {
+	uint16_t left, top;
+	uint16_t right, bottom;
+	uint32_t pixels;
+};
+
+/// Pixels with mask set along a tile border, inclusive frame coordinates, of list entry @blob
+struct blob_edge {
+	uint16_t left, top;
+	uint16_t right, bottom;
+	uint16_t blob;
+};
+
+struct blob_list {
+	/// Number of the frame on the core, see frame of struct dsp_struct_data
+	uint32_t frame;
+	uint32_t count;
+	/// BLOB_OVERFLOW_* flags of the frame
+	uint32_t overflow;
+	/// Border runs which may touch tiles of other cores
+	uint32_t nedges;
+	struct tile_blob blobs[MAX_FRAME_BLOBS];
+	struct blob_edge edges[MAX_BLOB_EDGES];
+};
+
+/// Pixels of a tile line with mask set
+struct blob_run {
+	uint16_t left, right;
+	uint32_t label;
+};
+
+/* Blob stage data placed after tile states of detector data */
+struct blob_data {
+	struct blob_list frames[TILE_BLOB_SLOTS];
+	/// Scratch of tile labeling, boxes are in tile coordinates
+	uint32_t parent[MAX_BLOB_LABELS];
+	struct tile_blob boxes[MAX_BLOB_LABELS];
+	struct blob_run runs[2][MAX_BLOB_RUNS];
+	/// Runs of the first line, the first and the last column of the tile
+	struct blob_edge top[MAX_BLOB_RUNS];
+	struct blob_edge left[MAX_BLOB_COLUMN_RUNS], right[MAX_BLOB_COLUMN_RUNS];
+	uint32_t ntop, nleft, nright;
+	/// List entry of each root label of the tile
+	uint16_t entry[MAX_BLOB_LABELS];
+	uint32_t nlabels;
+	/// Border runs of processed tiles of the frame, which may touch the next tiles
+	struct blob_edge seams[MAX_BLOB_SEAMS];
+	uint32_t nseams;
+	uint32_t min_pixels;
+	/// The first tile of the core, tiles before it belong to other cores
+	uint32_t first_x, first_y, first_height;
+};
+
+struct tileinfo {
+	uint32_t x, y;
+	uint32_t width, height;
+	uint32_t stride[2];
+};
+
+struct tilesbuffer {
+	uint32_t ntiles;
+	uint32_t tilesize;
+	uint32_t pixel_size;
+	struct tileinfo info[];
+};
+
+/* Bits 0..7 of tile history - the last frame, bit 8 + i - tile changed i frames before */
+#define TILE_HISTORY_FRAME_MASK 0xff
+#define TILE_HISTORY_SHIFT 8
+
+/// Statistics are kept for frames in flight, at least MAX_RESULT_FRAMES of dspdetector.h
+#define TILE_STATS_SLOTS 4
+
+/* Statistics of a tile in a frame */
+struct tile_stats {
+	/// Pixels with a color component differing from background by more than threshold
+	uint16_t changed;
+	/// Mean absolute difference of color components with background
+	uint8_t difference;
+	/// Bits 0..7 of the frame number
+	uint8_t frame;
+};
+
+/* State of a tile which firmware keeps between frames */
+struct tile_state {
+	uint32_t signature;
+	uint32_t history;
+	/// Output of the tile equals its input
+	uint32_t passthrough;
+	/// Statistics of frame i in stats[i % TILE_STATS_SLOTS]
+	struct tile_stats stats[TILE_STATS_SLOTS];
+};
+
+/* Detector data in XYRAM, written by host and firmware */
+struct dsp_struct_data {
+	uint32_t channels[8];
+	/// Background follows frames with weight 1/2^background_shift, 0 - frozen
+	uint32_t background_shift;
+	/// Background is taken, otherwise the next frame is copied to it
+	uint32_t flag_avered;
+	uint32_t skip_unchanged;
+	/// Number of frames processed by the core
+	uint32_t frame;
+	/// Stages run on each tile, detector() only if there are no stages
+	uint32_t nstages;
+	struct tile_stage stages[MAX_TILE_STAGES];
+	/// Rows and columns loaded around each tile, limited by frame edges
+	uint32_t halo;
+	uint32_t frame_width;
+	uint32_t frame_height;
+	/// Output channel writes mask of tiles packed 1 bit per pixel instead of pixels
+	uint32_t mask_output;
+	/// Output channel writes pixels, channels[4] writes mask packed to mask tiles
+	uint32_t mask_with_frame;
+	/// Collect struct tile_stats with threshold stats_threshold
+	uint32_t tile_stats;
+	uint32_t stats_threshold;
+	/// Offset of struct tilesbuffer of the core, which shares the buffer of the data
+	uint32_t tiles_offset;
+	/// Outputs read frame and background tiles from output slots, see process_tiles()
+	uint32_t output_slot;
+	struct tile_state tiles[];
+};
+
+#endif
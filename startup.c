@@ -0,0 +1,84 @@
+/*
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ */
+#include <error.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "startup.h"
+
+static double start_time;
+static bool trace;
+static bool done;
+
+static double now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+void startup_init(void)
+{
+	start_time = now();
+	trace = getenv("DELCORE30M_STARTUP_TRACE") != NULL;
+}
+
+double startup_begin(void)
+{
+	return now();
+}
+
+void startup_end(const char *name, double begin)
+{
+	double end = now();
+
+	if (trace)
+		printf("Startup: %-20s %7.1f ms, %7.1f ms from start\n", name, end - begin,
+		       end - start_time);
+}
+
+void startup_done(void)
+{
+	if (trace && !done)
+		printf("Startup: %-20s %18.1f ms from start\n", "first frame",
+		       now() - start_time);
+	done = true;
+}
+
+static void *phase_thread(void *arg)
+{
+	struct startup_phase *phase = arg;
+	double begin = now();
+
+	phase->fn(phase->arg);
+	startup_end(phase->name, begin);
+
+	return NULL;
+}
+
+void startup_start(struct startup_phase *phase, const char *name, void (*fn)(void *arg),
+		   void *arg)
+{
+	int ret;
+
+	phase->name = name;
+	phase->fn = fn;
+	phase->arg = arg;
+	ret = pthread_create(&phase->thread, NULL, phase_thread, phase);
+	if (ret)
+		error(EXIT_FAILURE, ret, "Failed to start %s", name);
+	phase->running = true;
+}
+
+void startup_wait(struct startup_phase *phase)
+{
+	if (!phase->running)
+		return;
+
+	pthread_join(phase->thread, NULL);
+	phase->running = false;
+}
@@ -0,0 +1,49 @@
+/*
+ * \file
+ * \brief Startup trace and concurrent initialization phases of demo applications
+ *
+ * If DELCORE30M_STARTUP_TRACE environment variable is set, duration of each
+ * startup phase and time from startup_init() are printed, so time to the first
+ * frame can be measured and split between phases.
+ *
+ * \copyright
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ */
+#ifndef _STARTUP_H_
+#define _STARTUP_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+
+/* Phase run by a thread concurrently with the main thread */
+struct startup_phase {
+	pthread_t thread;
+	const char *name;
+	void (*fn)(void *arg);
+	void *arg;
+	bool running;
+};
+
+/* Remember start time of the application. Must be called first in main(). */
+void startup_init(void);
+
+/* Return begin time of a phase to pass to startup_end() */
+double startup_begin(void);
+
+/* Print duration of phase @name started at @begin */
+void startup_end(const char *name, double begin);
+
+/* Print time from start to the first frame. Only the first call prints. */
+void startup_done(void);
+
+/*
+ * Run @fn(@arg) as phase @name in a new thread. Phase functions report errors
+ * by error(), which exits the whole application.
+ */
+void startup_start(struct startup_phase *phase, const char *name, void (*fn)(void *arg),
+		   void *arg);
+
+/* Wait until @phase is finished. Does nothing if the phase is not running. */
+void startup_wait(struct startup_phase *phase);
+
+#endif
@@ -10,8 +10,19 @@
 
 #include "stbfont.h"
 
-void init_font(struct fontData *data, int line_height)
+static void set_metrics(struct fontData *data, int line_height)
 {
+	stbtt_GetFontVMetrics(&data->font, &data->ascent, &data->descent, &data->lineGap);
+	data->scale = stbtt_ScaleForPixelHeight(&data->font, line_height);
+
+	data->ascent *= data->scale;
+	data->descent *= data->scale;
+	data->lineGap *= data->scale;
+}
+
+static void load_font(void *arg)
+{
+	struct fontData *data = arg;
 	size_t size;
 	char *font_path_env = getenv("DELCORE30M_FONT_PATH");
 
@@ -32,17 +43,27 @@ void init_font(struct fontData *data, int line_height)
 	if (!stbtt_InitFont(&data->font, data->fontbuf, 0))
 		error(EXIT_FAILURE, 0, "Failed to init font");
 
-	stbtt_GetFontVMetrics(&data->font, &data->ascent, &data->descent, &data->lineGap);
-	data->scale = stbtt_ScaleForPixelHeight(&data->font, line_height);
+	set_metrics(data, data->line_height);
+}
 
-	data->ascent *= data->scale;
-	data->descent *= data->scale;
-	data->lineGap *= data->scale;
+void init_font(struct fontData *data, int line_height)
+{
+	data->line_height = line_height;
+	startup_start(&data->loader, "font", load_font, data);
+}
+
+void resize_font(struct fontData *data, int line_height)
+{
+	startup_wait(&data->loader);
+	data->line_height = line_height;
+	set_metrics(data, line_height);
 }
 
 void draw_string(struct fontData *font, uint8_t *dest, uint32_t width, char *text,
 		 int line)
 {
+	startup_wait(&font->loader);
+
 	uint32_t height = font->ascent - font->descent + font->lineGap;
 	uint8_t *bitmap = calloc(height * width, sizeof(uint8_t));
 
@@ -6,6 +6,7 @@
 
 #include <stdint.h>
 
+#include "startup.h"
 #include "stb/stb_truetype.h"
 
 #define DEFAULT_FONT_PATH "/usr/share/fonts/ubuntu/Ubuntu-Regular.ttf"
@@ -17,10 +18,17 @@ struct fontData {
 	int descent;
 	int lineGap;
 	float scale;
+	int line_height;
+	/// Font file is read by a thread started by init_font()
+	struct startup_phase loader;
 };
 
+/* Start loading of the font. Font is waited by the first draw_string() or resize_font(). */
 void init_font(struct fontData *data, int line_height);
 
+/* Change height of text lines of loaded font */
+void resize_font(struct fontData *data, int line_height);
+
 void draw_string(struct fontData *font, uint8_t *dest, uint32_t width, char *text, int line);
 
 #endif